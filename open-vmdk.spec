@@ -11,10 +11,12 @@ Group:         Development/Tools
 Source0:       https://github.com/vmware/open-vmdk/archive/refs/tags/%{name}-%{version}.tar.gz
 %define sha512 %{name}=c79e2d87a95ce0a6f6f7116c68b7f2d6be23103644d2471f7bce4725f2c98742e3d6d4207c4c60e2d9d56f86c28213cc742e0a92dfec71cf3c1786fea1b2d303
 
+BuildRequires: openssl-devel
 BuildRequires: zlib-devel
 
 Requires: coreutils
 Requires: grep
+Requires: openssl-libs
 Requires: python3-lxml
 Requires: python3-PyYAML
 Requires: sed
@@ -31,10 +33,10 @@ that can be imported by VMware vSphere or Fusion and Workstation.
 %autosetup
 
 %build
-%make_build
+%make_build VERSION=%{version}
 
 %install
-%make_install
+%make_install LIBDIR=%{_libdir} INCLUDEDIR=%{_includedir}
 install -d -m 755 %{buildroot}%{_datadir}/%{name}
 install templates/*.ovf %{buildroot}%{_datadir}/%{name}
 
@@ -45,6 +47,8 @@ rm -rf %{buildroot}/*
 %defattr(-,root,root)
 %config(noreplace) %{_sysconfdir}/%{name}.conf
 %{_bindir}/*
+%{_libdir}/libopenvmdk.so*
+%{_includedir}/openvmdk.h
 %{_datadir}/%{name}/*
 
 %changelog
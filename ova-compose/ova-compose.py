@@ -15,6 +15,7 @@
 
 import sys
 import os
+import ctypes
 import subprocess
 import getopt
 import datetime
@@ -24,6 +25,12 @@ from lxml import etree as ET
 import hashlib
 import tempfile
 import shutil
+import tarfile
+import io
+import concurrent.futures
+import threading
+import errno
+import fcntl
 
 
 APP_NAME = "ova-compose"
@@ -46,6 +53,14 @@ NS_MAP = {
 }
 
 
+def source_date_epoch():
+    # see https://reproducible-builds.org/specs/source-date-epoch/
+    epoch = os.environ.get("SOURCE_DATE_EPOCH")
+    if epoch is None:
+        return None
+    return int(epoch)
+
+
 def xml_indent(elem, level=0):
     i = "\n" + level*"  "
     if len(elem):
@@ -69,6 +84,239 @@ def xml_config(key, val):
     return ET.Element('{%s}Config' % NS_VMW, { '{%s}required' % NS_OVF: 'false', '{%s}key' % NS_VMW: key, '{%s}value' % NS_VMW: val})
 
 
+class HashingReader(object):
+    """File object wrapper that hashes everything read through it."""
+
+    def __init__(self, f, ctxs):
+        self.f = f
+        self.ctxs = ctxs
+
+
+    def read(self, size=-1):
+        buf = self.f.read(size)
+        for ctx in self.ctxs:
+            ctx.update(buf)
+        return buf
+
+
+class OpenVmdkInfo(ctypes.Structure):
+    _fields_ = [("capacity", ctypes.c_uint64),
+                ("used", ctypes.c_uint64)]
+
+
+class OpenVmdk(object):
+    """libopenvmdk, if installed. Saves spawning vmdk-convert for every disk."""
+    lib = None
+    ctx = None
+    # conversion jobs may ask for disk info from several threads
+    lock = threading.Lock()
+
+    @classmethod
+    def load(cls):
+        if cls.lib is None:
+            try:
+                lib = ctypes.CDLL("libopenvmdk.so.1", use_errno=True)
+                lib.openvmdk_context_new.restype = ctypes.c_void_p
+                lib.openvmdk_open.restype = ctypes.c_void_p
+                lib.openvmdk_open.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+                lib.openvmdk_info.argtypes = [ctypes.c_void_p, ctypes.POINTER(OpenVmdkInfo)]
+                lib.openvmdk_close.argtypes = [ctypes.c_void_p]
+                cls.ctx = lib.openvmdk_context_new()
+                cls.lib = lib if cls.ctx else False
+            except (OSError, AttributeError):
+                cls.lib = False
+        return cls.lib or None
+
+
+    @classmethod
+    def disk_info(cls, filename):
+        with cls.lock:
+            return cls._disk_info(filename)
+
+
+    @classmethod
+    def _disk_info(cls, filename):
+        lib = cls.load()
+        disk = lib.openvmdk_open(cls.ctx, os.fsencode(filename))
+        if not disk:
+            err = ctypes.get_errno()
+            raise OSError(err, os.strerror(err), filename)
+        try:
+            info = OpenVmdkInfo()
+            if lib.openvmdk_info(disk, ctypes.byref(info)) != 0:
+                err = ctypes.get_errno()
+                raise OSError(err, os.strerror(err), filename)
+            return {'capacity': info.capacity, 'used': info.used}
+        finally:
+            lib.openvmdk_close(disk)
+
+
+class ConversionCache(object):
+    """
+    Content addressed store of converted disks, shared by all builds on a host.
+    An entry is keyed by a hash of the raw image data, the vmdk-convert binary
+    and the conversion options, and holds the vmdk, its sidecars and its disk
+    info. Entries are reflinked or copied, never hard linked, so writing to an
+    output later cannot change what is in the cache. The content hashes are
+    remembered per (device, inode, size, mtime), so unchanged images are not
+    even read again.
+    """
+
+    # written by vmdk-convert next to the vmdk
+    sidecars = [".digest", ".json"]
+
+    def __init__(self, cache_dir):
+        self.cache_dir = os.path.abspath(cache_dir)
+        os.makedirs(os.path.join(self.cache_dir, "stat"), exist_ok=True)
+        self._version = None
+
+
+    def converter_version(self):
+        # the version string stays the same across rebuilds, the binary does not
+        if self._version is None:
+            h = hashlib.sha256()
+            with open(shutil.which("vmdk-convert"), "rb") as f:
+                for block in iter(lambda: f.read(1024 * 1024), b""):
+                    h.update(block)
+            self._version = h.hexdigest()
+        return self._version
+
+
+    @staticmethod
+    def _content_hash(filename, blocksz=1024 * 1024):
+        # hash the offsets and contents of all non zero blocks, skipping holes,
+        # so the hash only depends on what the disk reads as
+        h = hashlib.blake2b(digest_size=32)
+        zero = memoryview(bytes(blocksz))
+        buf = bytearray(blocksz)
+        with open(filename, "rb") as f:
+            fd = f.fileno()
+            size = os.fstat(fd).st_size
+            h.update(size.to_bytes(8, "little"))
+            pos = 0
+            while pos < size:
+                try:
+                    start = os.lseek(fd, pos, os.SEEK_DATA)
+                    end = os.lseek(fd, start, os.SEEK_HOLE)
+                except OSError as e:
+                    if e.errno == errno.ENXIO:
+                        break
+                    start, end = pos, size
+                start -= start % blocksz
+                f.seek(start)
+                while start < end:
+                    n = f.readinto(buf)
+                    if n == 0:
+                        break
+                    block = memoryview(buf)[:n]
+                    if block != zero[:n]:
+                        h.update(start.to_bytes(8, "little"))
+                        h.update(block)
+                    start += n
+                pos = start
+        return h.hexdigest()
+
+
+    def content_hash(self, filename):
+        st = os.stat(filename)
+        ident = [st.st_dev, st.st_ino, st.st_size, st.st_mtime_ns]
+        name = hashlib.sha256(os.fsencode(os.path.realpath(filename))).hexdigest()
+        stat_file = os.path.join(self.cache_dir, "stat", name)
+        try:
+            with open(stat_file, "rt") as f:
+                entry = json.load(f)
+            if entry['stat'] == ident:
+                return entry['hash']
+        except (OSError, ValueError, KeyError):
+            pass
+
+        hash = self._content_hash(filename)
+        tmp = f"{stat_file}.{os.getpid()}.{threading.get_ident()}"
+        with open(tmp, "wt") as f:
+            json.dump({'stat': ident, 'hash': hash}, f)
+        os.replace(tmp, stat_file)
+        return hash
+
+
+    def key(self, raw_image, path, options):
+        # the output file name is part of the embedded descriptor
+        h = hashlib.sha256()
+        for part in [self.content_hash(raw_image), self.converter_version(),
+                     os.path.basename(path)] + options:
+            h.update(part.encode("UTF-8") + b"\0")
+        return h.hexdigest()
+
+
+    # ioctl to share the data of another file, copy on write
+    FICLONE = 0x40049409
+
+    @classmethod
+    def _clone(cls, src, dst):
+        with open(src, "rb") as fsrc, open(dst, "wb") as fdst:
+            try:
+                fcntl.ioctl(fdst.fileno(), cls.FICLONE, fsrc.fileno())
+            except OSError:
+                shutil.copyfileobj(fsrc, fdst, 1024 * 1024)
+        shutil.copystat(src, dst)
+
+
+    def fetch(self, key, path):
+        """Put the cached vmdk for key at path, return its disk info or None."""
+        entry = os.path.join(self.cache_dir, key)
+        try:
+            with open(os.path.join(entry, "info.json"), "rt") as f:
+                info = json.load(f)
+        except (OSError, ValueError):
+            return None
+
+        for file in [path] + [f"{path}{ext}" for ext in self.sidecars]:
+            if os.path.lexists(file):
+                os.remove(file)
+        # vmdk first, so the sidecars are not older than it
+        self._clone(os.path.join(entry, "disk.vmdk"), path)
+        for ext in self.sidecars:
+            if os.path.exists(os.path.join(entry, f"disk.vmdk{ext}")):
+                self._clone(os.path.join(entry, f"disk.vmdk{ext}"), f"{path}{ext}")
+        self._update_identity(path)
+        return info
+
+
+    @staticmethod
+    def _update_identity(path):
+        # the metadata names the vmdk it was written for by size, inode and
+        # mtime, which are those of the cache entry after cloning
+        sidecar = f"{path}.json"
+        try:
+            with open(sidecar, "rt") as f:
+                metadata = json.load(f)
+        except (OSError, ValueError):
+            return
+        st = os.stat(path)
+        metadata.update(size=st.st_size, inode=st.st_ino, mtime_ns=st.st_mtime_ns)
+        with open(sidecar, "wt") as f:
+            json.dump(metadata, f)
+
+
+    def store(self, key, path, info):
+        entry = os.path.join(self.cache_dir, key)
+        if os.path.exists(entry):
+            return
+        tmpdir = tempfile.mkdtemp(prefix=f"{key}-", dir=self.cache_dir)
+        try:
+            self._clone(path, os.path.join(tmpdir, "disk.vmdk"))
+            for ext in self.sidecars:
+                if os.path.exists(f"{path}{ext}"):
+                    self._clone(f"{path}{ext}", os.path.join(tmpdir, f"disk.vmdk{ext}"))
+            with open(os.path.join(tmpdir, "info.json"), "wt") as f:
+                json.dump(info, f)
+            os.rename(tmpdir, entry)
+        except OSError:
+            # lost a race with another build storing the same entry
+            shutil.rmtree(tmpdir, ignore_errors=True)
+            if not os.path.exists(entry):
+                raise
+
+
 class ValidationError(Exception):
     pass
 
@@ -556,6 +804,11 @@ class OVFFile(object):
 class OVFDisk(object):
     next_id = 0
 
+    # set by --cache-dir
+    cache = None
+    # disk info of vmdks just converted or fetched from the cache, by path
+    disk_infos = {}
+
     allocation_units_map = {
             'byte' : "byte",
             'KB' : "byte * 2^10",
@@ -572,7 +825,7 @@ class OVFDisk(object):
             'byte * 2^40' : 2 ** 40,
     }
 
-    def __init__(self, path, units=None, disk_id=None, file_id=None, raw_image=None):
+    def __init__(self, path, units=None, disk_id=None, file_id=None, raw_image=None, hash_type=None):
         if disk_id is None:
             self.id = f"vmdisk{OVFDisk.next_id}"
             OVFDisk.next_id += 1
@@ -594,19 +847,85 @@ class OVFDisk(object):
 
         if raw_image is not None:
             if os.path.exists(raw_image):
-                # check if the vmdk exists, and if it does if it's newer than the raw image
-                # if not, create vmdk from raw image
-                if not os.path.exists(path) or os.path.getctime(raw_image) > os.path.getctime(path):
-                    subprocess.check_call(['vmdk-convert', raw_image, path])
+                if OVFDisk.needs_conversion(raw_image, path):
+                    OVFDisk.convert(raw_image, path, hash_type=hash_type)
             else:
                 print(f"warning: raw image file {raw_image} does not exist, using {path}")
 
         self.file = OVFFile(path)
-        disk_info = OVF._disk_info(path)
+        disk_info = OVFDisk.disk_infos.get(os.path.abspath(path))
+        if disk_info is None:
+            disk_info = OVF._disk_info(path)
         self.capacity = int(disk_info['capacity'] / self.allocation_factors[self.units])
         self.used = disk_info['used']
 
 
+    @staticmethod
+    def needs_conversion(raw_image, path):
+        # check if the vmdk exists, and if it does if it's newer than the raw image
+        return os.path.exists(raw_image) and \
+            (not os.path.exists(path) or os.path.getctime(raw_image) > os.path.getctime(path))
+
+
+    @staticmethod
+    def convert(raw_image, path, hash_type=None, threads=None):
+        # the converter tells capacity and used size, no need to open the vmdk again
+        options = ['--metadata']
+        if source_date_epoch() is not None:
+            options.append('--reproducible')
+        if hash_type is not None:
+            # let the converter hash the output while writing it
+            options += ['--digest', hash_type]
+
+        cache = OVFDisk.cache
+        if cache is not None:
+            key = cache.key(raw_image, path, options)
+            info = cache.fetch(key, path)
+            if info is not None:
+                OVFDisk.disk_infos[os.path.abspath(path)] = info
+                return
+            # the old vmdk may be a link into the cache, don't overwrite it
+            for file in [path] + [f"{path}{ext}" for ext in ConversionCache.sidecars]:
+                if os.path.lexists(file):
+                    os.remove(file)
+
+        cmd = ['vmdk-convert'] + options
+        if threads is not None:
+            cmd += ['--threads', str(threads)]
+        subprocess.check_call(cmd + [raw_image, path])
+
+        if cache is not None:
+            info = OVF._disk_info(path)
+            cache.store(key, path, info)
+            OVFDisk.disk_infos[os.path.abspath(path)] = info
+
+
+    @staticmethod
+    def convert_all(conversions, hash_type=None, jobs=None, cpus=None):
+        """
+        Convert (raw_image, path) pairs, up to jobs at a time. The cpus are
+        shared between the running conversions, each vmdk-convert gets its
+        part as compression threads.
+        """
+        if not conversions:
+            return
+        if cpus is None:
+            cpus = os.cpu_count() or 1
+        if jobs is None:
+            jobs = cpus
+        jobs = max(1, min(jobs, len(conversions)))
+        threads = max(1, cpus // jobs)
+
+        with concurrent.futures.ThreadPoolExecutor(max_workers=jobs) as executor:
+            futures = [executor.submit(OVFDisk.convert, raw_image, path, hash_type, threads)
+                       for raw_image, path in conversions]
+            # wait for all of them, then report the first failure
+            for future in futures:
+                future.exception()
+            for future in futures:
+                future.result()
+
+
     def host_resource(self):
         return f"ovf:/disk/{self.id}"
 
@@ -929,7 +1248,7 @@ class OVF(object):
 
 
     @classmethod
-    def from_dict(cls, config):
+    def from_dict(cls, config, hash_type=None, jobs=None, cpus=None):
 
         # search for files and disks in hardware config:
         files = []
@@ -941,6 +1260,18 @@ class OVF(object):
         assert 'hardware' in config, "config needs a 'hardware' section"
 
         hardware = config['hardware']
+
+        # convert all raw images first, in parallel
+        conversions = []
+        for hw_id, hw in hardware.items():
+            if isinstance(hw, dict) and 'image' not in hw and 'raw_image' in hw:
+                if 'disk_image' not in hw:
+                    # if vmdk file is unset, use the raw image name and replace the extension
+                    hw['disk_image'] = os.path.splitext(hw['raw_image'])[0] + ".vmdk"
+                if OVFDisk.needs_conversion(hw['raw_image'], hw['disk_image']):
+                    conversions.append((hw['raw_image'], hw['disk_image']))
+        OVFDisk.convert_all(conversions, hash_type=hash_type, jobs=jobs, cpus=cpus)
+
         for hw_id, hw in hardware.items():
             if isinstance(hw, dict):
                 if 'image' in hw:
@@ -956,7 +1287,8 @@ class OVF(object):
                                    units=hw.get('units', None),
                                    raw_image=hw.get('raw_image', None),
                                    disk_id=hw.get('disk_id', None),
-                                   file_id=hw.get('file_id', None))
+                                   file_id=hw.get('file_id', None),
+                                   hash_type=hash_type)
                     disks.append(disk)
                     files.append(disk.file)
                     hw['disk'] = disk
@@ -1059,8 +1391,30 @@ class OVF(object):
             rasd_item.connect(self)
 
 
+    @staticmethod
+    def _get_sidecar_metadata(filename):
+        # vmdk-convert --metadata writes capacity, used size, digests and what
+        # identifies the vmdk (size, inode, mtime) to <file>.json
+        sidecar = f"{filename}.json"
+        try:
+            with open(sidecar, "rt") as f:
+                metadata = json.load(f)
+            st = os.stat(filename)
+            if [metadata['size'], metadata['inode'], metadata['mtime_ns']] != \
+                    [st.st_size, st.st_ino, st.st_mtime_ns]:
+                return None
+            return metadata
+        except (OSError, ValueError, KeyError):
+            return None
+
+
     @staticmethod
     def _disk_info(filename):
+        metadata = OVF._get_sidecar_metadata(filename)
+        if metadata is not None:
+            return {'capacity': metadata['capacity'], 'used': metadata['used']}
+        if OpenVmdk.load() is not None:
+            return OpenVmdk.disk_info(filename)
         out = subprocess.check_output(["vmdk-convert", "-i", filename]).decode("UTF-8")
         return json.loads(out)
 
@@ -1155,9 +1509,13 @@ class OVF(object):
         with open(ovf_file, "wb") as f:
             doc.write(f, pretty_print=True, exclusive=True, xml_declaration=True, encoding="UTF-8")
 
-        # if you know an easier way to produce a time stamp with the local tz, please fix:
-        timestamp = datetime.datetime.now(
-            datetime.datetime.now(datetime.timezone.utc).astimezone().tzinfo).strftime("%d-%m-%Y %H:%M:%S %z")
+        epoch = source_date_epoch()
+        if epoch is not None:
+            timestamp = datetime.datetime.fromtimestamp(epoch, datetime.timezone.utc).strftime("%d-%m-%Y %H:%M:%S %z")
+        else:
+            # if you know an easier way to produce a time stamp with the local tz, please fix:
+            timestamp = datetime.datetime.now(
+                datetime.datetime.now(datetime.timezone.utc).astimezone().tzinfo).strftime("%d-%m-%Y %H:%M:%S %z")
 
         # ugly hack to insert a comment (there should be a better way)
         with open(ovf_file, "rt") as f:
@@ -1171,15 +1529,123 @@ class OVF(object):
 
 
     @staticmethod
-    def _get_hash(filename, hash_type, blocksz=1024 * 1024):
-        hash = hashlib.new(hash_type)
-        with open(filename, "rb") as f:
-            while True:
-                buf = f.read(blocksz)
-                if not buf:
-                    break
-                hash.update(buf)
-        return hash.hexdigest()
+    def _get_sidecar_hash(filename, hash_type):
+        # only <file>.json tells whether the digests are still those of the
+        # file, <file>.digest alone is not trusted
+        metadata = OVF._get_sidecar_metadata(filename)
+        if metadata is not None and hash_type in metadata.get('digests', {}):
+            return metadata['digests'][hash_type]
+        return None
+
+
+    @staticmethod
+    def _get_hashes(filename, hash_types, blocksz=4 * 1024 * 1024):
+        # all digests of a file are computed from one read of it
+        hashes = {}
+        for hash_type in hash_types:
+            hash = OVF._get_sidecar_hash(filename, hash_type)
+            if hash is not None:
+                hashes[hash_type] = hash
+        missing = [t for t in hash_types if t not in hashes]
+        if missing:
+            ctxs = [hashlib.new(t) for t in missing]
+            buf = bytearray(blocksz)
+            view = memoryview(buf)
+            with open(filename, "rb", buffering=0) as f:
+                if hasattr(os, "posix_fadvise"):
+                    os.posix_fadvise(f.fileno(), 0, 0, os.POSIX_FADV_SEQUENTIAL)
+                while True:
+                    n = f.readinto(buf)
+                    if not n:
+                        break
+                    for ctx in ctxs:
+                        ctx.update(view[:n])
+            for hash_type, ctx in zip(missing, ctxs):
+                hashes[hash_type] = ctx.hexdigest()
+        return hashes
+
+
+    @staticmethod
+    def _get_hash(filename, hash_type):
+        return OVF._get_hashes(filename, [hash_type])[hash_type]
+
+
+    def write_manifests(self, ovf_file, mf_files):
+        """
+        Write one manifest per hash type, mf_files maps the hash type to the
+        manifest file name. Files are hashed concurrently, hashlib releases
+        the GIL while hashing.
+        """
+        filenames = [ovf_file] + [file.path for file in self.files]
+        hash_types = list(mf_files.keys())
+
+        workers = min(len(filenames), os.cpu_count() or 1)
+        with concurrent.futures.ThreadPoolExecutor(max_workers=workers) as executor:
+            all_hashes = list(executor.map(lambda fname: OVF._get_hashes(fname, hash_types), filenames))
+
+        for hash_type, mf_file in mf_files.items():
+            with open(mf_file, "wt") as f:
+                for fname, hashes in zip(filenames, all_hashes):
+                    f.write(f"{hash_type.upper()}({os.path.basename(fname)})= {hashes[hash_type]}\n")
+
+
+    tar_formats = {
+        'ustar': tarfile.USTAR_FORMAT,
+        'gnu': tarfile.GNU_FORMAT,
+        'pax': tarfile.PAX_FORMAT,
+        'posix': tarfile.PAX_FORMAT,
+    }
+
+
+    @staticmethod
+    def _tarinfo(name, size, mtime):
+        info = tarfile.TarInfo(name)
+        info.size = size
+        info.mtime = mtime
+        info.mode = 0o644
+        info.uid = info.gid = 0
+        info.uname = info.gname = "root"
+        return info
+
+
+    def write_ova(self, ova_file, ovf_file, mf_files, tar_format="gnu", blocksz=4 * 1024 * 1024):
+        """
+        Write the OVA in one pass: the OVF first, then the referenced files,
+        hashed while they are copied into the archive, and the manifest last.
+        The first manifest in mf_files goes into the OVA, any others are
+        written next to it.
+        """
+        hash_types = list(mf_files.keys())
+        epoch = source_date_epoch()
+        all_hashes = []
+
+        with tarfile.open(ova_file, "w", format=OVF.tar_formats[tar_format], copybufsize=blocksz) as tar:
+            for path in [ovf_file] + [file.path for file in self.files]:
+                hashes = {}
+                for hash_type in hash_types:
+                    hash = OVF._get_sidecar_hash(path, hash_type)
+                    if hash is not None:
+                        hashes[hash_type] = hash
+                ctxs = {t: hashlib.new(t) for t in hash_types if t not in hashes}
+                with open(path, "rb") as f:
+                    st = os.fstat(f.fileno())
+                    info = OVF._tarinfo(os.path.basename(path), st.st_size,
+                                        epoch if epoch is not None else int(st.st_mtime))
+                    tar.addfile(info, HashingReader(f, list(ctxs.values())))
+                for hash_type, ctx in ctxs.items():
+                    hashes[hash_type] = ctx.hexdigest()
+                all_hashes.append((os.path.basename(path), hashes))
+
+            for i, (hash_type, mf_file) in enumerate(mf_files.items()):
+                data = "".join(f"{hash_type.upper()}({fname})= {hashes[hash_type]}\n"
+                               for fname, hashes in all_hashes).encode("UTF-8")
+                if i == 0:
+                    info = OVF._tarinfo(os.path.basename(mf_file), len(data),
+                                        epoch if epoch is not None else int(datetime.datetime.now().timestamp()))
+                    tar.addfile(info, io.BytesIO(data))
+                else:
+                    with open(os.path.join(os.path.dirname(ova_file), os.path.basename(mf_file)), "wb") as f:
+                        f.write(data)
 
 
     def write_manifest(self, ovf_file=None, mf_file=None, hash_type="sha512"):
@@ -1187,15 +1653,7 @@ class OVF(object):
             ovf_file = f"{self.name}.ovf"
         if mf_file == None:
             mf_file = f"{self.name}.mf"
-        filenames = [ovf_file]
-
-        for file in self.files:
-            filenames.append(file.path)
-        with open(mf_file, "wt") as f:
-            for fname in filenames:
-                hash = OVF._get_hash(fname, hash_type)
-                fname = os.path.basename(fname)
-                f.write(f"{hash_type.upper()}({fname})= {hash}\n")
+        self.write_manifests(ovf_file, {hash_type: mf_file})
 
 
 def usage():
@@ -1207,6 +1665,10 @@ def usage():
     print("  -f, --format ova|ovf|dir    output format")
     print("  -m, --manifest              create manifest file along with ovf (default true for output formats ova and dir)")
     print("  --checksum-type sha1|sha256|sha512  set the checksum type for the manifest. Must be sha1, sha256 or sha512.")
+    print("                              A comma separated list writes one more manifest <name>.<type>.mf for every further type.")
+    print("  -j, --jobs <n>              number of disks to convert at the same time (default: number of CPUs)")
+    print("  --cpus <n>                  number of CPUs to use for all conversions together (default: all)")
+    print("  --cache-dir <dir>           reuse converted raw images from and store them in <dir>")
     print("  -q                          quiet mode")
     print("  -h                          print help")
     print("")
@@ -1248,9 +1710,12 @@ def main():
     params = {}
     checksum_type = "sha256"
     tar_format = "gnu"
+    jobs = None
+    cpus = None
+    cache_dir = os.environ.get("OVA_COMPOSE_CACHE_DIR")
 
     try:
-        opts, args = getopt.getopt(sys.argv[1:], 'f:hi:mo:q', longopts=['format=', 'input-file=', 'manifest', 'output-file=', 'param=', 'checksum-type=', 'tar-format='])
+        opts, args = getopt.getopt(sys.argv[1:], 'f:hi:j:mo:q', longopts=['format=', 'input-file=', 'jobs=', 'cpus=', 'manifest', 'output-file=', 'param=', 'checksum-type=', 'tar-format=', 'cache-dir='])
     except:
         print ("invalid option")
         sys.exit(2)
@@ -1271,6 +1736,14 @@ def main():
             params[k] = yaml.safe_load(v)
         elif o in ['--tar-format']:
             tar_format = a
+        elif o in ['-j', '--jobs']:
+            jobs = int(a)
+            assert jobs > 0, f"invalid number of jobs '{a}'"
+        elif o in ['--cpus']:
+            cpus = int(a)
+            assert cpus > 0, f"invalid number of cpus '{a}'"
+        elif o in ['--cache-dir']:
+            cache_dir = a
         elif o in ['-q']:
             do_quiet = True
         elif o in ['-h']:
@@ -1282,7 +1755,10 @@ def main():
     assert config_file != None, "no input file specified"
     assert output_file != None, "no output file/directory specified"
 
-    assert checksum_type in ["sha1", "sha512", "sha256"], f"checksum-type '{checksum_type}' is invalid"
+    checksum_types = checksum_type.split(",")
+    for t in checksum_types:
+        assert t in ["sha1", "sha512", "sha256"], f"checksum-type '{t}' is invalid"
+    checksum_type = checksum_types[0]
 
     if config_file != None:
         f = open(config_file, 'r')
@@ -1295,7 +1771,10 @@ def main():
     if f != sys.stdin:
         f.close()
 
-    ovf = OVF.from_dict(config)
+    if cache_dir:
+        OVFDisk.cache = ConversionCache(cache_dir)
+
+    ovf = OVF.from_dict(config, hash_type=",".join(checksum_types), jobs=jobs, cpus=cpus)
 
     if output_format is None:
         if output_file.endswith(".ova"):
@@ -1307,6 +1786,7 @@ def main():
 
     assert output_format != None, "no output format specified"
     assert output_format in ['ova', 'ovf', 'dir'], f"invalid output_format '{output_format}'"
+    assert tar_format in OVF.tar_formats, f"invalid tar format '{tar_format}'"
 
     if not do_quiet:
         print (f"creating '{output_file}' with format '{output_format}' from '{config_file}'")
@@ -1316,13 +1796,30 @@ def main():
     else:
         basename = os.path.basename(output_file)
     mf_file = f"{basename}.mf"
+    # the first checksum type goes into the main manifest, others get their own
+    mf_files = {checksum_type: mf_file}
+    for t in checksum_types[1:]:
+        mf_files[t] = f"{basename}.{t}.mf"
 
     if output_format == "ovf":
         ovf_file = output_file
         ovf.write_xml(ovf_file=ovf_file)
         if do_manifest:
-            ovf.write_manifest(ovf_file=ovf_file, mf_file=mf_file, hash_type=checksum_type)
-    elif output_format == "ova" or output_format == "dir":
+            ovf.write_manifests(ovf_file, mf_files)
+    elif output_format == "ova":
+        pwd = os.getcwd()
+        tmpdir = tempfile.mkdtemp(prefix=f"{basename}-", dir=pwd)
+        try:
+            ovf_file = os.path.join(tmpdir, f"{basename}.ovf")
+            ovf.write_xml(ovf_file=ovf_file)
+            ovf.write_ova(output_file, ovf_file, mf_files, tar_format=tar_format)
+        except Exception as e:
+            if os.path.exists(output_file):
+                os.remove(output_file)
+            raise e
+        finally:
+            shutil.rmtree(tmpdir)
+    elif output_format == "dir":
         pwd = os.getcwd()
         tmpdir = tempfile.mkdtemp(prefix=f"{basename}-", dir=pwd)
         try:
@@ -1330,24 +1827,14 @@ def main():
             ovf_file = f"{basename}.ovf"
             ovf.write_xml(ovf_file=ovf_file)
 
-            all_files = [ovf_file, mf_file]
             for file in ovf.files:
                 dst = os.path.basename(file.path)
                 os.symlink(os.path.join(pwd, file.path), dst)
-                all_files.append(dst)
 
-            ovf.write_manifest(ovf_file=ovf_file, mf_file=mf_file, hash_type=checksum_type)
+            ovf.write_manifests(ovf_file, mf_files)
 
-            if output_format == "ova":
-                ret = subprocess.check_call(["tar", f"--format={tar_format}", "-h",
-                                             "--owner=0", "--group=0", "--mode=0644",
-                                             "-cf",
-                                             os.path.join(pwd, output_file)] + all_files)
-                os.chdir(pwd)
-                shutil.rmtree(tmpdir)
-            else:
-                os.chdir(pwd)
-                shutil.move(tmpdir, output_file)
+            os.chdir(pwd)
+            shutil.move(tmpdir, output_file)
         except Exception as e:
             os.chdir(pwd)
             if os.path.isdir(tmpdir):
@@ -0,0 +1,236 @@
+#!/usr/bin/env python3
+
+# Copyright (c) 2023 VMware, Inc.  All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the “License”); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at:
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software distributed
+# under the License is distributed on an “AS IS” BASIS, without warranties or
+# conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+# specific language governing permissions and limitations under the License.
+
+import sys
+import os
+import subprocess
+import getopt
+import hashlib
+import shutil
+import tarfile
+
+
+APP_NAME = "ova-extract"
+
+HASH_TYPES = ["sha1", "sha256", "sha512"]
+
+
+class ManifestError(Exception):
+    pass
+
+
+class OVAExtractor(object):
+    """
+    Extract an OVA in one sequential read. Disks are converted by
+    vmdk-convert while they are read from the tar stream, and every
+    member is hashed on the way to check it against the manifest.
+    """
+
+    def __init__(self, output_dir, disk_format="img", hash_types=None, verify=True, quiet=False, blocksz=1024 * 1024):
+        self.output_dir = output_dir
+        self.disk_format = disk_format
+        self.hash_types = hash_types or HASH_TYPES
+        self.verify = verify
+        self.quiet = quiet
+        self.blocksz = blocksz
+        self.manifest = None
+        # member name -> {hash type: digest}
+        self.digests = {}
+        self.outputs = []
+
+
+    def _log(self, msg):
+        if not self.quiet:
+            print(msg)
+
+
+    @staticmethod
+    def _parse_manifest(data):
+        manifest = {}
+        for line in data.decode("UTF-8").splitlines():
+            if not line.strip():
+                continue
+            left, digest = line.split("=", maxsplit=1)
+            hash_type, name = left.strip().split("(", maxsplit=1)
+            hash_type = hash_type.lower()
+            if hash_type not in HASH_TYPES:
+                raise ManifestError(f"unsupported checksum type '{hash_type}' in manifest")
+            manifest[name.rstrip(")")] = (hash_type, digest.strip())
+        return manifest
+
+
+    def _hash_types_for(self, name):
+        # once the manifest is known only its checksum type is computed
+        if self.manifest is not None:
+            if name in self.manifest:
+                return [self.manifest[name][0]]
+            return []
+        return self.hash_types if self.verify else []
+
+
+    def _copy(self, f, out, ctxs):
+        buf = bytearray(self.blocksz)
+        view = memoryview(buf)
+        while True:
+            n = f.readinto(buf)
+            if not n:
+                break
+            for ctx in ctxs:
+                ctx.update(view[:n])
+            out.write(view[:n])
+
+
+    def _extract_disk(self, tar, member, ctxs):
+        name = os.path.splitext(member.name)[0] + ".img"
+        path = os.path.join(self.output_dir, os.path.basename(name))
+        self._log(f"converting {member.name} to {path}")
+        self.outputs.append(path)
+        stdout = subprocess.DEVNULL if self.quiet else None
+        proc = subprocess.Popen(["vmdk-convert", "-", path], stdin=subprocess.PIPE, stdout=stdout)
+        try:
+            self._copy(tar.extractfile(member), proc.stdin, ctxs)
+            proc.stdin.close()
+        except BrokenPipeError:
+            pass
+        if proc.wait() != 0:
+            raise RuntimeError(f"failed to convert {member.name}")
+
+
+    def _extract_file(self, tar, member, ctxs):
+        path = os.path.join(self.output_dir, os.path.basename(member.name))
+        self._log(f"extracting {member.name} to {path}")
+        self.outputs.append(path)
+        with open(path, "wb") as out:
+            self._copy(tar.extractfile(member), out, ctxs)
+
+
+    def extract(self, ova_file):
+        os.makedirs(self.output_dir, exist_ok=True)
+        try:
+            if ova_file == "-":
+                tar = tarfile.open(fileobj=sys.stdin.buffer, mode="r|")
+            else:
+                tar = tarfile.open(ova_file, mode="r|")
+            with tar:
+                for member in tar:
+                    if not member.isfile():
+                        continue
+                    if os.path.basename(member.name) != member.name:
+                        raise ManifestError(f"invalid member name '{member.name}'")
+                    ctxs = {t: hashlib.new(t) for t in self._hash_types_for(member.name)}
+                    if member.name.endswith(".mf"):
+                        data = tar.extractfile(member).read()
+                        self.manifest = self._parse_manifest(data)
+                        path = os.path.join(self.output_dir, member.name)
+                        self.outputs.append(path)
+                        with open(path, "wb") as f:
+                            f.write(data)
+                        continue
+                    if member.name.endswith(".vmdk") and self.disk_format == "img":
+                        self._extract_disk(tar, member, ctxs.values())
+                    else:
+                        self._extract_file(tar, member, ctxs.values())
+                    self.digests[member.name] = {t: ctx.hexdigest() for t, ctx in ctxs.items()}
+            if self.verify:
+                self.check_manifest()
+        except Exception:
+            # nothing half extracted or unverified stays behind
+            for path in self.outputs:
+                if os.path.exists(path):
+                    os.remove(path)
+            raise
+
+
+    def check_manifest(self):
+        if self.manifest is None:
+            raise ManifestError("OVA has no manifest")
+        for name, (hash_type, digest) in self.manifest.items():
+            if name not in self.digests:
+                raise ManifestError(f"{name} is in the manifest but not in the OVA")
+            if self.digests[name].get(hash_type) != digest:
+                raise ManifestError(f"checksum mismatch for {name}")
+        for name in self.digests:
+            if name not in self.manifest and not name.endswith(".cert"):
+                raise ManifestError(f"{name} is not in the manifest")
+        self._log("manifest verified")
+
+
+def usage():
+    print(f"Usage: {sys.argv[0]} [-C <dir>] [--format img|vmdk] [--checksum-type <types>] [--no-verify] [-q] [-h] <ova file>")
+    print("")
+    print("Extract an OVA in one pass: disks are converted while they are read, and all")
+    print("files are checked against the manifest.")
+    print("")
+    print("Options:")
+    print("  -C, --directory <dir>       extract into <dir> (default: current directory)")
+    print("  --format img|vmdk           convert disks to raw images (img, the default), or keep them as they are")
+    print("  --checksum-type <types>     comma separated checksum types to compute for files before the manifest")
+    print("                              was read (default: sha1,sha256,sha512)")
+    print("  --no-verify                 do not check the manifest")
+    print("  -q                          quiet mode")
+    print("  -h                          print help")
+    print("")
+    print("Use '-' to read the OVA from stdin.")
+
+
+def main():
+    output_dir = "."
+    disk_format = "img"
+    hash_types = None
+    verify = True
+    do_quiet = False
+
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 'C:hq', longopts=['directory=', 'format=', 'checksum-type=', 'no-verify'])
+    except:
+        print ("invalid option")
+        sys.exit(2)
+
+    for o, a in opts:
+        if o in ['-C', '--directory']:
+            output_dir = a
+        elif o in ['--format']:
+            disk_format = a
+        elif o in ['--checksum-type']:
+            hash_types = a.split(",")
+        elif o in ['--no-verify']:
+            verify = False
+        elif o in ['-q']:
+            do_quiet = True
+        elif o in ['-h']:
+            usage()
+            sys.exit(0)
+        else:
+            assert False, f"unhandled option {o}"
+
+    assert len(args) == 1, "need exactly one OVA file"
+    assert disk_format in ["img", "vmdk"], f"invalid format '{disk_format}'"
+    for t in hash_types or []:
+        assert t in HASH_TYPES, f"checksum-type '{t}' is invalid"
+
+    extractor = OVAExtractor(output_dir, disk_format=disk_format, hash_types=hash_types,
+                             verify=verify, quiet=do_quiet)
+    try:
+        extractor.extract(args[0])
+    except (ManifestError, RuntimeError) as e:
+        print(f"{APP_NAME}: {e}", file=sys.stderr)
+        sys.exit(1)
+
+    if not do_quiet:
+        print("done.")
+
+
+if __name__ == "__main__":
+    main()
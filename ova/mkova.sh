@@ -44,6 +44,42 @@ usage() {
     echo "* FIRMWARE: The firmware of the OVA template: efi or bios. Default value is efi."
 }
 
+# Print a value from the <vmdk>.json that 'vmdk-convert --metadata' writes,
+# fails if there is none or if it describes another size, inode or
+# modification time than the vmdk has now.
+disk_metadata() {
+    local vmdk=$1
+    local key=$2
+    local json="${vmdk}.json"
+    local value
+    local ident
+
+    [ -f "$json" ] || return 1
+    ident=$(stat -c '"size": %s, "inode": %i, "mtime_ns": %.9Y' "$vmdk" | sed 's/\.//')
+    grep -q "$ident" "$json" || return 1
+    value=$(sed -n "s/.*\"${key}\": \"\{0,1\}\([0-9a-f]*\).*/\1/p" "$json")
+    [ -n "$value" ] || return 1
+    echo $value
+}
+
+# Put a disk into the staging directory without copying its data if
+# possible: a reflink, else a hard link, else a symlink that tar follows.
+# With --ovf the staging directory becomes the output, which must not
+# share its disks with the sources, so those are reflinked or copied.
+stage_disk() {
+    local src=$1
+    local dst=$2
+
+    if [ ${ovf} == "true" ] ; then
+        cp --reflink=auto "$src" "$dst"
+        return
+    fi
+    cp --reflink=always "$src" "$dst" 2> /dev/null && return 0
+    # cp leaves an empty file behind when it cannot reflink
+    rm -f "$dst"
+    ln "$src" "$dst" 2> /dev/null || ln -s "$(realpath "$src")" "$dst"
+}
+
 OPTS=$(getopt -o n:m:f: --long num-cpus:,mem-size:,firmware:,hw:,template:,ovf -n $0 -- "$@")
 if [ $? != 0 ] ; then
     usage
@@ -133,16 +169,52 @@ disk_parent_id=`sed -n '/Hard Disk 1/,+3p' $ovftempl | grep Parent | sed 's/[^0-
 
 TMPDIR=$(mktemp -p . -d XXXXXXXX)
 
+# Stage all disks, and get the file size, capacity and checksum of all of
+# them at the same time. Each disk is read at most once for its checksum,
+# and not at all if vmdk-convert --metadata --digest already did that.
+pids=""
 index=1
 for vmdk in $vmdks; do
    vmdk_name="${name}-disk${index}.vmdk"
 
    echo "Adding $vmdk as ${vmdk_name}"
-   cp "$vmdk" $TMPDIR/"${vmdk_name}"
+   if ! stage_disk "$vmdk" $TMPDIR/"${vmdk_name}" ; then
+       rm -rf $TMPDIR
+       exit 4
+   fi
+
+   probe=$TMPDIR/.probe${index}
+   mkdir $probe
+   (disk_metadata "$vmdk" size || stat -L -c %s "$vmdk") > $probe/size &
+   pids="$pids $!"
+   (set -o pipefail
+    disk_metadata "$vmdk" capacity || \
+        vmdk-convert -i "$vmdk" | cut -d ',' -f 1 | awk '{print $NF}') > $probe/capacity &
+   pids="$pids $!"
+   (set -o pipefail
+    disk_metadata "$vmdk" sha${sha_alg} || \
+        sha${sha_alg}sum "$vmdk" | cut -d' ' -f1) > $probe/digest &
+   pids="$pids $!"
+
+   index=$((index+1))
+done
 
-   vmdk_file_size=$(du -b $TMPDIR/"${vmdk_name}" | cut -f1)
+for pid in $pids; do
+    if ! wait $pid ; then
+        echo "Failed to get the size or checksum of a disk" >&2
+        rm -rf $TMPDIR
+        exit 4
+    fi
+done
+
+index=1
+for vmdk in $vmdks; do
+   vmdk_name="${name}-disk${index}.vmdk"
+   probe=$TMPDIR/.probe${index}
+
+   vmdk_file_size=$(cat $probe/size)
    echo "$vmdk file size is $vmdk_file_size bytes"
-   vmdk_capacity=$(vmdk-convert -i "$vmdk" | cut -d ',' -f 1 | awk '{print $NF}')
+   vmdk_capacity=$(cat $probe/capacity)
    echo "$vmdk capacity is $vmdk_capacity bytes"
 
    if [ $index -eq 1 ]; then
@@ -191,8 +263,8 @@ for vmdk in $vmdks; do
 
    index=$((index+1))
 
-   # Get the sha checksum of the vmdk file
-   echo "SHA${sha_alg}($vmdk_name)= $(sha${sha_alg}sum $TMPDIR/${vmdk_name} | cut -d' ' -f1)" >> $TMPDIR/${name}.mf
+   echo "SHA${sha_alg}($vmdk_name)= $(cat $probe/digest)" >> $TMPDIR/${name}.mf
+   rm -rf $probe
 done
 
 # Get the sha checksum of the ovf file
@@ -208,7 +280,13 @@ if [ ${ovf} == "true" ] ; then
     echo "Completed to create ovf files in directory ${name}"
 else
     pushd $TMPDIR
-    tar --format=ustar -cf ../${name}.ova *.ovf *.mf *.vmdk
+    tar_opts=""
+    if [ -n "$SOURCE_DATE_EPOCH" ] ; then
+        # see https://reproducible-builds.org/specs/source-date-epoch/
+        tar_opts="--owner=0 --group=0 --numeric-owner --mtime=@${SOURCE_DATE_EPOCH}"
+    fi
+    # disks may be staged as links, archive what they point to
+    tar --format=ustar ${tar_opts} --dereference --hard-dereference -cf ../${name}.ova *.ovf *.mf *.vmdk
     popd
 
     echo "Completed to create ${name}.ova"
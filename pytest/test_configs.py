@@ -12,10 +12,12 @@
 # specific language governing permissions and limitations under the License.
 
 import glob
+import json
 import os
 import pytest
 import shutil
 import subprocess
+import tarfile
 import yaml
 import xmltodict
 
@@ -93,3 +95,118 @@ def test_configs(in_yaml):
                 if vmw_config['@vmw:key'] == "firmware":
                     firmware = vmw_config['@vmw:value']
         assert cfg_system['firmware'] == firmware
+
+
+@pytest.mark.parametrize("tar_format", ["gnu", "pax"])
+def test_reproducible_ova(tar_format):
+    in_yaml = os.path.join(CONFIG_DIR, "raw-image.yaml")
+    env = dict(os.environ, SOURCE_DATE_EPOCH="1700000000")
+
+    for i in range(2):
+        if os.path.exists(os.path.join(WORK_DIR, "dummy.vmdk")):
+            os.remove(os.path.join(WORK_DIR, "dummy.vmdk"))
+        process = subprocess.run([OVA_COMPOSE, "-i", in_yaml, "-o", "repro.ova", "--tar-format", tar_format],
+                                 cwd=WORK_DIR, env=env)
+        assert process.returncode == 0
+        os.rename(os.path.join(WORK_DIR, "repro.ova"), os.path.join(WORK_DIR, f"repro{i}.ova"))
+
+    with open(os.path.join(WORK_DIR, "repro0.ova"), "rb") as f0, open(os.path.join(WORK_DIR, "repro1.ova"), "rb") as f1:
+        assert f0.read() == f1.read()
+
+
+def test_parallel_conversion():
+    config = yaml.safe_load(open(os.path.join(CONFIG_DIR, "raw-image.yaml")))
+    hardware = config['hardware']
+    del hardware['rootdisk']
+    for i in range(3):
+        with open(os.path.join(WORK_DIR, f"parallel{i}.img"), "wb") as f:
+            f.write(os.urandom((i + 1) * 1024 * 1024))
+        hardware[f"disk{i}"] = {'type': "hard_disk", 'parent': "sata1", 'raw_image': f"parallel{i}.img"}
+    in_yaml = os.path.join(WORK_DIR, "parallel.yaml")
+    with open(in_yaml, "w") as f:
+        yaml.dump(config, f)
+
+    process = subprocess.run([OVA_COMPOSE, "-i", in_yaml, "-o", "parallel.ovf", "-j", "3", "--cpus", "2"], cwd=WORK_DIR)
+    assert process.returncode == 0
+
+    with open(os.path.join(WORK_DIR, "parallel.ovf")) as f:
+        ovf = xmltodict.parse(f.read())
+    disks = ovf['Envelope']['DiskSection']['Disk']
+    assert sorted(int(d['@ovf:capacity']) for d in disks) == [1024 * 1024, 2 * 1024 * 1024, 3 * 1024 * 1024]
+
+    for i in range(3):
+        process = subprocess.run([VMDK_CONVERT, "--verify", f"parallel{i}.img", f"parallel{i}.vmdk"], cwd=WORK_DIR)
+        assert process.returncode == 0
+
+
+@pytest.mark.parametrize("tar_format", ["ustar", "gnu", "pax"])
+def test_ova_layout(tar_format):
+    in_yaml = os.path.join(CONFIG_DIR, "raw-image.yaml")
+
+    process = subprocess.run([OVA_COMPOSE, "-i", in_yaml, "-o", "layout.ova", "--tar-format", tar_format], cwd=WORK_DIR)
+    assert process.returncode == 0
+
+    # the OVF must come first, the manifest may be last
+    with tarfile.open(os.path.join(WORK_DIR, "layout.ova")) as tar:
+        names = tar.getnames()
+        assert names == ["layout.ovf", "dummy.vmdk", "layout.mf"]
+        for member in tar.getmembers():
+            assert member.uid == 0 and member.gid == 0 and member.mode == 0o644
+        with open(os.path.join(WORK_DIR, "dummy.vmdk"), "rb") as f:
+            assert tar.extractfile("dummy.vmdk").read() == f.read()
+
+
+def test_conversion_cache():
+    config = yaml.safe_load(open(os.path.join(CONFIG_DIR, "raw-image.yaml")))
+    hardware = config['hardware']
+    hardware['rootdisk']['raw_image'] = "cached.img"
+    in_yaml = os.path.join(WORK_DIR, "cached.yaml")
+    with open(in_yaml, "w") as f:
+        yaml.dump(config, f)
+    with open(os.path.join(WORK_DIR, "cached.img"), "wb") as f:
+        f.truncate(8 * 1024 * 1024)
+        f.seek(1024 * 1024)
+        f.write(os.urandom(1024 * 1024))
+    cache_dir = os.path.join(WORK_DIR, "cache")
+
+    process = subprocess.run([OVA_COMPOSE, "-i", in_yaml, "-o", "cached1.ova", "--cache-dir", cache_dir],
+                             cwd=WORK_DIR, stdout=subprocess.PIPE, universal_newlines=True)
+    assert process.returncode == 0
+    assert "Starting to convert" in process.stdout
+
+    # a fresh checkout: no vmdk, and the image is newer
+    os.remove(os.path.join(WORK_DIR, "cached.vmdk"))
+    os.utime(os.path.join(WORK_DIR, "cached.img"))
+
+    process = subprocess.run([OVA_COMPOSE, "-i", in_yaml, "-o", "cached2.ova", "--cache-dir", cache_dir],
+                             cwd=WORK_DIR, stdout=subprocess.PIPE, universal_newlines=True)
+    assert process.returncode == 0
+    assert "Starting to convert" not in process.stdout
+
+    process = subprocess.run([VMDK_CONVERT, "--verify", "cached.img", "cached.vmdk"], cwd=WORK_DIR)
+    assert process.returncode == 0
+
+    # the metadata of a hit names the fetched vmdk, so it is used instead of reading the disk
+    with open(os.path.join(WORK_DIR, "cached.vmdk.json")) as f:
+        metadata = json.load(f)
+    st = os.stat(os.path.join(WORK_DIR, "cached.vmdk"))
+    assert [metadata['size'], metadata['inode'], metadata['mtime_ns']] == [st.st_size, st.st_ino, st.st_mtime_ns]
+
+    # changed contents must not hit
+    with open(os.path.join(WORK_DIR, "cached.img"), "r+b") as f:
+        f.seek(4 * 1024 * 1024)
+        f.write(b"x")
+
+    process = subprocess.run([OVA_COMPOSE, "-i", in_yaml, "-o", "cached3.ova", "--cache-dir", cache_dir],
+                             cwd=WORK_DIR, stdout=subprocess.PIPE, universal_newlines=True)
+    assert process.returncode == 0
+    assert "Starting to convert" in process.stdout
+
+    process = subprocess.run([VMDK_CONVERT, "--verify", "cached.img", "cached.vmdk"], cwd=WORK_DIR)
+    assert process.returncode == 0
+
+    # outputs are written over in place, so they must not share the cache entries
+    for entry in os.listdir(cache_dir):
+        disk = os.path.join(cache_dir, entry, "disk.vmdk")
+        if os.path.exists(disk):
+            assert os.stat(disk).st_nlink == 1
@@ -113,3 +113,45 @@ def test_manifest_invalid_checksum_type():
     process = subprocess.run(args, cwd=WORK_DIR)
     assert process.returncode != 0
 
+
+
+@pytest.mark.parametrize("out_format", ["ovf", "ova"])
+def test_multiple_checksum_types(out_format):
+    in_yaml = os.path.join(CONFIG_DIR, "raw-image.yaml")
+    out = os.path.join(WORK_DIR, f"multi.{out_format}")
+
+    args = [OVA_COMPOSE, "-i", in_yaml, "-o", out, "-m", "--checksum-type", "sha256,sha512,sha1"]
+    process = subprocess.run(args, cwd=WORK_DIR)
+    assert process.returncode == 0
+
+    if out_format == "ova":
+        subprocess.run(["tar", "xf", out], cwd=WORK_DIR)
+
+    check_mf(os.path.join(WORK_DIR, "multi.mf"), "sha256")
+    check_mf(os.path.join(WORK_DIR, "multi.sha512.mf"), "sha512")
+    check_mf(os.path.join(WORK_DIR, "multi.sha1.mf"), "sha1")
+
+
+def test_manifest_stale_sidecar():
+    # the sidecar describes another file once the vmdk is replaced, even by
+    # one of the same size and time, as cp -p or rsync leave it
+    process = subprocess.run([VMDK_CONVERT, "--metadata", "--digest", "sha256", "dummy.img", "stale.vmdk"], cwd=WORK_DIR)
+    assert process.returncode == 0
+    with open(os.path.join(WORK_DIR, "stale.vmdk"), "rb") as f:
+        data = bytearray(f.read())
+    data[-1] ^= 0xff
+    st = os.stat(os.path.join(WORK_DIR, "stale.vmdk"))
+    with open(os.path.join(WORK_DIR, "stale.tmp"), "wb") as f:
+        f.write(data)
+    os.utime(os.path.join(WORK_DIR, "stale.tmp"), ns=(st.st_atime_ns, st.st_mtime_ns))
+    os.replace(os.path.join(WORK_DIR, "stale.tmp"), os.path.join(WORK_DIR, "stale.vmdk"))
+
+    config = yaml.safe_load(open(os.path.join(CONFIG_DIR, "basic.yaml")))
+    config['hardware']['rootdisk']['disk_image'] = "stale.vmdk"
+    in_yaml = os.path.join(WORK_DIR, "stale.yaml")
+    with open(in_yaml, "w") as f:
+        yaml.dump(config, f)
+
+    process = subprocess.run([OVA_COMPOSE, "-i", in_yaml, "-o", "stale.ovf", "-m"], cwd=WORK_DIR)
+    assert process.returncode == 0
+    check_mf(os.path.join(WORK_DIR, "stale.mf"), "sha256")
@@ -0,0 +1,83 @@
+# Copyright (c) 2023 VMware, Inc.  All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the “License”); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at:
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software distributed
+# under the License is distributed on an “AS IS” BASIS, without warranties or
+# conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+# specific language governing permissions and limitations under the License.
+
+import hashlib
+import os
+import pytest
+import shutil
+import subprocess
+import tarfile
+
+
+THIS_DIR = os.path.dirname(os.path.abspath(__file__))
+MKOVA = os.path.join(THIS_DIR, "..", "ova", "mkova.sh")
+
+VMDK_CONVERT=os.path.join(THIS_DIR, "..", "build", "vmdk", "vmdk-convert")
+
+TEMPLATE_DIR=os.path.join(THIS_DIR, "..", "templates")
+
+WORK_DIR=os.path.join(os.getcwd(), "pytest-mkova")
+
+
+@pytest.fixture(scope='module', autouse=True)
+def setup_test():
+    os.makedirs(WORK_DIR, exist_ok=True)
+
+    for i in range(2):
+        with open(os.path.join(WORK_DIR, f"disk{i}.img"), "wb") as f:
+            f.write(os.urandom((i + 1) * 1024 * 1024))
+    # one disk with metadata, one without
+    process = subprocess.run([VMDK_CONVERT, "--metadata", "--digest", "sha512", "disk0.img", "disk0.vmdk"], cwd=WORK_DIR)
+    assert process.returncode == 0
+    process = subprocess.run([VMDK_CONVERT, "disk1.img", "disk1.vmdk"], cwd=WORK_DIR)
+    assert process.returncode == 0
+
+    yield
+    shutil.rmtree(WORK_DIR)
+
+
+def mkova(*args):
+    env = dict(os.environ, DATADIR=TEMPLATE_DIR,
+               PATH=os.path.dirname(VMDK_CONVERT) + os.pathsep + os.environ["PATH"])
+    process = subprocess.run(["bash", MKOVA] + list(args), cwd=WORK_DIR, env=env)
+    assert process.returncode == 0
+
+
+def test_mkova():
+    mkova("--hw", "20", "test", "disk0.vmdk", "disk1.vmdk")
+
+    with tarfile.open(os.path.join(WORK_DIR, "test.ova")) as tar:
+        assert tar.getnames() == ["test.ovf", "test.mf", "test-disk1.vmdk", "test-disk2.vmdk"]
+        files = {m.name: tar.extractfile(m).read() for m in tar.getmembers()}
+
+    for i in range(2):
+        with open(os.path.join(WORK_DIR, f"disk{i}.vmdk"), "rb") as f:
+            assert files[f"test-disk{i + 1}.vmdk"] == f.read()
+        assert f'ovf:size="{os.path.getsize(os.path.join(WORK_DIR, f"disk{i}.vmdk"))}"'.encode() in files["test.ovf"]
+
+    for line in files["test.mf"].decode().splitlines():
+        left, digest = line.split("= ")
+        name = left[len("SHA512("):-1]
+        assert hashlib.sha512(files[name]).hexdigest() == digest
+
+
+def test_mkova_ovf():
+    mkova("--hw", "20", "--ovf", "testdir", "disk0.vmdk")
+
+    staged = os.path.join(WORK_DIR, "testdir", "testdir-disk1.vmdk")
+    with open(staged, "rb") as f1, open(os.path.join(WORK_DIR, "disk0.vmdk"), "rb") as f2:
+        assert f1.read() == f2.read()
+    # the output is a file of its own, not a link to the source
+    assert not os.path.islink(staged)
+    assert os.stat(staged).st_nlink == 1
+    assert not os.path.samefile(staged, os.path.join(WORK_DIR, "disk0.vmdk"))
@@ -0,0 +1,83 @@
+# Copyright (c) 2023 VMware, Inc.  All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the “License”); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at:
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software distributed
+# under the License is distributed on an “AS IS” BASIS, without warranties or
+# conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+# specific language governing permissions and limitations under the License.
+
+import os
+import pytest
+import shutil
+import subprocess
+import time
+
+
+THIS_DIR = os.path.dirname(os.path.abspath(__file__))
+
+VMDK_CONVERT=os.path.join(THIS_DIR, "..", "build", "vmdk", "vmdk-convert")
+
+WORK_DIR=os.path.join(os.getcwd(), "pytest-mount")
+
+MB = 1024 * 1024
+
+pytestmark = pytest.mark.skipif(os.geteuid() != 0 or not os.path.exists("/dev/fuse"),
+                                reason="mounting needs root and /dev/fuse")
+
+
+@pytest.fixture(scope='module', autouse=True)
+def setup_test():
+    os.makedirs(os.path.join(WORK_DIR, "mnt"), exist_ok=True)
+
+    # data at 1 MB and 5 MB of an 8 MB disk
+    with open(os.path.join(WORK_DIR, "mount.img"), "wb") as f:
+        f.truncate(8 * MB)
+        f.seek(1 * MB)
+        f.write(os.urandom(MB))
+        f.seek(5 * MB + 4096)
+        f.write(os.urandom(100000))
+    process = subprocess.run([VMDK_CONVERT, "mount.img", "mount.vmdk"], cwd=WORK_DIR)
+    assert process.returncode == 0
+
+    yield
+    shutil.rmtree(WORK_DIR)
+
+
+@pytest.mark.parametrize("threads", [1, 4])
+def test_mount(threads):
+    mnt = os.path.join(WORK_DIR, "mnt")
+    raw = os.path.join(mnt, "disk.raw")
+    process = subprocess.Popen([VMDK_CONVERT, "--mount", mnt, "--threads", str(threads), "mount.vmdk"],
+                               cwd=WORK_DIR)
+    for i in range(50):
+        if os.path.exists(raw):
+            break
+        time.sleep(0.1)
+
+    assert os.listdir(mnt) == ["disk.raw"]
+    st = os.stat(raw)
+    assert st.st_size == 8 * MB
+    # only the allocated grains count
+    assert st.st_blocks * 512 == MB + 2 * 65536
+    with open(os.path.join(WORK_DIR, "mount.img"), "rb") as f:
+        image = f.read()
+    with open(raw, "rb") as f:
+        assert f.read() == image
+        fd = f.fileno()
+        assert os.lseek(fd, 0, os.SEEK_DATA) == 1 * MB
+        assert os.lseek(fd, 1 * MB + 100, os.SEEK_HOLE) == 2 * MB
+        assert os.lseek(fd, 2 * MB, os.SEEK_DATA) == 5 * MB
+        assert os.lseek(fd, 5 * MB, os.SEEK_HOLE) == 5 * MB + 2 * 65536
+        with pytest.raises(OSError):
+            os.lseek(fd, 6 * MB, os.SEEK_DATA)
+    with pytest.raises(OSError):
+        open(raw, "r+b")
+
+    process.terminate()
+    assert process.wait() == 0
+    assert not os.path.exists(raw)
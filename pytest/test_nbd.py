@@ -0,0 +1,324 @@
+# Copyright (c) 2023 VMware, Inc.  All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the “License”); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at:
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software distributed
+# under the License is distributed on an “AS IS” BASIS, without warranties or
+# conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+# specific language governing permissions and limitations under the License.
+
+import os
+import pytest
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import time
+
+
+THIS_DIR = os.path.dirname(os.path.abspath(__file__))
+
+VMDK_CONVERT=os.path.join(THIS_DIR, "..", "build", "vmdk", "vmdk-convert")
+
+WORK_DIR=os.path.join(os.getcwd(), "pytest-nbd")
+
+MB = 1024 * 1024
+
+
+class NbdClient:
+    """Just enough of an NBD client to talk to vmdk-convert --serve"""
+
+    def __init__(self, path, structured=True):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        for i in range(50):
+            try:
+                self.sock.connect(path)
+                break
+            except (FileNotFoundError, ConnectionRefusedError):
+                time.sleep(0.1)
+        magic, opt, flags = struct.unpack(">QQH", self.recv(18))
+        assert magic == 0x4e42444d41474943 and opt == 0x49484156454f5054
+        assert flags & 1
+        self.sock.sendall(struct.pack(">I", 3))
+        self.structured = False
+        if structured:
+            assert self.option(8, b"")[0][0] == 1
+            self.structured = True
+            query = b"base:allocation"
+            replies = self.option(10, struct.pack(">II", 0, 1) + struct.pack(">I", len(query)) + query)
+            # not offered for disks being created
+            self.context = None
+            if replies[0][0] == 4:
+                assert replies[0][1][4:] == query
+                self.context = struct.unpack(">I", replies[0][1][:4])[0]
+        replies = self.option(7, struct.pack(">IH", 0, 0))
+        info = [data for rep, data in replies if rep == 3 and data[:2] == b"\0\0"][0]
+        self.size, self.flags = struct.unpack(">QH", info[2:])
+        self.cookie = 0
+
+    def recv(self, n):
+        data = b""
+        while len(data) < n:
+            chunk = self.sock.recv(n - len(data))
+            assert chunk
+            data += chunk
+        return data
+
+    def option(self, opt, data):
+        self.sock.sendall(struct.pack(">QII", 0x49484156454f5054, opt, len(data)) + data)
+        replies = []
+        while True:
+            magic, reply_opt, rep, length = struct.unpack(">QIII", self.recv(20))
+            assert magic == 0x3e889045565a9 and reply_opt == opt
+            replies.append((rep, self.recv(length)))
+            if rep == 1 or rep & 0x80000000:
+                return replies
+
+    def request(self, cmd, offset, length, flags=0, data=b""):
+        self.cookie += 1
+        self.sock.sendall(struct.pack(">IHHQQI", 0x25609513, flags, cmd, self.cookie, offset, length) + data)
+        return self.cookie
+
+    def chunks(self, cookie):
+        """structured reply chunks as (type, payload)"""
+        while True:
+            magic, flags, rtype, reply_cookie, length = struct.unpack(">IHHQI", self.recv(20))
+            assert magic == 0x668e33ef and reply_cookie == cookie
+            yield rtype, self.recv(length)
+            if flags & 1:
+                return
+
+    def read(self, offset, length):
+        cookie = self.request(0, offset, length)
+        if not self.structured:
+            magic, error, reply_cookie = struct.unpack(">IIQ", self.recv(16))
+            assert magic == 0x67446698 and error == 0 and reply_cookie == cookie
+            return self.recv(length)
+        buf = bytearray(length)
+        for rtype, payload in self.chunks(cookie):
+            assert rtype in (0, 1, 2)
+            if rtype == 1:
+                pos = struct.unpack(">Q", payload[:8])[0] - offset
+                buf[pos:pos + len(payload) - 8] = payload[8:]
+        return bytes(buf)
+
+    def block_status(self, offset, length):
+        cookie = self.request(7, offset, length)
+        extents = []
+        for rtype, payload in self.chunks(cookie):
+            assert rtype == 5
+            assert struct.unpack(">I", payload[:4])[0] == self.context
+            for i in range(4, len(payload), 8):
+                extents.append(struct.unpack(">II", payload[i:i + 8]))
+        return extents
+
+    def error(self, cookie):
+        if not self.structured:
+            return struct.unpack(">IIQ", self.recv(16))[1]
+        return [struct.unpack(">I", payload[:4])[0] if rtype == 32769 else 0 for rtype, payload in self.chunks(cookie)][-1]
+
+    def close(self):
+        self.request(2, 0, 0)
+        self.sock.close()
+
+
+@pytest.fixture(scope='module', autouse=True)
+def setup_test():
+    os.makedirs(WORK_DIR, exist_ok=True)
+
+    # data at 1 MB and 5 MB of an 8 MB disk
+    with open(os.path.join(WORK_DIR, "nbd.img"), "wb") as f:
+        f.truncate(8 * MB)
+        f.seek(1 * MB)
+        f.write(os.urandom(MB))
+        f.seek(5 * MB + 4096)
+        f.write(os.urandom(100000))
+    process = subprocess.run([VMDK_CONVERT, "nbd.img", "nbd.vmdk"], cwd=WORK_DIR)
+    assert process.returncode == 0
+
+    yield
+    shutil.rmtree(WORK_DIR)
+
+
+@pytest.fixture
+def server():
+    sock = os.path.join(WORK_DIR, "nbd.sock")
+    process = subprocess.Popen([VMDK_CONVERT, "--serve", sock, "nbd.vmdk"], cwd=WORK_DIR)
+    yield sock
+    process.terminate()
+    assert process.wait() == 0
+    assert not os.path.exists(sock)
+
+
+def test_nbd_read(server):
+    with open(os.path.join(WORK_DIR, "nbd.img"), "rb") as f:
+        image = f.read()
+
+    client = NbdClient(server)
+    assert client.size == len(image)
+    assert client.flags & 2    # read-only
+    data = b"".join(client.read(pos, MB) for pos in range(0, client.size, MB))
+    assert data == image
+    # small reads that are not aligned to grains
+    for pos in (0, 1 * MB - 100, 5 * MB + 65536 - 1):
+        assert client.read(pos, 4096) == image[pos:pos + 4096]
+    client.close()
+
+    client = NbdClient(server, structured=False)
+    assert client.read(1 * MB - 512, 8192) == image[1 * MB - 512:1 * MB + 7680]
+    client.close()
+
+
+def test_nbd_block_status(server):
+    client = NbdClient(server)
+    assert client.context is not None
+    extents = client.block_status(0, client.size)
+    assert sum(length for length, flags in extents) == client.size
+    data = []
+    pos = 0
+    for length, flags in extents:
+        if flags == 0:
+            data.append((pos, pos + length))
+        else:
+            assert flags == 3
+        pos += length
+    assert data == [(1 * MB, 2 * MB), (5 * MB, 5 * MB + 2 * 65536)]
+
+    # writes and reads beyond the end fail
+    assert client.error(client.request(1, 0, 512, data=bytes(512))) == 1
+    assert client.error(client.request(0, client.size - 512, 1024)) == 22
+    client.close()
+
+
+def test_nbd_random_reads():
+    # random reads of several extents go to them directly, without read-ahead
+    lines = ""
+    image = b""
+    for i in range(4):
+        extent = os.urandom(MB)
+        with open(os.path.join(WORK_DIR, "multi-f%03d.vmdk" % i), "wb") as f:
+            f.write(extent)
+        image += extent
+        lines += 'RW 2048 FLAT "multi-f%03d.vmdk" 0\n' % i
+    with open(os.path.join(WORK_DIR, "multi.vmdk"), "w") as f:
+        f.write('# Disk DescriptorFile\nversion=1\nCID=1234abcd\nparentCID=ffffffff\n'
+                'createType="twoGbMaxExtentFlat"\n\n' + lines)
+
+    sock = os.path.join(WORK_DIR, "multi.sock")
+    process = subprocess.Popen([VMDK_CONVERT, "--serve", sock, "multi.vmdk"], cwd=WORK_DIR)
+    client = NbdClient(sock)
+    for pos in (3 * MB + 4096, 8192, 2 * MB - 512, MB, 65536, 3 * MB, 512, 2 * MB + 100000):
+        assert client.read(pos, 4096) == image[pos:pos + 4096]
+    names = []
+    for task in os.listdir("/proc/%d/task" % process.pid):
+        with open("/proc/%d/task/%s/comm" % (process.pid, task)) as f:
+            names.append(f.read().strip())
+    assert "vmdk-extents" not in names
+
+    # sequential reads are read ahead, and then random ones work again
+    assert b"".join(client.read(pos, 65536) for pos in range(0, len(image), 65536)) == image
+    assert client.read(MB + 512, 4096) == image[MB + 512:MB + 512 + 4096]
+    client.close()
+    process.terminate()
+    assert process.wait() == 0
+
+
+@pytest.mark.parametrize("fmt", ["streamOptimized", "monolithicSparse", "raw"])
+def test_nbd_write(fmt):
+    sock = os.path.join(WORK_DIR, "write.sock")
+    vmdk = os.path.join(WORK_DIR, f"write-{fmt}.vmdk")
+    process = subprocess.Popen([VMDK_CONVERT, "--serve", sock, "--size", "8M", "--format", fmt, "--threads", "4", vmdk],
+                               cwd=WORK_DIR)
+
+    model = bytearray(8 * MB)
+    client = NbdClient(sock)
+    assert client.size == len(model)
+    assert not client.flags & 2
+    # raw images know their allocation, sparse disks being written do not
+    assert (client.context is None) == (fmt != "raw")
+    writes = [(2 * MB, os.urandom(MB)), (0, os.urandom(300000)), (6 * MB + 512, os.urandom(4096)),
+              (2 * MB + 4096, os.urandom(8192))]
+    for pos, data in writes:
+        model[pos:pos + len(data)] = data
+        assert client.error(client.request(1, pos, len(data), data=data)) == 0
+    # reads see what was written so far
+    assert client.read(2 * MB, MB) == model[2 * MB:3 * MB]
+    # flush is offered where it can make the writes durable
+    if fmt == "streamOptimized":
+        assert not client.flags & 4
+        assert client.error(client.request(3, 0, 0)) == 22
+    else:
+        assert client.flags & 4
+        assert client.error(client.request(3, 0, 0)) == 0
+    for cmd, pos, length in [(6, 2 * MB + 65536, 3 * 65536), (4, 100000, 1000)]:
+        model[pos:pos + length] = bytes(length)
+        assert client.error(client.request(cmd, pos, length)) == 0
+    assert client.read(0, 8 * MB) == model
+    client.close()
+    assert process.wait() == 0
+    assert not os.path.exists(sock)
+
+    raw = os.path.join(WORK_DIR, f"write-{fmt}.img")
+    process = subprocess.run([VMDK_CONVERT, vmdk, raw], cwd=WORK_DIR)
+    assert process.returncode == 0
+    with open(raw, "rb") as f:
+        assert f.read() == model
+
+
+def test_nbd_write_interrupted():
+    sock = os.path.join(WORK_DIR, "interrupted.sock")
+    process = subprocess.Popen([VMDK_CONVERT, "--serve", sock, "--size", "1M", "interrupted.vmdk"], cwd=WORK_DIR)
+    client = NbdClient(sock)
+    assert client.error(client.request(1, 0, 512, data=os.urandom(512))) == 0
+    # gone without NBD_CMD_DISC, the disk is not completed
+    client.sock.close()
+    assert process.wait() == 1
+
+
+@pytest.mark.parametrize("args", [["--size", "16777217T"], ["--size", "18446744073709551615"],
+                                  ["--size", "9007199254740992K"], ["--read-rate", "16777216T"]])
+def test_nbd_size_overflow(args):
+    # sizes that do not fit are refused, instead of wrapping around
+    sock = os.path.join(WORK_DIR, "overflow.sock")
+    process = subprocess.run([VMDK_CONVERT, "--serve", sock, *args, "overflow.vmdk"],
+                             cwd=WORK_DIR, capture_output=True, text=True, timeout=10)
+    assert process.returncode == 1
+    assert "Invalid" in process.stderr
+    assert not os.path.exists(os.path.join(WORK_DIR, "overflow.vmdk"))
+
+
+@pytest.mark.parametrize("options", [["--digest", "sha256"], ["--metadata"], ["--reproducible"], ["--base", "nbd.vmdk"],
+                                     ["--threads", "4"], ["--queue-depth", "2"], ["--format", "raw"]])
+def test_nbd_read_only_options(options):
+    # options for written disks are refused when serving read-only
+    sock = os.path.join(WORK_DIR, "options.sock")
+    process = subprocess.run([VMDK_CONVERT, "--serve", sock, *options, "nbd.vmdk"],
+                             cwd=WORK_DIR, capture_output=True, text=True, timeout=10)
+    assert process.returncode == 1
+    assert "only with --size" in process.stderr
+    assert not os.path.exists(sock)
+
+
+def test_nbd_control():
+    # the control file is read again on SIGHUP while serving
+    control = os.path.join(WORK_DIR, "nbd-control")
+    with open(control, "w") as f:
+        f.write("write-rate 0\n")
+    sock = os.path.join(WORK_DIR, "control.sock")
+    process = subprocess.Popen([VMDK_CONVERT, "--serve", sock, "--size", "1M", "--control", control, "control.vmdk"],
+                               cwd=WORK_DIR, stderr=subprocess.PIPE, text=True)
+    client = NbdClient(sock)
+    assert client.error(client.request(1, 0, 512, data=os.urandom(512))) == 0
+    with open(control, "w") as f:
+        f.write("write-rate fast\n")
+    process.send_signal(signal.SIGHUP)
+    time.sleep(0.2)
+    assert client.error(client.request(1, 512, 512, data=os.urandom(512))) == 0
+    client.close()
+    assert process.wait() == 0
+    assert "Invalid line in" in process.stderr.read()
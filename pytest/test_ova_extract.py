@@ -0,0 +1,107 @@
+# Copyright (c) 2023 VMware, Inc.  All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the “License”); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at:
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software distributed
+# under the License is distributed on an “AS IS” BASIS, without warranties or
+# conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+# specific language governing permissions and limitations under the License.
+
+import os
+import pytest
+import shutil
+import subprocess
+import tarfile
+import yaml
+
+
+THIS_DIR = os.path.dirname(os.path.abspath(__file__))
+OVA_COMPOSE = os.path.join(THIS_DIR, "..", "ova-compose", "ova-compose.py")
+OVA_EXTRACT = os.path.join(THIS_DIR, "..", "ova-extract", "ova-extract.py")
+
+VMDK_CONVERT=os.path.join(THIS_DIR, "..", "build", "vmdk", "vmdk-convert")
+
+CONFIG_DIR=os.path.join(THIS_DIR, "configs")
+
+WORK_DIR=os.path.join(os.getcwd(), "pytest-ova-extract")
+
+ENV = dict(os.environ, PATH=os.path.dirname(VMDK_CONVERT) + os.pathsep + os.environ["PATH"])
+
+
+@pytest.fixture(scope='module', autouse=True)
+def setup_test():
+    os.makedirs(WORK_DIR, exist_ok=True)
+
+    # 4 MB of random data in a 16 MB sparse image
+    with open(os.path.join(WORK_DIR, "extract.img"), "wb") as f:
+        f.truncate(16 * 1024 * 1024)
+        f.seek(2 * 1024 * 1024)
+        f.write(os.urandom(4 * 1024 * 1024))
+
+    config = yaml.safe_load(open(os.path.join(CONFIG_DIR, "raw-image.yaml")))
+    config['hardware']['rootdisk']['raw_image'] = "extract.img"
+    with open(os.path.join(WORK_DIR, "extract.yaml"), "w") as f:
+        yaml.dump(config, f)
+
+    process = subprocess.run([OVA_COMPOSE, "-i", "extract.yaml", "-o", "extract.ova"], cwd=WORK_DIR, env=ENV)
+    assert process.returncode == 0
+
+    yield
+    shutil.rmtree(WORK_DIR)
+
+
+def extract(*args):
+    return subprocess.run([OVA_EXTRACT] + list(args), cwd=WORK_DIR, env=ENV)
+
+
+def test_extract():
+    assert extract("-C", "out", "extract.ova").returncode == 0
+
+    assert sorted(os.listdir(os.path.join(WORK_DIR, "out"))) == ["extract.img", "extract.mf", "extract.ovf"]
+    process = subprocess.run([VMDK_CONVERT, "--verify", "extract.img", "out/extract.img"], cwd=WORK_DIR)
+    assert process.returncode == 0
+
+
+def test_extract_stdin():
+    with open(os.path.join(WORK_DIR, "extract.ova"), "rb") as f:
+        process = subprocess.run([OVA_EXTRACT, "-C", "stdin", "--format", "vmdk", "-"], cwd=WORK_DIR, env=ENV, stdin=f)
+    assert process.returncode == 0
+
+    with open(os.path.join(WORK_DIR, "extract.vmdk"), "rb") as f1, open(os.path.join(WORK_DIR, "stdin", "extract.vmdk"), "rb") as f2:
+        assert f1.read() == f2.read()
+
+
+def test_extract_corrupt():
+    # flip a byte in the middle of the disk
+    with tarfile.open(os.path.join(WORK_DIR, "extract.ova")) as tar:
+        member = tar.getmember("extract.vmdk")
+    shutil.copy(os.path.join(WORK_DIR, "extract.ova"), os.path.join(WORK_DIR, "corrupt.ova"))
+    with open(os.path.join(WORK_DIR, "corrupt.ova"), "r+b") as f:
+        f.seek(member.offset_data + member.size // 2)
+        b = f.read(1)
+        f.seek(-1, os.SEEK_CUR)
+        f.write(bytes([b[0] ^ 0xff]))
+
+    assert extract("-C", "corrupt", "corrupt.ova").returncode != 0
+    assert os.listdir(os.path.join(WORK_DIR, "corrupt")) == []
+
+
+def test_extract_corrupt_ovf():
+    # a still valid OVF that differs from the one in the manifest, the disk is intact
+    with tarfile.open(os.path.join(WORK_DIR, "extract.ova")) as tar:
+        member = tar.getmember("extract.ovf")
+        ovf = tar.extractfile(member).read()
+    shutil.copy(os.path.join(WORK_DIR, "extract.ova"), os.path.join(WORK_DIR, "corrupt-ovf.ova"))
+    with open(os.path.join(WORK_DIR, "corrupt-ovf.ova"), "r+b") as f:
+        f.seek(member.offset_data + ovf.index(b"  "))
+        f.write(b"\t")
+
+    process = subprocess.run([OVA_EXTRACT, "-C", "corrupt-ovf", "corrupt-ovf.ova"], cwd=WORK_DIR, env=ENV,
+                             capture_output=True, text=True)
+    assert process.returncode == 1
+    assert "checksum mismatch for extract.ovf" in process.stderr
+    assert os.listdir(os.path.join(WORK_DIR, "corrupt-ovf")) == []
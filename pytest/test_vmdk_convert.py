@@ -0,0 +1,681 @@
+# Copyright (c) 2023 VMware, Inc.  All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the “License”); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at:
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software distributed
+# under the License is distributed on an “AS IS” BASIS, without warranties or
+# conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+# specific language governing permissions and limitations under the License.
+
+import ctypes
+import errno
+import filecmp
+import glob
+import hashlib
+import json
+import os
+import pytest
+import random
+import shutil
+import subprocess
+import time
+
+
+THIS_DIR = os.path.dirname(os.path.abspath(__file__))
+
+VMDK_CONVERT=os.path.join(THIS_DIR, "..", "build", "vmdk", "vmdk-convert")
+
+WORK_DIR=os.path.join(os.getcwd(), "pytest-vmdk-convert")
+
+
+@pytest.fixture(scope='module', autouse=True)
+def setup_test():
+    os.makedirs(WORK_DIR, exist_ok=True)
+
+    # 8 MB of random data at the start of a 32 MB sparse image
+    process = subprocess.run(["dd", "if=/dev/urandom", "of=random.img", "bs=1M", "count=8"], cwd=WORK_DIR)
+    assert process.returncode == 0
+    os.truncate(os.path.join(WORK_DIR, "random.img"), 32 * 1024 * 1024)
+
+    yield
+    shutil.rmtree(WORK_DIR)
+
+
+def convert(*args):
+    process = subprocess.run([VMDK_CONVERT] + list(args), cwd=WORK_DIR)
+    assert process.returncode == 0
+
+
+def work_path(name):
+    return os.path.join(WORK_DIR, name)
+
+
+def test_exit_status():
+    # failures to open or convert exit with 1, and leave no output
+    for args in [["nosuch.img", "status.vmdk"], ["random.img", "nosuch/status.vmdk"]]:
+        process = subprocess.run([VMDK_CONVERT] + args, cwd=WORK_DIR, capture_output=True, text=True)
+        assert process.returncode == 1
+        assert "No such file or directory" in process.stderr
+    assert not os.path.exists(work_path("status.vmdk"))
+
+    # a damaged sparse disk is an error, not read as a raw image
+    convert("random.img", "status.vmdk")
+    with open(work_path("status.vmdk"), "rb") as f:
+        header = f.read(1024)
+    with open(work_path("status-truncated.vmdk"), "wb") as f:
+        f.write(header)
+    process = subprocess.run([VMDK_CONVERT, "status-truncated.vmdk", "status.img"],
+                             cwd=WORK_DIR, capture_output=True, text=True)
+    assert process.returncode == 1
+    assert "Input/output error" in process.stderr
+    assert not os.path.exists(work_path("status.img"))
+
+    # anything without a sparse header still is
+    with open(work_path("status-raw.img"), "wb") as f:
+        f.write(b"not a vmdk".ljust(4096, b"\0"))
+    convert("status-raw.img", "status-raw.vmdk")
+
+
+def test_roundtrip():
+    convert("random.img", "roundtrip.vmdk")
+    convert("roundtrip.vmdk", "roundtrip.img")
+    assert filecmp.cmp(work_path("random.img"), work_path("roundtrip.img"), shallow=False)
+
+
+@pytest.mark.parametrize("redundant", [False, True])
+def test_monolithic_sparse(redundant):
+    args = ["--format", "monolithicSparse"] + (["--redundant-gd"] if redundant else [])
+    convert(*args, "random.img", "hosted.vmdk")
+    convert("--verify", "random.img", "hosted.vmdk")
+
+    with open(work_path("hosted.vmdk"), "rb") as f:
+        header = f.read(1024)
+    assert b'createType="monolithicSparse"' in header
+    # flags: valid newline detector, redundant GD, no compression
+    assert int.from_bytes(header[8:12], "little") == (3 if redundant else 1)
+    # only the 8 MB of data are stored
+    assert os.path.getsize(work_path("hosted.vmdk")) < 9 * 1024 * 1024
+
+    convert("hosted.vmdk", "hosted.img")
+    assert filecmp.cmp(work_path("random.img"), work_path("hosted.img"), shallow=False)
+
+
+def test_partial_last_grain():
+    # an allocated partial grain at the end used to make nextData loop forever
+    data = os.urandom(2 * 65536 + 3 * 512)
+    with open(work_path("partial.img"), "wb") as f:
+        f.write(data)
+    convert("partial.img", "partial.vmdk")
+
+    out = subprocess.check_output([VMDK_CONVERT, "-i", "partial.vmdk"], cwd=WORK_DIR, timeout=10)
+    assert out == b'{ "capacity": %d, "used": %d }\n' % (len(data), len(data))
+    process = subprocess.run([VMDK_CONVERT, "partial.vmdk", "partial-out.img"], cwd=WORK_DIR, timeout=10)
+    assert process.returncode == 0
+    with open(work_path("partial-out.img"), "rb") as f:
+        assert f.read() == data
+
+
+@pytest.mark.parametrize("fmt,options",
+                         [(fmt, options) for fmt in ["monolithicSparse", "raw"]
+                          for options in [["--digest", "sha256"], ["--metadata"], ["--grain-hashes"], ["--base", "nosuch.vmdk"]]] +
+                         [(fmt, ["--redundant-gd"]) for fmt in ["streamOptimized", "raw"]])
+def test_format_options(fmt, options):
+    # writer options that do not apply to the output format are refused
+    process = subprocess.run([VMDK_CONVERT, "--format", fmt, *options, "random.img", "format-options.out"],
+                             cwd=WORK_DIR, capture_output=True, text=True)
+    assert process.returncode == 1
+    assert "only go" in process.stderr
+    assert not os.path.exists(work_path("format-options.out"))
+
+
+def test_base():
+    convert("--grain-hashes", "random.img", "base.vmdk")
+    assert os.path.isfile(work_path("base.vmdk.grains"))
+
+    shutil.copy(work_path("random.img"), work_path("changed.img"))
+    with open(work_path("changed.img"), "r+b") as f:
+        f.seek(3 * 1024 * 1024 + 17)
+        f.write(b"changed")
+
+    convert("--base", "base.vmdk", "changed.img", "changed.vmdk")
+    convert("changed.vmdk", "changed-out.img")
+    assert filecmp.cmp(work_path("changed.img"), work_path("changed-out.img"), shallow=False)
+
+    # reused grains must give the same result as a full conversion
+    convert("changed.img", "changed-full.vmdk")
+    assert os.path.getsize(work_path("changed.vmdk")) == os.path.getsize(work_path("changed-full.vmdk"))
+
+
+def test_verify():
+    convert("random.img", "verify.vmdk")
+    convert("--verify", "--threads", "4", "random.img", "verify.vmdk")
+
+    shutil.copy(work_path("random.img"), work_path("verify-changed.img"))
+    with open(work_path("verify-changed.img"), "r+b") as f:
+        f.seek(5 * 1024 * 1024 + 1024)
+        f.write(b"\xff")
+
+    process = subprocess.run([VMDK_CONVERT, "--verify", "verify-changed.img", "verify.vmdk"],
+                             cwd=WORK_DIR, capture_output=True, text=True)
+    assert process.returncode == 1
+    assert f"LBA {(5 * 1024 * 1024 + 1024) // 512}" in process.stdout
+
+
+def test_reproducible():
+    for d in ["repro1", "repro2"]:
+        os.makedirs(work_path(d), exist_ok=True)
+        convert("--reproducible", "random.img", os.path.join(d, "repro.vmdk"))
+    assert filecmp.cmp(work_path("repro1/repro.vmdk"), work_path("repro2/repro.vmdk"), shallow=False)
+
+    convert("--seed", "1234", "random.img", "repro1/seed.vmdk")
+    convert("--seed", "1234", "random.img", "repro2/seed.vmdk")
+    assert filecmp.cmp(work_path("repro1/seed.vmdk"), work_path("repro2/seed.vmdk"), shallow=False)
+
+
+@pytest.mark.parametrize("options", [["--digest", "sha256"], ["--format", "monolithicSparse"]])
+def test_reproducible_prehashed(options):
+    # identifiers written before the contents still come from the contents
+    with open(work_path("other.img"), "wb") as f:
+        f.write(os.urandom(8 * 1024 * 1024))
+        f.truncate(32 * 1024 * 1024)
+    cids = []
+    for img, out in [("random.img", "repro1/pre.vmdk"), ("random.img", "repro2/pre.vmdk"), ("other.img", "repro1/other.vmdk")]:
+        os.makedirs(work_path(os.path.dirname(out)), exist_ok=True)
+        convert("--reproducible", *options, img, out)
+        with open(work_path(out), "rb") as f:
+            data = f.read(64 * 1024)
+        cids.append(data[data.index(b"\nCID=") + 5:][:8])
+    assert cids[0] == cids[1]
+    assert cids[0] != cids[2]
+
+
+def thread_names(pid):
+    names = []
+    for task in glob.glob("/proc/%d/task/*/comm" % pid):
+        try:
+            with open(task) as f:
+                names.append(f.read().strip())
+        except OSError:
+            pass
+    return names
+
+
+@pytest.fixture(scope='module')
+def mixed_img():
+    # random, compressible and zero grains, and a partial grain at the end
+    with open(work_path("mixed.img"), "wb") as f:
+        for i in range(64):
+            kind = i % 4
+            if kind == 0:
+                f.write(os.urandom(65536))
+            elif kind == 1:
+                f.write(bytes([i]) * 65536)
+            elif kind == 2:
+                f.write(b"".join(b"line %d of grain %d\n" % (j, i) for j in range(4096))[:65536])
+            else:
+                f.write(bytes(65536))
+        f.write(os.urandom(12345))
+        f.truncate(f.tell() + 512 - f.tell() % 512)
+    return "mixed.img"
+
+
+@pytest.mark.parametrize("threads", [2, 3, 8])
+@pytest.mark.parametrize("options", [[], ["--digest", "sha256"], ["--grain-hashes"]])
+def test_compress_threads(mixed_img, threads, options):
+    # the output does not depend on how many threads compressed it
+    # the descriptor names the file, so all outputs have the same name
+    variant = "-".join(o.strip("-") for o in options)
+    single = "threads/1%s/disk.vmdk" % variant
+    out = "threads/%d%s/disk.vmdk" % (threads, variant)
+    os.makedirs(work_path(os.path.dirname(out)), exist_ok=True)
+    if not os.path.exists(work_path(single)):
+        os.makedirs(work_path(os.path.dirname(single)), exist_ok=True)
+        convert("--reproducible", "--seed", "1", "--threads", "1", *options, mixed_img, single)
+    convert("--reproducible", "--seed", "1", "--threads", str(threads), *options, mixed_img, out)
+    assert filecmp.cmp(work_path(single), work_path(out), shallow=False)
+    convert("--verify", mixed_img, out)
+
+
+def test_compress_threads_running():
+    process = subprocess.Popen([VMDK_CONVERT, "--threads", "4", "--read-rate", "8M", "random.img", "deflate.vmdk"],
+                               cwd=WORK_DIR)
+    compressors = 0
+    while process.poll() is None:
+        compressors = max(compressors, thread_names(process.pid).count("vmdk-deflate"))
+        time.sleep(0.05)
+    assert process.wait() == 0
+    # the caller compresses as well
+    assert compressors == 3
+    convert("--verify", "random.img", "deflate.vmdk")
+
+
+def test_compress_threads_limit():
+    # a control file limit of one thread leaves the pool idle, the result is the same
+    with open(work_path("control-threads"), "w") as f:
+        f.write("threads 1\n")
+    for d in ["limit1", "limit4"]:
+        os.makedirs(work_path(d), exist_ok=True)
+    convert("--reproducible", "--seed", "1", "--threads", "1", "random.img", "limit1/disk.vmdk")
+    convert("--reproducible", "--seed", "1", "--threads", "4", "--control", "control-threads",
+            "random.img", "limit4/disk.vmdk")
+    assert filecmp.cmp(work_path("limit1/disk.vmdk"), work_path("limit4/disk.vmdk"), shallow=False)
+
+
+def test_queue_depth():
+    # io_uring or not, the output is the same
+    for d, depth in [("repro1", "1"), ("repro2", "8")]:
+        os.makedirs(work_path(d), exist_ok=True)
+        convert("--reproducible", "--queue-depth", depth, "random.img", os.path.join(d, "depth.vmdk"))
+    assert filecmp.cmp(work_path("repro1/depth.vmdk"), work_path("repro2/depth.vmdk"), shallow=False)
+    convert("--verify", "random.img", "repro2/depth.vmdk")
+
+
+@pytest.mark.parametrize("durability", ["once", "none"])
+@pytest.mark.parametrize("fmt", ["streamOptimized", "monolithicSparse", "raw"])
+def test_durability(durability, fmt):
+    convert("--durability", durability, "--format", fmt, "random.img", "durability.out")
+    convert("--verify", "random.img", "durability.out")
+
+
+def test_throttle():
+    with open(work_path("control"), "w") as f:
+        f.write("# limits for test_throttle\nthreads 1\nwrite-rate 0\n")
+    # 8 MB of data at 16 MB/s take at least about half a second
+    start = time.monotonic()
+    convert("--threads", "4", "--read-rate", "16M", "--write-rate", "1K", "--control", "control",
+            "random.img", "throttle.vmdk")
+    assert time.monotonic() - start > 0.4
+    convert("--verify", "random.img", "throttle.vmdk")
+
+    with open(work_path("control"), "w") as f:
+        f.write("read-rate fast\n")
+    process = subprocess.run([VMDK_CONVERT, "--control", "control", "random.img", "throttle.vmdk"], cwd=WORK_DIR)
+    assert process.returncode == 1
+
+
+def test_resume():
+    # 8 MB at 4 MB/s, killed halfway through
+    process = subprocess.Popen([VMDK_CONVERT, "--resume", "--checkpoint-interval", "0", "--read-rate", "4M",
+                                "random.img", "resume.vmdk"], cwd=WORK_DIR)
+    time.sleep(1)
+    process.kill()
+    process.wait()
+    assert os.path.exists(work_path("resume.vmdk.resume"))
+
+    output = subprocess.check_output([VMDK_CONVERT, "--resume", "random.img", "resume.vmdk"], cwd=WORK_DIR)
+    assert b"Resuming at" in output
+    assert not os.path.exists(work_path("resume.vmdk.resume"))
+    convert("--verify", "random.img", "resume.vmdk")
+
+
+def test_resume_other_source():
+    shutil.copy(work_path("random.img"), work_path("resume-src.img"))
+    process = subprocess.Popen([VMDK_CONVERT, "--resume", "--checkpoint-interval", "0", "--read-rate", "4M",
+                                "resume-src.img", "resume2.vmdk"], cwd=WORK_DIR)
+    time.sleep(1)
+    process.kill()
+    process.wait()
+    assert os.path.exists(work_path("resume2.vmdk.resume"))
+
+    # same size, other contents: the checkpoint must not be used
+    with open(work_path("resume-src.img"), "r+b") as f:
+        f.write(os.urandom(1024 * 1024))
+    process = subprocess.run([VMDK_CONVERT, "--resume", "resume-src.img", "resume2.vmdk"], cwd=WORK_DIR)
+    assert process.returncode == 1
+
+    # a plain conversion starts over, and leaves no checkpoint behind
+    convert("resume-src.img", "resume2.vmdk")
+    assert not os.path.exists(work_path("resume2.vmdk.resume"))
+    output = subprocess.check_output([VMDK_CONVERT, "--resume", "resume-src.img", "resume2.vmdk"], cwd=WORK_DIR)
+    assert b"Resuming at" not in output
+    convert("--verify", "resume-src.img", "resume2.vmdk")
+
+
+@pytest.mark.parametrize("digests", ["sha256", "sha1,sha512"])
+def test_digest(digests):
+    convert("--digest", digests, "random.img", "digest.vmdk")
+    convert("--verify", "random.img", "digest.vmdk")
+
+    with open(work_path("digest.vmdk.digest"), "rt") as f:
+        lines = f.read().splitlines()
+    assert len(lines) == len(digests.split(","))
+    for line in lines:
+        left, value = line.split("= ")
+        hash_type = left.split("(")[0].lower()
+        assert left == f"{hash_type.upper()}(digest.vmdk)"
+        with open(work_path("digest.vmdk"), "rb") as f:
+            assert hashlib.new(hash_type, f.read()).hexdigest() == value
+
+
+def test_metadata():
+    convert("--metadata", "--digest", "sha256", "random.img", "metadata.vmdk")
+
+    with open(work_path("metadata.vmdk.json"), "rt") as f:
+        metadata = json.load(f)
+    info = json.loads(subprocess.check_output([VMDK_CONVERT, "-i", "metadata.vmdk"], cwd=WORK_DIR))
+    assert metadata['capacity'] == info['capacity'] == 32 * 1024 * 1024
+    assert metadata['used'] == info['used']
+    assert metadata['size'] == os.path.getsize(work_path("metadata.vmdk"))
+    with open(work_path("metadata.vmdk"), "rb") as f:
+        assert metadata['digests'] == {'sha256': hashlib.sha256(f.read()).hexdigest()}
+
+
+def test_estimate():
+    convert("random.img", "estimate.vmdk")
+    info = json.loads(subprocess.check_output([VMDK_CONVERT, "-i", "--estimate", "random.img"], cwd=WORK_DIR))
+    # few enough grains to sample all of them, then the estimate is exact
+    assert info['sampledGrains'] == info['grains'] == 8 * 1024 * 1024 // 65536
+    assert info['estimatedSizeLow'] == info['estimatedSize'] == info['estimatedSizeHigh'] == \
+        os.path.getsize(work_path("estimate.vmdk"))
+
+    # digests move the grain tables behind the grains, with markers
+    convert("--digest", "sha256", "random.img", "estimate-digest.vmdk")
+    info = json.loads(subprocess.check_output([VMDK_CONVERT, "-i", "--estimate", "--digest", "sha256", "random.img"],
+                                              cwd=WORK_DIR))
+    assert info['estimatedSize'] == os.path.getsize(work_path("estimate-digest.vmdk"))
+    process = subprocess.run([VMDK_CONVERT, "-i", "--digest", "sha256", "random.img"], cwd=WORK_DIR)
+    assert process.returncode == 1
+
+    process = subprocess.run([VMDK_CONVERT, "-i", "--estimate", "--sample", "2", "random.img"], cwd=WORK_DIR)
+    assert process.returncode == 1
+    process = subprocess.run([VMDK_CONVERT, "-i", "--sample", "0.5", "random.img"], cwd=WORK_DIR)
+    assert process.returncode == 1
+
+
+def test_estimate_min_samples():
+    # 6000 grains in strata of 94: rounding each stratum on its own gave 1021 samples
+    with open(work_path("estimate-6000.img"), "wb") as f:
+        for i in range(6000):
+            f.seek(i * 65536)
+            f.write(os.urandom(4096))
+        f.truncate(6000 * 65536)
+    info = json.loads(subprocess.check_output([VMDK_CONVERT, "-i", "--estimate", "estimate-6000.img"], cwd=WORK_DIR))
+    assert info['grains'] == 6000
+    assert info['sampledGrains'] >= 1024
+    os.remove(work_path("estimate-6000.img"))
+
+
+def test_library():
+    lib = ctypes.CDLL(os.path.join(THIS_DIR, "..", "build", "vmdk", "libopenvmdk.so.1"), use_errno=True)
+    lib.openvmdk_context_new.restype = ctypes.c_void_p
+    lib.openvmdk_context_free.argtypes = [ctypes.c_void_p]
+    lib.openvmdk_context_set_tools_version.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+    lib.openvmdk_open.restype = ctypes.c_void_p
+    lib.openvmdk_open.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+    lib.openvmdk_create.restype = ctypes.c_void_p
+    lib.openvmdk_create.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_uint64, ctypes.c_int]
+    lib.openvmdk_pread.restype = ctypes.c_ssize_t
+    lib.openvmdk_pread.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_uint64]
+    lib.openvmdk_pwrite.restype = ctypes.c_ssize_t
+    lib.openvmdk_pwrite.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_uint64]
+    lib.openvmdk_info.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+    lib.openvmdk_close.argtypes = [ctypes.c_void_p]
+
+    class Info(ctypes.Structure):
+        _fields_ = [("capacity", ctypes.c_uint64), ("used", ctypes.c_uint64)]
+
+    assert lib.openvmdk_api_version() == 1
+    ctx = lib.openvmdk_context_new()
+    assert lib.openvmdk_context_set_tools_version(ctx, b"12325") == 0
+
+    data = os.urandom(65536 * 3)
+    disk = lib.openvmdk_create(ctx, work_path("lib.vmdk").encode(), 1024 * 1024, 0)
+    assert disk
+    assert lib.openvmdk_pwrite(disk, data, len(data), 65536) == len(data)
+    assert lib.openvmdk_close(disk) == 0
+
+    disk = lib.openvmdk_open(ctx, work_path("lib.vmdk").encode())
+    assert disk
+    info = Info()
+    assert lib.openvmdk_info(disk, ctypes.byref(info)) == 0
+    assert info.capacity == 1024 * 1024
+    assert info.used == len(data)
+    buf = ctypes.create_string_buffer(len(data))
+    assert lib.openvmdk_pread(disk, buf, len(data), 65536) == len(data)
+    assert buf.raw == data
+    assert lib.openvmdk_close(disk) == 0
+    lib.openvmdk_context_free(ctx)
+
+    # reading takes nothing from a context
+    disk = lib.openvmdk_open(None, work_path("lib.vmdk").encode())
+    assert disk
+    assert lib.openvmdk_pread(disk, buf, len(data), 65536) == len(data)
+    assert buf.raw == data
+    assert lib.openvmdk_close(disk) == 0
+
+    with open(work_path("lib.vmdk"), "rb") as f:
+        assert b'ddb.toolsVersion = "12325"' in f.read(16384)
+
+    # creating without a context uses the defaults
+    disk = lib.openvmdk_create(None, work_path("lib-default.vmdk").encode(), 1024 * 1024, 0)
+    assert disk
+    assert lib.openvmdk_pwrite(disk, data, len(data), 65536) == len(data)
+    assert lib.openvmdk_close(disk) == 0
+    convert("lib-default.vmdk", "lib-default.img")
+    with open(work_path("lib-default.img"), "rb") as f:
+        assert f.read()[65536:65536 + len(data)] == data
+
+    # capacities that do not fit an off_t are refused
+    for fmt in (0, 1, 2):
+        assert not lib.openvmdk_create(None, work_path("lib-huge.vmdk").encode(), 1 << 63, fmt)
+        assert ctypes.get_errno() == errno.EINVAL
+    assert not os.path.exists(work_path("lib-huge.vmdk"))
+
+
+@pytest.mark.parametrize("open_grains,digests", [(1, 0), (4, 0), (16, 2)])
+def test_library_random_writes(open_grains, digests):
+    lib = ctypes.CDLL(os.path.join(THIS_DIR, "..", "build", "vmdk", "libopenvmdk.so.1"), use_errno=True)
+    lib.openvmdk_context_new.restype = ctypes.c_void_p
+    lib.openvmdk_context_free.argtypes = [ctypes.c_void_p]
+    lib.openvmdk_context_set_open_grains.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+    lib.openvmdk_context_set_digests.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+    lib.openvmdk_create.restype = ctypes.c_void_p
+    lib.openvmdk_create.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_uint64, ctypes.c_int]
+    lib.openvmdk_pwrite.restype = ctypes.c_ssize_t
+    lib.openvmdk_pwrite.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_uint64]
+    lib.openvmdk_close.argtypes = [ctypes.c_void_p]
+
+    ctx = lib.openvmdk_context_new()
+    assert lib.openvmdk_context_set_open_grains(ctx, open_grains) == 0
+    assert lib.openvmdk_context_set_digests(ctx, digests) == 0
+
+    # overlapping 4k writes in random order, some grains zeroed again
+    capacity = 1024 * 1024 + 8192
+    rng = random.Random(open_grains)
+    model = bytearray(capacity)
+    vmdk = work_path(f"random-{open_grains}.vmdk")
+    disk = lib.openvmdk_create(ctx, vmdk.encode(), capacity, 0)
+    assert disk
+    for i in range(400):
+        pos = rng.randrange(0, capacity // 4096) * 4096
+        length = min(rng.choice([4096, 12288, 65536]), capacity - pos)
+        data = bytes(length) if i % 10 == 0 else rng.randbytes(length)
+        model[pos:pos + length] = data
+        assert lib.openvmdk_pwrite(disk, data, length, pos) == length
+    assert lib.openvmdk_close(disk) == 0
+    lib.openvmdk_context_free(ctx)
+
+    raw = work_path(f"random-{open_grains}.img")
+    convert(vmdk, raw)
+    with open(raw, "rb") as f:
+        assert f.read() == model
+
+    # read as a stream, superseded copies of grains must not show up
+    stream_raw = work_path(f"random-{open_grains}-stream.img")
+    with open(vmdk, "rb") as f:
+        process = subprocess.run([VMDK_CONVERT, "-", stream_raw], cwd=WORK_DIR, stdin=f)
+    assert process.returncode == 0
+    with open(stream_raw, "rb") as f:
+        assert f.read() == model
+
+    if digests:
+        with open(vmdk, "rb") as f:
+            digest = hashlib.sha256(f.read()).hexdigest()
+        with open(vmdk + ".digest") as f:
+            assert f.read().split("= ")[1].strip() == digest
+
+
+@pytest.mark.parametrize("digests", [0, 2])
+def test_library_rewrite_then_zero(digests):
+    lib = ctypes.CDLL(os.path.join(THIS_DIR, "..", "build", "vmdk", "libopenvmdk.so.1"), use_errno=True)
+    lib.openvmdk_context_new.restype = ctypes.c_void_p
+    lib.openvmdk_context_free.argtypes = [ctypes.c_void_p]
+    lib.openvmdk_context_set_open_grains.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+    lib.openvmdk_context_set_digests.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+    lib.openvmdk_create.restype = ctypes.c_void_p
+    lib.openvmdk_create.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_uint64, ctypes.c_int]
+    lib.openvmdk_pwrite.restype = ctypes.c_ssize_t
+    lib.openvmdk_pwrite.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_uint64]
+    lib.openvmdk_close.argtypes = [ctypes.c_void_p]
+
+    ctx = lib.openvmdk_context_new()
+    assert lib.openvmdk_context_set_open_grains(ctx, 1) == 0
+    assert lib.openvmdk_context_set_digests(ctx, digests) == 0
+    vmdk = work_path(f"rewrite-zero-{digests}.vmdk")
+    disk = lib.openvmdk_create(ctx, vmdk.encode(), 4 * 65536, 0)
+    assert disk
+    # grain 1 written, then pushed out by grain 0, then zeroed again
+    for pos, data in [(65536, b"C" * 65536), (0, b"A" * 65536), (65536, bytes(65536))]:
+        assert lib.openvmdk_pwrite(disk, data, len(data), pos) == len(data)
+    assert lib.openvmdk_close(disk) == 0
+    lib.openvmdk_context_free(ctx)
+
+    expected = b"A" * 65536 + bytes(3 * 65536)
+    with open(vmdk, "rb") as f:
+        process = subprocess.run([VMDK_CONVERT, "-", "rewrite-zero.img"], cwd=WORK_DIR, stdin=f)
+    assert process.returncode == 0
+    with open(work_path("rewrite-zero.img"), "rb") as f:
+        assert f.read() == expected
+    convert(vmdk, "rewrite-zero.img")
+    with open(work_path("rewrite-zero.img"), "rb") as f:
+        assert f.read() == expected
+
+
+def make_child(child, parent, hint):
+    # turn a converted disk into a snapshot of parent by linking its embedded descriptor
+    with open(work_path(parent), "rb") as f:
+        data = f.read(64 * 1024)
+    cid = data[data.index(b"\nCID=") + 5:][:8]
+
+    with open(work_path(child), "r+b") as f:
+        hdr = f.read(512)
+        offset = int.from_bytes(hdr[28:36], "little") * 512
+        size = int.from_bytes(hdr[36:44], "little") * 512
+        f.seek(offset)
+        desc = f.read(size).rstrip(b"\0")
+        desc = desc.replace(b"parentCID=ffffffff", b"parentCID=" + cid)
+        desc = desc.replace(b"\ncreateType=", b'\nparentFileNameHint="%s"\ncreateType=' % hint.encode())
+        f.seek(offset)
+        f.write(desc.ljust(size, b"\0"))
+
+
+def test_snapshot_chain():
+    # parent: random.img, child: only grains 3 and 200 changed, the rest holes
+    with open(work_path("child.img"), "wb") as f:
+        f.truncate(32 * 1024 * 1024)
+        f.seek(3 * 65536)
+        f.write(b"\1" * 65536)
+        f.seek(200 * 65536)
+        f.write(b"\2" * 65536)
+    with open(work_path("random.img"), "rb") as f:
+        expected = bytearray(f.read())
+    expected[3 * 65536:4 * 65536] = b"\1" * 65536
+    expected[200 * 65536:201 * 65536] = b"\2" * 65536
+
+    os.makedirs(work_path("chain"), exist_ok=True)
+    convert("random.img", "chain/parent.vmdk")
+    convert("child.img", "chain/child.vmdk")
+    make_child("chain/child.vmdk", "chain/parent.vmdk", "parent.vmdk")
+
+    convert("chain/child.vmdk", "chain-out.img")
+    with open(work_path("chain-out.img"), "rb") as f:
+        assert f.read() == expected
+
+    out = subprocess.check_output([VMDK_CONVERT, "-i", "chain/child.vmdk"], cwd=WORK_DIR)
+    assert b'"used": %d' % (8 * 1024 * 1024 + 65536) in out
+
+    # parent modified after the snapshot was taken
+    convert("child.img", "chain/parent.vmdk")
+    process = subprocess.run([VMDK_CONVERT, "chain/child.vmdk", "chain-bad.img"], cwd=WORK_DIR)
+    assert process.returncode == 1
+
+
+def test_descriptor():
+    os.makedirs(work_path("desc"), exist_ok=True)
+    a = os.urandom(1024 * 1024)
+    b = os.urandom(2 * 1024 * 1024)
+    c = os.urandom(1024 * 1024)
+    with open(work_path("desc/a-flat.vmdk"), "wb") as f:
+        f.write(a)
+    with open(work_path("b.img"), "wb") as f:
+        f.write(b)
+    with open(work_path("desc/c-flat.vmdk"), "wb") as f:
+        f.write(c)
+    convert("b.img", "desc/b-s002.vmdk")
+
+    with open(work_path("desc/disk.vmdk"), "w") as f:
+        f.write('# Disk DescriptorFile\nversion=1\nCID=1234abcd\nparentCID=ffffffff\ncreateType="twoGbMaxExtentSparse"\n\n'
+                '# Extent description\n'
+                'RW 2048 FLAT "a-flat.vmdk" 0\n'
+                'RW 4096 SPARSE "b-s002.vmdk"\n'
+                'RW 2048 ZERO\n'
+                'RW 1024 FLAT "c-flat.vmdk" 1\n')
+    expected = a + b + bytes(1024 * 1024) + c[512:512 + 512 * 1024]
+    with open(work_path("desc-expected.img"), "wb") as f:
+        f.write(expected)
+
+    convert("desc/disk.vmdk", "desc-out.img")
+    assert filecmp.cmp(work_path("desc-expected.img"), work_path("desc-out.img"), shallow=False)
+    convert("--verify", "--threads", "2", "desc-expected.img", "desc/disk.vmdk")
+
+    # snapshot on top of it, changing one grain in the zero extent
+    with open(work_path("delta.img"), "wb") as f:
+        f.truncate(len(expected))
+        f.seek(3 * 1024 * 1024 + 65536)
+        f.write(b"\3" * 65536)
+    convert("delta.img", "desc/delta-s001.vmdk")
+    with open(work_path("desc/delta.vmdk"), "w") as f:
+        f.write('# Disk DescriptorFile\nversion=1\nCID=5678abcd\nparentCID=1234abcd\ncreateType="twoGbMaxExtentSparse"\n'
+                'parentFileNameHint="disk.vmdk"\n\n'
+                'RW %d SPARSE "delta-s001.vmdk"\n' % (len(expected) // 512))
+    expected = bytearray(expected)
+    expected[3 * 1024 * 1024 + 65536:3 * 1024 * 1024 + 2 * 65536] = b"\3" * 65536
+    with open(work_path("delta-expected.img"), "wb") as f:
+        f.write(expected)
+    convert("--verify", "delta-expected.img", "desc/delta.vmdk")
+
+    out = subprocess.check_output([VMDK_CONVERT, "-i", "desc/delta.vmdk"], cwd=WORK_DIR)
+    assert out == b'{ "capacity": %d, "used": %d }\n' % (len(expected), len(expected) - 1024 * 1024 + 65536)
+
+
+def test_descriptor_read_ahead():
+    # extents are read by several threads while a slow conversion runs
+    os.makedirs(work_path("ra"), exist_ok=True)
+    data = b""
+    lines = ""
+    for i in range(8):
+        extent = os.urandom(1024 * 1024)
+        with open(work_path("ra/disk-f%03d.vmdk" % i), "wb") as f:
+            f.write(extent)
+        data += extent
+        lines += 'RW 2048 FLAT "disk-f%03d.vmdk" 0\n' % i
+    with open(work_path("ra/disk.vmdk"), "w") as f:
+        f.write('# Disk DescriptorFile\nversion=1\nCID=1234abcd\nparentCID=ffffffff\n'
+                'createType="twoGbMaxExtentFlat"\n\n' + lines)
+    with open(work_path("ra-expected.img"), "wb") as f:
+        f.write(data)
+
+    process = subprocess.Popen([VMDK_CONVERT, "--threads", "1", "--queue-depth", "1", "--read-rate", "4M",
+                                "ra/disk.vmdk", "ra-out.vmdk"], cwd=WORK_DIR)
+    readers = 0
+    deadline = time.monotonic() + 1.5
+    while process.poll() is None and time.monotonic() < deadline:
+        readers = max(readers, thread_names(process.pid).count("vmdk-extents"))
+        time.sleep(0.05)
+    assert process.wait() == 0
+    assert readers >= 2
+    convert("--verify", "ra-expected.img", "ra-out.vmdk")
@@ -0,0 +1,936 @@
+/* *******************************************************************************
+ * Copyright (c) 2014-2023 VMware, Inc.  All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”); you may not
+ * use this file except in compliance with the License.  You may obtain a copy of
+ * the License at:
+ *
+ *            http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed
+ * under the License is distributed on an “AS IS” BASIS, without warranties or
+ * conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ * *********************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "diskinfo.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VMDK_SECTOR_SIZE	512ULL
+
+/* Descriptor files are small, anything bigger is not one. */
+#define DESCRIPTOR_MAX_SIZE	(1024 * 1024)
+
+/*
+ * Multi-extent disks are read ahead by a pool of threads, so that the
+ * extents, which are independent files, are read while the caller
+ * processes what it read before.  Chunks never span extents.  Only
+ * sequential readers gain from it, so it starts once READ_AHEAD_AFTER
+ * reads in a row continued where the one before ended.
+ */
+#define READ_AHEAD_CHUNK	(1024 * 1024)
+#define READ_AHEAD_THREADS	4
+#define READ_AHEAD_CHUNKS	(4 * READ_AHEAD_THREADS)
+#define READ_AHEAD_AFTER	4
+
+typedef enum {
+	EXTENT_SPARSE,
+	EXTENT_FLAT,
+	EXTENT_ZERO,
+} ExtentType;
+
+typedef struct {
+	ExtentType type;
+	DiskInfo *di;		/* NULL for EXTENT_ZERO */
+	off_t start;		/* position in the virtual disk */
+	off_t size;
+	off_t offset;		/* position of the data in a flat extent file */
+	bool busy;		/* a sparse extent is read by one thread at a time */
+} Extent;
+
+typedef enum {
+	CHUNK_FREE,
+	CHUNK_QUEUED,
+	CHUNK_READING,
+	CHUNK_READY,
+	CHUNK_FAILED,
+} ChunkState;
+
+typedef struct {
+	ChunkState state;
+	unsigned int extent;
+	off_t pos;		/* position in the virtual disk */
+	size_t len;
+	uint8_t *data;
+} ReadAheadChunk;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* a chunk changed its state */
+	pthread_t threads[READ_AHEAD_THREADS];
+	unsigned int numThreads;
+	ReadAheadChunk chunks[READ_AHEAD_CHUNKS];
+	uint8_t *buffers;
+	off_t next;		/* read-ahead continues here */
+	bool stop;
+} ReadAhead;
+
+/*
+ * Disk described by a text descriptor file, e.g. twoGbMaxExtentSparse or
+ * monolithicFlat, made of one or more extents.
+ */
+typedef struct {
+	DiskInfo hdr;
+	Extent *extents;
+	unsigned int numExtents;
+	off_t capacity;
+	DiskInfo *parent;	/* for snapshots: unallocated areas come from here */
+	ReadAhead *readAhead;	/* started by the first sequential reads */
+	off_t lastEnd;		/* where the last read ended */
+	unsigned int sequential; /* reads in a row that started at lastEnd */
+} DescriptorDiskInfo;
+
+
+static inline DescriptorDiskInfo *
+getDDI(DiskInfo *self)
+{
+	return (DescriptorDiskInfo *)self;
+}
+
+/*
+ * Look up "key=value" or "key = \"value\"" in a descriptor.  Returns a
+ * malloced copy of the value without quotes, or NULL if the key is missing.
+ */
+char *
+Descriptor_GetValue(const char *desc,
+                    const char *key)
+{
+	size_t keyLen = strlen(key);
+	const char *line;
+
+	for (line = desc; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+		const char *p = line + strspn(line, " \t");
+		size_t len;
+
+		if (strncmp(p, key, keyLen) != 0) {
+			continue;
+		}
+		p += keyLen;
+		p += strspn(p, " \t");
+		if (*p != '=') {
+			continue;
+		}
+		p++;
+		p += strspn(p, " \t");
+		if (*p == '"') {
+			p++;
+			len = strcspn(p, "\"\r\n");
+		} else {
+			len = strcspn(p, " \t\r\n");
+		}
+		return strndup(p, len);
+	}
+	return NULL;
+}
+
+/* CID stored in a descriptor, 0xFFFFFFFF if it is missing */
+uint32_t
+Descriptor_GetCID(const char *desc,
+                  const char *key)
+{
+	char *value = Descriptor_GetValue(desc, key);
+	uint32_t cid = 0xFFFFFFFFU;
+
+	if (value) {
+		cid = strtoul(value, NULL, 16);
+		free(value);
+	}
+	return cid;
+}
+
+/* parentFileNameHint and extent file names are relative to the descriptor. */
+char *
+Descriptor_ParentFileName(const char *childFileName,
+                          const char *hint)
+{
+	char *dir;
+	char *ret;
+
+	if (hint[0] == '/') {
+		return strdup(hint);
+	}
+	dir = strdup(childFileName);
+	if (dir == NULL) {
+		return NULL;
+	}
+	if (asprintf(&ret, "%s/%s", dirname(dir), hint) == -1) {
+		ret = NULL;
+	}
+	free(dir);
+	return ret;
+}
+
+/*
+ * Read a text descriptor file.  Fails with EMEDIUMTYPE if the file does not
+ * look like one.
+ */
+static char *
+loadDescriptorFile(const char *fileName)
+{
+	struct stat stb;
+	char *desc;
+	int fd;
+
+	fd = open(fileName, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &stb)) {
+		goto failFd;
+	}
+	if (!S_ISREG(stb.st_mode) || stb.st_size == 0 || stb.st_size > DESCRIPTOR_MAX_SIZE) {
+		errno = EMEDIUMTYPE;
+		goto failFd;
+	}
+	desc = malloc(stb.st_size + 1);
+	if (desc == NULL) {
+		goto failFd;
+	}
+	if (pread(fd, desc, stb.st_size, 0) != stb.st_size) {
+		goto failDesc;
+	}
+	desc[stb.st_size] = '\0';
+	if (strlen(desc) != (size_t)stb.st_size ||
+	    (strncmp(desc, "createType", 10) != 0 && strstr(desc, "\ncreateType") == NULL)) {
+		errno = EMEDIUMTYPE;
+		goto failDesc;
+	}
+	close(fd);
+	return desc;
+
+failDesc:
+	free(desc);
+failFd:
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Descriptor of a disk: the contents of a descriptor file, or the descriptor
+ * embedded in a sparse extent.
+ */
+char *
+Descriptor_Load(const char *fileName)
+{
+	char *desc = Sparse_ReadDescriptor(fileName);
+
+	if (desc == NULL && errno == EMEDIUMTYPE) {
+		desc = loadDescriptorFile(fileName);
+	}
+	return desc;
+}
+
+static off_t
+DescriptorGetCapacity(DiskInfo *self)
+{
+	return getDDI(self)->capacity;
+}
+
+/* Index of the extent containing pos, numExtents if past the end */
+static unsigned int
+findExtent(const DescriptorDiskInfo *ddi,
+           off_t pos)
+{
+	unsigned int lo = 0;
+	unsigned int hi = ddi->numExtents;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		const Extent *ext = &ddi->extents[mid];
+
+		if (pos < ext->start) {
+			hi = mid;
+		} else if (pos >= ext->start + ext->size) {
+			lo = mid + 1;
+		} else {
+			return mid;
+		}
+	}
+	return lo;
+}
+
+/* Read [pos, pos + len) of a disk, zeroes past its end */
+static bool
+readDisk(DiskInfo *di,
+         uint8_t *buf,
+         size_t len,
+         off_t pos)
+{
+	off_t capacity = di->vmt->getCapacity(di);
+	ssize_t rd = 0;
+
+	if (pos < capacity) {
+		if ((off_t)len > capacity - pos) {
+			rd = di->vmt->pread(di, buf, capacity - pos, pos);
+		} else {
+			rd = di->vmt->pread(di, buf, len, pos);
+		}
+		if (rd < 0) {
+			return false;
+		}
+	}
+	memset(buf + rd, 0, len - rd);
+	return true;
+}
+
+/* Next data area of one extent at or after extPos, in extent coordinates */
+static int
+extentNextData(const Extent *ext,
+               off_t extPos,
+               off_t *pos,
+               off_t *end)
+{
+	off_t p;
+	off_t e = extPos + ext->offset;
+
+	if (ext->type == EXTENT_ZERO ||
+	    ext->di->vmt->nextData(ext->di, &p, &e) != 0) {
+		errno = ENXIO;
+		return -1;
+	}
+	p -= ext->offset;
+	e -= ext->offset;
+	if (p < extPos) {
+		p = extPos;
+	}
+	if (e > ext->size) {
+		e = ext->size;
+	}
+	if (p >= e) {
+		errno = ENXIO;
+		return -1;
+	}
+	*pos = p;
+	*end = e;
+	return 0;
+}
+
+/*
+ * Read part of one extent.  Areas the extent does not have are read from
+ * the parent, if there is one.
+ */
+static bool
+readExtent(DescriptorDiskInfo *ddi,
+           const Extent *ext,
+           uint8_t *buf,
+           size_t len,
+           off_t pos)
+{
+	off_t extPos = pos - ext->start;
+	off_t extEnd = extPos + len;
+
+	if (ddi->parent == NULL) {
+		if (ext->type == EXTENT_ZERO) {
+			memset(buf, 0, len);
+			return true;
+		}
+		return readDisk(ext->di, buf, len, ext->offset + extPos);
+	}
+	while (extPos < extEnd) {
+		off_t dataPos;
+		off_t dataEnd;
+
+		if (extentNextData(ext, extPos, &dataPos, &dataEnd) != 0 || dataPos >= extEnd) {
+			dataPos = dataEnd = extEnd;
+		} else if (dataEnd > extEnd) {
+			dataEnd = extEnd;
+		}
+		if (dataPos > extPos &&
+		    !readDisk(ddi->parent, buf, dataPos - extPos, ext->start + extPos)) {
+			return false;
+		}
+		buf += dataPos - extPos;
+		if (dataEnd > dataPos &&
+		    !readDisk(ext->di, buf, dataEnd - dataPos, ext->offset + dataPos)) {
+			return false;
+		}
+		buf += dataEnd - dataPos;
+		extPos = dataEnd;
+	}
+	return true;
+}
+
+/* Whether the chunk has data for pos, or will have. */
+static bool
+chunkHas(const ReadAheadChunk *chunk,
+         off_t pos)
+{
+	return chunk->state != CHUNK_FREE && pos >= chunk->pos && pos < chunk->pos + (off_t)chunk->len;
+}
+
+static void *
+readAheadThread(void *arg)
+{
+	DescriptorDiskInfo *ddi = arg;
+	ReadAhead *ra = ddi->readAhead;
+
+	pthread_mutex_lock(&ra->lock);
+	while (!ra->stop) {
+		ReadAheadChunk *chunk = NULL;
+		Extent *ext;
+		unsigned int i;
+		bool ok;
+
+		/* Lowest queued chunk whose extent is free to read. */
+		for (i = 0; i < READ_AHEAD_CHUNKS; i++) {
+			ReadAheadChunk *c = &ra->chunks[i];
+
+			if (c->state == CHUNK_QUEUED && !ddi->extents[c->extent].busy &&
+			    (!chunk || c->pos < chunk->pos)) {
+				chunk = c;
+			}
+		}
+		if (!chunk) {
+			pthread_cond_wait(&ra->cond, &ra->lock);
+			continue;
+		}
+		ext = &ddi->extents[chunk->extent];
+		chunk->state = CHUNK_READING;
+		/* Flat extents are plain preads, any number of them at once. */
+		ext->busy = ext->type == EXTENT_SPARSE;
+		pthread_mutex_unlock(&ra->lock);
+
+		ok = readExtent(ddi, ext, chunk->data, chunk->len, chunk->pos);
+
+		pthread_mutex_lock(&ra->lock);
+		ext->busy = false;
+		chunk->state = ok ? CHUNK_READY : CHUNK_FAILED;
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+static void
+stopReadAhead(DescriptorDiskInfo *ddi)
+{
+	ReadAhead *ra = ddi->readAhead;
+	unsigned int i;
+
+	if (!ra) {
+		return;
+	}
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = true;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	for (i = 0; i < ra->numThreads; i++) {
+		pthread_join(ra->threads[i], NULL);
+	}
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra->buffers);
+	free(ra);
+	ddi->readAhead = NULL;
+}
+
+/*
+ * Start the read-ahead threads, one per extent up to READ_AHEAD_THREADS.
+ * Without them reads go to the extents directly.
+ */
+static bool
+startReadAhead(DescriptorDiskInfo *ddi)
+{
+	ReadAhead *ra;
+	unsigned int i;
+
+	ra = calloc(1, sizeof *ra);
+	if (!ra) {
+		return false;
+	}
+	ra->buffers = malloc((size_t)READ_AHEAD_CHUNKS * READ_AHEAD_CHUNK);
+	if (!ra->buffers) {
+		free(ra);
+		return false;
+	}
+	for (i = 0; i < READ_AHEAD_CHUNKS; i++) {
+		ra->chunks[i].data = ra->buffers + (size_t)i * READ_AHEAD_CHUNK;
+	}
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	ddi->readAhead = ra;
+	for (i = 0; i < READ_AHEAD_THREADS && i < ddi->numExtents; i++) {
+		if (pthread_create(&ra->threads[i], NULL, readAheadThread, ddi) != 0) {
+			break;
+		}
+		pthread_setname_np(ra->threads[i], "vmdk-extents");
+		ra->numThreads++;
+	}
+	if (ra->numThreads == 0) {
+		stopReadAhead(ddi);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Queue chunks from ra->next on, as far as free chunks go.  Chunks before
+ * pos were consumed, chunks not reaching up to pos belong to an earlier
+ * position.  Called with the lock held.
+ */
+static void
+queueReadAhead(DescriptorDiskInfo *ddi,
+               off_t pos)
+{
+	ReadAhead *ra = ddi->readAhead;
+	unsigned int i;
+
+	for (i = 0; i < READ_AHEAD_CHUNKS && ra->next < ddi->capacity; i++) {
+		ReadAheadChunk *chunk = &ra->chunks[i];
+		unsigned int e;
+		off_t end;
+
+		if (chunk->state == CHUNK_QUEUED || chunk->state == CHUNK_READING ||
+		    ((chunk->state == CHUNK_READY || chunk->state == CHUNK_FAILED) &&
+		     chunk->pos + (off_t)chunk->len > pos && chunk->pos < ra->next)) {
+			continue;
+		}
+		e = findExtent(ddi, ra->next);
+		end = (ra->next / READ_AHEAD_CHUNK + 1) * READ_AHEAD_CHUNK;
+		if (end > ddi->extents[e].start + ddi->extents[e].size) {
+			end = ddi->extents[e].start + ddi->extents[e].size;
+		}
+		chunk->state = CHUNK_QUEUED;
+		chunk->extent = e;
+		chunk->pos = ra->next;
+		chunk->len = end - ra->next;
+		ra->next = end;
+	}
+	pthread_cond_broadcast(&ra->cond);
+}
+
+/*
+ * Read through the read-ahead chunks.  Chunks cover everything from the
+ * last read up to ra->next; reading anywhere else drops the chunks that
+ * were queued and starts over there.
+ */
+static ssize_t
+readAhead(DescriptorDiskInfo *ddi,
+          uint8_t *buf,
+          size_t len,
+          off_t pos)
+{
+	ReadAhead *ra = ddi->readAhead;
+	uint8_t *buf8 = buf;
+	bool retried = false;
+	bool ok = true;
+
+	pthread_mutex_lock(&ra->lock);
+	while (len > 0 && ok) {
+		ReadAheadChunk *chunk = NULL;
+		unsigned int i;
+		off_t start;
+		size_t n;
+
+		for (i = 0; i < READ_AHEAD_CHUNKS && !chunk; i++) {
+			if (chunkHas(&ra->chunks[i], pos)) {
+				chunk = &ra->chunks[i];
+			}
+		}
+		if (!chunk) {
+			for (i = 0; i < READ_AHEAD_CHUNKS; i++) {
+				if (ra->chunks[i].state == CHUNK_QUEUED) {
+					ra->chunks[i].state = CHUNK_FREE;
+				}
+			}
+			start = pos - pos % READ_AHEAD_CHUNK;
+			if (start < ddi->extents[findExtent(ddi, pos)].start) {
+				start = ddi->extents[findExtent(ddi, pos)].start;
+			}
+			ra->next = start;
+			queueReadAhead(ddi, pos);
+			if (ra->next == start) {
+				/* All chunks are still being read for earlier positions. */
+				pthread_cond_wait(&ra->cond, &ra->lock);
+			}
+			continue;
+		}
+		while (chunk->state == CHUNK_QUEUED || chunk->state == CHUNK_READING) {
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		}
+		if (chunk->state != CHUNK_READY) {
+			/* Dropped, so that the next read tries again. */
+			chunk->state = CHUNK_FREE;
+			if (retried) {
+				ok = false;
+				break;
+			}
+			retried = true;
+			continue;
+		}
+		n = chunk->pos + chunk->len - pos;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(buf8, chunk->data + (pos - chunk->pos), n);
+		buf8 += n;
+		pos += n;
+		len -= n;
+		if (pos == chunk->pos + (off_t)chunk->len) {
+			chunk->state = CHUNK_FREE;
+		}
+		queueReadAhead(ddi, pos);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return ok ? buf8 - buf : -1;
+}
+
+/*
+ * Stop the threads from reading for a reader that went elsewhere: queued
+ * chunks are dropped, and chunks being read are waited for, as a sparse
+ * extent must not be read by two threads at once.
+ */
+static void
+idleReadAhead(DescriptorDiskInfo *ddi)
+{
+	ReadAhead *ra = ddi->readAhead;
+	unsigned int i;
+
+	if (!ra) {
+		return;
+	}
+	pthread_mutex_lock(&ra->lock);
+	for (i = 0; i < READ_AHEAD_CHUNKS; i++) {
+		ReadAheadChunk *chunk = &ra->chunks[i];
+
+		if (chunk->state == CHUNK_QUEUED) {
+			chunk->state = CHUNK_FREE;
+		}
+		while (chunk->state == CHUNK_READING) {
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		}
+	}
+	pthread_mutex_unlock(&ra->lock);
+}
+
+/*
+ * Sequential reads of disks of several extents, like a conversion, go
+ * through the read-ahead threads, so that extents are read concurrently
+ * and ahead of the reader.  Other reads, and all reads of snapshots,
+ * whose parent is shared by all extents, go to the extents directly.
+ */
+static ssize_t
+DescriptorPread(DiskInfo *self,
+                void *buf,
+                size_t len,
+                off_t pos)
+{
+	DescriptorDiskInfo *ddi = getDDI(self);
+	unsigned int first = findExtent(ddi, pos);
+	unsigned int last;
+	unsigned int i;
+	uint8_t *buf8 = buf;
+	bool ok = true;
+
+	if (pos >= ddi->capacity) {
+		return 0;
+	}
+	if ((off_t)len > ddi->capacity - pos) {
+		len = ddi->capacity - pos;
+	}
+	if (pos == ddi->lastEnd) {
+		ddi->sequential++;
+	} else {
+		ddi->sequential = 0;
+	}
+	ddi->lastEnd = pos + len;
+	if (ddi->numExtents > 1 && !ddi->parent && ddi->sequential >= READ_AHEAD_AFTER &&
+	    (ddi->readAhead || startReadAhead(ddi))) {
+		return readAhead(ddi, buf8, len, pos);
+	}
+	idleReadAhead(ddi);
+	last = findExtent(ddi, pos + len - 1);
+	for (i = first; i <= last && ok; i++) {
+		const Extent *ext = &ddi->extents[i];
+		off_t segEnd = ext->start + ext->size;
+		size_t segLen = segEnd - pos < (off_t)len ? (size_t)(segEnd - pos) : len;
+
+		ok = readExtent(ddi, ext, buf8, segLen, pos);
+		buf8 += segLen;
+		pos += segLen;
+		len -= segLen;
+	}
+	return ok ? buf8 - (uint8_t *)buf : -1;
+}
+
+/* Next data area of the extents themselves, ignoring the parent */
+static int
+ownNextData(DescriptorDiskInfo *ddi,
+            off_t from,
+            off_t *pos,
+            off_t *end)
+{
+	unsigned int i;
+
+	for (i = findExtent(ddi, from); i < ddi->numExtents; i++) {
+		const Extent *ext = &ddi->extents[i];
+		off_t extPos = from > ext->start ? from - ext->start : 0;
+
+		if (extentNextData(ext, extPos, pos, end) == 0) {
+			*pos += ext->start;
+			*end += ext->start;
+			return 0;
+		}
+	}
+	errno = ENXIO;
+	return -1;
+}
+
+/*
+ * Data areas of a snapshot are the union of its own and its parent's.  The
+ * area starting first is returned; if it overlaps one of the other side, the
+ * rest is picked up by the next call.
+ */
+static int
+DescriptorNextData(DiskInfo *self,
+                   off_t *pos,
+                   off_t *end)
+{
+	DescriptorDiskInfo *ddi = getDDI(self);
+	off_t from = *end;
+	off_t ownPos, ownEnd;
+	off_t parentPos, parentEnd = from;
+	bool own;
+	bool parent = false;
+
+	own = ownNextData(ddi, from, &ownPos, &ownEnd) == 0;
+	if (ddi->parent &&
+	    ddi->parent->vmt->nextData(ddi->parent, &parentPos, &parentEnd) == 0) {
+		if (parentPos < from) {
+			parentPos = from;
+		}
+		if (parentEnd > ddi->capacity) {
+			parentEnd = ddi->capacity;
+		}
+		parent = parentPos < parentEnd;
+	}
+	if (own && (!parent || ownPos <= parentPos)) {
+		*pos = ownPos;
+		*end = ownEnd;
+	} else if (parent) {
+		*pos = parentPos;
+		*end = parentEnd;
+	} else {
+		errno = ENXIO;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+DescriptorClose(DiskInfo *self)
+{
+	DescriptorDiskInfo *ddi = getDDI(self);
+	unsigned int i;
+	int ret = 0;
+
+	stopReadAhead(ddi);
+	for (i = 0; i < ddi->numExtents; i++) {
+		if (ddi->extents[i].di && ddi->extents[i].di->vmt->close(ddi->extents[i].di)) {
+			ret = -1;
+		}
+	}
+	if (ddi->parent && ddi->parent->vmt->close(ddi->parent)) {
+		ret = -1;
+	}
+	free(ddi->extents);
+	free(ddi);
+	return ret;
+}
+
+static DiskInfoVMT descriptorDiskInfoVMT = {
+	.getCapacity = DescriptorGetCapacity,
+	.pread = DescriptorPread,
+	.nextData = DescriptorNextData,
+	.close = DescriptorClose,
+	.abort = DescriptorClose,
+};
+
+/*
+ * Parse one extent line:
+ *     RW 4192256 SPARSE "disk-s001.vmdk"
+ *     RW 8388608 FLAT "disk-flat.vmdk" 0
+ *     RW 2048 ZERO
+ */
+static bool
+addExtent(DescriptorDiskInfo *ddi,
+          const char *fileName,
+          const char *line)
+{
+	char access[16];
+	char type[16];
+	char name[4096];
+	unsigned long long sectors;
+	unsigned long long offset = 0;
+	Extent ext = { 0 };
+	Extent *extents;
+	int n;
+
+	n = sscanf(line, "%15s %llu %15s \"%4095[^\"]\" %llu", access, &sectors, type, name, &offset);
+	if (n < 3) {
+		fprintf(stderr, "%s: cannot parse extent \"%s\"\n", fileName, line);
+		errno = EINVAL;
+		return false;
+	}
+	ext.start = ddi->capacity;
+	ext.size = sectors * VMDK_SECTOR_SIZE;
+	ext.offset = offset * VMDK_SECTOR_SIZE;
+	if (strcmp(type, "ZERO") == 0 || strcmp(access, "NOACCESS") == 0) {
+		ext.type = EXTENT_ZERO;
+	} else if (n < 4) {
+		fprintf(stderr, "%s: extent \"%s\" has no file name\n", fileName, line);
+		errno = EINVAL;
+		return false;
+	} else {
+		char *path;
+
+		if (strcmp(type, "SPARSE") == 0) {
+			ext.type = EXTENT_SPARSE;
+		} else if (strcmp(type, "FLAT") == 0 || strcmp(type, "VMFS") == 0) {
+			ext.type = EXTENT_FLAT;
+		} else {
+			fprintf(stderr, "%s: extent type %s is not supported\n", fileName, type);
+			errno = ENOTSUP;
+			return false;
+		}
+		path = Descriptor_ParentFileName(fileName, name);
+		if (path == NULL) {
+			return false;
+		}
+		ext.di = ext.type == EXTENT_SPARSE ? Sparse_Open(path) : Flat_Open(path);
+		if (ext.di == NULL) {
+			fprintf(stderr, "Cannot open extent %s: %s\n", path, strerror(errno));
+			free(path);
+			return false;
+		}
+		free(path);
+	}
+	extents = realloc(ddi->extents, (ddi->numExtents + 1) * sizeof *extents);
+	if (extents == NULL) {
+		if (ext.di) {
+			ext.di->vmt->close(ext.di);
+		}
+		return false;
+	}
+	ddi->extents = extents;
+	ddi->extents[ddi->numExtents++] = ext;
+	ddi->capacity += ext.size;
+	return true;
+}
+
+static bool
+openParent(DescriptorDiskInfo *ddi,
+           const char *fileName,
+           const char *desc)
+{
+	uint32_t parentCID = Descriptor_GetCID(desc, "parentCID");
+	char *hint;
+	char *path;
+	char *parentDesc;
+	bool ok = false;
+
+	if (parentCID == 0xFFFFFFFFU) {
+		return true;
+	}
+	hint = Descriptor_GetValue(desc, "parentFileNameHint");
+	if (hint == NULL) {
+		fprintf(stderr, "%s: parentCID without parentFileNameHint\n", fileName);
+		errno = EINVAL;
+		return false;
+	}
+	path = Descriptor_ParentFileName(fileName, hint);
+	free(hint);
+	if (path == NULL) {
+		return false;
+	}
+	parentDesc = Descriptor_Load(path);
+	if (parentDesc && Descriptor_GetCID(parentDesc, "CID") != parentCID) {
+		fprintf(stderr, "%s: content ID does not match parentCID %08x of its child, the parent was modified\n", path, parentCID);
+		errno = ESTALE;
+		goto out;
+	}
+	ddi->parent = Disk_Open(path);
+	if (ddi->parent == NULL) {
+		fprintf(stderr, "Cannot open parent disk %s: %s\n", path, strerror(errno));
+		goto out;
+	}
+	ok = true;
+out:
+	free(parentDesc);
+	free(path);
+	return ok;
+}
+
+/*
+ * Open a disk described by a text descriptor file.  Fails with EMEDIUMTYPE
+ * if fileName is not a descriptor file.
+ */
+DiskInfo *
+Descriptor_Open(const char *fileName)
+{
+	DescriptorDiskInfo *ddi;
+	char *desc;
+	char *line;
+	char *saveptr;
+
+	desc = loadDescriptorFile(fileName);
+	if (desc == NULL) {
+		return NULL;
+	}
+	ddi = calloc(1, sizeof *ddi);
+	if (ddi == NULL) {
+		goto failDesc;
+	}
+	ddi->hdr.vmt = &descriptorDiskInfoVMT;
+	if (!openParent(ddi, fileName, desc)) {
+		goto failDDI;
+	}
+	for (line = strtok_r(desc, "\r\n", &saveptr); line; line = strtok_r(NULL, "\r\n", &saveptr)) {
+		line += strspn(line, " \t");
+		if (strncmp(line, "RW ", 3) == 0 ||
+		    strncmp(line, "RDONLY ", 7) == 0 ||
+		    strncmp(line, "NOACCESS ", 9) == 0) {
+			if (!addExtent(ddi, fileName, line)) {
+				goto failDDI;
+			}
+		}
+	}
+	if (ddi->numExtents == 0) {
+		fprintf(stderr, "%s: descriptor has no extents\n", fileName);
+		errno = EINVAL;
+		goto failDDI;
+	}
+	free(desc);
+	return &ddi->hdr;
+
+failDDI:
+	{
+		int err = errno;
+
+		DescriptorClose(&ddi->hdr);
+		errno = err;
+	}
+failDesc:
+	free(desc);
+	return NULL;
+}
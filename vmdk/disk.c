@@ -0,0 +1,41 @@
+/* *******************************************************************************
+ * Copyright (c) 2014-2023 VMware, Inc.  All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”); you may not
+ * use this file except in compliance with the License.  You may obtain a copy of
+ * the License at:
+ *
+ *            http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed
+ * under the License is distributed on an “AS IS” BASIS, without warranties or
+ * conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ * *********************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "diskinfo.h"
+
+#include <errno.h>
+
+/*
+ * Open an existing disk of any supported type.  Sparse VMDKs are recognized
+ * by their header and descriptor files by their contents, everything else is
+ * treated as a raw image.  A VMDK that cannot be opened, e.g. because its
+ * parent or one of its extents is missing, is an error and not read as raw.
+ */
+DiskInfo *
+Disk_Open(const char *fileName)
+{
+	DiskInfo *di;
+
+	di = Sparse_Open(fileName);
+	if (di == NULL && errno == EMEDIUMTYPE) {
+		di = Descriptor_Open(fileName);
+	}
+	if (di == NULL && errno == EMEDIUMTYPE) {
+		di = Flat_Open(fileName);
+	}
+	return di;
+}
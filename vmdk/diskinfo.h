@@ -27,6 +27,8 @@ typedef struct {
 	ssize_t (*pread)(DiskInfo *self, void *buf, size_t len, off_t pos);
 	ssize_t (*pwrite)(DiskInfo *self, const void *buf, size_t len, off_t pos);
 	int (*nextData)(DiskInfo *self, off_t *pos, off_t *end);
+	/* Make everything written so far durable, NULL if the format cannot */
+	int (*flush)(DiskInfo *self);
 	int (*close)(DiskInfo *self);
 	int (*abort)(DiskInfo *self);
 } DiskInfoVMT;
@@ -35,11 +37,96 @@ struct DiskInfo {
 	const DiskInfoVMT *vmt;
 };
 
-extern char *toolsVersion; /* toolsVersion in metadata */
+#define DIGEST_SHA1	(1 << 0)
+#define DIGEST_SHA256	(1 << 1)
+#define DIGEST_SHA512	(1 << 2)
 
+/* How the output is synced when it is closed */
+typedef enum {
+	DURABILITY_FULL,	/* sync, write the header that makes the disk valid, sync again */
+	DURABILITY_ONCE,	/* a single sync at the very end */
+	DURABILITY_NONE,	/* left to the kernel's writeback */
+} Durability;
+
+/* Identifies a source file, so a checkpoint is not resumed from another one */
+typedef struct {
+	uint64_t size;
+	uint64_t inode;
+	uint64_t mtime;		/* ns */
+} SourceId;
+
+typedef struct {
+	const char *baseFileName;	/* previous output to reuse unchanged grains from */
+	bool grainHashes;		/* write per-grain hash sidecar next to the output */
+	bool reproducible;		/* derive CID and longContentID from the contents... */
+	bool seeded;			/* ...or from seed, if set */
+	uint64_t seed;
+	unsigned int digests;		/* DIGEST_* of the output, computed while writing */
+	const char *toolsVersion;	/* ddb.toolsVersion in metadata, NULL for unknown */
+	unsigned int threads;		/* compression threads, 0 or 1 compresses inline */
+	bool metadata;			/* write capacity, used, size and digests to <vmdk>.json */
+	bool redundantGD;		/* monolithicSparse: also write the redundant grain directory */
+	unsigned int openGrains;	/* streamOptimized: grains assembled at once, 0 for the default */
+	unsigned int queueDepth;	/* streamOptimized: output chunks in flight, 0 for the default, 1 for synchronous writes */
+	Durability durability;		/* syncs at close, DURABILITY_FULL by default */
+	bool checkpoints;		/* streamOptimized: keep <vmdk>.resume for StreamOptimized_Checkpoint */
+	bool resume;			/* ...and continue from it if it exists */
+	SourceId source;		/* ...made from this source */
+} SparseWriterOptions;
+
+DiskInfo *Disk_Open(const char *fileName);
 DiskInfo *Flat_Open(const char *fileName);
 DiskInfo *Flat_Create(const char *fileName, off_t capacity);
+bool Flat_ReadAhead(DiskInfo *di, unsigned int depth);
+bool Flat_DropBehind(DiskInfo *di);
 DiskInfo *Sparse_Open(const char *fileName);
-DiskInfo *StreamOptimized_Create(const char *fileName, off_t capacity);
+DiskInfo *Sparse_OpenStream(int fd);
+char *Sparse_ReadDescriptor(const char *fileName);
+DiskInfo *Descriptor_Open(const char *fileName);
+char *Descriptor_Load(const char *fileName);
+char *Descriptor_GetValue(const char *desc, const char *key);
+uint32_t Descriptor_GetCID(const char *desc, const char *key);
+char *Descriptor_ParentFileName(const char *childFileName, const char *hint);
+DiskInfo *StreamOptimized_Create(const char *fileName, off_t capacity,
+                                 const SparseWriterOptions *opts);
+int StreamOptimized_Checkpoint(DiskInfo *di, off_t pos);
+off_t StreamOptimized_ResumePos(DiskInfo *di);
+bool StreamOptimized_Layout(off_t capacity, bool gdAtEnd, uint32_t *grainBytes, uint32_t *gtGrains,
+                            off_t *overhead, off_t *gtOverhead);
+DiskInfo *HostedSparse_Create(const char *fileName, off_t capacity,
+                              const SparseWriterOptions *opts);
+
+int verifyDisks(const char *srcName, const char *dstName, int numThreads);
+
+/* Projected size of streamOptimized output, from a sample of the grains */
+typedef struct {
+	off_t size;
+	off_t low;		/* 95% confidence interval */
+	off_t high;
+	uint64_t grains;	/* populated grains */
+	uint64_t sampled;
+} SizeEstimate;
+
+int estimateSize(const char *srcName, double fraction, int numThreads, bool digests, SizeEstimate *est);
+int serveDisk(const char *socketPath, DiskInfo *di, bool writable, void (*onRequest)(void));
+int mountDisk(const char *srcName, const char *mountPoint, int numThreads);
+
+/* io_uring, used for read-ahead and write-behind where the kernel has it */
+#define DEFAULT_QUEUE_DEPTH	4
+
+typedef struct IoRing IoRing;
+
+IoRing *IoRing_Create(unsigned int depth);
+int IoRing_Submit(IoRing *ring, int fd, bool write, void *buf, size_t len, off_t pos, uint64_t tag);
+int IoRing_Wait(IoRing *ring, uint64_t *tag, ssize_t *res);
+unsigned int IoRing_InFlight(const IoRing *ring);
+void IoRing_Destroy(IoRing *ring);
+
+/* Process wide limits on bandwidth (bytes per second) and compression threads, 0 for none */
+void Throttle_SetRates(uint64_t readRate, uint64_t writeRate);
+void Throttle_SetThreads(unsigned int threads);
+unsigned int Throttle_Threads(void);
+void Throttle_Read(size_t len);
+void Throttle_Write(size_t len);
 
 #endif /* _DISKINFO_H_ */
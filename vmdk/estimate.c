@@ -0,0 +1,493 @@
+/* *******************************************************************************
+ * Copyright (c) 2023 VMware, Inc.  All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”); you may not
+ * use this file except in compliance with the License.  You may obtain a copy of
+ * the License at:
+ *
+ *            http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed
+ * under the License is distributed on an “AS IS” BASIS, without warranties or
+ * conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ * *********************************************************************************/
+
+/*
+ * Estimate how big a streamOptimized conversion of a disk gets, without
+ * doing it.  A fraction of the populated grains is compressed the way the
+ * writer compresses them, and the total is projected from that.  The
+ * grains are sampled in strata that follow the data extents, so sparse
+ * regions and large extents of similar data both get their share, and
+ * the spread within the strata gives the confidence interval.
+ */
+
+#define _GNU_SOURCE
+
+#include "diskinfo.h"
+#include "vmware_vmdk.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#define CEILING(x, y) (((x) + (y) - 1) / (y))
+#define VMDK_SECTOR_SIZE	512ULL
+
+/* Samples per stratum, runs of extents are merged or split to get them. */
+#define STRATUM_SAMPLES		16
+
+/* Fewer samples than this say little, small disks get sampled more. */
+#define MIN_SAMPLES		1024
+
+/* Two-sided 95% quantile of the normal distribution */
+#define CONFIDENCE_Z		1.96
+
+typedef struct {
+	uint64_t start;		/* grain numbers */
+	uint64_t end;
+} GrainRange;
+
+typedef struct {
+	uint64_t grains;
+	uint64_t samples;
+	double sum;
+	double sumSquares;
+} Stratum;
+
+typedef struct {
+	uint64_t grainNr;
+	uint64_t stratum;
+	uint32_t size;		/* output bytes, 0 for a zero grain */
+} Sample;
+
+typedef struct {
+	const char *srcName;
+	off_t capacity;
+	uint32_t grainBytes;
+	Sample *samples;
+	uint64_t numSamples;
+	pthread_mutex_t lock;
+	uint64_t nextSample;	/* work queue position, protected by lock */
+	bool failed;
+} Estimator;
+
+/* Populated grains, as ascending ranges that do not overlap. */
+static bool
+getGrainRanges(DiskInfo *di,
+               uint32_t grainBytes,
+               GrainRange **ranges,
+               size_t *numRanges,
+               uint64_t *grains)
+{
+	size_t maxRanges = 0;
+	off_t pos;
+	off_t end = 0;
+
+	*ranges = NULL;
+	*numRanges = 0;
+	*grains = 0;
+	while (di->vmt->nextData(di, &pos, &end) == 0) {
+		uint64_t start = pos / grainBytes;
+		uint64_t stop = CEILING(end, grainBytes);
+
+		if (*numRanges != 0 && start <= (*ranges)[*numRanges - 1].end) {
+			/* Shares a grain with the previous extent. */
+			if (stop > (*ranges)[*numRanges - 1].end) {
+				*grains += stop - (*ranges)[*numRanges - 1].end;
+				(*ranges)[*numRanges - 1].end = stop;
+			}
+			continue;
+		}
+		if (*numRanges == maxRanges) {
+			size_t newMax = maxRanges ? maxRanges * 2 : 64;
+			GrainRange *newRanges = realloc(*ranges, newMax * sizeof **ranges);
+
+			if (!newRanges) {
+				goto fail;
+			}
+			*ranges = newRanges;
+			maxRanges = newMax;
+		}
+		(*ranges)[*numRanges].start = start;
+		(*ranges)[*numRanges].end = stop;
+		(*numRanges)++;
+		*grains += stop - start;
+	}
+	if (errno == ENXIO) {
+		return true;
+	}
+fail:
+	free(*ranges);
+	*ranges = NULL;
+	return false;
+}
+
+/*
+ * Cut the populated grains into strata and pick samples from each, evenly
+ * spaced from a random start, fraction of all grains in total.  A stratum
+ * ends at the end of an extent once it has about STRATUM_SAMPLES samples,
+ * and large extents are split.
+ */
+static bool
+pickSamples(const GrainRange *ranges,
+            size_t numRanges,
+            double fraction,
+            Stratum **strata,
+            uint64_t *numStrata,
+            Sample **samples,
+            uint64_t *numSamples)
+{
+	uint64_t stratumGrains = ceil(STRATUM_SAMPLES / fraction);
+	unsigned short randomState[3] = { 0x1234, 0xabcd, 0x330e };
+	size_t maxStrata = 0;
+	size_t maxSamples = 0;
+	size_t r = 0;
+	uint64_t off = 0;	/* grains of ranges[r] taken so far */
+	uint64_t before = 0;	/* grains in the strata so far */
+
+	*strata = NULL;
+	*numStrata = 0;
+	*samples = NULL;
+	*numSamples = 0;
+	while (r < numRanges) {
+		/* Where the stratum starts, sampling walks forward from there. */
+		size_t sr = r;
+		uint64_t soff = off;
+		uint64_t n = 0;
+		uint64_t k;
+		uint64_t j;
+		uint64_t skipped = 0;
+		double u;
+
+		while (r < numRanges && n < stratumGrains) {
+			uint64_t take = ranges[r].end - ranges[r].start - off;
+
+			if (take > stratumGrains - n) {
+				take = stratumGrains - n;
+			}
+			n += take;
+			off += take;
+			if (ranges[r].start + off == ranges[r].end) {
+				r++;
+				off = 0;
+				if (n >= stratumGrains / 2) {
+					break;
+				}
+			}
+		}
+		/*
+		 * Rounded over all strata so far, rounding each on its own can
+		 * lose up to half a sample per stratum and end below MIN_SAMPLES.
+		 */
+		k = llround((before + n) * fraction) - llround(before * fraction);
+		before += n;
+		if (k < 1) {
+			k = 1;
+		}
+		if (*numStrata == maxStrata) {
+			size_t newMax = maxStrata ? maxStrata * 2 : 64;
+			Stratum *newStrata = realloc(*strata, newMax * sizeof **strata);
+
+			if (!newStrata) {
+				goto fail;
+			}
+			*strata = newStrata;
+			maxStrata = newMax;
+		}
+		memset(&(*strata)[*numStrata], 0, sizeof **strata);
+		(*strata)[*numStrata].grains = n;
+		(*strata)[*numStrata].samples = k;
+
+		u = erand48(randomState);
+		for (j = 0; j < k; j++) {
+			uint64_t idx = (j + u) * n / k;
+
+			/* Walk to the range that holds the idx-th grain of the stratum. */
+			while (idx - skipped >= ranges[sr].end - ranges[sr].start - soff) {
+				skipped += ranges[sr].end - ranges[sr].start - soff;
+				sr++;
+				soff = 0;
+			}
+			if (*numSamples == maxSamples) {
+				size_t newMax = maxSamples ? maxSamples * 2 : 1024;
+				Sample *newSamples = realloc(*samples, newMax * sizeof **samples);
+
+				if (!newSamples) {
+					goto fail;
+				}
+				*samples = newSamples;
+				maxSamples = newMax;
+			}
+			(*samples)[*numSamples].grainNr = ranges[sr].start + soff + idx - skipped;
+			(*samples)[*numSamples].stratum = *numStrata;
+			(*samples)[*numSamples].size = 0;
+			(*numSamples)++;
+		}
+		(*numStrata)++;
+	}
+	return true;
+
+fail:
+	free(*strata);
+	free(*samples);
+	*strata = NULL;
+	*samples = NULL;
+	return false;
+}
+
+/* Bytes grain data takes in the output, compressed as the writer does it. */
+static bool
+compressedSize(z_stream *zstream,
+               const uint8_t *data,
+               size_t len,
+               uint8_t *out,
+               size_t outLen,
+               uint32_t *size)
+{
+	size_t i;
+
+	for (i = 0; i < len && data[i] == 0; i++) {
+	}
+	if (i == len) {
+		/* The writer leaves zero grains out. */
+		*size = 0;
+		return true;
+	}
+	if (deflateReset(zstream) != Z_OK) {
+		return false;
+	}
+	zstream->next_in = (uint8_t *)data;
+	zstream->avail_in = len;
+	zstream->next_out = out;
+	zstream->avail_out = outLen;
+	if (deflate(zstream, Z_FINISH) != Z_STREAM_END) {
+		return false;
+	}
+	*size = CEILING(sizeof(SparseGrainLBAHeaderOnDisk) + zstream->total_out, VMDK_SECTOR_SIZE) *
+	        VMDK_SECTOR_SIZE;
+	return true;
+}
+
+static void *
+estimateWorker(void *arg)
+{
+	Estimator *e = arg;
+	z_stream zstream = { 0 };
+	DiskInfo *src;
+	uint8_t *data = NULL;
+	uint8_t *out = NULL;
+	size_t outLen;
+	off_t end = CEILING(e->capacity, VMDK_SECTOR_SIZE) * VMDK_SECTOR_SIZE;
+
+	src = Disk_Open(e->srcName);
+	if (!src) {
+		goto fail;
+	}
+	if (deflateInit(&zstream, Z_BEST_COMPRESSION) != Z_OK) {
+		goto failSrc;
+	}
+	outLen = deflateBound(&zstream, e->grainBytes);
+	data = malloc(e->grainBytes);
+	out = malloc(outLen);
+	if (!data || !out) {
+		goto failDeflate;
+	}
+	for (;;) {
+		Sample *sample;
+		off_t pos;
+		size_t len;
+		size_t readLen;
+
+		pthread_mutex_lock(&e->lock);
+		if (e->failed || e->nextSample == e->numSamples) {
+			pthread_mutex_unlock(&e->lock);
+			break;
+		}
+		sample = &e->samples[e->nextSample++];
+		pthread_mutex_unlock(&e->lock);
+
+		/* The last grain may be short, the output rounds it to sectors. */
+		pos = sample->grainNr * e->grainBytes;
+		len = end - pos < e->grainBytes ? (size_t)(end - pos) : e->grainBytes;
+		readLen = e->capacity - pos < (off_t)len ? (size_t)(e->capacity - pos) : len;
+		memset(data + readLen, 0, len - readLen);
+		Throttle_Read(readLen);
+		if (src->vmt->pread(src, data, readLen, pos) != (ssize_t)readLen ||
+		    !compressedSize(&zstream, data, len, out, outLen, &sample->size)) {
+			goto failDeflate;
+		}
+	}
+	free(out);
+	free(data);
+	deflateEnd(&zstream);
+	src->vmt->close(src);
+	return NULL;
+
+failDeflate:
+	free(out);
+	free(data);
+	deflateEnd(&zstream);
+failSrc:
+	src->vmt->close(src);
+fail:
+	pthread_mutex_lock(&e->lock);
+	e->failed = true;
+	pthread_mutex_unlock(&e->lock);
+	return NULL;
+}
+
+/* Grain tables that cover populated grains. */
+static uint64_t
+countGTs(const GrainRange *ranges,
+         size_t numRanges,
+         uint32_t gtGrains)
+{
+	uint64_t gts = 0;
+	uint64_t next = 0;	/* first table not counted yet */
+	size_t i;
+
+	for (i = 0; i < numRanges; i++) {
+		uint64_t first = ranges[i].start / gtGrains;
+		uint64_t last = (ranges[i].end - 1) / gtGrains;
+
+		if (first < next) {
+			first = next;
+		}
+		if (first <= last) {
+			gts += last - first + 1;
+			next = last + 1;
+		}
+	}
+	return gts;
+}
+
+/*
+ * Project the streamOptimized output size of srcName from a sample of
+ * fraction of its populated grains, compressed with numThreads threads.
+ * With digests the output has the layout that goes with them.
+ */
+int
+estimateSize(const char *srcName,
+             double fraction,
+             int numThreads,
+             bool digests,
+             SizeEstimate *est)
+{
+	Estimator e;
+	DiskInfo *src;
+	GrainRange *ranges;
+	size_t numRanges;
+	Stratum *strata = NULL;
+	uint64_t numStrata = 0;
+	uint32_t gtGrains;
+	off_t overhead;
+	off_t gtOverhead;
+	pthread_t *threads;
+	int started;
+	int i;
+	uint64_t s;
+	double total = 0;
+	double variance = 0;
+	double sum = 0;
+	double sumSquares = 0;
+	double pooled = 0;
+	double margin;
+	int ret = -1;
+
+	memset(&e, 0, sizeof e);
+	e.srcName = srcName;
+	src = Disk_Open(srcName);
+	if (!src) {
+		return -1;
+	}
+	e.capacity = src->vmt->getCapacity(src);
+	if (!StreamOptimized_Layout(e.capacity, digests, &e.grainBytes, &gtGrains, &overhead, &gtOverhead) ||
+	    !getGrainRanges(src, e.grainBytes, &ranges, &numRanges, &est->grains)) {
+		src->vmt->close(src);
+		return -1;
+	}
+	src->vmt->close(src);
+	overhead += countGTs(ranges, numRanges, gtGrains) * gtOverhead;
+
+	if (est->grains != 0 && fraction * est->grains < MIN_SAMPLES) {
+		fraction = (double)MIN_SAMPLES / est->grains;
+	}
+	if (fraction > 1) {
+		fraction = 1;
+	}
+	if (!pickSamples(ranges, numRanges, fraction, &strata, &numStrata, &e.samples, &e.numSamples)) {
+		goto failRanges;
+	}
+	est->sampled = e.numSamples;
+
+	if (pthread_mutex_init(&e.lock, NULL) != 0) {
+		goto failSamples;
+	}
+	if (numThreads < 1) {
+		numThreads = 1;
+	}
+	threads = calloc(numThreads, sizeof *threads);
+	if (!threads) {
+		goto failLock;
+	}
+	for (started = 0; started < numThreads; started++) {
+		if (pthread_create(&threads[started], NULL, estimateWorker, &e) != 0) {
+			break;
+		}
+	}
+	if (started == 0) {
+		estimateWorker(&e);
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	if (e.failed) {
+		goto failLock;
+	}
+
+	for (s = 0; s < e.numSamples; s++) {
+		Stratum *st = &strata[e.samples[s].stratum];
+		double size = e.samples[s].size;
+
+		st->sum += size;
+		st->sumSquares += size * size;
+		sum += size;
+		sumSquares += size * size;
+	}
+	if (e.numSamples > 1) {
+		pooled = (sumSquares - sum * sum / e.numSamples) / (e.numSamples - 1);
+	}
+	for (s = 0; s < numStrata; s++) {
+		Stratum *st = &strata[s];
+		double mean = st->sum / st->samples;
+		/* Single samples say nothing about the spread, use all of them. */
+		double spread = st->samples > 1 ?
+		                (st->sumSquares - st->sum * mean) / (st->samples - 1) : pooled;
+
+		total += st->grains * mean;
+		if (spread > 0) {
+			variance += (double)st->grains * st->grains * (1 - (double)st->samples / st->grains) *
+			            spread / st->samples;
+		}
+	}
+	margin = CONFIDENCE_Z * sqrt(variance);
+	est->size = overhead + llround(total);
+	est->low = overhead + (total > margin ? llround(total - margin) : 0);
+	est->high = overhead + llround(total + margin);
+	ret = 0;
+
+failLock:
+	pthread_mutex_destroy(&e.lock);
+failSamples:
+	free(strata);
+	free(e.samples);
+failRanges:
+	free(ranges);
+	return ret;
+}
@@ -19,13 +19,46 @@
 
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <errno.h>
 
+/*
+ * Read-ahead for sequential copies: within the extent last returned by
+ * nextData, up to depth chunks are read with io_uring ahead of the reader.
+ */
+#define READ_AHEAD_CHUNK	(1024 * 1024)
+
+/*
+ * With drop-behind, what was read or written is dropped from the page
+ * cache in steps of this.
+ */
+#define DROP_BEHIND_CHUNK	(8 * 1024 * 1024)
+
+typedef struct {
+	uint8_t *data;
+	off_t pos;
+	size_t len;
+	ssize_t res;		/* bytes read or -errno, once done */
+	bool busy;		/* submitted, not completed yet */
+	bool used;		/* holds a chunk of the current extent */
+} ReadAheadChunk;
+
 typedef struct {
 	DiskInfo hdr;
 	int fd;
 	uint64_t capacity;
+	IoRing *ring;
+	ReadAheadChunk *chunks;
+	unsigned int numChunks;
+	uint8_t *chunkBuffers;
+	off_t raNext;		/* next position to read ahead */
+	off_t raEnd;		/* end of the current extent */
+	bool dropBehind;
+	off_t dropStart;	/* read or written, but still in the page cache */
+	off_t dropEnd;
+	off_t syncStart;	/* written, writeback started */
+	off_t syncEnd;
 } FlatDiskInfo;
 
 static inline FlatDiskInfo *
@@ -42,6 +75,144 @@ FlatGetCapacity(DiskInfo *self)
 	return fdi->capacity;
 }
 
+/* Wait for one read-ahead chunk to complete, any of them. */
+static bool
+reapChunk(FlatDiskInfo *fdi)
+{
+	uint64_t tag;
+	ssize_t res;
+
+	if (IoRing_Wait(fdi->ring, &tag, &res) != 0 || tag >= fdi->numChunks) {
+		return false;
+	}
+	fdi->chunks[tag].res = res;
+	fdi->chunks[tag].busy = false;
+	return true;
+}
+
+/* Throw away all chunks, waiting for the ones still being read. */
+static void
+dropChunks(FlatDiskInfo *fdi)
+{
+	unsigned int i;
+
+	while (IoRing_InFlight(fdi->ring) > 0 && reapChunk(fdi)) {
+	}
+	for (i = 0; i < fdi->numChunks; i++) {
+		fdi->chunks[i].used = false;
+	}
+}
+
+/* Start reads for all free chunks, up to the end of the extent. */
+static void
+fillChunks(FlatDiskInfo *fdi)
+{
+	unsigned int i;
+
+	for (i = 0; i < fdi->numChunks && fdi->raNext < fdi->raEnd; i++) {
+		ReadAheadChunk *chunk = &fdi->chunks[i];
+
+		if (chunk->used) {
+			continue;
+		}
+		chunk->pos = fdi->raNext;
+		chunk->len = fdi->raEnd - fdi->raNext < READ_AHEAD_CHUNK ? fdi->raEnd - fdi->raNext : READ_AHEAD_CHUNK;
+		if (IoRing_Submit(fdi->ring, fdi->fd, false, chunk->data, chunk->len, chunk->pos, i) != 0) {
+			/* Reads go directly to the file from here on. */
+			fdi->raEnd = fdi->raNext;
+			return;
+		}
+		chunk->busy = true;
+		chunk->used = true;
+		fdi->raNext += chunk->len;
+	}
+}
+
+static ReadAheadChunk *
+findChunk(FlatDiskInfo *fdi,
+          off_t pos)
+{
+	unsigned int i;
+
+	for (i = 0; i < fdi->numChunks; i++) {
+		ReadAheadChunk *chunk = &fdi->chunks[i];
+
+		if (chunk->used && pos >= chunk->pos && pos < chunk->pos + (off_t)chunk->len) {
+			return chunk;
+		}
+	}
+	return NULL;
+}
+
+/* Drop data that was read from the page cache, once enough of it piled up. */
+static void
+dropRead(FlatDiskInfo *fdi,
+         off_t pos,
+         ssize_t len)
+{
+	if (len <= 0) {
+		return;
+	}
+	if (pos != fdi->dropEnd) {
+		fdi->dropStart = pos;
+	}
+	fdi->dropEnd = pos + len;
+	if (fdi->dropEnd - fdi->dropStart >= DROP_BEHIND_CHUNK) {
+		posix_fadvise(fdi->fd, fdi->dropStart, fdi->dropEnd - fdi->dropStart, POSIX_FADV_DONTNEED);
+		fdi->dropStart = fdi->dropEnd;
+	}
+}
+
+static ssize_t
+readAhead(FlatDiskInfo *fdi,
+          void *buf,
+          size_t len,
+          off_t pos)
+{
+	uint8_t *buf8 = buf;
+	size_t done = 0;
+
+	while (done < len) {
+		ReadAheadChunk *chunk = findChunk(fdi, pos);
+		size_t n;
+
+		if (!chunk) {
+			ssize_t rd = pread(fdi->fd, buf8 + done, len - done, pos);
+
+			if (rd == -1) {
+				return done ? (ssize_t)done : -1;
+			}
+			return done + rd;
+		}
+		while (chunk->busy) {
+			if (!reapChunk(fdi)) {
+				return -1;
+			}
+		}
+		if (chunk->res < 0) {
+			chunk->used = false;
+			errno = -chunk->res;
+			return done ? (ssize_t)done : -1;
+		}
+		if (pos >= chunk->pos + chunk->res) {
+			/* short read, end of file */
+			return done;
+		}
+		n = chunk->pos + chunk->res - pos;
+		if (n > len - done) {
+			n = len - done;
+		}
+		memcpy(buf8 + done, chunk->data + (pos - chunk->pos), n);
+		done += n;
+		pos += n;
+		if (pos == chunk->pos + (off_t)chunk->len) {
+			chunk->used = false;
+			fillChunks(fdi);
+		}
+	}
+	return done;
+}
+
 static ssize_t
 FlatPread(DiskInfo *self,
           void *buf,
@@ -49,7 +220,48 @@ FlatPread(DiskInfo *self,
           off_t pos)
 {
 	FlatDiskInfo *fdi = getFDI(self);
-	return pread(fdi->fd, buf, len, pos);
+	ssize_t rd;
+
+	if (fdi->ring) {
+		rd = readAhead(fdi, buf, len, pos);
+	} else {
+		rd = pread(fdi->fd, buf, len, pos);
+	}
+	if (fdi->dropBehind) {
+		dropRead(fdi, pos, rd);
+	}
+	return rd;
+}
+
+/*
+ * Start writeback of data that was written once enough of it piled up,
+ * and wait for the previous batch, so that dirty pages do not pile up
+ * until close.  Then those pages can go.
+ */
+static void
+dropWritten(FlatDiskInfo *fdi,
+            off_t pos,
+            ssize_t len)
+{
+	if (len <= 0) {
+		return;
+	}
+	if (pos != fdi->dropEnd) {
+		fdi->dropStart = pos;
+	}
+	fdi->dropEnd = pos + len;
+	if (fdi->dropEnd - fdi->dropStart < DROP_BEHIND_CHUNK) {
+		return;
+	}
+	sync_file_range(fdi->fd, fdi->dropStart, fdi->dropEnd - fdi->dropStart, SYNC_FILE_RANGE_WRITE);
+	if (fdi->syncEnd > fdi->syncStart) {
+		sync_file_range(fdi->fd, fdi->syncStart, fdi->syncEnd - fdi->syncStart,
+		                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(fdi->fd, fdi->syncStart, fdi->syncEnd - fdi->syncStart, POSIX_FADV_DONTNEED);
+	}
+	fdi->syncStart = fdi->dropStart;
+	fdi->syncEnd = fdi->dropEnd;
+	fdi->dropStart = fdi->dropEnd;
 }
 
 static ssize_t
@@ -59,11 +271,23 @@ FlatPwrite(DiskInfo *self,
            off_t pos)
 {
 	FlatDiskInfo *fdi = getFDI(self);
+	ssize_t written;
 
 	/*
          * Should we do some zero detection here to generate sparse file?
          */
-	return pwrite(fdi->fd, buf, len, pos);
+	Throttle_Write(len);
+	written = pwrite(fdi->fd, buf, len, pos);
+	if (fdi->dropBehind) {
+		dropWritten(fdi, pos, written);
+	}
+	return written;
+}
+
+static int
+FlatFlush(DiskInfo *self)
+{
+	return fdatasync(getFDI(self)->fd);
 }
 
 static int
@@ -72,6 +296,12 @@ FlatClose(DiskInfo *self)
 	FlatDiskInfo *fdi = getFDI(self);
 	int fd = fdi->fd;
 
+	if (fdi->ring) {
+		dropChunks(fdi);
+		IoRing_Destroy(fdi->ring);
+		free(fdi->chunks);
+		free(fdi->chunkBuffers);
+	}
 	free(fdi);
 	return close(fd);
 }
@@ -103,6 +333,13 @@ FlatNextData(DiskInfo *self,
 	}
 	*pos = dataOff;
 	*end = holeOff;
+	if (fdi->ring) {
+		/* Readers copy extents one after the other, start on this one. */
+		dropChunks(fdi);
+		fdi->raNext = dataOff;
+		fdi->raEnd = holeOff;
+		fillChunks(fdi);
+	}
 	return 0;
 	
 }
@@ -112,6 +349,7 @@ static DiskInfoVMT flatDiskInfoVMT = {
 	.pread = FlatPread,
 	.pwrite = FlatPwrite,
 	.nextData = FlatNextData,
+	.flush = FlatFlush,
 	.close = FlatClose,
 	.abort = FlatClose
 };
@@ -129,7 +367,7 @@ Flat_Open(const char *fileName)
 	if (fstat(fd, &stb)) {
 		goto errClose;
 	}
-	fdi = malloc(sizeof *fdi);
+	fdi = calloc(1, sizeof *fdi);
 	if (!fdi) {
 		goto errClose;
 	}
@@ -155,7 +393,7 @@ Flat_Create(const char *fileName,
 	if (ftruncate(fd, capacity)) {
 		goto errClose;
 	}
-	fdi = malloc(sizeof *fdi);
+	fdi = calloc(1, sizeof *fdi);
 	if (!fdi) {
 		goto errClose;
 	}
@@ -168,3 +406,59 @@ errClose:
 	return NULL;
 }
 
+
+/*
+ * Keep up to depth chunks read ahead of a reader that copies the extents
+ * returned by nextData in order.  Returns false if di is not a flat disk
+ * or io_uring is not available, reads are synchronous then.
+ */
+bool
+Flat_ReadAhead(DiskInfo *di,
+               unsigned int depth)
+{
+	FlatDiskInfo *fdi = getFDI(di);
+	unsigned int i;
+
+	if (di->vmt != &flatDiskInfoVMT || depth < 2 || fdi->ring) {
+		return false;
+	}
+	fdi->chunks = calloc(depth, sizeof *fdi->chunks);
+	fdi->chunkBuffers = malloc((size_t)depth * READ_AHEAD_CHUNK);
+	if (!fdi->chunks || !fdi->chunkBuffers) {
+		goto fail;
+	}
+	fdi->ring = IoRing_Create(depth);
+	if (!fdi->ring) {
+		goto fail;
+	}
+	fdi->numChunks = depth;
+	for (i = 0; i < depth; i++) {
+		fdi->chunks[i].data = fdi->chunkBuffers + (size_t)i * READ_AHEAD_CHUNK;
+	}
+	return true;
+
+fail:
+	free(fdi->chunks);
+	free(fdi->chunkBuffers);
+	fdi->chunks = NULL;
+	fdi->chunkBuffers = NULL;
+	return false;
+}
+
+/*
+ * The disk is read or written once from start to end, for a conversion.
+ * Tell the kernel, and drop what was read or written from the page cache,
+ * so that a large conversion does not push out everybody else's data.
+ */
+bool
+Flat_DropBehind(DiskInfo *di)
+{
+	FlatDiskInfo *fdi = getFDI(di);
+
+	if (di->vmt != &flatDiskInfoVMT) {
+		return false;
+	}
+	posix_fadvise(fdi->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	fdi->dropBehind = true;
+	return true;
+}
@@ -0,0 +1,263 @@
+/* *******************************************************************************
+ * Copyright (c) 2014-2023 VMware, Inc.  All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”); you may not
+ * use this file except in compliance with the License.  You may obtain a copy of
+ * the License at:
+ *
+ *            http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed
+ * under the License is distributed on an “AS IS” BASIS, without warranties or
+ * conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ * *********************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "openvmdk.h"
+#include "diskinfo.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct OpenVmdkContext {
+	SparseWriterOptions writerOpts;
+	char *toolsVersion;
+};
+
+struct OpenVmdkDisk {
+	DiskInfo *di;
+};
+
+int
+openvmdk_api_version(void)
+{
+	return OPENVMDK_API_VERSION;
+}
+
+OpenVmdkContext *
+openvmdk_context_new(void)
+{
+	return calloc(1, sizeof(OpenVmdkContext));
+}
+
+void
+openvmdk_context_free(OpenVmdkContext *ctx)
+{
+	if (ctx) {
+		free(ctx->toolsVersion);
+		free(ctx);
+	}
+}
+
+int
+openvmdk_context_set_tools_version(OpenVmdkContext *ctx,
+                                   const char *toolsVersion)
+{
+	char *copy = NULL;
+
+	if (toolsVersion) {
+		copy = strdup(toolsVersion);
+		if (!copy) {
+			return -1;
+		}
+	}
+	free(ctx->toolsVersion);
+	ctx->toolsVersion = copy;
+	ctx->writerOpts.toolsVersion = copy;
+	return 0;
+}
+
+int
+openvmdk_context_set_reproducible(OpenVmdkContext *ctx,
+                                  int enable,
+                                  int hasSeed,
+                                  uint64_t seed)
+{
+	ctx->writerOpts.reproducible = enable != 0;
+	ctx->writerOpts.seeded = enable && hasSeed;
+	ctx->writerOpts.seed = seed;
+	return 0;
+}
+
+int
+openvmdk_context_set_digests(OpenVmdkContext *ctx,
+                             unsigned int digests)
+{
+	if (digests & ~(OPENVMDK_DIGEST_SHA1 | OPENVMDK_DIGEST_SHA256 | OPENVMDK_DIGEST_SHA512)) {
+		errno = EINVAL;
+		return -1;
+	}
+	ctx->writerOpts.digests = digests;
+	return 0;
+}
+
+int
+openvmdk_context_set_threads(OpenVmdkContext *ctx,
+                             unsigned int threads)
+{
+	if (threads < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	ctx->writerOpts.threads = threads;
+	return 0;
+}
+
+int
+openvmdk_context_set_open_grains(OpenVmdkContext *ctx,
+                                 unsigned int grains)
+{
+	if (grains < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	ctx->writerOpts.openGrains = grains;
+	return 0;
+}
+
+int
+openvmdk_context_set_metadata(OpenVmdkContext *ctx,
+                              int enable)
+{
+	ctx->writerOpts.metadata = enable != 0;
+	return 0;
+}
+
+static OpenVmdkDisk *
+newDisk(DiskInfo *di)
+{
+	OpenVmdkDisk *disk;
+
+	if (!di) {
+		return NULL;
+	}
+	disk = malloc(sizeof *disk);
+	if (!disk) {
+		di->vmt->abort(di);
+		errno = ENOMEM;
+		return NULL;
+	}
+	disk->di = di;
+	return disk;
+}
+
+/* Nothing in the context applies to reading, see openvmdk.h. */
+OpenVmdkDisk *
+openvmdk_open(OpenVmdkContext *ctx,
+              const char *fileName)
+{
+	(void)ctx;
+	return newDisk(Disk_Open(fileName));
+}
+
+OpenVmdkDisk *
+openvmdk_create(OpenVmdkContext *ctx,
+                const char *fileName,
+                uint64_t capacity,
+                OpenVmdkFormat format)
+{
+	static const SparseWriterOptions defaultOpts;
+	const SparseWriterOptions *opts = ctx ? &ctx->writerOpts : &defaultOpts;
+
+	/* Disks are sized in off_t. */
+	if (capacity > INT64_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	switch (format) {
+	case OPENVMDK_FORMAT_STREAM_OPTIMIZED:
+		return newDisk(StreamOptimized_Create(fileName, capacity, opts));
+	case OPENVMDK_FORMAT_RAW:
+		return newDisk(Flat_Create(fileName, capacity));
+	case OPENVMDK_FORMAT_MONOLITHIC_SPARSE:
+		return newDisk(HostedSparse_Create(fileName, capacity, opts));
+	}
+	errno = EINVAL;
+	return NULL;
+}
+
+ssize_t
+openvmdk_pread(OpenVmdkDisk *disk,
+               void *buf,
+               size_t len,
+               uint64_t pos)
+{
+	if (!disk->di->vmt->pread) {
+		errno = EBADF;
+		return -1;
+	}
+	return disk->di->vmt->pread(disk->di, buf, len, pos);
+}
+
+ssize_t
+openvmdk_pwrite(OpenVmdkDisk *disk,
+                const void *buf,
+                size_t len,
+                uint64_t pos)
+{
+	if (!disk->di->vmt->pwrite) {
+		errno = EBADF;
+		return -1;
+	}
+	return disk->di->vmt->pwrite(disk->di, buf, len, pos);
+}
+
+int
+openvmdk_next_data(OpenVmdkDisk *disk,
+                   uint64_t *pos,
+                   uint64_t *end)
+{
+	off_t p;
+	off_t e = *end;
+
+	if (!disk->di->vmt->nextData) {
+		errno = EBADF;
+		return -1;
+	}
+	if (disk->di->vmt->nextData(disk->di, &p, &e)) {
+		return -1;
+	}
+	*pos = p;
+	*end = e;
+	return 0;
+}
+
+int
+openvmdk_info(OpenVmdkDisk *disk,
+              OpenVmdkInfo *info)
+{
+	uint64_t pos;
+	uint64_t end = 0;
+
+	if (!disk->di->vmt->getCapacity) {
+		errno = EBADF;
+		return -1;
+	}
+	info->capacity = disk->di->vmt->getCapacity(disk->di);
+	info->used = 0;
+	while (openvmdk_next_data(disk, &pos, &end) == 0) {
+		info->used += end - pos;
+	}
+	return errno == ENXIO ? 0 : -1;
+}
+
+int
+openvmdk_close(OpenVmdkDisk *disk)
+{
+	int ret = disk->di->vmt->close(disk->di);
+
+	free(disk);
+	return ret;
+}
+
+int
+openvmdk_abort(OpenVmdkDisk *disk)
+{
+	int ret = disk->di->vmt->abort(disk->di);
+
+	free(disk);
+	return ret;
+}
@@ -17,16 +17,93 @@
 
 #include "diskinfo.h"
 
-#include <sys/time.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <getopt.h>
+#include <asm/byteorder.h>
+#include <openssl/evp.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-/* toolsVersion in metadata -
-   default is 2^31-1 (unknown) */
-char *toolsVersion = "2147483647";
+#ifndef VMDK_CONVERT_VERSION
+#define VMDK_CONVERT_VERSION	"unknown"
+#endif
+
+typedef enum {
+	FORMAT_AUTO,		/* streamOptimized for *.vmdk, raw otherwise */
+	FORMAT_STREAM_OPTIMIZED,
+	FORMAT_MONOLITHIC_SPARSE,
+	FORMAT_RAW,
+} OutputFormat;
+
+/* Long options whose letter is taken already, beyond the range of chars. */
+enum {
+	OPT_READ_RATE = 256,
+	OPT_WRITE_RATE,
+};
+
+static const struct {
+	const char *name;
+	OutputFormat format;
+} formatNames[] = {
+	{ "streamOptimized", FORMAT_STREAM_OPTIMIZED },
+	{ "monolithicSparse", FORMAT_MONOLITHIC_SPARSE },
+	{ "raw", FORMAT_RAW },
+};
+
+static const struct {
+	const char *name;
+	Durability durability;
+} durabilityNames[] = {
+	{ "full", DURABILITY_FULL },
+	{ "once", DURABILITY_ONCE },
+	{ "none", DURABILITY_NONE },
+};
+
+/* Limits from the command line, the control file can change them at runtime. */
+typedef struct {
+	off_t readRate;
+	off_t writeRate;
+	int threads;
+} Limits;
+
+static Limits cmdLimits;
+static const char *controlFile;
+static volatile sig_atomic_t controlChanged;
+
+static bool loadControl(void);
+
+/* --resume: seconds between checkpoints of the output */
+#define DEFAULT_CHECKPOINT_INTERVAL	60
+
+/* -i --estimate: fraction of the populated grains that is compressed */
+#define DEFAULT_SAMPLE_FRACTION	0.0002
+
+static bool checkpoints;
+static time_t checkpointInterval = DEFAULT_CHECKPOINT_INTERVAL;
+static time_t lastCheckpoint;
+
+static void
+controlHandler(int sig)
+{
+	(void)sig;
+	controlChanged = 1;
+}
+
+/* Apply the control file again if SIGHUP came since the last call. */
+static void
+pollControl(void)
+{
+	if (controlChanged) {
+		controlChanged = 0;
+		loadControl();
+	}
+}
 
 static int
 copyData(DiskInfo *dst,
@@ -47,6 +124,8 @@ copyData(DiskInfo *dst,
 		} else {
 			length -= readLen;
 		}
+		pollControl();
+		Throttle_Read(readLen);
 		if (src->vmt->pread(src, buf, readLen, srcOffset) != (ssize_t)readLen) {
 			return -1;
 		}
@@ -55,6 +134,13 @@ copyData(DiskInfo *dst,
 		}		
 		srcOffset += readLen;
 		dstOffset += readLen;
+		if (checkpoints && time(NULL) - lastCheckpoint >= checkpointInterval) {
+			if (StreamOptimized_Checkpoint(dst, dstOffset)) {
+				fprintf(stderr, "Checkpoint failed: %s\n", strerror(errno));
+				return -1;
+			}
+			lastCheckpoint = time(NULL);
+		}
 	}
 	return 0;
 }
@@ -62,11 +148,23 @@ copyData(DiskInfo *dst,
 static bool
 copyDisk(DiskInfo *src, DiskInfo *dst)
 {
+	off_t resumePos = StreamOptimized_ResumePos(dst);
 	off_t end;
 	off_t pos;
 
+	if (resumePos != 0) {
+		printf("Resuming at %llu bytes\n", (unsigned long long)resumePos);
+	}
+	lastCheckpoint = time(NULL);
 	end = 0;
 	while (src->vmt->nextData(src, &pos, &end) == 0) {
+		/* Everything before resumePos is in the output already. */
+		if (end <= resumePos) {
+			continue;
+		}
+		if (pos < resumePos) {
+			pos = resumePos;
+		}
 		if (copyData(dst, pos, src, pos, end - pos)) {
 			goto failAll;
 		}
@@ -89,12 +187,214 @@ static int
 printUsage(char *cmd)
 {
 	printf("Usage:\n");
-	printf("%s -i src.vmdk: displays information for specified virtual disk\n", cmd);
-	printf("%s [-t toolsVersion] src.vmdk dst.vmdk: converts source disk to destination disk with given tools version\n\n", cmd);
+	printf("%s -i [--estimate [--sample f] [--digest types]] src.vmdk: displays information for specified\n", cmd);
+	printf("    virtual disk, with --estimate also the projected size of its streamOptimized conversion\n");
+	printf("%s --verify [--threads n] src.vmdk dst.vmdk: checks that both disks have the same contents\n", cmd);
+	printf("%s --serve socket src.vmdk: exports the disk read-only over NBD on a Unix socket\n", cmd);
+	printf("%s --serve socket --size n [options] dst.vmdk: creates the disk from what one NBD client writes\n", cmd);
+	printf("%s --mount dir [--threads n] src.vmdk: shows the disk contents as dir/disk.raw until interrupted\n", cmd);
+	printf("%s [-t toolsVersion] [--grain-hashes] [--base base.vmdk] src.vmdk dst.vmdk: converts source disk to destination disk with given tools version\n", cmd);
+	printf("%s [options] - dst.img: converts a streamOptimized disk read from stdin\n\n", cmd);
+	printf("Options:\n");
+	printf("  --grain-hashes      write per-grain hashes to dst.vmdk.grains for later --base use\n");
+	printf("  --base base.vmdk    copy unchanged grains from a previous output (needs base.vmdk.grains)\n");
+	printf("  --digest types      hash the output while writing it, types is a list of sha1, sha256 and sha512;\n");
+	printf("                      the digests are written to dst.vmdk.digest\n");
+	printf("  --format f          output format: streamOptimized (default for dst.vmdk), monolithicSparse\n");
+	printf("                      (uncompressed, for local use) or raw (default otherwise)\n");
+	printf("  --redundant-gd      with monolithicSparse, also write the redundant grain directory\n");
+	printf("  --metadata          write capacity, used and file size (and the digests) of dst.vmdk to dst.vmdk.json\n");
+	printf("  --reproducible      derive disk identifiers from the contents, so identical input gives identical output;\n");
+	printf("                      with --digest or monolithicSparse output the source is read twice for that\n");
+	printf("  --seed n            derive disk identifiers from n (implies --reproducible)\n");
+	printf("  --size n            with --serve, size in bytes of the disk to create, K, M, G or T suffixes are allowed\n");
+	printf("  --threads n         number of compression, verify or mount threads (default: number of CPUs)\n");
+	printf("  --durability mode   how the output is synced at close: full (default: sync, write the header\n");
+	printf("                      that makes the disk valid, sync again), once (a single sync) or none\n");
+	printf("  --read-rate n       limit reading the source to n bytes per second, K, M, G or T suffixes are allowed\n");
+	printf("  --write-rate n      limit writing the output to n bytes per second\n");
+	printf("  --control file      file with limits that replace the ones above, reread on SIGHUP:\n");
+	printf("                      lines of \"read-rate n\", \"write-rate n\" and \"threads n\", 0 lifts a limit\n");
+	printf("  --queue-depth n     reads ahead of and writes behind the compression with io_uring (default: %d,\n", DEFAULT_QUEUE_DEPTH);
+	printf("                      1 for synchronous I/O)\n");
+	printf("  --resume            checkpoint a streamOptimized conversion to dst.vmdk.resume, and continue from\n");
+	printf("                      that checkpoint if it exists\n");
+	printf("  --checkpoint-interval n  with --resume, seconds between checkpoints (default: %d)\n",
+	       DEFAULT_CHECKPOINT_INTERVAL);
+	printf("  --sample f          with --estimate, fraction of the grains to compress (default: %g)\n",
+	       DEFAULT_SAMPLE_FRACTION);
+	printf("  --version           print the version and exit\n\n");
 
 	return 1;
 }
 
+/* Parse a comma separated list of digest types */
+static bool
+parseDigests(const char *text,
+             unsigned int *digests)
+{
+	char *list = strdup(text);
+	char *saveptr;
+	char *name;
+	bool ret = true;
+
+	if (!list) {
+		return false;
+	}
+	for (name = strtok_r(list, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+		if (strcasecmp(name, "sha1") == 0) {
+			*digests |= DIGEST_SHA1;
+		} else if (strcasecmp(name, "sha256") == 0) {
+			*digests |= DIGEST_SHA256;
+		} else if (strcasecmp(name, "sha512") == 0) {
+			*digests |= DIGEST_SHA512;
+		} else {
+			ret = false;
+		}
+	}
+	free(list);
+	return ret;
+}
+
+/* Parse a size with an optional binary K, M, G or T suffix */
+static bool
+parseSize(const char *text,
+          off_t *size)
+{
+	static const char suffixes[] = "KMGT";
+	unsigned long long val;
+	char *end;
+	const char *suffix;
+	int shift = 0;
+
+	errno = 0;
+	val = strtoull(text, &end, 10);
+	if (errno || end == text || *text == '-') {
+		return false;
+	}
+	if (*end != '\0') {
+		suffix = strchr(suffixes, *end);
+		if (!suffix || end[1] != '\0') {
+			return false;
+		}
+		shift = 10 * (suffix - suffixes + 1);
+	}
+	/* Checked before shifting, which would wrap large values around. */
+	if (val > (unsigned long long)INT64_MAX >> 10 >> shift) {
+		return false;
+	}
+	val <<= shift;
+	if (val == 0) {
+		return false;
+	}
+	*size = val;
+	return true;
+}
+
+/* The format to write filename in, FORMAT_AUTO goes by the name. */
+static OutputFormat
+resolveFormat(const char *filename,
+              OutputFormat format)
+{
+	if (format == FORMAT_AUTO) {
+		if (strlen(filename) >= 5 && strcmp(&(filename[strlen(filename) - 5]), ".vmdk") == 0)
+			format = FORMAT_STREAM_OPTIMIZED;
+		else
+			format = FORMAT_RAW;
+	}
+	return format;
+}
+
+/*
+ * Whether the disk identifiers must be known before the contents are
+ * written: streamOptimized disks hashed while writing them have their
+ * descriptor first, monolithicSparse disks do not hash the grains.
+ */
+static bool
+needsSeed(const SparseWriterOptions *writerOpts,
+          OutputFormat format)
+{
+	return writerOpts->reproducible && !writerOpts->seeded &&
+	       ((format == FORMAT_STREAM_OPTIMIZED && writerOpts->digests) || format == FORMAT_MONOLITHIC_SPARSE);
+}
+
+/*
+ * Seed for the disk identifiers from a hash of the source contents, for
+ * --reproducible where they cannot be derived while writing.  Costs an
+ * extra pass over the data.
+ */
+static bool
+seedFromSource(DiskInfo *src,
+               uint64_t *seed)
+{
+	static uint8_t buf[1024 * 1024];
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	EVP_MD_CTX *ctx;
+	off_t end = 0;
+	off_t pos;
+	bool ret = false;
+
+	ctx = EVP_MD_CTX_new();
+	if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) {
+		goto out;
+	}
+	while (src->vmt->nextData(src, &pos, &end) == 0) {
+		while (pos < end) {
+			size_t len = end - pos < (off_t)sizeof buf ? (size_t)(end - pos) : sizeof buf;
+			uint64_t lePos = __cpu_to_le64(pos);
+
+			Throttle_Read(len);
+			if (src->vmt->pread(src, buf, len, pos) != (ssize_t)len ||
+			    EVP_DigestUpdate(ctx, &lePos, sizeof lePos) != 1 ||
+			    EVP_DigestUpdate(ctx, buf, len) != 1) {
+				goto out;
+			}
+			pos += len;
+		}
+	}
+	if (errno != ENXIO || EVP_DigestFinal_ex(ctx, digest, NULL) != 1) {
+		goto out;
+	}
+	memcpy(seed, digest, sizeof *seed);
+	ret = true;
+out:
+	EVP_MD_CTX_free(ctx);
+	return ret;
+}
+
+static DiskInfo *
+createDisk(const char *filename,
+           off_t capacity,
+           OutputFormat format,
+           const SparseWriterOptions *writerOpts)
+{
+	format = resolveFormat(filename, format);
+	if (writerOpts->checkpoints && format != FORMAT_STREAM_OPTIMIZED) {
+		fprintf(stderr, "Only streamOptimized conversions can be resumed\n");
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((writerOpts->digests || writerOpts->metadata || writerOpts->grainHashes || writerOpts->baseFileName) &&
+	    format != FORMAT_STREAM_OPTIMIZED) {
+		fprintf(stderr, "--digest, --metadata, --grain-hashes and --base only go with streamOptimized output\n");
+		errno = EINVAL;
+		return NULL;
+	}
+	if (writerOpts->redundantGD && format != FORMAT_MONOLITHIC_SPARSE) {
+		fprintf(stderr, "--redundant-gd only goes with monolithicSparse output\n");
+		errno = EINVAL;
+		return NULL;
+	}
+	switch (format) {
+	case FORMAT_STREAM_OPTIMIZED:
+		return StreamOptimized_Create(filename, capacity, writerOpts);
+	case FORMAT_MONOLITHIC_SPARSE:
+		return HostedSparse_Create(filename, capacity, writerOpts);
+	default:
+		return Flat_Create(filename, capacity);
+	}
+}
+
 /* Check a string is number */
 static bool
 isNumber(char *text)
@@ -111,30 +411,253 @@ isNumber(char *text)
 	return true;
 }
 
+/*
+ * Apply the limits of the command line, with those in the control file on
+ * top: lines of "read-rate n", "write-rate n" and "threads n", where rates
+ * are bytes per second with an optional K, M, G or T suffix, and 0 lifts
+ * the limit.
+ */
+static bool
+loadControl(void)
+{
+	Limits limits = cmdLimits;
+	char line[256];
+	FILE *f;
+	bool ret = true;
+
+	if (controlFile) {
+		f = fopen(controlFile, "r");
+		if (!f) {
+			fprintf(stderr, "Cannot read %s: %s\n", controlFile, strerror(errno));
+			return false;
+		}
+		while (fgets(line, sizeof line, f)) {
+			char key[32];
+			char value[64];
+			off_t *rate = NULL;
+
+			if (line[0] == '#' || sscanf(line, "%31s %63s", key, value) != 2) {
+				continue;
+			}
+			if (strcmp(key, "read-rate") == 0) {
+				rate = &limits.readRate;
+			} else if (strcmp(key, "write-rate") == 0) {
+				rate = &limits.writeRate;
+			} else if (strcmp(key, "threads") == 0 && isNumber(value)) {
+				limits.threads = atoi(value);
+				continue;
+			}
+			if (!rate || (strcmp(value, "0") != 0 && !parseSize(value, rate))) {
+				fprintf(stderr, "Invalid line in %s: %s", controlFile, line);
+				ret = false;
+				continue;
+			}
+			if (strcmp(value, "0") == 0) {
+				*rate = 0;
+			}
+		}
+		fclose(f);
+	}
+	Throttle_SetRates(limits.readRate, limits.writeRate);
+	Throttle_SetThreads(limits.threads);
+	return ret;
+}
+
 int
 main(int argc,
      char *argv[])
 {
-	struct timeval tv;
 	DiskInfo *di;
 	const char *src;
 	int opt;
 	bool doInfo = false;
 	bool doConvert = false;
+	bool doVerify = false;
+	bool doEstimate = false;
+	double sampleFraction = DEFAULT_SAMPLE_FRACTION;
+	bool doSample = false;
+	const char *serveSocket = NULL;
+	const char *mountPoint = NULL;
+	off_t createSize = 0;
+	int numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int queueDepth = DEFAULT_QUEUE_DEPTH;
+	bool writerTuned = false;	/* --threads or --queue-depth given */
+	SparseWriterOptions writerOpts = { 0 };
+	OutputFormat format = FORMAT_AUTO;
+	size_t i;
+	int ret = 0;
+	static const struct option longOpts[] = {
+		{ "base", required_argument, NULL, 'b' },
+		{ "digest", required_argument, NULL, 'd' },
+		{ "format", required_argument, NULL, 'f' },
+		{ "grain-hashes", no_argument, NULL, 'g' },
+		{ "metadata", no_argument, NULL, 'm' },
+		{ "mount", required_argument, NULL, 'M' },
+		{ "queue-depth", required_argument, NULL, 'Q' },
+		{ "durability", required_argument, NULL, 'D' },
+		{ "read-rate", required_argument, NULL, OPT_READ_RATE },
+		{ "write-rate", required_argument, NULL, OPT_WRITE_RATE },
+		{ "control", required_argument, NULL, 'C' },
+		{ "resume", no_argument, NULL, 'e' },
+		{ "estimate", no_argument, NULL, 'E' },
+		{ "sample", required_argument, NULL, 'P' },
+		{ "checkpoint-interval", required_argument, NULL, 'I' },
+		{ "redundant-gd", no_argument, NULL, 'R' },
+		{ "reproducible", no_argument, NULL, 'r' },
+		{ "seed", required_argument, NULL, 's' },
+		{ "serve", required_argument, NULL, 'S' },
+		{ "size", required_argument, NULL, 'z' },
+		{ "threads", required_argument, NULL, 'T' },
+		{ "verify", no_argument, NULL, 'V' },
+		{ "version", no_argument, NULL, 'v' },
+		{ NULL, 0, NULL, 0 }
+	};
 
-	gettimeofday(&tv, NULL);
-	srand48(tv.tv_sec ^ tv.tv_usec);
-
-	while ((opt = getopt(argc, argv, "it:")) != -1) {
+	while ((opt = getopt_long(argc, argv, "it:", longOpts, NULL)) != -1) {
 		switch (opt) {
 		case 'i':
 			doInfo = true;
 			break;
+		case 'b':
+			doConvert = true;
+			writerOpts.baseFileName = optarg;
+			/* Chain the next conversion to this one. */
+			writerOpts.grainHashes = true;
+			break;
+		case 'd':
+			if (!parseDigests(optarg, &writerOpts.digests)) {
+				fprintf(stderr, "Invalid digest type: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'f':
+			doConvert = true;
+			for (i = 0; i < sizeof formatNames / sizeof formatNames[0]; i++) {
+				if (strcmp(optarg, formatNames[i].name) == 0) {
+					format = formatNames[i].format;
+					break;
+				}
+			}
+			if (format == FORMAT_AUTO) {
+				fprintf(stderr, "Invalid format: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'R':
+			doConvert = true;
+			writerOpts.redundantGD = true;
+			break;
+		case 'g':
+			doConvert = true;
+			writerOpts.grainHashes = true;
+			break;
+		case 'm':
+			doConvert = true;
+			writerOpts.metadata = true;
+			break;
+		case 'r':
+			doConvert = true;
+			writerOpts.reproducible = true;
+			break;
+		case 's':
+			if (!isNumber(optarg) || *optarg == '\0') {
+				fprintf(stderr, "Invalid seed: %s\n", optarg);
+				exit(1);
+			}
+			doConvert = true;
+			writerOpts.reproducible = true;
+			writerOpts.seeded = true;
+			writerOpts.seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'S':
+			serveSocket = optarg;
+			break;
+		case 'M':
+			mountPoint = optarg;
+			break;
+		case 'z':
+			if (!parseSize(optarg, &createSize)) {
+				fprintf(stderr, "Invalid size: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case OPT_READ_RATE:
+		case OPT_WRITE_RATE:
+			if (!parseSize(optarg, opt == OPT_READ_RATE ? &cmdLimits.readRate : &cmdLimits.writeRate)) {
+				fprintf(stderr, "Invalid rate: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'C':
+			controlFile = optarg;
+			break;
+		case 'e':
+			doConvert = true;
+			checkpoints = true;
+			writerOpts.checkpoints = true;
+			writerOpts.resume = true;
+			break;
+		case 'E':
+			doEstimate = true;
+			break;
+		case 'P': {
+			char *end;
+
+			sampleFraction = strtod(optarg, &end);
+			if (*optarg == '\0' || *end != '\0' || !(sampleFraction > 0 && sampleFraction <= 1)) {
+				fprintf(stderr, "Invalid sample fraction: %s\n", optarg);
+				exit(1);
+			}
+			doSample = true;
+			break;
+		}
+		case 'I':
+			if (!isNumber(optarg) || *optarg == '\0') {
+				fprintf(stderr, "Invalid checkpoint interval: %s\n", optarg);
+				exit(1);
+			}
+			checkpointInterval = atoi(optarg);
+			break;
+		case 'T':
+			if (!isNumber(optarg) || atoi(optarg) < 1) {
+				fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+				exit(1);
+			}
+			numThreads = atoi(optarg);
+			writerTuned = true;
+			break;
+		case 'D':
+			doConvert = true;
+			for (i = 0; i < sizeof durabilityNames / sizeof durabilityNames[0]; i++) {
+				if (strcmp(optarg, durabilityNames[i].name) == 0) {
+					writerOpts.durability = durabilityNames[i].durability;
+					break;
+				}
+			}
+			if (i == sizeof durabilityNames / sizeof durabilityNames[0]) {
+				fprintf(stderr, "Invalid durability mode: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'Q':
+			if (!isNumber(optarg) || atoi(optarg) < 1 || atoi(optarg) > 64) {
+				fprintf(stderr, "Invalid queue depth: %s\n", optarg);
+				exit(1);
+			}
+			queueDepth = atoi(optarg);
+			writerTuned = true;
+			break;
+		case 'V':
+			doVerify = true;
+			break;
+		case 'v':
+			printf("vmdk-convert %s\n", VMDK_CONVERT_VERSION);
+			exit(0);
 		case 't':
 			doConvert = true;
-			toolsVersion = optarg;
-			if (!isNumber(toolsVersion)){
-				fprintf(stderr, "Invalid tools version: %s\n", toolsVersion);
+			writerOpts.toolsVersion = optarg;
+			if (!isNumber(optarg)){
+				fprintf(stderr, "Invalid tools version: %s\n", optarg);
 				exit(1);
 			}
 			break;
@@ -144,33 +667,136 @@ main(int argc,
 		}
 	}
 
-	if (doInfo && doConvert) {
+	/* --estimate takes digests for the layout that goes with them. */
+	if (writerOpts.digests && !doEstimate) {
+		doConvert = true;
+	}
+	/* Writer options go with conversions and with disks created over NBD. */
+	if (doInfo + (doConvert || serveSocket) + doVerify + (mountPoint != NULL) > 1 ||
+	    (createSize != 0 && !serveSocket) || (checkpoints && serveSocket) || (doEstimate && !doInfo) || (doSample && !doEstimate)) {
 		printUsage(argv[0]);
 		exit(1);
 	}
+	if (serveSocket && createSize == 0 && (doConvert || writerTuned)) {
+		/* Served disks are read-only, nothing of them is written. */
+		fprintf(stderr, "--serve takes options for the written disk only with --size\n");
+		exit(1);
+	}
+	if (checkpoints &&
+	    (writerOpts.digests || writerOpts.grainHashes || (writerOpts.reproducible && !writerOpts.seeded))) {
+		/* They hash the whole output, which a resumed conversion does not see. */
+		fprintf(stderr, "--resume does not go with --digest, --grain-hashes, --base or --reproducible without --seed\n");
+		exit(1);
+	}
+
+	if (!loadControl()) {
+		exit(1);
+	}
+	if (controlFile) {
+		struct sigaction sa = { .sa_handler = controlHandler, .sa_flags = SA_RESTART };
+
+		sigaction(SIGHUP, &sa, NULL);
+	}
+
+	if (serveSocket && createSize != 0) {
+		DiskInfo *tgt;
+
+		if (argc - optind != 1) {
+			printUsage(argv[0]);
+			exit(1);
+		}
+		if (needsSeed(&writerOpts, resolveFormat(argv[optind], format))) {
+			fprintf(stderr, "--reproducible needs --seed here, the contents are not known in advance\n");
+			exit(1);
+		}
+		writerOpts.threads = numThreads;
+		writerOpts.queueDepth = queueDepth;
+		tgt = createDisk(argv[optind], createSize, format, &writerOpts);
+		if (tgt == NULL) {
+			fprintf(stderr, "Cannot open target disk %s: %s\n", argv[optind], strerror(errno));
+			return 1;
+		}
+		if (serveDisk(serveSocket, tgt, true, pollControl)) {
+			fprintf(stderr, "Disk %s not completed: %s\n", argv[optind], strerror(errno));
+			tgt->vmt->abort(tgt);
+			return 1;
+		}
+		if (tgt->vmt->close(tgt)) {
+			fprintf(stderr, "Failure!\n");
+			return 1;
+		}
+		return 0;
+	}
+
+	if (mountPoint) {
+		if (argc - optind != 1) {
+			printUsage(argv[0]);
+			exit(1);
+		}
+		return mountDisk(argv[optind], mountPoint, numThreads) ? 1 : 0;
+	}
+
+	if (doVerify) {
+		if (argc - optind != 2) {
+			printUsage(argv[0]);
+			exit(1);
+		}
+		switch (verifyDisks(argv[optind], argv[optind + 1], numThreads)) {
+		case 0:
+			return 0;
+		case 1:
+			return 1;
+		default:
+			return 2;
+		}
+	}
 
 	if (optind >= argc) {
 		src = "src.vmdk";
 	} else {
 		src = argv[optind++];
 	}
-	di = Sparse_Open(src);
-	if (di == NULL) {
-		di = Flat_Open(src);
+	if (strcmp(src, "-") == 0) {
+		/* a streamOptimized disk piped in, e.g. from an OVA */
+		di = Sparse_OpenStream(STDIN_FILENO);
+	} else {
+		di = Disk_Open(src);
 	}
 	if (di == NULL) {
 		fprintf(stderr, "Cannot open source disk %s: %s\n", src, strerror(errno));
+		ret = 1;
+	} else if (serveSocket) {
+		if (serveDisk(serveSocket, di, false, pollControl)) {
+			fprintf(stderr, "Cannot serve on %s: %s\n", serveSocket, strerror(errno));
+			ret = 1;
+		}
+		di->vmt->close(di);
 	} else {
 		if (doInfo) {
 			off_t capacity = di->vmt->getCapacity(di);
 			off_t end = 0;
 			off_t pos;
 			off_t usedSpace = 0;
+			SizeEstimate est;
+
 			while (di->vmt->nextData(di, &pos, &end) == 0) {
 				usedSpace += end - pos;
 			}
-			printf("{ \"capacity\": %llu, \"used\": %llu }\n",
-					(unsigned long long)capacity, (unsigned long long)usedSpace);
+			if (!doEstimate) {
+				printf("{ \"capacity\": %llu, \"used\": %llu }\n",
+						(unsigned long long)capacity, (unsigned long long)usedSpace);
+			} else if (strcmp(src, "-") == 0 || estimateSize(src, sampleFraction, numThreads, writerOpts.digests != 0, &est)) {
+				fprintf(stderr, "Cannot estimate the size of %s: %s\n", src, strerror(errno));
+				ret = 1;
+			} else {
+				printf("{ \"capacity\": %llu, \"used\": %llu, \"estimatedSize\": %llu, "
+				       "\"estimatedSizeLow\": %llu, \"estimatedSizeHigh\": %llu, "
+				       "\"grains\": %llu, \"sampledGrains\": %llu }\n",
+				       (unsigned long long)capacity, (unsigned long long)usedSpace,
+				       (unsigned long long)est.size, (unsigned long long)est.low,
+				       (unsigned long long)est.high, (unsigned long long)est.grains,
+				       (unsigned long long)est.sampled);
+			}
 		} else {
 			const char *filename;
 			DiskInfo *tgt;
@@ -182,24 +808,51 @@ main(int argc,
 				filename = argv[optind++];
 			}
 			capacity = di->vmt->getCapacity(di);
+			if (checkpoints) {
+				struct stat st;
 
-			if (strcmp(&(filename[strlen(filename) - 5]), ".vmdk") == 0)
-				tgt = StreamOptimized_Create(filename, capacity);
-			else
-				tgt = Flat_Create(filename, capacity);
+				/* A checkpoint only goes with the source it was taken of. */
+				if (strcmp(src, "-") == 0 || stat(src, &st) != 0) {
+					fprintf(stderr, "--resume needs a source file\n");
+					exit(1);
+				}
+				writerOpts.source.size = st.st_size;
+				writerOpts.source.inode = st.st_ino;
+				writerOpts.source.mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+			}
+			if (needsSeed(&writerOpts, resolveFormat(filename, format))) {
+				if (strcmp(src, "-") == 0) {
+					fprintf(stderr, "--reproducible needs --seed here, the contents are not known in advance\n");
+					exit(1);
+				}
+				if (!seedFromSource(di, &writerOpts.seed)) {
+					fprintf(stderr, "Cannot read source disk %s: %s\n", src, strerror(errno));
+					exit(1);
+				}
+				writerOpts.seeded = true;
+			}
+			writerOpts.threads = numThreads;
+			writerOpts.queueDepth = queueDepth;
+			tgt = createDisk(filename, capacity, format, &writerOpts);
 
 			if (tgt == NULL) {
 				fprintf(stderr, "Cannot open target disk %s: %s\n", filename, strerror(errno));
+				ret = 1;
 			} else {
+				/* Raw sources are read ahead, other formats are slow to inflate anyway. */
+				Flat_ReadAhead(di, queueDepth);
+				Flat_DropBehind(di);
+				Flat_DropBehind(tgt);
 				printf("Starting to convert %s to %s...\n", src, filename);
 				if (copyDisk(di, tgt)) {
 					printf("Success\n");
 				} else {
 					fprintf(stderr, "Failure!\n");
+					ret = 1;
 				}
 			}
 		}
 		di->vmt->close(di);
 	}
-	return 0;
+	return ret;
 }
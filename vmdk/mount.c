@@ -0,0 +1,578 @@
+/* *******************************************************************************
+ * Copyright (c) 2014-2023 VMware, Inc.  All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”); you may not
+ * use this file except in compliance with the License.  You may obtain a copy of
+ * the License at:
+ *
+ *            http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed
+ * under the License is distributed on an “AS IS” BASIS, without warranties or
+ * conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ * *********************************************************************************/
+
+/*
+ * Mount a disk as a read-only FUSE filesystem with a single file, disk.raw,
+ * holding its contents.  The kernel protocol is spoken directly on
+ * /dev/fuse, so there is no dependency on libfuse.  root mounts the
+ * filesystem itself, other users need fusermount3 (or fusermount).
+ *
+ * Several threads serve requests, each with its own handle of the disk,
+ * so grains are inflated in parallel.  SEEK_DATA and SEEK_HOLE are
+ * answered from the grain tables, and the file's block count is the
+ * allocated size, so sparse aware tools only read the populated parts.
+ */
+
+#define _GNU_SOURCE
+
+#include "diskinfo.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fuse.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MOUNT_FILE_NAME		"disk.raw"
+#define MOUNT_FILE_ID		2
+#define MOUNT_MAX_PAGES		256		/* 1 MiB reads */
+#define MOUNT_MAX_READ		(MOUNT_MAX_PAGES * 4096)
+#define MOUNT_BUFFER_SIZE	(MOUNT_MAX_READ + 4096)
+#define MOUNT_ATTR_TIMEOUT	3600		/* nothing ever changes */
+
+typedef struct {
+	const char *srcName;
+	const char *mountPoint;
+	int fd;				/* /dev/fuse */
+	struct stat srcStat;
+	off_t capacity;
+	off_t used;
+	pthread_t mainThread;
+	volatile bool stopping;
+} FuseMount;
+
+typedef struct {
+	FuseMount *fm;
+	pthread_t thread;
+	DiskInfo *di;
+	uint8_t *in;			/* MOUNT_BUFFER_SIZE request buffer */
+	uint8_t *out;			/* MOUNT_MAX_READ reply buffer */
+	bool failed;
+} FuseWorker;
+
+static bool
+sendReply(FuseMount *fm,
+          uint64_t unique,
+          int error,
+          const void *data,
+          size_t len)
+{
+	struct fuse_out_header hdr = {
+		.len = sizeof hdr + (error ? 0 : len),
+		.error = -error,
+		.unique = unique,
+	};
+	struct iovec iov[2] = {
+		{ &hdr, sizeof hdr },
+		{ (void *)data, error ? 0 : len },
+	};
+
+	/* ENOENT means the request was interrupted, that is fine. */
+	return writev(fm->fd, iov, 2) != -1 || errno == ENOENT;
+}
+
+static void
+fillAttr(const FuseMount *fm,
+         uint64_t nodeid,
+         struct fuse_attr *attr)
+{
+	memset(attr, 0, sizeof *attr);
+	attr->ino = nodeid;
+	attr->atime = fm->srcStat.st_atim.tv_sec;
+	attr->atimensec = fm->srcStat.st_atim.tv_nsec;
+	attr->mtime = fm->srcStat.st_mtim.tv_sec;
+	attr->mtimensec = fm->srcStat.st_mtim.tv_nsec;
+	attr->ctime = fm->srcStat.st_ctim.tv_sec;
+	attr->ctimensec = fm->srcStat.st_ctim.tv_nsec;
+	attr->uid = fm->srcStat.st_uid;
+	attr->gid = fm->srcStat.st_gid;
+	attr->blksize = 65536;
+	if (nodeid == FUSE_ROOT_ID) {
+		attr->mode = S_IFDIR | 0555;
+		attr->nlink = 2;
+	} else {
+		attr->mode = S_IFREG | 0444;
+		attr->nlink = 1;
+		attr->size = fm->capacity;
+		attr->blocks = fm->used / 512;
+	}
+}
+
+static bool
+handleLookup(FuseWorker *w,
+             const struct fuse_in_header *in,
+             const char *name)
+{
+	struct fuse_entry_out entry = { 0 };
+
+	if (in->nodeid != FUSE_ROOT_ID || strcmp(name, MOUNT_FILE_NAME) != 0) {
+		return sendReply(w->fm, in->unique, ENOENT, NULL, 0);
+	}
+	entry.nodeid = MOUNT_FILE_ID;
+	entry.entry_valid = MOUNT_ATTR_TIMEOUT;
+	entry.attr_valid = MOUNT_ATTR_TIMEOUT;
+	fillAttr(w->fm, MOUNT_FILE_ID, &entry.attr);
+	return sendReply(w->fm, in->unique, 0, &entry, sizeof entry);
+}
+
+static bool
+handleReadDir(FuseWorker *w,
+              const struct fuse_in_header *in,
+              const struct fuse_read_in *arg)
+{
+	static const struct {
+		uint64_t ino;
+		const char *name;
+		uint32_t type;
+	} entries[] = {
+		{ FUSE_ROOT_ID, ".", DT_DIR },
+		{ FUSE_ROOT_ID, "..", DT_DIR },
+		{ MOUNT_FILE_ID, MOUNT_FILE_NAME, DT_REG },
+	};
+	size_t len = 0;
+	uint64_t i;
+
+	for (i = arg->offset; i < sizeof entries / sizeof entries[0]; i++) {
+		struct fuse_dirent *dirent = (struct fuse_dirent *)(w->out + len);
+		size_t size;
+
+		dirent->namelen = strlen(entries[i].name);
+		size = FUSE_DIRENT_SIZE(dirent);
+		if (len + size > arg->size) {
+			break;
+		}
+		memset(dirent, 0, size);
+		dirent->ino = entries[i].ino;
+		dirent->off = i + 1;
+		dirent->namelen = strlen(entries[i].name);
+		dirent->type = entries[i].type;
+		memcpy(dirent->name, entries[i].name, dirent->namelen);
+		len += size;
+	}
+	return sendReply(w->fm, in->unique, 0, w->out, len);
+}
+
+static bool
+handleRead(FuseWorker *w,
+           const struct fuse_in_header *in,
+           const struct fuse_read_in *arg)
+{
+	size_t len = arg->size < MOUNT_MAX_READ ? arg->size : MOUNT_MAX_READ;
+
+	if (in->nodeid != MOUNT_FILE_ID) {
+		return sendReply(w->fm, in->unique, EISDIR, NULL, 0);
+	}
+	if (arg->offset >= (uint64_t)w->fm->capacity) {
+		len = 0;
+	} else if (len > w->fm->capacity - arg->offset) {
+		len = w->fm->capacity - arg->offset;
+	}
+	if (len != 0 && w->di->vmt->pread(w->di, w->out, len, arg->offset) != (ssize_t)len) {
+		return sendReply(w->fm, in->unique, EIO, NULL, 0);
+	}
+	return sendReply(w->fm, in->unique, 0, w->out, len);
+}
+
+static bool
+handleLseek(FuseWorker *w,
+            const struct fuse_in_header *in,
+            const struct fuse_lseek_in *arg)
+{
+	struct fuse_lseek_out out;
+	off_t pos;
+	off_t end = arg->offset;
+
+	if (arg->offset >= (uint64_t)w->fm->capacity) {
+		return sendReply(w->fm, in->unique, ENXIO, NULL, 0);
+	}
+	if (arg->whence != SEEK_DATA && arg->whence != SEEK_HOLE) {
+		return sendReply(w->fm, in->unique, EINVAL, NULL, 0);
+	}
+	if (w->di->vmt->nextData(w->di, &pos, &end) != 0) {
+		if (errno != ENXIO) {
+			return sendReply(w->fm, in->unique, EIO, NULL, 0);
+		}
+		/* Nothing but a hole up to the end. */
+		if (arg->whence == SEEK_DATA) {
+			return sendReply(w->fm, in->unique, ENXIO, NULL, 0);
+		}
+		out.offset = arg->offset;
+	} else if (arg->whence == SEEK_DATA) {
+		out.offset = pos;
+	} else {
+		out.offset = pos > (off_t)arg->offset ? (off_t)arg->offset : end;
+	}
+	return sendReply(w->fm, in->unique, 0, &out, sizeof out);
+}
+
+/*
+ * Handle one request.  Returns false when the filesystem is gone or the
+ * kernel does not take replies anymore.
+ */
+static bool
+handleRequest(FuseWorker *w,
+              size_t len)
+{
+	FuseMount *fm = w->fm;
+	const struct fuse_in_header *in = (const struct fuse_in_header *)w->in;
+	const void *arg = w->in + sizeof *in;
+
+	if (len < sizeof *in || in->len != len) {
+		return false;
+	}
+	switch (in->opcode) {
+	case FUSE_INIT: {
+		const struct fuse_init_in *init = arg;
+		struct fuse_init_out out = { 0 };
+
+		out.major = FUSE_KERNEL_VERSION;
+		out.minor = FUSE_KERNEL_MINOR_VERSION;
+		if (init->major != FUSE_KERNEL_VERSION) {
+			/* The kernel tells its version, then asks again. */
+			return sendReply(fm, in->unique, 0, &out, sizeof out) && init->major < FUSE_KERNEL_VERSION;
+		}
+		out.max_readahead = init->max_readahead;
+		out.flags = init->flags & (FUSE_ASYNC_READ | FUSE_PARALLEL_DIROPS | FUSE_MAX_PAGES);
+		out.max_background = 16;
+		out.congestion_threshold = 12;
+		out.max_write = 4096;
+		out.time_gran = 1;
+		out.max_pages = MOUNT_MAX_PAGES;
+		return sendReply(fm, in->unique, 0, &out, init->minor < 23 ? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof out);
+	}
+	case FUSE_DESTROY:
+		sendReply(fm, in->unique, 0, NULL, 0);
+		return false;
+	case FUSE_FORGET:
+	case FUSE_BATCH_FORGET:
+	case FUSE_INTERRUPT:
+		return true;
+	case FUSE_LOOKUP:
+		return handleLookup(w, in, arg);
+	case FUSE_GETATTR: {
+		struct fuse_attr_out out = { 0 };
+
+		out.attr_valid = MOUNT_ATTR_TIMEOUT;
+		fillAttr(fm, in->nodeid, &out.attr);
+		return sendReply(fm, in->unique, 0, &out, sizeof out);
+	}
+	case FUSE_OPEN:
+	case FUSE_OPENDIR: {
+		const struct fuse_open_in *open = arg;
+		struct fuse_open_out out = { 0 };
+
+		if ((open->flags & O_ACCMODE) != O_RDONLY) {
+			return sendReply(fm, in->unique, EROFS, NULL, 0);
+		}
+		out.open_flags = FOPEN_KEEP_CACHE;
+		return sendReply(fm, in->unique, 0, &out, sizeof out);
+	}
+	case FUSE_READ:
+		return handleRead(w, in, arg);
+	case FUSE_READDIR:
+		return handleReadDir(w, in, arg);
+	case FUSE_LSEEK:
+		return handleLseek(w, in, arg);
+	case FUSE_STATFS: {
+		struct fuse_statfs_out out = { 0 };
+
+		out.st.blocks = fm->capacity / 512;
+		out.st.files = 2;
+		out.st.bsize = 512;
+		out.st.frsize = 512;
+		out.st.namelen = 255;
+		return sendReply(fm, in->unique, 0, &out, sizeof out);
+	}
+	case FUSE_RELEASE:
+	case FUSE_RELEASEDIR:
+	case FUSE_FLUSH:
+		return sendReply(fm, in->unique, 0, NULL, 0);
+	default:
+		return sendReply(fm, in->unique, ENOSYS, NULL, 0);
+	}
+}
+
+/* Only there to interrupt read() in the workers. */
+static void
+stopHandler(int sig)
+{
+	(void)sig;
+}
+
+static void *
+fuseWorker(void *arg)
+{
+	FuseWorker *w = arg;
+	sigset_t stopSig;
+
+	sigemptyset(&stopSig);
+	sigaddset(&stopSig, SIGUSR2);
+	pthread_sigmask(SIG_UNBLOCK, &stopSig, NULL);
+	while (!w->fm->stopping) {
+		ssize_t len = read(w->fm->fd, w->in, MOUNT_BUFFER_SIZE);
+
+		if (len == -1) {
+			if (errno == EINTR || errno == EAGAIN || errno == ENOENT) {
+				continue;
+			}
+			/* ENODEV: unmounted */
+			w->failed = errno != ENODEV;
+			break;
+		}
+		if (!handleRequest(w, len)) {
+			break;
+		}
+	}
+	/* Wake up the main thread if the filesystem went away by itself. */
+	if (!w->fm->stopping) {
+		pthread_kill(w->fm->mainThread, SIGUSR1);
+	}
+	return NULL;
+}
+
+/* Let fusermount3 mount it, it passes back the /dev/fuse descriptor. */
+static int
+fusermount(const char *mountPoint,
+           const char *options)
+{
+	static const char *helpers[] = { "fusermount3", "fusermount" };
+	int sv[2];
+	pid_t pid;
+	char ctl[CMSG_SPACE(sizeof(int))];
+	char dummy;
+	struct iovec iov = { &dummy, 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = ctl, .msg_controllen = sizeof ctl,
+	};
+	struct cmsghdr *cmsg;
+	int status;
+	int fd = -1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		return -1;
+	}
+	pid = fork();
+	if (pid == -1) {
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		char commFd[16];
+		size_t i;
+
+		close(sv[0]);
+		snprintf(commFd, sizeof commFd, "%d", sv[1]);
+		setenv("_FUSE_COMMFD", commFd, 1);
+		for (i = 0; i < sizeof helpers / sizeof helpers[0]; i++) {
+			execlp(helpers[i], helpers[i], "-o", options, "--", mountPoint, (char *)NULL);
+		}
+		_exit(127);
+	}
+	close(sv[1]);
+	if (recvmsg(sv[0], &msg, 0) > 0) {
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+		}
+	}
+	close(sv[0]);
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		if (fd != -1) {
+			close(fd);
+		}
+		errno = EPERM;
+		return -1;
+	}
+	return fd;
+}
+
+static int
+openMount(FuseMount *fm)
+{
+	char options[128];
+	int fd;
+
+	if (geteuid() != 0) {
+		return fusermount(fm->mountPoint, "ro,nosuid,nodev,fsname=vmdk,subtype=vmdk");
+	}
+	fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	snprintf(options, sizeof options, "fd=%d,rootmode=40000,user_id=0,group_id=0,allow_other", fd);
+	if (mount("vmdk", fm->mountPoint, "fuse.vmdk", MS_RDONLY | MS_NOSUID | MS_NODEV, options) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+closeMount(FuseMount *fm)
+{
+	if (geteuid() == 0) {
+		umount2(fm->mountPoint, MNT_DETACH);
+	} else {
+		pid_t pid = fork();
+
+		if (pid == 0) {
+			execlp("fusermount3", "fusermount3", "-u", "-z", "--", fm->mountPoint, (char *)NULL);
+			execlp("fusermount", "fusermount", "-u", "-z", "--", fm->mountPoint, (char *)NULL);
+			_exit(127);
+		}
+		if (pid > 0) {
+			waitpid(pid, NULL, 0);
+		}
+	}
+}
+
+/*
+ * Mount srcName at mountPoint and serve it with numThreads threads until
+ * it is unmounted, or SIGINT or SIGTERM.  Returns 0 on success.
+ */
+int
+mountDisk(const char *srcName,
+          const char *mountPoint,
+          int numThreads)
+{
+	FuseMount fm = { .srcName = srcName, .mountPoint = mountPoint, .fd = -1 };
+	FuseWorker *workers;
+	DiskInfo *di;
+	sigset_t sigs;
+	sigset_t oldSigs;
+	struct sigaction sa = { .sa_handler = stopHandler };
+	struct sigaction oldSa;
+	struct timespec zero = { 0, 0 };
+	off_t pos;
+	off_t end = 0;
+	int started;
+	int sig;
+	int i;
+	int ret = -1;
+
+	if (numThreads < 1) {
+		numThreads = 1;
+	}
+	workers = calloc(numThreads, sizeof *workers);
+	if (!workers) {
+		return -1;
+	}
+	for (i = 0; i < numThreads; i++) {
+		workers[i].fm = &fm;
+		workers[i].di = Disk_Open(srcName);
+		workers[i].in = malloc(MOUNT_BUFFER_SIZE);
+		workers[i].out = malloc(MOUNT_MAX_READ);
+		if (!workers[i].di || !workers[i].in || !workers[i].out) {
+			fprintf(stderr, "Cannot open %s: %s\n", srcName, strerror(errno));
+			goto failWorkers;
+		}
+	}
+	di = workers[0].di;
+	fm.capacity = di->vmt->getCapacity(di);
+	while (di->vmt->nextData(di, &pos, &end) == 0) {
+		fm.used += end - pos;
+	}
+	if (errno != ENXIO || stat(srcName, &fm.srcStat) != 0) {
+		fprintf(stderr, "Cannot read %s: %s\n", srcName, strerror(errno));
+		goto failWorkers;
+	}
+
+	/* Signals go to the main thread only, through sigwait(). */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &sigs, &oldSigs);
+	sigdelset(&sigs, SIGUSR2);
+	fm.mainThread = pthread_self();
+	/* No SA_RESTART, so that SIGUSR2 makes a blocked read() return. */
+	sigaction(SIGUSR2, &sa, &oldSa);
+	fm.fd = openMount(&fm);
+	if (fm.fd == -1) {
+		fprintf(stderr, "Cannot mount %s: %s\n", mountPoint, strerror(errno));
+		goto failSignals;
+	}
+	for (started = 0; started < numThreads; started++) {
+		if (pthread_create(&workers[started].thread, NULL, fuseWorker, &workers[started]) != 0) {
+			break;
+		}
+	}
+	if (started == 0) {
+		closeMount(&fm);
+		goto failFd;
+	}
+	printf("Mounted %s at %s/%s\n", srcName, mountPoint, MOUNT_FILE_NAME);
+	fflush(stdout);
+
+	sigwait(&sigs, &sig);
+	fm.stopping = true;
+	if (sig != SIGUSR1) {
+		closeMount(&fm);
+	}
+	ret = 0;
+	for (i = 0; i < started; i++) {
+		struct timespec deadline;
+
+		/* Keep poking, the signal may come just before read(). */
+		do {
+			pthread_kill(workers[i].thread, SIGUSR2);
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += 100000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+		} while (pthread_timedjoin_np(workers[i].thread, NULL, &deadline) == ETIMEDOUT);
+		if (workers[i].failed) {
+			ret = -1;
+		}
+	}
+	/* Drop the wakeups of workers that stopped on their own. */
+	sigdelset(&sigs, SIGINT);
+	sigdelset(&sigs, SIGTERM);
+	while (sigtimedwait(&sigs, NULL, &zero) == SIGUSR1) {
+	}
+
+failFd:
+	if (fm.fd != -1) {
+		close(fm.fd);
+	}
+failSignals:
+	sigaction(SIGUSR2, &oldSa, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldSigs, NULL);
+failWorkers:
+	for (i = 0; i < numThreads; i++) {
+		if (workers[i].di) {
+			workers[i].di->vmt->close(workers[i].di);
+		}
+		free(workers[i].in);
+		free(workers[i].out);
+	}
+	free(workers);
+	return ret;
+}
@@ -0,0 +1,881 @@
+/* *******************************************************************************
+ * Copyright (c) 2014-2023 VMware, Inc.  All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”); you may not
+ * use this file except in compliance with the License.  You may obtain a copy of
+ * the License at:
+ *
+ *            http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed
+ * under the License is distributed on an “AS IS” BASIS, without warranties or
+ * conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ * *********************************************************************************/
+
+/*
+ * Export a disk over NBD on a Unix socket.  Only the fixed newstyle
+ * handshake is spoken.  With structured replies, reads send holes as such
+ * and the base:allocation meta context reports them through
+ * NBD_CMD_BLOCK_STATUS, so clients only fetch populated data.  Clients are
+ * served one at a time.
+ *
+ * A disk being created is exported writable to a single client instead.
+ * Zeroes and trimmed ranges are written as zeroes, which the sparse writers
+ * leave out, and the disk is finished when the client disconnects.
+ */
+
+#define _GNU_SOURCE
+
+#include "diskinfo.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define NBD_MAGIC			0x4e42444d41474943ULL	/* "NBDMAGIC" */
+#define NBD_IHAVEOPT			0x49484156454f5054ULL	/* "IHAVEOPT" */
+#define NBD_REP_MAGIC			0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC		0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC		0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC	0x668e33ef
+
+/* handshake flags */
+#define NBD_FLAG_FIXED_NEWSTYLE		(1 << 0)
+#define NBD_FLAG_NO_ZEROES		(1 << 1)
+
+/* options */
+#define NBD_OPT_EXPORT_NAME		1
+#define NBD_OPT_ABORT			2
+#define NBD_OPT_LIST			3
+#define NBD_OPT_INFO			6
+#define NBD_OPT_GO			7
+#define NBD_OPT_STRUCTURED_REPLY	8
+#define NBD_OPT_LIST_META_CONTEXT	9
+#define NBD_OPT_SET_META_CONTEXT	10
+
+#define NBD_REP_ACK			1
+#define NBD_REP_SERVER			2
+#define NBD_REP_INFO			3
+#define NBD_REP_META_CONTEXT		4
+#define NBD_REP_ERR_UNSUP		0x80000001
+#define NBD_REP_ERR_INVALID		0x80000003
+#define NBD_REP_ERR_TOO_BIG		0x80000009
+
+#define NBD_INFO_EXPORT			0
+#define NBD_INFO_BLOCK_SIZE		3
+
+/* transmission flags */
+#define NBD_FLAG_HAS_FLAGS		(1 << 0)
+#define NBD_FLAG_READ_ONLY		(1 << 1)
+#define NBD_FLAG_SEND_FLUSH		(1 << 2)
+#define NBD_FLAG_SEND_TRIM		(1 << 5)
+#define NBD_FLAG_SEND_WRITE_ZEROES	(1 << 6)
+#define NBD_FLAG_SEND_DF		(1 << 7)
+
+#define NBD_CMD_READ			0
+#define NBD_CMD_WRITE			1
+#define NBD_CMD_DISC			2
+#define NBD_CMD_FLUSH			3
+#define NBD_CMD_TRIM			4
+#define NBD_CMD_CACHE			5
+#define NBD_CMD_WRITE_ZEROES		6
+#define NBD_CMD_BLOCK_STATUS		7
+
+#define NBD_CMD_FLAG_DF			(1 << 2)
+#define NBD_CMD_FLAG_REQ_ONE		(1 << 3)
+
+#define NBD_REPLY_FLAG_DONE		(1 << 0)
+#define NBD_REPLY_TYPE_NONE		0
+#define NBD_REPLY_TYPE_OFFSET_DATA	1
+#define NBD_REPLY_TYPE_OFFSET_HOLE	2
+#define NBD_REPLY_TYPE_BLOCK_STATUS	5
+#define NBD_REPLY_TYPE_ERROR		32769
+
+#define NBD_STATE_HOLE			(1 << 0)
+#define NBD_STATE_ZERO			(1 << 1)
+
+#define NBD_EPERM			1
+#define NBD_EIO				5
+#define NBD_ENOMEM			12
+#define NBD_EINVAL			22
+
+#define NBD_MAX_OPTION		4096
+#define NBD_MAX_REQUEST		(32 * 1024 * 1024)
+#define NBD_PREFERRED_BLOCK	65536		/* a grain */
+#define NBD_MAX_EXTENTS		1024		/* per block status reply */
+#define NBD_ZERO_CHUNK		(1024 * 1024)
+#define NBD_ALLOCATION_ID	1
+#define NBD_ALLOCATION_CONTEXT	"base:allocation"
+
+typedef struct {
+	DiskInfo *di;
+	off_t capacity;
+	int fd;
+	bool writable;
+	bool noZeroes;
+	bool structured;
+	bool allocation;	/* base:allocation selected */
+	uint8_t *buf;		/* NBD_MAX_REQUEST bytes */
+	uint8_t *zeroes;	/* NBD_ZERO_CHUNK bytes, for writable disks */
+	void (*onRequest)(void);	/* called before each request, may be NULL */
+} NbdConn;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	uint64_t cookie;
+	uint64_t offset;
+	uint32_t length;
+} NbdRequest;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	uint64_t cookie;
+	uint32_t length;
+} NbdStructuredReply;
+
+static volatile sig_atomic_t stopServer;
+
+static void
+onSignal(int sig)
+{
+	(void)sig;
+	stopServer = 1;
+}
+
+static bool
+recvAll(int fd,
+        void *buf,
+        size_t len)
+{
+	uint8_t *buf8 = buf;
+
+	while (len > 0) {
+		ssize_t rd = recv(fd, buf8, len, 0);
+
+		if (rd <= 0) {
+			if (rd == -1 && errno == EINTR && !stopServer) {
+				continue;
+			}
+			return false;
+		}
+		buf8 += rd;
+		len -= rd;
+	}
+	return true;
+}
+
+static bool
+sendAll(int fd,
+        const void *buf,
+        size_t len)
+{
+	const uint8_t *buf8 = buf;
+
+	while (len > 0) {
+		ssize_t wr = send(fd, buf8, len, MSG_NOSIGNAL);
+
+		if (wr <= 0) {
+			if (wr == -1 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf8 += wr;
+		len -= wr;
+	}
+	return true;
+}
+
+/* Consume a payload that is not going to be used. */
+static bool
+skipAll(NbdConn *conn,
+        size_t len)
+{
+	while (len > 0) {
+		size_t n = len < NBD_MAX_REQUEST ? len : NBD_MAX_REQUEST;
+
+		if (!recvAll(conn->fd, conn->buf, n)) {
+			return false;
+		}
+		len -= n;
+	}
+	return true;
+}
+
+static bool
+sendOptReply(NbdConn *conn,
+             uint32_t opt,
+             uint32_t type,
+             const void *data,
+             uint32_t len)
+{
+	struct __attribute__((packed)) {
+		uint64_t magic;
+		uint32_t opt;
+		uint32_t type;
+		uint32_t len;
+	} hdr = {
+		htobe64(NBD_REP_MAGIC), htobe32(opt), htobe32(type), htobe32(len)
+	};
+
+	return sendAll(conn->fd, &hdr, sizeof hdr) && sendAll(conn->fd, data, len);
+}
+
+static uint16_t
+transmissionFlags(NbdConn *conn)
+{
+	uint16_t flags = NBD_FLAG_HAS_FLAGS;
+
+	if (conn->writable) {
+		flags |= NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES;
+		/* streamOptimized disks only get their tables on close */
+		if (conn->di->vmt->flush) {
+			flags |= NBD_FLAG_SEND_FLUSH;
+		}
+	} else {
+		flags |= NBD_FLAG_READ_ONLY;
+	}
+	if (conn->structured) {
+		flags |= NBD_FLAG_SEND_DF;
+	}
+	return flags;
+}
+
+/* NBD_OPT_INFO and NBD_OPT_GO: describe the export. */
+static bool
+sendExportInfo(NbdConn *conn,
+               uint32_t opt)
+{
+	struct __attribute__((packed)) {
+		uint16_t type;
+		uint64_t size;
+		uint16_t flags;
+	} exportInfo = {
+		htobe16(NBD_INFO_EXPORT), htobe64(conn->capacity), htobe16(transmissionFlags(conn))
+	};
+	struct __attribute__((packed)) {
+		uint16_t type;
+		uint32_t minimum;
+		uint32_t preferred;
+		uint32_t maximum;
+	} blockSize = {
+		htobe16(NBD_INFO_BLOCK_SIZE), htobe32(1), htobe32(NBD_PREFERRED_BLOCK), htobe32(NBD_MAX_REQUEST)
+	};
+
+	return sendOptReply(conn, opt, NBD_REP_INFO, &exportInfo, sizeof exportInfo) &&
+	       sendOptReply(conn, opt, NBD_REP_INFO, &blockSize, sizeof blockSize) &&
+	       sendOptReply(conn, opt, NBD_REP_ACK, NULL, 0);
+}
+
+/*
+ * Check the export name and the list of information requests of
+ * NBD_OPT_INFO and NBD_OPT_GO.  Any export name is accepted.
+ */
+static bool
+checkInfoRequest(const uint8_t *data,
+                 uint32_t len)
+{
+	uint32_t nameLen;
+	uint16_t numRequests;
+
+	if (len < sizeof nameLen + sizeof numRequests) {
+		return false;
+	}
+	memcpy(&nameLen, data, sizeof nameLen);
+	nameLen = be32toh(nameLen);
+	if (nameLen > len - sizeof nameLen - sizeof numRequests) {
+		return false;
+	}
+	memcpy(&numRequests, data + sizeof nameLen + nameLen, sizeof numRequests);
+	return sizeof nameLen + nameLen + sizeof numRequests + be16toh(numRequests) * sizeof(uint16_t) == len;
+}
+
+/*
+ * NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.  The only
+ * context is base:allocation, for disks that know their allocation.
+ */
+static bool
+handleMetaContext(NbdConn *conn,
+                  uint32_t opt,
+                  const uint8_t *data,
+                  uint32_t len)
+{
+	uint32_t nameLen;
+	uint32_t numQueries;
+	uint32_t pos;
+	bool found = false;
+	uint8_t reply[sizeof(uint32_t) + sizeof NBD_ALLOCATION_CONTEXT - 1];
+	uint32_t id = htobe32(opt == NBD_OPT_SET_META_CONTEXT ? NBD_ALLOCATION_ID : 0);
+
+	if (opt == NBD_OPT_SET_META_CONTEXT && !conn->structured) {
+		return sendOptReply(conn, opt, NBD_REP_ERR_INVALID, NULL, 0);
+	}
+	if (len < 2 * sizeof(uint32_t)) {
+		return sendOptReply(conn, opt, NBD_REP_ERR_INVALID, NULL, 0);
+	}
+	memcpy(&nameLen, data, sizeof nameLen);
+	nameLen = be32toh(nameLen);
+	if (nameLen > len - 2 * sizeof(uint32_t)) {
+		return sendOptReply(conn, opt, NBD_REP_ERR_INVALID, NULL, 0);
+	}
+	pos = sizeof nameLen + nameLen;
+	memcpy(&numQueries, data + pos, sizeof numQueries);
+	numQueries = be32toh(numQueries);
+	pos += sizeof numQueries;
+	if (numQueries == 0 && opt == NBD_OPT_LIST_META_CONTEXT) {
+		found = true;
+	}
+	while (numQueries-- > 0) {
+		uint32_t queryLen;
+
+		if (len - pos < sizeof queryLen) {
+			return sendOptReply(conn, opt, NBD_REP_ERR_INVALID, NULL, 0);
+		}
+		memcpy(&queryLen, data + pos, sizeof queryLen);
+		queryLen = be32toh(queryLen);
+		pos += sizeof queryLen;
+		if (queryLen > len - pos) {
+			return sendOptReply(conn, opt, NBD_REP_ERR_INVALID, NULL, 0);
+		}
+		if ((queryLen == strlen(NBD_ALLOCATION_CONTEXT) &&
+		     memcmp(data + pos, NBD_ALLOCATION_CONTEXT, queryLen) == 0) ||
+		    (opt == NBD_OPT_LIST_META_CONTEXT && queryLen == 5 &&
+		     memcmp(data + pos, "base:", 5) == 0)) {
+			found = true;
+		}
+		pos += queryLen;
+	}
+	if (pos != len) {
+		return sendOptReply(conn, opt, NBD_REP_ERR_INVALID, NULL, 0);
+	}
+	if (!conn->di->vmt->nextData) {
+		found = false;
+	}
+	if (opt == NBD_OPT_SET_META_CONTEXT) {
+		conn->allocation = found;
+	}
+	if (found) {
+		memcpy(reply, &id, sizeof id);
+		memcpy(reply + sizeof id, NBD_ALLOCATION_CONTEXT, sizeof reply - sizeof id);
+		if (!sendOptReply(conn, opt, NBD_REP_META_CONTEXT, reply, sizeof reply)) {
+			return false;
+		}
+	}
+	return sendOptReply(conn, opt, NBD_REP_ACK, NULL, 0);
+}
+
+/*
+ * Handshake and option haggling.  Returns 1 to go on with transmission,
+ * 0 if the client gave up and -1 on errors.
+ */
+static int
+negotiate(NbdConn *conn)
+{
+	struct __attribute__((packed)) {
+		uint64_t magic;
+		uint64_t opt;
+		uint16_t flags;
+	} greeting = {
+		htobe64(NBD_MAGIC), htobe64(NBD_IHAVEOPT), htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES)
+	};
+	uint32_t clientFlags;
+
+	if (!sendAll(conn->fd, &greeting, sizeof greeting) ||
+	    !recvAll(conn->fd, &clientFlags, sizeof clientFlags)) {
+		return -1;
+	}
+	clientFlags = be32toh(clientFlags);
+	if (!(clientFlags & NBD_FLAG_FIXED_NEWSTYLE)) {
+		fprintf(stderr, "NBD client does not support fixed newstyle negotiation\n");
+		return -1;
+	}
+	conn->noZeroes = clientFlags & NBD_FLAG_NO_ZEROES;
+
+	for (;;) {
+		struct __attribute__((packed)) {
+			uint64_t magic;
+			uint32_t opt;
+			uint32_t len;
+		} hdr;
+		uint8_t data[NBD_MAX_OPTION];
+		bool ok;
+
+		if (!recvAll(conn->fd, &hdr, sizeof hdr) || be64toh(hdr.magic) != NBD_IHAVEOPT) {
+			return -1;
+		}
+		hdr.opt = be32toh(hdr.opt);
+		hdr.len = be32toh(hdr.len);
+		if (hdr.len > sizeof data) {
+			if (hdr.opt == NBD_OPT_EXPORT_NAME) {
+				return -1;
+			}
+			if (!skipAll(conn, hdr.len) ||
+			    !sendOptReply(conn, hdr.opt, NBD_REP_ERR_TOO_BIG, NULL, 0)) {
+				return -1;
+			}
+			continue;
+		}
+		if (!recvAll(conn->fd, data, hdr.len)) {
+			return -1;
+		}
+		switch (hdr.opt) {
+		case NBD_OPT_EXPORT_NAME: {
+			struct __attribute__((packed)) {
+				uint64_t size;
+				uint16_t flags;
+				uint8_t zeroes[124];
+			} reply = { htobe64(conn->capacity), htobe16(transmissionFlags(conn)), { 0 } };
+
+			if (!sendAll(conn->fd, &reply, conn->noZeroes ? sizeof reply - sizeof reply.zeroes : sizeof reply)) {
+				return -1;
+			}
+			return 1;
+		}
+		case NBD_OPT_ABORT:
+			sendOptReply(conn, hdr.opt, NBD_REP_ACK, NULL, 0);
+			return 0;
+		case NBD_OPT_LIST: {
+			uint32_t noName = 0;
+
+			ok = hdr.len != 0 ?
+			     sendOptReply(conn, hdr.opt, NBD_REP_ERR_INVALID, NULL, 0) :
+			     sendOptReply(conn, hdr.opt, NBD_REP_SERVER, &noName, sizeof noName) &&
+			     sendOptReply(conn, hdr.opt, NBD_REP_ACK, NULL, 0);
+			break;
+		}
+		case NBD_OPT_STRUCTURED_REPLY:
+			if (hdr.len != 0) {
+				ok = sendOptReply(conn, hdr.opt, NBD_REP_ERR_INVALID, NULL, 0);
+				break;
+			}
+			conn->structured = true;
+			ok = sendOptReply(conn, hdr.opt, NBD_REP_ACK, NULL, 0);
+			break;
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO:
+			if (!checkInfoRequest(data, hdr.len)) {
+				ok = sendOptReply(conn, hdr.opt, NBD_REP_ERR_INVALID, NULL, 0);
+				break;
+			}
+			if (!sendExportInfo(conn, hdr.opt)) {
+				return -1;
+			}
+			if (hdr.opt == NBD_OPT_GO) {
+				return 1;
+			}
+			ok = true;
+			break;
+		case NBD_OPT_LIST_META_CONTEXT:
+		case NBD_OPT_SET_META_CONTEXT:
+			ok = handleMetaContext(conn, hdr.opt, data, hdr.len);
+			break;
+		default:
+			ok = sendOptReply(conn, hdr.opt, NBD_REP_ERR_UNSUP, NULL, 0);
+			break;
+		}
+		if (!ok) {
+			return -1;
+		}
+	}
+}
+
+static bool
+sendSimpleReply(NbdConn *conn,
+                uint64_t cookie,
+                uint32_t error,
+                const void *data,
+                size_t len)
+{
+	struct __attribute__((packed)) {
+		uint32_t magic;
+		uint32_t error;
+		uint64_t cookie;
+	} reply = { htobe32(NBD_SIMPLE_REPLY_MAGIC), htobe32(error), cookie };
+
+	return sendAll(conn->fd, &reply, sizeof reply) && sendAll(conn->fd, data, len);
+}
+
+static bool
+sendChunk(NbdConn *conn,
+          uint64_t cookie,
+          uint16_t flags,
+          uint16_t type,
+          const void *hdr,
+          size_t hdrLen,
+          const void *data,
+          size_t len)
+{
+	NbdStructuredReply reply = {
+		htobe32(NBD_STRUCTURED_REPLY_MAGIC), htobe16(flags), htobe16(type), cookie, htobe32(hdrLen + len)
+	};
+
+	return sendAll(conn->fd, &reply, sizeof reply) &&
+	       sendAll(conn->fd, hdr, hdrLen) &&
+	       sendAll(conn->fd, data, len);
+}
+
+/* Complete a request without data. */
+static bool
+sendDone(NbdConn *conn,
+         uint64_t cookie,
+         uint32_t error)
+{
+	if (!conn->structured) {
+		return sendSimpleReply(conn, cookie, error, NULL, 0);
+	}
+	if (error) {
+		struct __attribute__((packed)) {
+			uint32_t error;
+			uint16_t msgLen;
+		} payload = { htobe32(error), 0 };
+
+		return sendChunk(conn, cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, &payload, sizeof payload, NULL, 0);
+	}
+	return sendChunk(conn, cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+}
+
+/*
+ * Find the allocation at pos: returns the end of the data or hole that pos
+ * is in, and whether it is data.  Returns -1 on errors.
+ */
+static off_t
+nextExtent(NbdConn *conn,
+           off_t pos,
+           bool *isData)
+{
+	off_t dataPos;
+	off_t dataEnd = pos;
+
+	if (conn->di->vmt->nextData(conn->di, &dataPos, &dataEnd) != 0) {
+		if (errno != ENXIO) {
+			return -1;
+		}
+		*isData = false;
+		return conn->capacity;
+	}
+	if (dataPos > pos) {
+		*isData = false;
+		return dataPos;
+	}
+	*isData = true;
+	return dataEnd > pos ? dataEnd : conn->capacity;
+}
+
+static bool
+handleRead(NbdConn *conn,
+           const NbdRequest *req)
+{
+	off_t pos = req->offset;
+	off_t end = req->offset + req->length;
+	uint64_t offset;
+
+	if (!conn->structured || (req->flags & NBD_CMD_FLAG_DF) || !conn->di->vmt->nextData) {
+		if (conn->di->vmt->pread(conn->di, conn->buf, req->length, pos) != (ssize_t)req->length) {
+			return sendDone(conn, req->cookie, NBD_EIO);
+		}
+		if (!conn->structured) {
+			return sendSimpleReply(conn, req->cookie, 0, conn->buf, req->length);
+		}
+		offset = htobe64(pos);
+		return sendChunk(conn, req->cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_OFFSET_DATA, &offset, sizeof offset, conn->buf, req->length);
+	}
+
+	/* Holes are sent without their zeroes. */
+	while (pos < end) {
+		bool isData;
+		off_t next = nextExtent(conn, pos, &isData);
+
+		if (next < 0) {
+			return sendDone(conn, req->cookie, NBD_EIO);
+		}
+		if (next > end) {
+			next = end;
+		}
+		offset = htobe64(pos);
+		if (isData) {
+			if (conn->di->vmt->pread(conn->di, conn->buf, next - pos, pos) != next - pos) {
+				return sendDone(conn, req->cookie, NBD_EIO);
+			}
+			if (!sendChunk(conn, req->cookie, 0, NBD_REPLY_TYPE_OFFSET_DATA, &offset, sizeof offset, conn->buf, next - pos)) {
+				return false;
+			}
+		} else {
+			struct __attribute__((packed)) {
+				uint64_t offset;
+				uint32_t length;
+			} hole = { offset, htobe32(next - pos) };
+
+			if (!sendChunk(conn, req->cookie, 0, NBD_REPLY_TYPE_OFFSET_HOLE, &hole, sizeof hole, NULL, 0)) {
+				return false;
+			}
+		}
+		pos = next;
+	}
+	return sendDone(conn, req->cookie, 0);
+}
+
+static bool
+handleBlockStatus(NbdConn *conn,
+                  const NbdRequest *req)
+{
+	struct __attribute__((packed)) {
+		uint32_t length;
+		uint32_t flags;
+	} *extents = (void *)conn->buf;
+	uint32_t numExtents = 0;
+	uint32_t id = htobe32(NBD_ALLOCATION_ID);
+	off_t pos = req->offset;
+	off_t end = req->offset + req->length;
+
+	if (!conn->allocation) {
+		return sendDone(conn, req->cookie, NBD_EINVAL);
+	}
+	while (pos < end && numExtents < NBD_MAX_EXTENTS) {
+		bool isData;
+		off_t next = nextExtent(conn, pos, &isData);
+
+		if (next < 0) {
+			return sendDone(conn, req->cookie, NBD_EIO);
+		}
+		if (next > end) {
+			next = end;
+		}
+		extents[numExtents].length = htobe32(next - pos);
+		extents[numExtents].flags = htobe32(isData ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO);
+		numExtents++;
+		pos = next;
+		if (req->flags & NBD_CMD_FLAG_REQ_ONE) {
+			break;
+		}
+	}
+	return sendChunk(conn, req->cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS, &id, sizeof id, extents, numExtents * sizeof *extents);
+}
+
+static bool
+handleWrite(NbdConn *conn,
+            const NbdRequest *req)
+{
+	bool inRange = req->offset <= (uint64_t)conn->capacity &&
+	               req->length <= conn->capacity - req->offset;
+
+	if (!conn->writable || !inRange || req->length > NBD_MAX_REQUEST) {
+		/* The payload comes anyway. */
+		if (!skipAll(conn, req->length)) {
+			return false;
+		}
+		return sendDone(conn, req->cookie, !conn->writable ? NBD_EPERM : NBD_EINVAL);
+	}
+	if (!recvAll(conn->fd, conn->buf, req->length)) {
+		return false;
+	}
+	if (conn->di->vmt->pwrite(conn->di, conn->buf, req->length, req->offset) != (ssize_t)req->length) {
+		return sendDone(conn, req->cookie, NBD_EIO);
+	}
+	return sendDone(conn, req->cookie, 0);
+}
+
+/* NBD_CMD_WRITE_ZEROES and NBD_CMD_TRIM */
+static bool
+handleZeroes(NbdConn *conn,
+             const NbdRequest *req)
+{
+	off_t pos = req->offset;
+	off_t end = req->offset + req->length;
+
+	if (!conn->writable) {
+		return sendDone(conn, req->cookie, NBD_EPERM);
+	}
+	while (pos < end) {
+		size_t n = end - pos < NBD_ZERO_CHUNK ? end - pos : NBD_ZERO_CHUNK;
+
+		if (conn->di->vmt->pwrite(conn->di, conn->zeroes, n, pos) != (ssize_t)n) {
+			return sendDone(conn, req->cookie, NBD_EIO);
+		}
+		pos += n;
+	}
+	return sendDone(conn, req->cookie, 0);
+}
+
+/* Only advertised for writable disks whose format can flush. */
+static bool
+handleFlush(NbdConn *conn,
+            const NbdRequest *req)
+{
+	if (!conn->writable || !conn->di->vmt->flush) {
+		return sendDone(conn, req->cookie, NBD_EINVAL);
+	}
+	if (conn->di->vmt->flush(conn->di) != 0) {
+		return sendDone(conn, req->cookie, NBD_EIO);
+	}
+	return sendDone(conn, req->cookie, 0);
+}
+
+/*
+ * Serve requests until the client disconnects.  Returns 0 after
+ * NBD_CMD_DISC and -1 on errors.
+ */
+static int
+transmit(NbdConn *conn)
+{
+	for (;;) {
+		NbdRequest req;
+		bool ok;
+
+		if (!recvAll(conn->fd, &req, sizeof req)) {
+			return -1;
+		}
+		if (conn->onRequest) {
+			conn->onRequest();
+		}
+		if (be32toh(req.magic) != NBD_REQUEST_MAGIC) {
+			fprintf(stderr, "Bad NBD request magic\n");
+			return -1;
+		}
+		req.flags = be16toh(req.flags);
+		req.type = be16toh(req.type);
+		req.offset = be64toh(req.offset);
+		req.length = be32toh(req.length);
+
+		if (req.type == NBD_CMD_DISC) {
+			return 0;
+		}
+		if (req.type == NBD_CMD_WRITE) {
+			ok = handleWrite(conn, &req);
+		} else if (req.offset > (uint64_t)conn->capacity ||
+		           req.length > conn->capacity - req.offset) {
+			ok = sendDone(conn, req.cookie, NBD_EINVAL);
+		} else {
+			switch (req.type) {
+			case NBD_CMD_READ:
+				ok = req.length <= NBD_MAX_REQUEST ?
+				     handleRead(conn, &req) :
+				     sendDone(conn, req.cookie, NBD_EINVAL);
+				break;
+			case NBD_CMD_BLOCK_STATUS:
+				ok = handleBlockStatus(conn, &req);
+				break;
+			case NBD_CMD_WRITE_ZEROES:
+			case NBD_CMD_TRIM:
+				ok = handleZeroes(conn, &req);
+				break;
+			case NBD_CMD_FLUSH:
+				ok = handleFlush(conn, &req);
+				break;
+			case NBD_CMD_CACHE:
+				ok = sendDone(conn, req.cookie, 0);
+				break;
+			default:
+				ok = sendDone(conn, req.cookie, NBD_EINVAL);
+				break;
+			}
+		}
+		if (!ok) {
+			return -1;
+		}
+	}
+}
+
+/*
+ * Export di on a Unix socket at socketPath until SIGINT or SIGTERM.  A
+ * writable disk is served to one client only, and serveDisk() returns when
+ * it disconnected; the caller then closes the disk if the return value is 0.
+ * onRequest, if not NULL, is called before each request is handled, e.g. to
+ * pick up changed limits.  Returns -1 if the socket cannot be set up or the
+ * writing client failed.
+ */
+int
+serveDisk(const char *socketPath,
+          DiskInfo *di,
+          bool writable,
+          void (*onRequest)(void))
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct sigaction sa = { .sa_handler = onSignal };
+	NbdConn conn = { .di = di, .capacity = di->vmt->getCapacity(di), .writable = writable,
+	                 .onRequest = onRequest };
+	bool transmitted;
+	int listenFd;
+	int ret = -1;
+
+	if (strlen(socketPath) >= sizeof addr.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, socketPath);
+	conn.buf = malloc(NBD_MAX_REQUEST);
+	if (writable) {
+		conn.zeroes = calloc(1, NBD_ZERO_CHUNK);
+	}
+	if (!conn.buf || (writable && !conn.zeroes)) {
+		goto failBuf;
+	}
+	listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenFd == -1) {
+		goto failBuf;
+	}
+	unlink(socketPath);
+	if (bind(listenFd, (struct sockaddr *)&addr, sizeof addr) != 0 ||
+	    listen(listenFd, 1) != 0) {
+		goto failSocket;
+	}
+	/* No SA_RESTART, so that accept() returns on signals. */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	printf("Serving on %s\n", socketPath);
+	fflush(stdout);
+
+	while (!stopServer) {
+		conn.fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+		if (conn.fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			ret = -1;
+			goto failBound;
+		}
+		conn.structured = false;
+		conn.allocation = false;
+		ret = negotiate(&conn);
+		transmitted = ret > 0;
+		if (transmitted) {
+			ret = transmit(&conn);
+		}
+		close(conn.fd);
+		if (ret < 0 && !stopServer) {
+			fprintf(stderr, "NBD client dropped\n");
+		}
+		if (writable && transmitted) {
+			/* The disk is complete after NBD_CMD_DISC only. */
+			if (ret < 0) {
+				errno = ECONNRESET;
+			}
+			goto failBound;
+		}
+	}
+	ret = 0;
+	if (writable) {
+		/* Interrupted before a client finished the disk. */
+		errno = EINTR;
+		ret = -1;
+	}
+
+failBound:
+	unlink(socketPath);
+failSocket:
+	close(listenFd);
+failBuf:
+	free(conn.zeroes);
+	free(conn.buf);
+	return ret;
+}
@@ -0,0 +1,104 @@
+/* ********************************************************************************
+ * Copyright (c) 2014-2023 VMware, Inc.  All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”); you may not
+ * use this file except in compliance with the License.  You may obtain a copy of
+ * the License at:
+ *
+ *            http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed
+ * under the License is distributed on an “AS IS” BASIS, without warranties or
+ * conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ * *********************************************************************************/
+
+/*
+ * Public API of libopenvmdk.
+ *
+ * All state lives in an OpenVmdkContext and the disks opened through it.
+ * Handles are opaque, functions return NULL or -1 on failure and set errno.
+ * A disk handle must not be used by more than one thread at a time, but
+ * different handles can be used concurrently.
+ */
+
+#ifndef _OPENVMDK_H_
+#define _OPENVMDK_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OPENVMDK_API_VERSION	1
+
+typedef struct OpenVmdkContext OpenVmdkContext;
+typedef struct OpenVmdkDisk OpenVmdkDisk;
+
+typedef enum {
+	OPENVMDK_FORMAT_STREAM_OPTIMIZED = 0,
+	OPENVMDK_FORMAT_RAW = 1,
+	OPENVMDK_FORMAT_MONOLITHIC_SPARSE = 2,	/* uncompressed hosted sparse */
+} OpenVmdkFormat;
+
+#define OPENVMDK_DIGEST_SHA1	(1 << 0)
+#define OPENVMDK_DIGEST_SHA256	(1 << 1)
+#define OPENVMDK_DIGEST_SHA512	(1 << 2)
+
+typedef struct {
+	uint64_t capacity;	/* virtual size in bytes */
+	uint64_t used;		/* bytes in allocated regions */
+} OpenVmdkInfo;
+
+int openvmdk_api_version(void);
+
+OpenVmdkContext *openvmdk_context_new(void);
+void openvmdk_context_free(OpenVmdkContext *ctx);
+/* ddb.toolsVersion for disks created afterwards, NULL for unknown */
+int openvmdk_context_set_tools_version(OpenVmdkContext *ctx, const char *toolsVersion);
+/*
+ * derive disk IDs from the contents, or from seed if hasSeed is set; with
+ * digests or monolithicSparse output the IDs are written before the
+ * contents, so creating those fails with EINVAL unless seeded
+ */
+int openvmdk_context_set_reproducible(OpenVmdkContext *ctx, int enable, int hasSeed, uint64_t seed);
+/* OPENVMDK_DIGEST_* of created disks, written to <file>.digest */
+int openvmdk_context_set_digests(OpenVmdkContext *ctx, unsigned int digests);
+/* threads compressing grains of a created disk, 1 (the default) compresses in the caller */
+int openvmdk_context_set_threads(OpenVmdkContext *ctx, unsigned int threads);
+/* grains of a created disk that can be written out of order before one is flushed */
+int openvmdk_context_set_open_grains(OpenVmdkContext *ctx, unsigned int grains);
+/* write capacity, used, size and digests of created disks to <file>.json */
+int openvmdk_context_set_metadata(OpenVmdkContext *ctx, int enable);
+
+/*
+ * open a raw image or a sparse VMDK, including its parent disks; the
+ * context settings are all for created disks, reading does not use any,
+ * so ctx may be NULL
+ */
+OpenVmdkDisk *openvmdk_open(OpenVmdkContext *ctx, const char *fileName);
+/*
+ * create a disk with the settings of ctx, or the defaults if ctx is NULL;
+ * fails with EINVAL for capacities beyond INT64_MAX
+ */
+OpenVmdkDisk *openvmdk_create(OpenVmdkContext *ctx, const char *fileName,
+                              uint64_t capacity, OpenVmdkFormat format);
+ssize_t openvmdk_pread(OpenVmdkDisk *disk, void *buf, size_t len, uint64_t pos);
+ssize_t openvmdk_pwrite(OpenVmdkDisk *disk, const void *buf, size_t len, uint64_t pos);
+/*
+ * Find the next allocated region at or after *end.  Start with *end = 0.
+ * Returns -1 with errno ENXIO after the last region.
+ */
+int openvmdk_next_data(OpenVmdkDisk *disk, uint64_t *pos, uint64_t *end);
+int openvmdk_info(OpenVmdkDisk *disk, OpenVmdkInfo *info);
+/* close finishes a created disk, abort discards the rest of the work */
+int openvmdk_close(OpenVmdkDisk *disk);
+int openvmdk_abort(OpenVmdkDisk *disk);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _OPENVMDK_H_ */
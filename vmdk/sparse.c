@@ -18,18 +18,73 @@
 #include "vmware_vmdk.h"
 #include "diskinfo.h"
 
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <openssl/evp.h>
 #include <zlib.h>
 
 #define CEILING(x, y) (((x) + (y) - 1) / (y))
 
 #define VMDK_SECTOR_SIZE	512ULL
 
+/* toolsVersion in metadata - default is 2^31-1 (unknown) */
+#define DEFAULT_TOOLS_VERSION	"2147483647"
+
+/* Layout of the streamOptimized disks written here */
+#define STREAM_GRAIN_SIZE	128	/* sectors */
+#define STREAM_GTES_PER_GT	512
+#define STREAM_DESCRIPTOR_SIZE	20	/* sectors */
+
+/*
+ * Per-grain hash sidecar.  It is written next to a streamOptimized output
+ * and lets a later conversion (--base) copy the compressed payload of every
+ * grain whose contents did not change instead of deflating it again.
+ */
+#define GRAIN_HASH_SUFFIX	".grains"
+#define GRAIN_HASH_MAGIC	"VMDKGRHS"
+#define GRAIN_HASH_SIZE		32	/* SHA-256 */
+
+/* Digests of the output file, written as manifest lines to <vmdk>.digest */
+#define DIGEST_SUFFIX		".digest"
+
+/*
+ * Everything packaging tools need to know about the output, so they do not
+ * have to open it again: capacity, populated size, file size and digests.
+ */
+#define METADATA_SUFFIX		".json"
+
+static const struct {
+	unsigned int flag;
+	const char *name;
+	const char *key;	/* in <vmdk>.json */
+	const EVP_MD *(*md)(void);
+} digestTypes[] = {
+	{ DIGEST_SHA1, "SHA1", "sha1", EVP_sha1 },
+	{ DIGEST_SHA256, "SHA256", "sha256", EVP_sha256 },
+	{ DIGEST_SHA512, "SHA512", "sha512", EVP_sha512 },
+};
+
+#define NUM_DIGEST_TYPES	(sizeof digestTypes / sizeof digestTypes[0])
+
+#pragma pack(push, 1)
+typedef struct {
+	char	magic[8];
+	__le64	grainSize;
+	__le64	numGrains;
+	__le64	vmdkSize; /* size of the VMDK the hashes belong to */
+	uint8_t	pad[480];
+} GrainHashFileHeader;
+#pragma pack(pop)
+
 static uint16_t
 getUnalignedLE16(const __le16 *src)
 {
@@ -144,8 +199,11 @@ setSparseExtentHeader(SparseExtentHeaderOnDisk *dst,
 
 static char *
 makeDiskDescriptorFile(const char *fileName,
+                       const char *createType,
                        uint64_t capacity,
-                       uint32_t cid)
+                       uint32_t cid,
+                       const uint32_t *contentID,
+                       const char *toolsVersion)
 {
 	static const char ddfTemplate[] =
 "# Disk DescriptorFile\n"
@@ -153,7 +211,7 @@ makeDiskDescriptorFile(const char *fileName,
 "encoding=\"UTF-8\"\n"
 "CID=%08x\n"
 "parentCID=ffffffff\n"
-"createType=\"streamOptimized\"\n"
+"createType=\"%s\"\n"
 "\n"
 "# Extent description\n"
 "RW %llu SPARSE \"%s\"\n"
@@ -178,7 +236,7 @@ makeDiskDescriptorFile(const char *fileName,
 	} else {
 		cylinders = CEILING(capacity, 255 * 63);
 	}
-	if (asprintf(&ret, ddfTemplate, cid, (long long int)capacity, fileName, (uint32_t)mrand48(), (uint32_t)mrand48(), (uint32_t)mrand48(), cid, cylinders, toolsVersion) == -1) {
+	if (asprintf(&ret, ddfTemplate, cid, createType, (long long int)capacity, fileName, contentID[0], contentID[1], contentID[2], cid, cylinders, toolsVersion) == -1) {
 		return NULL;
 	}
 	return ret;
@@ -201,6 +259,56 @@ typedef struct {
 	__le32 *gt;
 } SparseGTInfo;
 
+/*
+ * A complete grain waiting to be compressed.  Grains are compressed in
+ * batches by several threads, and written out in order afterwards.
+ */
+typedef struct {
+	uint64_t grainNr;
+	uint8_t *data;		/* grain contents */
+	uint32_t len;
+	uint8_t *out;		/* compressed grain with its header, zlibBufferSize bytes */
+	size_t outLen;
+	uint8_t hash[GRAIN_HASH_SIZE];
+	bool reuse;		/* same as in the base disk, copy it from there */
+	bool failed;
+} PendingGrain;
+
+/* Grains per batch for each compression thread */
+#define GRAINS_PER_THREAD	4
+
+/*
+ * A grain being assembled from writes.  Several can be open at once, so
+ * writers do not have to go strictly in order.  Complete grains are queued
+ * right away, partial ones when the least recently used slot is needed or
+ * at close.
+ */
+typedef struct {
+	uint64_t grainNr;	/* ~0ULL for a free slot */
+	uint8_t *data;
+	uint32_t validStart;
+	uint32_t validEnd;
+	uint64_t lastUse;
+	bool loaded;		/* read back from the output, valid as a whole */
+} OpenGrain;
+
+#define DEFAULT_OPEN_GRAINS	16
+
+/*
+ * The output is written in large aligned chunks, with O_DIRECT if possible.
+ * With io_uring several of them are in flight while compression goes on.
+ */
+#define OUTPUT_BUFFER_SIZE	(8 * 1024 * 1024)
+#define OUTPUT_ALIGNMENT	4096
+
+typedef struct {
+	uint8_t *data;
+	off_t pos;
+	size_t len;
+	int fd;			/* the write went there */
+	bool busy;
+} OutputChunk;
+
 typedef struct {
 	SparseGTInfo gtInfo;
 	off_t gdOffset;
@@ -213,10 +321,62 @@ typedef struct {
 	z_stream zstream;
 	int fd;
 	char *fileName;
-	uint8_t *grainBuffer;
-	uint64_t grainBufferNr;
-	uint32_t grainBufferValidStart;
-	uint32_t grainBufferValidEnd;
+	OpenGrain *open;
+	unsigned int maxOpen;
+	uint8_t *openBuffers;
+	OpenGrain *lastOpen;	/* checked first, writers mostly stay in one grain */
+	uint64_t openClock;
+	z_stream inflateStream;	/* reads back grains that are written again */
+	bool inflateReady;
+	uint8_t *readBuffer;	/* last grain read back by pread */
+	uint64_t readGrainNr;
+	uint8_t *outBuffer;	/* grains not written out yet */
+	size_t outLen;
+	off_t outStart;		/* where outBuffer goes in the file */
+	int directFd;		/* fd opened with O_DIRECT, or fd itself */
+	IoRing *ring;		/* NULL for synchronous writes */
+	OutputChunk *outChunks;	/* outBuffer is one of them */
+	unsigned int numOutChunks;
+	unsigned int curOutChunk;
+	uint8_t *outBuffers;
+	off_t writtenBack;	/* output before this is on disk, through the page cache */
+	Durability durability;
+	int checkpointFd;	/* <vmdk>.resume, -1 without checkpoints */
+	uint64_t checkpointGrain;	/* grains before this are in the checkpoint */
+	off_t resumePos;	/* where a resumed conversion continues */
+	SourceId source;	/* what the checkpoint was taken of */
+	EVP_MD_CTX *hashCtx;
+	uint8_t *grainHashes;
+	DiskInfo *base;
+	void *baseHashMap;
+	size_t baseHashMapLen;
+	uint64_t baseGrains;
+	uint64_t reusedGrains;
+	char *toolsVersion;
+	unsigned short randomState[3];
+	EVP_MD_CTX *contentCtx;
+	bool gdAtEnd;
+	EVP_MD_CTX *digestCtx[NUM_DIGEST_TYPES];
+	uint8_t digest[NUM_DIGEST_TYPES][EVP_MAX_MD_SIZE];
+	unsigned int digestLen[NUM_DIGEST_TYPES];
+	bool metadata;
+	PendingGrain *pending;
+	unsigned int numPending;
+	unsigned int maxPending;
+	uint8_t *pendingBuffers;
+	pthread_t *threads;	/* compression threads besides the caller */
+	unsigned int numThreads;
+	pthread_mutex_t lock;
+	pthread_cond_t batchReady;
+	pthread_cond_t batchDone;
+	unsigned int batchSize;	/* grains of the current batch */
+	unsigned int batchNext;	/* next grain to compress */
+	unsigned int batchFinished;
+	unsigned int busyThreads;	/* compression threads at work */
+	bool stopThreads;
+	uint32_t *stale;	/* sectors of grain copies that were superseded */
+	size_t numStale;
+	size_t maxStale;
 } SparseVmdkWriter;
 
 typedef struct {
@@ -225,6 +385,12 @@ typedef struct {
 	SparseExtentHeader diskHdr;
 } StreamOptimizedDiskInfo;
 
+static bool openBase(SparseVmdkWriter *writer, const char *baseFileName,
+                     const char *fileName, const SparseExtentHeader *hdr);
+static void closeBase(SparseVmdkWriter *writer);
+static size_t readBaseGrain(SparseVmdkWriter *writer, uint64_t grainNr,
+                            void *buf, size_t bufSize);
+
 static StreamOptimizedDiskInfo *
 getSODI(DiskInfo *self)
 {
@@ -305,6 +471,25 @@ safeWrite(int fd,
 	return true;
 }
 
+static bool
+safePwrite(int fd,
+           const void *buf,
+           size_t len,
+           off_t pos)
+{
+	ssize_t written = pwrite(fd, buf, len, pos);
+
+	if (written == -1) {
+		fprintf(stderr, "Write failed: %s\n", strerror(errno));
+		return false;
+	}
+	if ((size_t)written != len) {
+		fprintf(stderr, "Short write.  Disk full?\n");
+		return false;
+	}
+	return true;
+}
+
 static bool
 safePread(int fd,
           void *buf,
@@ -319,294 +504,1794 @@ safePread(int fd,
 	}
 	if ((size_t)rd != len) {
 		fprintf(stderr, "Short read, %zu instead of %zu\n", rd, len);
+		/* The file ends early, e.g. a truncated copy. */
+		errno = EIO;
 		return false;
 	}
 	return true;
 }
 
-static bool
-isZeroed(const void *data,
-         size_t len)
+/*
+ * Output written through the page cache: start its writeback right away,
+ * and wait for what was written before, so dirty pages do not pile up
+ * until close.  The pages are not needed anymore, drop them.
+ */
+static void
+writeBehind(SparseVmdkWriter *writer,
+            off_t pos,
+            size_t len)
 {
-	const uint64_t *data64 = data;
-	len = len >> 3;
+	sync_file_range(writer->fd, pos, len, SYNC_FILE_RANGE_WRITE);
+	if (pos > writer->writtenBack) {
+		sync_file_range(writer->fd, writer->writtenBack, pos - writer->writtenBack,
+		                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(writer->fd, writer->writtenBack, pos - writer->writtenBack, POSIX_FADV_DONTNEED);
+		writer->writtenBack = pos;
+	}
+}
 
-	while (len--) {
-		if (*data64++ != 0) {
-			return false;
-		}
+/*
+ * Sync the output as the durability mode asks.  final is the sync after
+ * the header that makes the disk valid, the other one comes before it.
+ */
+static bool
+syncOutput(int fd,
+           Durability durability,
+           bool final)
+{
+	if (durability == DURABILITY_NONE ||
+	    (durability == DURABILITY_ONCE && !final)) {
+		return true;
 	}
-	return true;
+	return fsync(fd) == 0;
 }
 
-static int
-fillGrain(StreamOptimizedDiskInfo *sodi)
+/* Wait for one output chunk to be written, any of them. */
+static bool
+reapOutput(SparseVmdkWriter *writer)
 {
-	size_t lenBytes;
+	OutputChunk *chunk;
+	uint64_t tag;
+	ssize_t res;
 
-	if (sodi->writer.grainBufferNr < sodi->writer.gtInfo.lastGrainNr) {
-		lenBytes = sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
-	} else if (sodi->writer.grainBufferNr == sodi->writer.gtInfo.lastGrainNr) {
-		lenBytes = sodi->writer.gtInfo.lastGrainSize;
-	} else {
-		lenBytes = 0;
+	if (IoRing_Wait(writer->ring, &tag, &res) != 0 || tag >= writer->numOutChunks) {
+		fprintf(stderr, "Write failed: %s\n", strerror(errno));
+		return false;
 	}
-	if (sodi->writer.grainBufferValidStart == 0 &&
-	    sodi->writer.grainBufferValidEnd >= lenBytes) {
-		return 0;
+	chunk = &writer->outChunks[tag];
+	chunk->busy = false;
+	if (res == -EINVAL && chunk->fd != writer->fd) {
+		/* Some filesystems accept O_DIRECT opens, but not the writes. */
+		if (writer->directFd != writer->fd) {
+			close(writer->directFd);
+			writer->directFd = writer->fd;
+		}
+		if (!safePwrite(writer->fd, chunk->data, chunk->len, chunk->pos)) {
+			return false;
+		}
+		writeBehind(writer, chunk->pos, chunk->len);
+		return true;
 	}
-	if (sodi->writer.gtInfo.gt[sodi->writer.grainBufferNr] != __cpu_to_le32(0)) {
-		fprintf(stderr, "Unimplemented read-modify-write.\n");
-		return -1;
+	if (res < 0) {
+		fprintf(stderr, "Write failed: %s\n", strerror(-res));
+		return false;
 	}
-	if (sodi->writer.grainBufferValidStart != 0) {
-		memset(sodi->writer.grainBuffer, 0, sodi->writer.grainBufferValidStart);
-		sodi->writer.grainBufferValidStart = 0;
+	if ((size_t)res != chunk->len) {
+		fprintf(stderr, "Short write.  Disk full?\n");
+		return false;
 	}
-	if (sodi->writer.grainBufferValidEnd < lenBytes) {
-		memset(sodi->writer.grainBuffer + sodi->writer.grainBufferValidEnd, 0, lenBytes - sodi->writer.grainBufferValidEnd);
-		sodi->writer.grainBufferValidEnd = lenBytes;
+	if (chunk->fd == writer->fd) {
+		writeBehind(writer, chunk->pos, chunk->len);
 	}
-	return 0;
+	return true;
 }
 
-static int
-flushGrain(StreamOptimizedDiskInfo *sodi)
+/* Wait until all output chunks are written. */
+static bool
+drainOutput(SparseVmdkWriter *writer)
 {
-	int ret;
-	uint32_t oldLoc;
-
-	if (sodi->writer.grainBufferNr == ~0ULL) {
-		return 0;
-	}
-	if (sodi->writer.grainBufferValidEnd == 0) {
-		return 0;
-	}
-	ret = fillGrain(sodi);
-	if (ret) {
-		return ret;
-	}
+	bool ret = true;
 
-	oldLoc = __le32_to_cpu(sodi->writer.gtInfo.gt[sodi->writer.grainBufferNr]);
-	if (oldLoc != 0) {
-		fprintf(stderr, "Cannot update already written grain\n");
-		return -1;
+	while (writer->ring && IoRing_InFlight(writer->ring) > 0) {
+		if (!reapOutput(writer)) {
+			ret = false;
+		}
 	}
+	return ret;
+}
 
-	if (!isZeroed(sodi->writer.grainBuffer, sodi->writer.grainBufferValidEnd)) {
-		size_t dataLen;
-		uint32_t rem;
-		SparseGrainLBAHeaderOnDisk *grainHdr = sodi->writer.zlibBuffer.grainHdr;
+/*
+ * Start writing the full output buffer, and continue in the next one once
+ * its previous write is done.
+ */
+static bool
+submitOutput(SparseVmdkWriter *writer)
+{
+	OutputChunk *chunk = &writer->outChunks[writer->curOutChunk];
 
-		sodi->writer.gtInfo.gt[sodi->writer.grainBufferNr] = __cpu_to_le32(sodi->writer.curSP);
-		if (deflateReset(&sodi->writer.zstream) != Z_OK) {
-			fprintf(stderr, "DeflateReset failed\n");
-			return -1;
-		}
-		sodi->writer.zstream.next_in = sodi->writer.grainBuffer;
-		sodi->writer.zstream.avail_in = sodi->writer.grainBufferValidEnd;
-		sodi->writer.zstream.next_out = sodi->writer.zlibBuffer.data + sizeof *grainHdr;
-		sodi->writer.zstream.avail_out = sodi->writer.zlibBufferSize - sizeof *grainHdr;
-		if (deflate(&sodi->writer.zstream, Z_FINISH) != Z_STREAM_END) {
-			fprintf(stderr, "Deflate failed\n");
-			return -1;
+	chunk->pos = writer->outStart;
+	chunk->len = writer->outLen;
+	chunk->fd = writer->directFd;
+	if (IoRing_Submit(writer->ring, chunk->fd, true, chunk->data, chunk->len, chunk->pos, writer->curOutChunk) != 0) {
+		fprintf(stderr, "Write failed: %s\n", strerror(errno));
+		return false;
+	}
+	chunk->busy = true;
+	writer->outStart += writer->outLen;
+	writer->outLen = 0;
+	writer->curOutChunk = (writer->curOutChunk + 1) % writer->numOutChunks;
+	chunk = &writer->outChunks[writer->curOutChunk];
+	while (chunk->busy) {
+		if (!reapOutput(writer)) {
+			return false;
 		}
-		dataLen = sodi->writer.zstream.next_out - sodi->writer.zlibBuffer.data;
-		grainHdr->lba = sodi->writer.grainBufferNr * sodi->diskHdr.grainSize;
-		grainHdr->cmpSize = __cpu_to_le32(dataLen - sizeof *grainHdr);
-		rem = dataLen & (VMDK_SECTOR_SIZE - 1);
-		if (rem != 0) {
-			rem = VMDK_SECTOR_SIZE - rem;
-			memset(sodi->writer.zstream.next_out, 0, rem);
-			dataLen += rem;
+	}
+	writer->outBuffer = chunk->data;
+	return true;
+}
+
+/*
+ * Write the first len bytes of the output buffer where it belongs, with
+ * O_DIRECT unless the filesystem turns that down.
+ */
+static bool
+writeOutputBuffer(SparseVmdkWriter *writer,
+                  size_t len)
+{
+	if (writer->directFd != writer->fd) {
+		ssize_t written = pwrite(writer->directFd, writer->outBuffer, len, writer->outStart);
+
+		if (written == -1 && errno == EINVAL) {
+			/* Some filesystems accept O_DIRECT opens, but not the writes. */
+			close(writer->directFd);
+			writer->directFd = writer->fd;
+		} else if (written == -1) {
+			fprintf(stderr, "Write failed: %s\n", strerror(errno));
+			return false;
+		} else if ((size_t)written != len) {
+			fprintf(stderr, "Short write.  Disk full?\n");
+			return false;
 		}
-		if (!safeWrite(sodi->writer.fd, grainHdr, dataLen)) {
-			return -1;
+	}
+	if (writer->directFd == writer->fd) {
+		if (!safePwrite(writer->fd, writer->outBuffer, len, writer->outStart)) {
+			return false;
 		}
-		sodi->writer.curSP += dataLen / VMDK_SECTOR_SIZE;
+		writeBehind(writer, writer->outStart, len);
 	}
-	return 0;
+	return true;
 }
 
-static int
-prepareGrain(StreamOptimizedDiskInfo *sodi,
-             uint64_t grainNr)
+/*
+ * Write out the output buffer.  Unless it is the final one it is full, so
+ * both its size and its position are aligned as O_DIRECT wants them.  The
+ * final one is padded to the alignment, and the padding cut off again.
+ */
+static bool
+flushOutput(SparseVmdkWriter *writer,
+            bool final)
 {
-	if (grainNr != sodi->writer.grainBufferNr) {
-		int ret;
+	size_t len = writer->outLen;
 
-		ret = flushGrain(sodi);
-		if (ret < 0) {
-			return ret;
+	Throttle_Write(len);
+	if (writer->ring) {
+		if (!final) {
+			return submitOutput(writer);
+		}
+		if (!drainOutput(writer)) {
+			return false;
 		}
-		sodi->writer.grainBufferNr = grainNr;
-		sodi->writer.grainBufferValidStart = 0;
-		sodi->writer.grainBufferValidEnd = 0;
 	}
-	return 0;
+	if (final) {
+		len = (len + OUTPUT_ALIGNMENT - 1) & ~(size_t)(OUTPUT_ALIGNMENT - 1);
+		memset(writer->outBuffer + writer->outLen, 0, len - writer->outLen);
+	}
+	if (!writeOutputBuffer(writer, len)) {
+		return false;
+	}
+	if (final && len != writer->outLen &&
+	    ftruncate(writer->fd, writer->outStart + writer->outLen) != 0) {
+		fprintf(stderr, "Truncate failed: %s\n", strerror(errno));
+		return false;
+	}
+	writer->outStart += writer->outLen;
+	writer->outLen = 0;
+	return true;
 }
 
-static ssize_t
-StreamOptimizedPwrite(DiskInfo *self,
-                      const void *buf,
-                      size_t length,
-                      off_t pos)
+/* Append to the output buffer, writing it out whenever it is full. */
+static bool
+bufferWrite(SparseVmdkWriter *writer,
+            const void *buf,
+            size_t len)
 {
 	const uint8_t *buf8 = buf;
-	StreamOptimizedDiskInfo *sodi = getSODI(self);
-	SparseVmdkWriter *writer = &sodi->writer;
-	SparseExtentHeader *hdr = &sodi->diskHdr;
-	uint64_t grainNr = pos / (hdr->grainSize * VMDK_SECTOR_SIZE);
-	uint32_t updateStart = pos & (hdr->grainSize * VMDK_SECTOR_SIZE - 1);
 
-	while (length > 0) {
-		uint32_t updateLen;
-		uint32_t updateEnd;
+	while (len > 0) {
+		size_t n = OUTPUT_BUFFER_SIZE - writer->outLen;
 
-		if (prepareGrain(sodi, grainNr)) {
-			return -1;
+		if (n > len) {
+			n = len;
 		}
-		updateLen = hdr->grainSize * VMDK_SECTOR_SIZE - updateStart;
-		if (length < updateLen) {
-			updateLen = length;
-			length = 0;
-		} else {
-			length -= updateLen;
+		memcpy(writer->outBuffer + writer->outLen, buf8, n);
+		writer->outLen += n;
+		buf8 += n;
+		len -= n;
+		if (writer->outLen == OUTPUT_BUFFER_SIZE && !flushOutput(writer, false)) {
+			return false;
 		}
-		updateEnd = updateStart + updateLen;
-		if (writer->grainBufferValidEnd == 0) {
-			;
-		} else if (updateEnd < writer->grainBufferValidStart ||
-		           updateStart > writer->grainBufferValidEnd) {
-			if (fillGrain(sodi)) {
-				return -1;
-			}
+	}
+	return true;
+}
+
+/* Read back output, part of which may still be in the output buffer. */
+static bool
+outputPread(SparseVmdkWriter *writer,
+            void *buf,
+            size_t len,
+            off_t pos)
+{
+	uint8_t *buf8 = buf;
+
+	if (pos < writer->outStart) {
+		size_t n = writer->outStart - pos;
+
+		if (!drainOutput(writer)) {
+			return false;
 		}
-		memcpy(writer->grainBuffer + updateStart, buf8, updateLen);
-		if (updateStart < writer->grainBufferValidStart || writer->grainBufferValidEnd == 0) {
-			writer->grainBufferValidStart = updateStart;
+		if (n > len) {
+			n = len;
 		}
-		if (updateEnd > writer->grainBufferValidEnd) {
-			writer->grainBufferValidEnd = updateEnd;
+		if (!safePread(writer->fd, buf8, n, pos)) {
+			return false;
 		}
-		buf8 += updateLen;
-		grainNr++;
-		updateStart = 0;
+		buf8 += n;
+		pos += n;
+		len -= n;
 	}
-	return buf8 - (const uint8_t *)buf;
+	if (len == 0) {
+		return true;
+	}
+	if ((size_t)(pos - writer->outStart) + len > writer->outLen) {
+		fprintf(stderr, "Read beyond the output\n");
+		return false;
+	}
+	memcpy(buf8, writer->outBuffer + (pos - writer->outStart), len);
+	return true;
 }
 
+/*
+ * Append to the output.  When the output is hashed while it is written,
+ * everything except the header goes through here, in file order.
+ */
 static bool
-writeSpecial(SparseVmdkWriter *writer,
-             uint32_t marker,
-             SectorType length)
+writerWrite(SparseVmdkWriter *writer,
+            const void *buf,
+            size_t len)
 {
-	SparseSpecialLBAHeaderOnDisk *specialHdr = writer->zlibBuffer.specialHdr;
+	size_t i;
 
-	memset(writer->zlibBuffer.data, 0, VMDK_SECTOR_SIZE);
-	specialHdr->lba = __cpu_to_le64(length);
-	specialHdr->type = __cpu_to_le32(marker);
-	return safeWrite(writer->fd, specialHdr, VMDK_SECTOR_SIZE);
+	for (i = 0; i < NUM_DIGEST_TYPES; i++) {
+		if (writer->digestCtx[i] &&
+		    EVP_DigestUpdate(writer->digestCtx[i], buf, len) != 1) {
+			fprintf(stderr, "Output hashing failed\n");
+			return false;
+		}
+	}
+	return bufferWrite(writer, buf, len);
 }
 
 static bool
-writeEOS(SparseVmdkWriter *writer)
+isZeroed(const void *data,
+         size_t len)
 {
-	return writeSpecial(writer, GRAIN_MARKER_EOS, 0);
+	const uint64_t *data64 = data;
+	len = len >> 3;
+
+	while (len--) {
+		if (*data64++ != 0) {
+			return false;
+		}
+	}
+	return true;
 }
 
-static int
-StreamOptimizedFinalize(StreamOptimizedDiskInfo *sodi)
+static bool
+hashGrain(EVP_MD_CTX *hashCtx,
+          const uint8_t *data,
+          size_t len,
+          uint8_t *hash)
 {
-	int ret;
-
-	ret = close(sodi->writer.fd);
-	deflateEnd(&sodi->writer.zstream);
-	free(sodi->writer.gtInfo.gd);
-	free(sodi->writer.grainBuffer);
-	free(sodi->writer.zlibBuffer.data);
-	free(sodi->writer.fileName);
-	free(sodi);
-	return ret;
+	if (EVP_DigestInit_ex(hashCtx, EVP_sha256(), NULL) != 1 ||
+	    EVP_DigestUpdate(hashCtx, data, len) != 1 ||
+	    EVP_DigestFinal_ex(hashCtx, hash, NULL) != 1) {
+		fprintf(stderr, "Grain hashing failed\n");
+		return false;
+	}
+	return true;
 }
 
-static int
-StreamOptimizedAbort(DiskInfo *self)
+static uint32_t
+grainLength(const StreamOptimizedDiskInfo *sodi,
+            uint64_t grainNr)
 {
-	StreamOptimizedDiskInfo *sodi = getSODI(self);
-
-	return StreamOptimizedFinalize(sodi);
+	if (grainNr < sodi->writer.gtInfo.lastGrainNr) {
+		return sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+	} else if (grainNr == sodi->writer.gtInfo.lastGrainNr) {
+		return sodi->writer.gtInfo.lastGrainSize;
+	}
+	return 0;
 }
 
-static int
-StreamOptimizedClose(DiskInfo *self)
+/* Zero whatever was not written of a new grain. */
+static void
+fillGrain(StreamOptimizedDiskInfo *sodi,
+          OpenGrain *og)
 {
-	StreamOptimizedDiskInfo *sodi = getSODI(self);
-	uint32_t cid;
-	char *descFile;
-	SparseExtentHeaderOnDisk onDisk;
+	uint32_t lenBytes = grainLength(sodi, og->grainNr);
 
-	if (flushGrain(sodi)) {
-		goto failAll;
-	}
-	writeEOS(&sodi->writer);
-	if (lseek(sodi->writer.fd, sodi->writer.gdOffset * VMDK_SECTOR_SIZE, SEEK_SET) == -1) {
-		goto failAll;
-	}
-	if (!safeWrite(sodi->writer.fd, sodi->writer.gtInfo.gd, (sodi->writer.gtInfo.GDsectors + sodi->writer.gtInfo.GTsectors * sodi->writer.gtInfo.GTs) * VMDK_SECTOR_SIZE)) {
-		goto failAll;
+	if (og->validStart != 0) {
+		memset(og->data, 0, og->validStart);
+		og->validStart = 0;
 	}
-	do {
-		cid = mrand48();
-		/*
-		 * Do not accept 0xFFFFFFFF and 0xFFFFFFFE.  They may be interpreted by
-		 * some software as no parent, or disk full of zeroes.
-		 */
-	} while (cid == 0xFFFFFFFFU || cid == 0xFFFFFFFEU);
-	descFile = makeDiskDescriptorFile(sodi->writer.fileName, sodi->diskHdr.capacity, cid);
-	if (pwrite(sodi->writer.fd, descFile, strlen(descFile), sodi->diskHdr.descriptorOffset * VMDK_SECTOR_SIZE) != (ssize_t)strlen(descFile)) {
-		free(descFile);
-		goto failAll;
+	if (og->validEnd < lenBytes) {
+		memset(og->data + og->validEnd, 0, lenBytes - og->validEnd);
+		og->validEnd = lenBytes;
 	}
-	free(descFile);
+}
 
-	/*
-	 * Write everything out as it should be, except that file signature is
-	 * vmdk, rather than VMDK.  Then flush everything to the media, and finally
-	 * rewrite header with proper VMDK signature.
-	 */
-	setSparseExtentHeader(&onDisk, &sodi->diskHdr, true);
-	if (pwrite(sodi->writer.fd, &onDisk, sizeof onDisk, 0) != sizeof onDisk) {
-		goto failAll;
-	}
-	if (fsync(sodi->writer.fd) != 0) {
-		goto failAll;
+static bool
+deflateGrain(StreamOptimizedDiskInfo *sodi,
+             PendingGrain *grain,
+             z_stream *zstream)
+{
+	SparseGrainLBAHeaderOnDisk *grainHdr = (SparseGrainLBAHeaderOnDisk *)grain->out;
+	size_t dataLen;
+	uint32_t rem;
+
+	if (deflateReset(zstream) != Z_OK) {
+		fprintf(stderr, "DeflateReset failed\n");
+		return false;
 	}
-	setSparseExtentHeader(&onDisk, &sodi->diskHdr, false);
-	if (pwrite(sodi->writer.fd, &onDisk, sizeof onDisk, 0) != sizeof onDisk) {
-		goto failAll;
+	zstream->next_in = grain->data;
+	zstream->avail_in = grain->len;
+	zstream->next_out = grain->out + sizeof *grainHdr;
+	zstream->avail_out = sodi->writer.zlibBufferSize - sizeof *grainHdr;
+	if (deflate(zstream, Z_FINISH) != Z_STREAM_END) {
+		fprintf(stderr, "Deflate failed\n");
+		return false;
 	}
-	if (fsync(sodi->writer.fd) != 0) {
-		goto failAll;
+	dataLen = zstream->next_out - grain->out;
+	grainHdr->lba = __cpu_to_le64(grain->grainNr * sodi->diskHdr.grainSize);
+	grainHdr->cmpSize = __cpu_to_le32(dataLen - sizeof *grainHdr);
+	rem = dataLen & (VMDK_SECTOR_SIZE - 1);
+	if (rem != 0) {
+		rem = VMDK_SECTOR_SIZE - rem;
+		memset(zstream->next_out, 0, rem);
+		dataLen += rem;
 	}
-	return StreamOptimizedFinalize(sodi);
-
-failAll:
-	StreamOptimizedAbort(&sodi->hdr);
-	return -1;
+	grain->outLen = dataLen;
+	return true;
+}
+
+/*
+ * Hash and compress one grain.  This is the part that runs in parallel, so
+ * it must not touch any writer state besides the grain itself.
+ */
+static void
+compressGrain(StreamOptimizedDiskInfo *sodi,
+              PendingGrain *grain,
+              z_stream *zstream,
+              EVP_MD_CTX *hashCtx)
+{
+	SparseVmdkWriter *writer = &sodi->writer;
+
+	grain->reuse = false;
+	grain->failed = false;
+	if (writer->hashCtx) {
+		if (!hashGrain(hashCtx, grain->data, grain->len, grain->hash)) {
+			grain->failed = true;
+			return;
+		}
+		/* Unchanged since the base?  Then its compressed payload is copied later. */
+		if (grain->grainNr < writer->baseGrains &&
+		    memcmp(grain->hash, (uint8_t *)writer->baseHashMap + sizeof(GrainHashFileHeader) + grain->grainNr * GRAIN_HASH_SIZE, GRAIN_HASH_SIZE) == 0) {
+			grain->reuse = true;
+			return;
+		}
+	}
+	grain->failed = !deflateGrain(sodi, grain, zstream);
+}
+
+static void *
+compressThread(void *arg)
+{
+	StreamOptimizedDiskInfo *sodi = arg;
+	SparseVmdkWriter *writer = &sodi->writer;
+	z_stream zstream = { 0 };
+	EVP_MD_CTX *hashCtx = NULL;
+
+	if (deflateInit(&zstream, Z_BEST_COMPRESSION) != Z_OK) {
+		return NULL;
+	}
+	if (writer->hashCtx) {
+		hashCtx = EVP_MD_CTX_new();
+		if (!hashCtx) {
+			/* The caller compresses everything itself then. */
+			deflateEnd(&zstream);
+			return NULL;
+		}
+	}
+	pthread_mutex_lock(&writer->lock);
+	for (;;) {
+		unsigned int i;
+
+		/* The caller compresses as well, it counts against the limit. */
+		while (!writer->stopThreads &&
+		       (writer->batchNext >= writer->batchSize ||
+		        (Throttle_Threads() != 0 && writer->busyThreads + 1 >= Throttle_Threads()))) {
+			pthread_cond_wait(&writer->batchReady, &writer->lock);
+		}
+		if (writer->stopThreads) {
+			break;
+		}
+		i = writer->batchNext++;
+		writer->busyThreads++;
+		pthread_mutex_unlock(&writer->lock);
+		compressGrain(sodi, &writer->pending[i], &zstream, hashCtx);
+		pthread_mutex_lock(&writer->lock);
+		writer->busyThreads--;
+		if (++writer->batchFinished == writer->batchSize) {
+			pthread_cond_signal(&writer->batchDone);
+		}
+	}
+	pthread_mutex_unlock(&writer->lock);
+	EVP_MD_CTX_free(hashCtx);
+	deflateEnd(&zstream);
+	return NULL;
+}
+
+static void
+stopCompressThreads(SparseVmdkWriter *writer)
+{
+	unsigned int i;
+
+	if (!writer->threads) {
+		return;
+	}
+	pthread_mutex_lock(&writer->lock);
+	writer->stopThreads = true;
+	pthread_cond_broadcast(&writer->batchReady);
+	pthread_mutex_unlock(&writer->lock);
+	for (i = 0; i < writer->numThreads; i++) {
+		pthread_join(writer->threads[i], NULL);
+	}
+	free(writer->threads);
+	writer->threads = NULL;
+	pthread_cond_destroy(&writer->batchReady);
+	pthread_cond_destroy(&writer->batchDone);
+	pthread_mutex_destroy(&writer->lock);
+}
+
+static bool
+startCompressThreads(StreamOptimizedDiskInfo *sodi,
+                     unsigned int numThreads)
+{
+	SparseVmdkWriter *writer = &sodi->writer;
+
+	if (numThreads <= 1) {
+		return true;
+	}
+	writer->threads = calloc(numThreads - 1, sizeof *writer->threads);
+	if (!writer->threads) {
+		return false;
+	}
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->batchReady, NULL);
+	pthread_cond_init(&writer->batchDone, NULL);
+	for (writer->numThreads = 0; writer->numThreads < numThreads - 1; writer->numThreads++) {
+		if (pthread_create(&writer->threads[writer->numThreads], NULL, compressThread, sodi) != 0) {
+			break;
+		}
+		pthread_setname_np(writer->threads[writer->numThreads], "vmdk-deflate");
+	}
+	return true;
+}
+
+/*
+ * Remember where the written copy of grainNr is, if it has one, before the
+ * grain table stops pointing at it.  Readers going by the grain tables
+ * never see it again, but readers of the stream, which take grains in file
+ * order, would; the copies are hidden from them when the disk is closed.
+ */
+static bool
+addStale(SparseVmdkWriter *writer,
+         uint64_t grainNr)
+{
+	uint32_t sect = __le32_to_cpu(writer->gtInfo.gt[grainNr]);
+
+	/* 0 is not allocated, 1 still queued */
+	if (sect <= 1) {
+		return true;
+	}
+	if (writer->numStale == writer->maxStale) {
+		size_t newMax = writer->maxStale ? writer->maxStale * 2 : 64;
+		uint32_t *newStale = realloc(writer->stale, newMax * sizeof *writer->stale);
+
+		if (!newStale) {
+			return false;
+		}
+		writer->stale = newStale;
+		writer->maxStale = newMax;
+	}
+	writer->stale[writer->numStale++] = sect;
+	return true;
+}
+
+/*
+ * Compress all pending grains, using the compression threads if there are
+ * any, and append them to the output in grain order.
+ */
+static int
+writePendingGrains(StreamOptimizedDiskInfo *sodi)
+{
+	SparseVmdkWriter *writer = &sodi->writer;
+	unsigned int i;
+
+	if (writer->numPending == 0) {
+		return 0;
+	}
+	if (writer->threads) {
+		pthread_mutex_lock(&writer->lock);
+		writer->batchSize = writer->numPending;
+		writer->batchNext = 0;
+		writer->batchFinished = 0;
+		pthread_cond_broadcast(&writer->batchReady);
+		while (writer->batchNext < writer->batchSize) {
+			i = writer->batchNext++;
+			pthread_mutex_unlock(&writer->lock);
+			compressGrain(sodi, &writer->pending[i], &writer->zstream, writer->hashCtx);
+			pthread_mutex_lock(&writer->lock);
+			writer->batchFinished++;
+		}
+		while (writer->batchFinished < writer->batchSize) {
+			pthread_cond_wait(&writer->batchDone, &writer->lock);
+		}
+		writer->batchSize = 0;
+		writer->batchNext = 0;
+		pthread_mutex_unlock(&writer->lock);
+	} else {
+		for (i = 0; i < writer->numPending; i++) {
+			compressGrain(sodi, &writer->pending[i], &writer->zstream, writer->hashCtx);
+		}
+	}
+
+	for (i = 0; i < writer->numPending; i++) {
+		PendingGrain *grain = &writer->pending[i];
+
+		if (grain->failed || !addStale(writer, grain->grainNr)) {
+			return -1;
+		}
+		writer->gtInfo.gt[grain->grainNr] = __cpu_to_le32(writer->curSP);
+		if (writer->grainHashes) {
+			memcpy(writer->grainHashes + grain->grainNr * GRAIN_HASH_SIZE, grain->hash, GRAIN_HASH_SIZE);
+		}
+		if (writer->contentCtx) {
+			__le64 grainNr = __cpu_to_le64(grain->grainNr);
+
+			if (EVP_DigestUpdate(writer->contentCtx, &grainNr, sizeof grainNr) != 1 ||
+			    EVP_DigestUpdate(writer->contentCtx, grain->hash, GRAIN_HASH_SIZE) != 1) {
+				return -1;
+			}
+		}
+		if (grain->reuse) {
+			grain->outLen = readBaseGrain(writer, grain->grainNr, grain->out, writer->zlibBufferSize);
+			if (grain->outLen != 0) {
+				writer->reusedGrains++;
+			} else if (!deflateGrain(sodi, grain, &writer->zstream)) {
+				return -1;
+			}
+		}
+		if (!writerWrite(writer, grain->out, grain->outLen)) {
+			return -1;
+		}
+		writer->curSP += grain->outLen / VMDK_SECTOR_SIZE;
+	}
+	writer->numPending = 0;
+	return 0;
+}
+
+/* Read back and inflate a grain that was already written. */
+static int
+readWrittenGrain(StreamOptimizedDiskInfo *sodi,
+                 uint64_t grainNr,
+                 uint8_t *data)
+{
+	SparseVmdkWriter *writer = &sodi->writer;
+	SparseGrainLBAHeaderOnDisk *grainHdr = writer->zlibBuffer.grainHdr;
+	uint32_t sect;
+	size_t dataLen;
+
+	/* Still queued?  Then it has to be written before it can be read. */
+	if (__le32_to_cpu(writer->gtInfo.gt[grainNr]) == 1 &&
+	    writePendingGrains(sodi)) {
+		return -1;
+	}
+	sect = __le32_to_cpu(writer->gtInfo.gt[grainNr]);
+	if (!writer->inflateReady) {
+		if (inflateInit(&writer->inflateStream) != Z_OK) {
+			fprintf(stderr, "InflateInit failed\n");
+			return -1;
+		}
+		writer->inflateReady = true;
+	}
+	if (!outputPread(writer, grainHdr, VMDK_SECTOR_SIZE, (off_t)sect * VMDK_SECTOR_SIZE)) {
+		goto fail;
+	}
+	dataLen = sizeof *grainHdr + __le32_to_cpu(grainHdr->cmpSize);
+	if (__le64_to_cpu(grainHdr->lba) != grainNr * sodi->diskHdr.grainSize ||
+	    dataLen > writer->zlibBufferSize) {
+		goto fail;
+	}
+	if (dataLen > VMDK_SECTOR_SIZE &&
+	    !outputPread(writer, writer->zlibBuffer.data + VMDK_SECTOR_SIZE, dataLen - VMDK_SECTOR_SIZE, ((off_t)sect + 1) * VMDK_SECTOR_SIZE)) {
+		goto fail;
+	}
+	if (inflateReset(&writer->inflateStream) != Z_OK) {
+		goto fail;
+	}
+	writer->inflateStream.next_in = writer->zlibBuffer.data + sizeof *grainHdr;
+	writer->inflateStream.avail_in = dataLen - sizeof *grainHdr;
+	writer->inflateStream.next_out = data;
+	writer->inflateStream.avail_out = grainLength(sodi, grainNr);
+	if (inflate(&writer->inflateStream, Z_FINISH) != Z_STREAM_END ||
+	    writer->inflateStream.avail_out != 0) {
+		goto fail;
+	}
+	return 0;
+
+fail:
+	fprintf(stderr, "Cannot read back grain %llu\n", (unsigned long long)grainNr);
+	return -1;
+}
+
+/*
+ * Load a grain that was already written into its open slot, so a partial
+ * update can be merged into it.  Its new copy is appended when the grain is
+ * flushed, and the old one stays behind unreferenced.
+ */
+static int
+loadGrain(StreamOptimizedDiskInfo *sodi,
+          OpenGrain *og)
+{
+	if (readWrittenGrain(sodi, og->grainNr, og->data)) {
+		return -1;
+	}
+	og->validStart = 0;
+	og->validEnd = grainLength(sodi, og->grainNr);
+	og->loaded = true;
+	return 0;
+}
+
+/*
+ * Queue an open grain for compression and free its slot.  Its buffer is
+ * swapped with the free pending one, so nothing is copied.
+ */
+static int
+flushGrain(StreamOptimizedDiskInfo *sodi,
+           OpenGrain *og)
+{
+	SparseVmdkWriter *writer = &sodi->writer;
+	uint64_t grainNr = og->grainNr;
+
+	if (og->validEnd != 0) {
+		fillGrain(sodi, og);
+	}
+	og->grainNr = ~0ULL;
+	if (writer->lastOpen == og) {
+		writer->lastOpen = NULL;
+	}
+	if (og->validEnd == 0) {
+		return 0;
+	}
+	if (!isZeroed(og->data, og->validEnd)) {
+		PendingGrain *grain = &writer->pending[writer->numPending++];
+		uint8_t *data = grain->data;
+
+		grain->data = og->data;
+		og->data = data;
+		grain->grainNr = grainNr;
+		grain->len = og->validEnd;
+		if (!addStale(writer, grainNr)) {
+			return -1;
+		}
+		/* Queued; the real location is filled in when the grain is written. */
+		writer->gtInfo.gt[grainNr] = __cpu_to_le32(1);
+		if (writer->numPending == writer->maxPending) {
+			return writePendingGrains(sodi);
+		}
+	} else if (writer->gtInfo.gt[grainNr] != __cpu_to_le32(0)) {
+		/* Zeroed again, drop the earlier copy. */
+		if (!addStale(writer, grainNr)) {
+			return -1;
+		}
+		writer->gtInfo.gt[grainNr] = __cpu_to_le32(0);
+		if (writer->grainHashes) {
+			memset(writer->grainHashes + grainNr * GRAIN_HASH_SIZE, 0, GRAIN_HASH_SIZE);
+		}
+	}
+	return 0;
+}
+
+/* Flush the open grains before limit, lowest grain first. */
+static int
+flushGrainsBelow(StreamOptimizedDiskInfo *sodi,
+                 uint64_t limit)
+{
+	SparseVmdkWriter *writer = &sodi->writer;
+
+	for (;;) {
+		OpenGrain *lowest = NULL;
+		unsigned int i;
+
+		for (i = 0; i < writer->maxOpen; i++) {
+			OpenGrain *og = &writer->open[i];
+
+			if (og->grainNr < limit && (!lowest || og->grainNr < lowest->grainNr)) {
+				lowest = og;
+			}
+		}
+		if (!lowest) {
+			return 0;
+		}
+		if (flushGrain(sodi, lowest)) {
+			return -1;
+		}
+	}
+}
+
+static int
+flushAllGrains(StreamOptimizedDiskInfo *sodi)
+{
+	return flushGrainsBelow(sodi, ~0ULL);
+}
+
+/*
+ * Find the open grain for grainNr, or open it.  If all slots are taken the
+ * least recently used grain is flushed.  A grain that was written before
+ * is read back first.
+ */
+static OpenGrain *
+prepareGrain(StreamOptimizedDiskInfo *sodi,
+             uint64_t grainNr)
+{
+	SparseVmdkWriter *writer = &sodi->writer;
+	OpenGrain *og = writer->lastOpen;
+	OpenGrain *victim = NULL;
+	unsigned int i;
+
+	if (og && og->grainNr == grainNr) {
+		return og;
+	}
+	for (i = 0; i < writer->maxOpen; i++) {
+		og = &writer->open[i];
+		if (og->grainNr == grainNr) {
+			writer->lastOpen = og;
+			return og;
+		}
+		if (!victim || (victim->grainNr != ~0ULL &&
+		                (og->grainNr == ~0ULL || og->lastUse < victim->lastUse))) {
+			victim = og;
+		}
+	}
+	if (victim->grainNr != ~0ULL && flushGrain(sodi, victim)) {
+		return NULL;
+	}
+	victim->grainNr = grainNr;
+	victim->validStart = 0;
+	victim->validEnd = 0;
+	victim->loaded = false;
+	if (writer->readGrainNr == grainNr) {
+		writer->readGrainNr = ~0ULL;
+	}
+	if (writer->gtInfo.gt[grainNr] != __cpu_to_le32(0) && loadGrain(sodi, victim)) {
+		victim->grainNr = ~0ULL;
+		return NULL;
+	}
+	writer->lastOpen = victim;
+	return victim;
+}
+
+static ssize_t
+StreamOptimizedPwrite(DiskInfo *self,
+                      const void *buf,
+                      size_t length,
+                      off_t pos)
+{
+	const uint8_t *buf8 = buf;
+	StreamOptimizedDiskInfo *sodi = getSODI(self);
+	SparseVmdkWriter *writer = &sodi->writer;
+	SparseExtentHeader *hdr = &sodi->diskHdr;
+	uint64_t grainNr = pos / (hdr->grainSize * VMDK_SECTOR_SIZE);
+	uint32_t updateStart = pos & (hdr->grainSize * VMDK_SECTOR_SIZE - 1);
+
+	if (pos < 0 || (uint64_t)pos + length > hdr->capacity * VMDK_SECTOR_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (length > 0) {
+		OpenGrain *og;
+		uint32_t updateLen;
+		uint32_t updateEnd;
+
+		og = prepareGrain(sodi, grainNr);
+		if (!og) {
+			return -1;
+		}
+		updateLen = hdr->grainSize * VMDK_SECTOR_SIZE - updateStart;
+		if (length < updateLen) {
+			updateLen = length;
+			length = 0;
+		} else {
+			length -= updateLen;
+		}
+		updateEnd = updateStart + updateLen;
+		if (og->validEnd == 0) {
+			;
+		} else if (updateEnd < og->validStart ||
+		           updateStart > og->validEnd) {
+			fillGrain(sodi, og);
+		}
+		memcpy(og->data + updateStart, buf8, updateLen);
+		if (updateStart < og->validStart || og->validEnd == 0) {
+			og->validStart = updateStart;
+		}
+		if (updateEnd > og->validEnd) {
+			og->validEnd = updateEnd;
+		}
+		og->lastUse = ++writer->openClock;
+		/* Read back grains stay open, more updates to them are likely. */
+		if (!og->loaded && og->validStart == 0 &&
+		    og->validEnd >= grainLength(sodi, grainNr) &&
+		    flushGrain(sodi, og)) {
+			return -1;
+		}
+		buf8 += updateLen;
+		grainNr++;
+		updateStart = 0;
+	}
+	return buf8 - (const uint8_t *)buf;
+}
+
+/*
+ * Reads see what was written so far: open grains come from their buffers,
+ * everything else is read back from the output.
+ */
+static ssize_t
+StreamOptimizedPread(DiskInfo *self,
+                     void *buf,
+                     size_t length,
+                     off_t pos)
+{
+	StreamOptimizedDiskInfo *sodi = getSODI(self);
+	SparseVmdkWriter *writer = &sodi->writer;
+	uint32_t grainBytes = sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+	uint64_t grainNr = pos / grainBytes;
+	uint32_t skip = pos & (grainBytes - 1);
+	uint8_t *buf8 = buf;
+
+	if (pos < 0 || (uint64_t)pos + length > sodi->diskHdr.capacity * VMDK_SECTOR_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (length > 0) {
+		OpenGrain *og = NULL;
+		uint32_t n = grainBytes - skip;
+		unsigned int i;
+
+		if (n > length) {
+			n = length;
+		}
+		for (i = 0; i < writer->maxOpen; i++) {
+			if (writer->open[i].grainNr == grainNr) {
+				og = &writer->open[i];
+				break;
+			}
+		}
+		if (og) {
+			/* Whatever was not written of a new grain is zero. */
+			uint32_t start = og->validStart > skip ? og->validStart : skip;
+			uint32_t end = og->validEnd < skip + n ? og->validEnd : skip + n;
+
+			memset(buf8, 0, n);
+			if (og->validEnd != 0 && start < end) {
+				memcpy(buf8 + start - skip, og->data + start, end - start);
+			}
+		} else if (writer->gtInfo.gt[grainNr] == __cpu_to_le32(0)) {
+			memset(buf8, 0, n);
+		} else {
+			if (writer->readGrainNr != grainNr) {
+				writer->readGrainNr = ~0ULL;
+				if (!writer->readBuffer) {
+					writer->readBuffer = malloc(grainBytes);
+					if (!writer->readBuffer) {
+						return -1;
+					}
+				}
+				if (readWrittenGrain(sodi, grainNr, writer->readBuffer)) {
+					errno = EIO;
+					return -1;
+				}
+				writer->readGrainNr = grainNr;
+			}
+			memcpy(buf8, writer->readBuffer + skip, n);
+		}
+		buf8 += n;
+		length -= n;
+		grainNr++;
+		skip = 0;
+	}
+	return buf8 - (uint8_t *)buf;
+}
+
+static off_t
+StreamOptimizedGetCapacity(DiskInfo *self)
+{
+	return getSODI(self)->diskHdr.capacity * VMDK_SECTOR_SIZE;
+}
+
+static bool
+writeSpecial(SparseVmdkWriter *writer,
+             uint32_t marker,
+             SectorType length)
+{
+	SparseSpecialLBAHeaderOnDisk *specialHdr = writer->zlibBuffer.specialHdr;
+
+	memset(writer->zlibBuffer.data, 0, VMDK_SECTOR_SIZE);
+	specialHdr->lba = __cpu_to_le64(length);
+	specialHdr->type = __cpu_to_le32(marker);
+	return writerWrite(writer, specialHdr, VMDK_SECTOR_SIZE);
+}
+
+static bool
+writeEOS(SparseVmdkWriter *writer)
+{
+	return writeSpecial(writer, GRAIN_MARKER_EOS, 0);
+}
+
+static char *
+grainHashFileName(const char *fileName)
+{
+	char *ret;
+
+	if (asprintf(&ret, "%s%s", fileName, GRAIN_HASH_SUFFIX) == -1) {
+		return NULL;
+	}
+	return ret;
+}
+
+static bool
+writeGrainHashes(StreamOptimizedDiskInfo *sodi)
+{
+	GrainHashFileHeader hdr;
+	struct stat stb;
+	char *hashFileName;
+	int fd;
+	bool ret = false;
+
+	if (fstat(sodi->writer.fd, &stb)) {
+		return false;
+	}
+	hashFileName = grainHashFileName(sodi->writer.fileName);
+	if (!hashFileName) {
+		return false;
+	}
+	fd = open(hashFileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1) {
+		fprintf(stderr, "Cannot create %s: %s\n", hashFileName, strerror(errno));
+		goto out;
+	}
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, GRAIN_HASH_MAGIC, sizeof hdr.magic);
+	hdr.grainSize = __cpu_to_le64(sodi->diskHdr.grainSize);
+	hdr.numGrains = __cpu_to_le64(sodi->writer.gtInfo.GTEs);
+	hdr.vmdkSize = __cpu_to_le64(stb.st_size);
+	ret = safeWrite(fd, &hdr, sizeof hdr) &&
+	      safeWrite(fd, sodi->writer.grainHashes, sodi->writer.gtInfo.GTEs * GRAIN_HASH_SIZE);
+	if (close(fd) != 0) {
+		ret = false;
+	}
+out:
+	free(hashFileName);
+	return ret;
+}
+
+static void
+randomizeState(unsigned short *randomState)
+{
+	/* Every writer gets its own random state, there is no global seed. */
+	if (getrandom(randomState, 3 * sizeof *randomState, 0) != 3 * sizeof *randomState) {
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		randomState[0] = tv.tv_usec;
+		randomState[1] = tv.tv_sec;
+		randomState[2] = getpid();
+	}
+}
+
+static void
+seedState(unsigned short *randomState,
+          uint64_t seed)
+{
+	randomState[0] = seed;
+	randomState[1] = seed >> 16;
+	randomState[2] = seed >> 32;
+}
+
+static uint32_t
+writerRandom(SparseVmdkWriter *writer)
+{
+	return jrand48(writer->randomState);
+}
+
+/*
+ * In reproducible mode without a seed the identifiers are derived from a
+ * hash over the hashes of all stored grains, so identical contents yield
+ * an identical disk.
+ */
+static bool
+seedFromContents(StreamOptimizedDiskInfo *sodi)
+{
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	__le64 capacity = __cpu_to_le64(sodi->diskHdr.capacity);
+
+	if (EVP_DigestUpdate(sodi->writer.contentCtx, &capacity, sizeof capacity) != 1 ||
+	    EVP_DigestFinal_ex(sodi->writer.contentCtx, digest, NULL) != 1) {
+		return false;
+	}
+	memcpy(sodi->writer.randomState, digest, sizeof sodi->writer.randomState);
+	return true;
+}
+
+static char *
+makeDescriptor(StreamOptimizedDiskInfo *sodi)
+{
+	uint32_t cid;
+	uint32_t contentID[3];
+
+	do {
+		cid = writerRandom(&sodi->writer);
+		/*
+		 * Do not accept 0xFFFFFFFF and 0xFFFFFFFE.  They may be interpreted by
+		 * some software as no parent, or disk full of zeroes.
+		 */
+	} while (cid == 0xFFFFFFFFU || cid == 0xFFFFFFFEU);
+	contentID[0] = writerRandom(&sodi->writer);
+	contentID[1] = writerRandom(&sodi->writer);
+	contentID[2] = writerRandom(&sodi->writer);
+	/* The extent is this very file, so refer to it without its directory. */
+	return makeDiskDescriptorFile(basename(sodi->writer.fileName), "streamOptimized", sodi->diskHdr.capacity, cid, contentID, sodi->writer.toolsVersion);
+}
+
+/*
+ * Turn the superseded grain copies into progress markers spanning the same
+ * sectors, which stream readers skip.  The output is all in the file by now.
+ */
+static bool
+hideStaleGrains(StreamOptimizedDiskInfo *sodi)
+{
+	SparseVmdkWriter *writer = &sodi->writer;
+	SparseSpecialLBAHeaderOnDisk *specialHdr = writer->zlibBuffer.specialHdr;
+	size_t i;
+
+	for (i = 0; i < writer->numStale; i++) {
+		off_t pos = (off_t)writer->stale[i] * VMDK_SECTOR_SIZE;
+		uint64_t sectors;
+
+		if (!safePread(writer->fd, writer->zlibBuffer.data, VMDK_SECTOR_SIZE, pos)) {
+			return false;
+		}
+		sectors = CEILING(sizeof(SparseGrainLBAHeaderOnDisk) + __le32_to_cpu(writer->zlibBuffer.grainHdr->cmpSize),
+		                  VMDK_SECTOR_SIZE);
+		memset(writer->zlibBuffer.data, 0, VMDK_SECTOR_SIZE);
+		specialHdr->lba = __cpu_to_le64(sectors - 1);
+		specialHdr->type = __cpu_to_le32(GRAIN_MARKER_PROGRESS);
+		if (!safePwrite(writer->fd, specialHdr, VMDK_SECTOR_SIZE, pos)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * The digests were taken while writing, before stale grains were hidden.
+ * Take them again from the file, which has its final header by now.
+ */
+static bool
+rehashOutput(SparseVmdkWriter *writer)
+{
+	static uint8_t buf[1024 * 1024];
+	off_t pos = 0;
+	size_t i;
+
+	for (i = 0; i < NUM_DIGEST_TYPES; i++) {
+		if (writer->digestCtx[i] &&
+		    EVP_DigestInit_ex(writer->digestCtx[i], digestTypes[i].md(), NULL) != 1) {
+			return false;
+		}
+	}
+	for (;;) {
+		ssize_t rd = pread(writer->fd, buf, sizeof buf, pos);
+
+		if (rd == -1 && errno == EINTR) {
+			continue;
+		}
+		if (rd == -1) {
+			return false;
+		}
+		if (rd == 0) {
+			return true;
+		}
+		for (i = 0; i < NUM_DIGEST_TYPES; i++) {
+			if (writer->digestCtx[i] &&
+			    EVP_DigestUpdate(writer->digestCtx[i], buf, rd) != 1) {
+				return false;
+			}
+		}
+		pos += rd;
+	}
+}
+
+static bool
+finishDigests(SparseVmdkWriter *writer)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_DIGEST_TYPES; i++) {
+		if (writer->digestCtx[i] &&
+		    EVP_DigestFinal_ex(writer->digestCtx[i], writer->digest[i], &writer->digestLen[i]) != 1) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void
+printDigest(FILE *f, const SparseVmdkWriter *writer, size_t i)
+{
+	unsigned int j;
+
+	for (j = 0; j < writer->digestLen[i]; j++) {
+		fprintf(f, "%02x", writer->digest[i][j]);
+	}
+}
+
+static bool
+writeDigests(SparseVmdkWriter *writer)
+{
+	char *digestFileName;
+	FILE *f;
+	size_t i;
+	bool ret = true;
+
+	if (asprintf(&digestFileName, "%s%s", writer->fileName, DIGEST_SUFFIX) == -1) {
+		return false;
+	}
+	f = fopen(digestFileName, "w");
+	if (!f) {
+		fprintf(stderr, "Cannot create %s: %s\n", digestFileName, strerror(errno));
+		free(digestFileName);
+		return false;
+	}
+	for (i = 0; i < NUM_DIGEST_TYPES; i++) {
+		if (!writer->digestCtx[i]) {
+			continue;
+		}
+		fprintf(f, "%s(%s)= ", digestTypes[i].name, basename(writer->fileName));
+		printDigest(f, writer, i);
+		fprintf(f, "\n");
+	}
+	if (fclose(f) != 0) {
+		ret = false;
+	}
+	free(digestFileName);
+	return ret;
+}
+
+/*
+ * Write <vmdk>.json.  used is what 'vmdk-convert -i' reports for the output:
+ * the allocated grains, with the last one only up to the capacity.  Size,
+ * inode and modification time let readers tell whether the vmdk is still
+ * the one described.
+ */
+static bool
+writeMetadata(StreamOptimizedDiskInfo *sodi)
+{
+	SparseVmdkWriter *writer = &sodi->writer;
+	uint64_t grainBytes = sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+	uint64_t used = 0;
+	uint64_t grainNr;
+	char *metadataFileName;
+	const char *sep = "";
+	struct stat st;
+	FILE *f;
+	size_t i;
+	bool ret = true;
+
+	for (grainNr = 0; grainNr < writer->gtInfo.GTEs; grainNr++) {
+		if (writer->gtInfo.gt[grainNr] == 0) {
+			continue;
+		}
+		if (grainNr == writer->gtInfo.lastGrainNr) {
+			used += writer->gtInfo.lastGrainSize;
+		} else {
+			used += grainBytes;
+		}
+	}
+	if (fstat(writer->fd, &st) != 0) {
+		return false;
+	}
+	if (asprintf(&metadataFileName, "%s%s", writer->fileName, METADATA_SUFFIX) == -1) {
+		return false;
+	}
+	f = fopen(metadataFileName, "w");
+	if (!f) {
+		fprintf(stderr, "Cannot create %s: %s\n", metadataFileName, strerror(errno));
+		free(metadataFileName);
+		return false;
+	}
+	fprintf(f, "{ \"capacity\": %llu, \"used\": %llu, \"size\": %llu, \"inode\": %llu, \"mtime_ns\": %llu",
+	        (unsigned long long)sodi->diskHdr.capacity * VMDK_SECTOR_SIZE,
+	        (unsigned long long)used, (unsigned long long)st.st_size, (unsigned long long)st.st_ino,
+	        (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec);
+	if (writer->gdAtEnd) {
+		fprintf(f, ", \"digests\": { ");
+		for (i = 0; i < NUM_DIGEST_TYPES; i++) {
+			if (!writer->digestCtx[i]) {
+				continue;
+			}
+			fprintf(f, "%s\"%s\": \"", sep, digestTypes[i].key);
+			printDigest(f, writer, i);
+			fprintf(f, "\"");
+			sep = ", ";
+		}
+		fprintf(f, " }");
+	}
+	fprintf(f, " }\n");
+	if (fclose(f) != 0) {
+		ret = false;
+	}
+	free(metadataFileName);
+	return ret;
+}
+
+/*
+ * With digests the disk uses the layout ESX produces for streamOptimized
+ * disks: header and descriptor, grains, then grain tables, grain directory
+ * and a footer.  Everything is written strictly in order, only the header
+ * is rewritten at the end to replace the temporary signature.  The digests
+ * already include the final header.
+ */
+static bool
+writePrologue(StreamOptimizedDiskInfo *sodi)
+{
+	SparseExtentHeaderOnDisk onDisk;
+	size_t descSize = sodi->diskHdr.descriptorSize * VMDK_SECTOR_SIZE;
+	char *descFile;
+	char *descBuf;
+	size_t i;
+	bool ret;
+
+	setSparseExtentHeader(&onDisk, &sodi->diskHdr, false);
+	for (i = 0; i < NUM_DIGEST_TYPES; i++) {
+		if (sodi->writer.digestCtx[i] &&
+		    EVP_DigestUpdate(sodi->writer.digestCtx[i], &onDisk, sizeof onDisk) != 1) {
+			return false;
+		}
+	}
+	setSparseExtentHeader(&onDisk, &sodi->diskHdr, true);
+	if (!bufferWrite(&sodi->writer, &onDisk, sizeof onDisk)) {
+		return false;
+	}
+	descFile = makeDescriptor(sodi);
+	if (!descFile) {
+		return false;
+	}
+	descBuf = calloc(1, descSize);
+	if (!descBuf || strlen(descFile) > descSize) {
+		free(descBuf);
+		free(descFile);
+		return false;
+	}
+	memcpy(descBuf, descFile, strlen(descFile));
+	ret = writerWrite(&sodi->writer, descBuf, descSize);
+	free(descBuf);
+	free(descFile);
+	return ret;
+}
+
+static bool
+writeEpilogue(StreamOptimizedDiskInfo *sodi)
+{
+	SparseGTInfo *gtInfo = &sodi->writer.gtInfo;
+	SparseExtentHeader footer;
+	SparseExtentHeaderOnDisk onDisk;
+	uint32_t i;
+
+	for (i = 0; i < gtInfo->GTs; i++) {
+		__le32 *gt = gtInfo->gt + i * sodi->diskHdr.numGTEsPerGT;
+
+		if (isZeroed(gt, gtInfo->GTsectors * VMDK_SECTOR_SIZE)) {
+			gtInfo->gd[i] = __cpu_to_le32(0);
+			continue;
+		}
+		if (!writeSpecial(&sodi->writer, GRAIN_MARKER_GRAIN_TABLE, gtInfo->GTsectors)) {
+			return false;
+		}
+		gtInfo->gd[i] = __cpu_to_le32(sodi->writer.curSP + 1);
+		if (!writerWrite(&sodi->writer, gt, gtInfo->GTsectors * VMDK_SECTOR_SIZE)) {
+			return false;
+		}
+		sodi->writer.curSP += 1 + gtInfo->GTsectors;
+	}
+	if (!writeSpecial(&sodi->writer, GRAIN_MARKER_GRAIN_DIRECTORY, gtInfo->GDsectors)) {
+		return false;
+	}
+	footer = sodi->diskHdr;
+	footer.gdOffset = sodi->writer.curSP + 1;
+	if (!writerWrite(&sodi->writer, gtInfo->gd, gtInfo->GDsectors * VMDK_SECTOR_SIZE)) {
+		return false;
+	}
+	sodi->writer.curSP += 1 + gtInfo->GDsectors;
+	if (!writeSpecial(&sodi->writer, GRAIN_MARKER_FOOTER, 1)) {
+		return false;
+	}
+	setSparseExtentHeader(&onDisk, &footer, false);
+	if (!writerWrite(&sodi->writer, &onDisk, sizeof onDisk)) {
+		return false;
+	}
+	sodi->writer.curSP += 2;
+	return writeEOS(&sodi->writer);
+}
+
+/*
+ * Checkpoints let a conversion that was killed continue where it was.
+ * <vmdk>.resume holds a header and the grain table entries of the grains
+ * that are safely in the output.  The output itself is synced before the
+ * header is updated, so the header never points at data that is not there.
+ */
+#define CHECKPOINT_SUFFIX	".resume"
+#define CHECKPOINT_MAGIC	"VMDKCKP1"
+
+typedef struct {
+	char magic[8];
+	__le64 capacity;	/* sectors */
+	__le64 grainSize;	/* sectors */
+	__le64 grains;		/* grain table entries after the header */
+	__le64 nextPos;		/* everything before this is in the output */
+	__le64 curSP;		/* output sectors used */
+	__le64 sourceSize;	/* the source the output comes from */
+	__le64 sourceInode;
+	__le64 sourceMtime;	/* ns */
+	uint8_t pad[440];
+} __attribute__((__packed__)) CheckpointHeaderOnDisk;
+
+static char *
+checkpointFileName(const char *fileName)
+{
+	char *name;
+
+	if (asprintf(&name, "%s%s", fileName, CHECKPOINT_SUFFIX) == -1) {
+		return NULL;
+	}
+	return name;
+}
+
+static bool
+writeCheckpointHeader(StreamOptimizedDiskInfo *sodi,
+                      uint64_t nextPos)
+{
+	CheckpointHeaderOnDisk hdr;
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof hdr.magic);
+	hdr.capacity = __cpu_to_le64(sodi->diskHdr.capacity);
+	hdr.grainSize = __cpu_to_le64(sodi->diskHdr.grainSize);
+	hdr.grains = __cpu_to_le64(sodi->writer.gtInfo.GTEs);
+	hdr.nextPos = __cpu_to_le64(nextPos);
+	hdr.curSP = __cpu_to_le64(sodi->writer.curSP);
+	hdr.sourceSize = __cpu_to_le64(sodi->writer.source.size);
+	hdr.sourceInode = __cpu_to_le64(sodi->writer.source.inode);
+	hdr.sourceMtime = __cpu_to_le64(sodi->writer.source.mtime);
+	return safePwrite(sodi->writer.checkpointFd, &hdr, sizeof hdr, 0) &&
+	       fsync(sodi->writer.checkpointFd) == 0;
+}
+
+/*
+ * Pick up a partial output from its checkpoint: grain tables and output
+ * position, and the unaligned end of the output goes back into the output
+ * buffer.  The grain written last is read back to check that it is intact.
+ */
+static bool
+resumeFromCheckpoint(StreamOptimizedDiskInfo *sodi)
+{
+	SparseVmdkWriter *writer = &sodi->writer;
+	uint64_t grainBytes = sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+	CheckpointHeaderOnDisk hdr;
+	uint64_t curSP;
+	uint64_t lastGrain = ~0ULL;
+	uint32_t lastSect = 0;
+	uint64_t limit;
+	uint64_t i;
+	struct stat st;
+	off_t end;
+
+	if (!safePread(writer->checkpointFd, &hdr, sizeof hdr, 0) ||
+	    memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof hdr.magic) != 0 ||
+	    __le64_to_cpu(hdr.capacity) != sodi->diskHdr.capacity ||
+	    __le64_to_cpu(hdr.grainSize) != sodi->diskHdr.grainSize ||
+	    __le64_to_cpu(hdr.grains) != writer->gtInfo.GTEs) {
+		errno = EINVAL;
+		fprintf(stderr, "Checkpoint does not match the disk\n");
+		return false;
+	}
+	if (__le64_to_cpu(hdr.sourceSize) != writer->source.size ||
+	    __le64_to_cpu(hdr.sourceInode) != writer->source.inode ||
+	    __le64_to_cpu(hdr.sourceMtime) != writer->source.mtime) {
+		errno = EINVAL;
+		fprintf(stderr, "Checkpoint is for another source, or the source changed since\n");
+		return false;
+	}
+	curSP = __le64_to_cpu(hdr.curSP);
+	limit = __le64_to_cpu(hdr.nextPos) / grainBytes;
+	end = (off_t)curSP * VMDK_SECTOR_SIZE;
+	if (curSP < sodi->diskHdr.overHead || curSP > UINT32_MAX || limit > writer->gtInfo.GTEs ||
+	    fstat(writer->fd, &st) != 0 || st.st_size < end) {
+		errno = EINVAL;
+		fprintf(stderr, "Output is shorter than its checkpoint\n");
+		return false;
+	}
+	if (limit > 0 &&
+	    !safePread(writer->checkpointFd, writer->gtInfo.gt, limit * sizeof *writer->gtInfo.gt, sizeof hdr)) {
+		return false;
+	}
+	for (i = 0; i < limit; i++) {
+		uint32_t sect = __le32_to_cpu(writer->gtInfo.gt[i]);
+
+		if (sect != 0 && (sect < sodi->diskHdr.overHead || sect >= curSP)) {
+			errno = EINVAL;
+			fprintf(stderr, "Checkpoint has an invalid grain table\n");
+			return false;
+		}
+		if (sect > lastSect) {
+			lastSect = sect;
+			lastGrain = i;
+		}
+	}
+	writer->curSP = curSP;
+	writer->checkpointGrain = limit;
+	writer->resumePos = limit * grainBytes;
+
+	/* Continue at the end of the output, the buffer takes its unaligned part. */
+	writer->outStart = end & ~(off_t)(OUTPUT_ALIGNMENT - 1);
+	writer->outLen = end - writer->outStart;
+	if (!safePread(writer->fd, writer->outBuffer, writer->outLen, writer->outStart) ||
+	    ftruncate(writer->fd, end) != 0) {
+		return false;
+	}
+	if (lastGrain != ~0ULL) {
+		uint8_t *data = malloc(grainBytes);
+		int ret;
+
+		if (!data) {
+			return false;
+		}
+		ret = readWrittenGrain(sodi, lastGrain, data);
+		free(data);
+		if (ret) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Open <vmdk>.resume.  When resuming from an existing one the output is
+ * kept, otherwise both start from scratch.
+ */
+static bool
+openCheckpoint(StreamOptimizedDiskInfo *sodi,
+               bool resume)
+{
+	SparseVmdkWriter *writer = &sodi->writer;
+	char *name = checkpointFileName(writer->fileName);
+	struct stat st;
+
+	if (!name) {
+		return false;
+	}
+	writer->checkpointFd = open(name, O_RDWR | O_CREAT, 0666);
+	free(name);
+	if (writer->checkpointFd == -1 || fstat(writer->checkpointFd, &st) != 0) {
+		return false;
+	}
+	if (resume && st.st_size != 0) {
+		return resumeFromCheckpoint(sodi);
+	}
+	if (ftruncate(writer->fd, 0) != 0 ||
+	    ftruncate(writer->checkpointFd, 0) != 0 ||
+	    ftruncate(writer->checkpointFd, sizeof(CheckpointHeaderOnDisk) + writer->gtInfo.GTEs * sizeof *writer->gtInfo.gt) != 0) {
+		return false;
+	}
+	return writeCheckpointHeader(sodi, 0);
+}
+
+static int
+StreamOptimizedFinalize(StreamOptimizedDiskInfo *sodi)
+{
+	size_t i;
+	int ret;
+
+	stopCompressThreads(&sodi->writer);
+	drainOutput(&sodi->writer);
+	IoRing_Destroy(sodi->writer.ring);
+	if (sodi->writer.directFd != sodi->writer.fd) {
+		close(sodi->writer.directFd);
+	}
+	ret = close(sodi->writer.fd);
+	if (sodi->writer.checkpointFd != -1) {
+		close(sodi->writer.checkpointFd);
+	}
+	deflateEnd(&sodi->writer.zstream);
+	if (sodi->writer.inflateReady) {
+		inflateEnd(&sodi->writer.inflateStream);
+	}
+	closeBase(&sodi->writer);
+	EVP_MD_CTX_free(sodi->writer.hashCtx);
+	EVP_MD_CTX_free(sodi->writer.contentCtx);
+	for (i = 0; i < NUM_DIGEST_TYPES; i++) {
+		EVP_MD_CTX_free(sodi->writer.digestCtx[i]);
+	}
+	free(sodi->writer.grainHashes);
+	free(sodi->writer.gtInfo.gd);
+	free(sodi->writer.stale);
+	free(sodi->writer.pending);
+	free(sodi->writer.pendingBuffers);
+	free(sodi->writer.open);
+	free(sodi->writer.openBuffers);
+	free(sodi->writer.readBuffer);
+	free(sodi->writer.outChunks);
+	free(sodi->writer.outBuffers);
+	free(sodi->writer.zlibBuffer.data);
+	free(sodi->writer.toolsVersion);
+	free(sodi->writer.fileName);
+	free(sodi);
+	return ret;
+}
+
+static int
+StreamOptimizedAbort(DiskInfo *self)
+{
+	StreamOptimizedDiskInfo *sodi = getSODI(self);
+
+	return StreamOptimizedFinalize(sodi);
+}
+
+static int
+StreamOptimizedClose(DiskInfo *self)
+{
+	StreamOptimizedDiskInfo *sodi = getSODI(self);
+	char *descFile;
+	SparseExtentHeaderOnDisk onDisk;
+
+	if (flushAllGrains(sodi) || writePendingGrains(sodi)) {
+		goto failAll;
+	}
+	if (sodi->writer.gdAtEnd) {
+		if (!writeEpilogue(sodi) || !flushOutput(&sodi->writer, true) ||
+		    !hideStaleGrains(sodi)) {
+			goto failAll;
+		}
+		if (!syncOutput(sodi->writer.fd, sodi->writer.durability, false)) {
+			goto failAll;
+		}
+		goto finalHeader;
+	}
+	if (!writeEOS(&sodi->writer) || !flushOutput(&sodi->writer, true) ||
+	    !hideStaleGrains(sodi)) {
+		goto failAll;
+	}
+	if (lseek(sodi->writer.fd, sodi->writer.gdOffset * VMDK_SECTOR_SIZE, SEEK_SET) == -1) {
+		goto failAll;
+	}
+	if (!safeWrite(sodi->writer.fd, sodi->writer.gtInfo.gd, (sodi->writer.gtInfo.GDsectors + sodi->writer.gtInfo.GTsectors * sodi->writer.gtInfo.GTs) * VMDK_SECTOR_SIZE)) {
+		goto failAll;
+	}
+	if (sodi->writer.contentCtx && !seedFromContents(sodi)) {
+		goto failAll;
+	}
+	descFile = makeDescriptor(sodi);
+	if (!descFile) {
+		goto failAll;
+	}
+	if (pwrite(sodi->writer.fd, descFile, strlen(descFile), sodi->diskHdr.descriptorOffset * VMDK_SECTOR_SIZE) != (ssize_t)strlen(descFile)) {
+		free(descFile);
+		goto failAll;
+	}
+	free(descFile);
+
+	/*
+	 * Write everything out as it should be, except that file signature is
+	 * vmdk, rather than VMDK.  Then flush everything to the media, and finally
+	 * rewrite header with proper VMDK signature.
+	 */
+	setSparseExtentHeader(&onDisk, &sodi->diskHdr, true);
+	if (pwrite(sodi->writer.fd, &onDisk, sizeof onDisk, 0) != sizeof onDisk) {
+		goto failAll;
+	}
+	if (!syncOutput(sodi->writer.fd, sodi->writer.durability, false)) {
+		goto failAll;
+	}
+finalHeader:
+	setSparseExtentHeader(&onDisk, &sodi->diskHdr, false);
+	if (pwrite(sodi->writer.fd, &onDisk, sizeof onDisk, 0) != sizeof onDisk) {
+		goto failAll;
+	}
+	if (!syncOutput(sodi->writer.fd, sodi->writer.durability, true)) {
+		goto failAll;
+	}
+	if (sodi->writer.grainHashes && !writeGrainHashes(sodi)) {
+		goto failAll;
+	}
+	if (sodi->writer.gdAtEnd && sodi->writer.numStale != 0 && !rehashOutput(&sodi->writer)) {
+		goto failAll;
+	}
+	if (sodi->writer.gdAtEnd &&
+	    (!finishDigests(&sodi->writer) || !writeDigests(&sodi->writer))) {
+		goto failAll;
+	}
+	if (sodi->writer.metadata && !writeMetadata(sodi)) {
+		goto failAll;
+	}
+	if (sodi->writer.base) {
+		printf("Reused %llu grains from base disk\n", (unsigned long long)sodi->writer.reusedGrains);
+	}
+	if (sodi->writer.checkpointFd != -1) {
+		/* Complete, nothing to resume anymore. */
+		char *name = checkpointFileName(sodi->writer.fileName);
+
+		if (name) {
+			unlink(name);
+			free(name);
+		}
+	}
+	return StreamOptimizedFinalize(sodi);
+
+failAll:
+	StreamOptimizedAbort(&sodi->hdr);
+	return -1;
 }
 
 static DiskInfoVMT streamOptimizedVMT = {
+	.getCapacity = StreamOptimizedGetCapacity,
+	.pread = StreamOptimizedPread,
 	.pwrite = StreamOptimizedPwrite,
 	.close = StreamOptimizedClose,
 	.abort = StreamOptimizedAbort
 };
 
+/*
+ * Record that everything before pos was written, for a conversion that
+ * writes in order and was created with checkpoints.  Grains before pos
+ * are completed, everything is synced, then the checkpoint is updated.
+ * Costs a sync or two, so once in a while is enough.
+ */
+int
+StreamOptimized_Checkpoint(DiskInfo *di,
+                           off_t pos)
+{
+	StreamOptimizedDiskInfo *sodi = getSODI(di);
+	SparseVmdkWriter *writer = &sodi->writer;
+	uint64_t limit;
+	size_t len;
+
+	if (di->vmt != &streamOptimizedVMT || writer->checkpointFd == -1) {
+		errno = EINVAL;
+		return -1;
+	}
+	limit = pos / (sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE);
+	if (limit > writer->gtInfo.GTEs) {
+		limit = writer->gtInfo.GTEs;
+	}
+	if (limit <= writer->checkpointGrain) {
+		return 0;
+	}
+	if (flushGrainsBelow(sodi, limit) || writePendingGrains(sodi) || !drainOutput(writer)) {
+		return -1;
+	}
+	/* Written padded, but kept, the buffer goes out again once it is full. */
+	len = (writer->outLen + OUTPUT_ALIGNMENT - 1) & ~(size_t)(OUTPUT_ALIGNMENT - 1);
+	memset(writer->outBuffer + writer->outLen, 0, len - writer->outLen);
+	if ((len != 0 && !writeOutputBuffer(writer, len)) || fsync(writer->fd) != 0) {
+		return -1;
+	}
+	if (!safePwrite(writer->checkpointFd, writer->gtInfo.gt + writer->checkpointGrain,
+	                (limit - writer->checkpointGrain) * sizeof *writer->gtInfo.gt,
+	                sizeof(CheckpointHeaderOnDisk) + writer->checkpointGrain * sizeof *writer->gtInfo.gt) ||
+	    fsync(writer->checkpointFd) != 0 ||
+	    !writeCheckpointHeader(sodi, limit * sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE)) {
+		return -1;
+	}
+	writer->checkpointGrain = limit;
+	return 0;
+}
+
+/*
+ * Grain size and grains per grain table of the streamOptimized output for
+ * a disk of capacity bytes, and what the output takes besides the
+ * compressed grains: overhead in any case, plus gtOverhead for each grain
+ * table with grains.  The header, descriptor and end of stream marker are
+ * always there.  Without digests all grain tables follow the grain
+ * directory at the start.  With digests (gdAtEnd) the grain tables with
+ * grains, the grain directory and the footer come at the end, each after
+ * a marker.
+ */
+bool
+StreamOptimized_Layout(off_t capacity,
+                       bool gdAtEnd,
+                       uint32_t *grainBytes,
+                       uint32_t *gtGrains,
+                       off_t *overhead,
+                       off_t *gtOverhead)
+{
+	SparseExtentHeader hdr;
+	SparseGTInfo gtInfo;
+	SectorType sectors;
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.numGTEsPerGT = STREAM_GTES_PER_GT;
+	hdr.grainSize = STREAM_GRAIN_SIZE;
+	hdr.capacity = CEILING(capacity, VMDK_SECTOR_SIZE);
+	if (!getGDGT(&gtInfo, &hdr)) {
+		return false;
+	}
+	free(gtInfo.gd);
+	*grainBytes = STREAM_GRAIN_SIZE * VMDK_SECTOR_SIZE;
+	*gtGrains = STREAM_GTES_PER_GT;
+	sectors = 1 + STREAM_DESCRIPTOR_SIZE + 1;
+	if (gdAtEnd) {
+		/* GD and footer, each with its marker */
+		sectors += 1 + gtInfo.GDsectors + 2;
+		*gtOverhead = (1 + gtInfo.GTsectors) * VMDK_SECTOR_SIZE;
+	} else {
+		sectors += gtInfo.GDsectors + (SectorType)gtInfo.GTs * gtInfo.GTsectors;
+		*gtOverhead = 0;
+	}
+	*overhead = sectors * VMDK_SECTOR_SIZE;
+	return true;
+}
+
+/* Where a conversion resumed from a checkpoint continues, 0 for a new one. */
+off_t
+StreamOptimized_ResumePos(DiskInfo *di)
+{
+	if (di->vmt != &streamOptimizedVMT) {
+		return 0;
+	}
+	return getSODI(di)->writer.resumePos;
+}
+
 DiskInfo *
-StreamOptimized_Create(const char *fileName, off_t capacity)
+StreamOptimized_Create(const char *fileName,
+                       off_t capacity,
+                       const SparseWriterOptions *opts)
 {
 	StreamOptimizedDiskInfo *sodi;
 	size_t maxOutSize;
+	char *hashFileName;
+	unsigned int numThreads;
+	size_t i;
 
 	sodi = malloc(sizeof *sodi);
 	if (!sodi) {
@@ -620,37 +2305,125 @@ StreamOptimized_Create(const char *fileName, off_t capacity)
 	sodi->hdr.vmt = &streamOptimizedVMT;
 	sodi->diskHdr.version = SPARSE_VERSION_INCOMPAT_FLAGS;
 	sodi->diskHdr.flags = SPARSEFLAG_VALID_NEWLINE_DETECTOR | SPARSEFLAG_COMPRESSED | SPARSEFLAG_EMBEDDED_LBA;
-	sodi->diskHdr.numGTEsPerGT = 512;
+	sodi->diskHdr.numGTEsPerGT = STREAM_GTES_PER_GT;
 	sodi->diskHdr.compressAlgorithm = SPARSE_COMPRESSALGORITHM_DEFLATE;
-	sodi->diskHdr.grainSize = 128;
+	sodi->diskHdr.grainSize = STREAM_GRAIN_SIZE;
 	sodi->diskHdr.overHead = 1;
 	sodi->diskHdr.capacity = CEILING(capacity, VMDK_SECTOR_SIZE);
 	if (!getGDGT(&sodi->writer.gtInfo, &sodi->diskHdr)) {
 		goto failFileName;
 	}
-	sodi->writer.fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	sodi->writer.toolsVersion = strdup(opts && opts->toolsVersion ? opts->toolsVersion : DEFAULT_TOOLS_VERSION);
+	if (!sodi->writer.toolsVersion) {
+		goto failFileName;
+	}
+	if (!opts || !opts->reproducible) {
+		randomizeState(sodi->writer.randomState);
+	} else {
+		if (opts->seeded) {
+			seedState(sodi->writer.randomState, opts->seed);
+		} else if (opts->digests) {
+			/*
+			 * The descriptor is written before any grain, so it
+			 * cannot depend on the contents.  Disks of the same size
+			 * would share their identifiers, the caller has to seed.
+			 */
+			errno = EINVAL;
+			goto failHashes;
+		} else {
+			sodi->writer.contentCtx = EVP_MD_CTX_new();
+			if (!sodi->writer.contentCtx ||
+			    EVP_DigestInit_ex(sodi->writer.contentCtx, EVP_sha256(), NULL) != 1) {
+				goto failHashes;
+			}
+		}
+	}
+	if (opts && (opts->grainHashes || opts->baseFileName || sodi->writer.contentCtx)) {
+		sodi->writer.hashCtx = EVP_MD_CTX_new();
+		if (!sodi->writer.hashCtx) {
+			goto failHashes;
+		}
+	}
+	for (i = 0; opts && i < NUM_DIGEST_TYPES; i++) {
+		if (opts->digests & digestTypes[i].flag) {
+			sodi->writer.gdAtEnd = true;
+			sodi->writer.digestCtx[i] = EVP_MD_CTX_new();
+			if (!sodi->writer.digestCtx[i] ||
+			    EVP_DigestInit_ex(sodi->writer.digestCtx[i], digestTypes[i].md(), NULL) != 1) {
+				goto failHashes;
+			}
+		}
+	}
+	if (opts && (opts->grainHashes || opts->baseFileName)) {
+		sodi->writer.grainHashes = calloc(sodi->writer.gtInfo.GTEs, GRAIN_HASH_SIZE);
+		if (!sodi->writer.grainHashes) {
+			goto failHashes;
+		}
+		if (opts->baseFileName &&
+		    !openBase(&sodi->writer, opts->baseFileName, fileName, &sodi->diskHdr)) {
+			goto failHashes;
+		}
+	}
+	sodi->writer.checkpointFd = -1;
+	if (opts) {
+		sodi->writer.source = opts->source;
+	}
+	if (opts && opts->checkpoints &&
+	    (sodi->writer.gdAtEnd || sodi->writer.contentCtx || sodi->writer.grainHashes)) {
+		/* Their hash state cannot be picked up again. */
+		errno = EINVAL;
+		goto failBase;
+	}
+	sodi->writer.fd = open(fileName, O_RDWR | O_CREAT | (opts && opts->checkpoints ? 0 : O_TRUNC), 0666);
 	if (sodi->writer.fd == -1) {
-		goto failGDGT;
+		goto failBase;
+	}
+	/* Hashes of whatever was there before are stale now, and so is a checkpoint. */
+	if (!opts || !opts->checkpoints) {
+		hashFileName = checkpointFileName(fileName);
+		if (!hashFileName) {
+			goto failFD;
+		}
+		unlink(hashFileName);
+		free(hashFileName);
+	}
+	hashFileName = grainHashFileName(fileName);
+	if (!hashFileName) {
+		goto failFD;
+	}
+	unlink(hashFileName);
+	free(hashFileName);
+	if (asprintf(&hashFileName, "%s%s", fileName, DIGEST_SUFFIX) == -1) {
+		goto failFD;
+	}
+	unlink(hashFileName);
+	free(hashFileName);
+	if (asprintf(&hashFileName, "%s%s", fileName, METADATA_SUFFIX) == -1) {
+		goto failFD;
 	}
+	unlink(hashFileName);
+	free(hashFileName);
+	sodi->writer.metadata = opts && opts->metadata;
+	sodi->writer.durability = opts ? opts->durability : DURABILITY_FULL;
 	sodi->diskHdr.descriptorOffset = sodi->diskHdr.overHead;
-	sodi->diskHdr.descriptorSize = 20;
+	sodi->diskHdr.descriptorSize = STREAM_DESCRIPTOR_SIZE;
 	sodi->diskHdr.overHead = sodi->diskHdr.overHead + sodi->diskHdr.descriptorSize;
-	sodi->writer.gdOffset = sodi->diskHdr.overHead;
-	sodi->diskHdr.gdOffset = sodi->writer.gdOffset;
-	sodi->diskHdr.overHead += sodi->writer.gtInfo.GDsectors;
-	sodi->writer.gtOffset = sodi->diskHdr.overHead;
-	sodi->diskHdr.overHead = prefillGD(&sodi->writer.gtInfo, sodi->diskHdr.overHead);
-	sodi->writer.curSP = sodi->diskHdr.overHead;
-	sodi->writer.grainBuffer = malloc(sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE);
-	if (!sodi->writer.grainBuffer) {
-		goto failFD;
+	if (sodi->writer.gdAtEnd) {
+		sodi->diskHdr.gdOffset = SPARSE_GD_AT_END;
+	} else {
+		sodi->writer.gdOffset = sodi->diskHdr.overHead;
+		sodi->diskHdr.gdOffset = sodi->writer.gdOffset;
+		sodi->diskHdr.overHead += sodi->writer.gtInfo.GDsectors;
+		sodi->writer.gtOffset = sodi->diskHdr.overHead;
+		sodi->diskHdr.overHead = prefillGD(&sodi->writer.gtInfo, sodi->diskHdr.overHead);
 	}
-	sodi->writer.grainBufferNr = ~0ULL;
+	sodi->writer.curSP = sodi->diskHdr.overHead;
+	sodi->writer.readGrainNr = ~0ULL;
 	sodi->writer.zstream.zalloc = NULL;
 	sodi->writer.zstream.zfree = NULL;
 	sodi->writer.zstream.opaque = &sodi->writer;
 	if (deflateInit(&sodi->writer.zstream, Z_BEST_COMPRESSION) != Z_OK) {
-		goto failGrainBuffer;
+		goto failFD;
 	}
 	maxOutSize = deflateBound(&sodi->writer.zstream, sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE) + sizeof(SparseGrainLBAHeaderOnDisk);
 	maxOutSize = (maxOutSize + VMDK_SECTOR_SIZE - 1) & ~(VMDK_SECTOR_SIZE - 1);
@@ -659,22 +2432,107 @@ StreamOptimized_Create(const char *fileName, off_t capacity)
 	if (!sodi->writer.zlibBuffer.data) {
 		goto failDeflate;
 	}
-	if (lseek(sodi->writer.fd, sodi->writer.curSP * VMDK_SECTOR_SIZE, SEEK_SET) == -1) {
+	numThreads = opts && opts->threads > 1 ? opts->threads : 1;
+	sodi->writer.maxPending = numThreads > 1 ? numThreads * GRAINS_PER_THREAD : 1;
+	sodi->writer.pending = calloc(sodi->writer.maxPending, sizeof *sodi->writer.pending);
+	sodi->writer.pendingBuffers = malloc(sodi->writer.maxPending * (sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE + maxOutSize));
+	if (!sodi->writer.pending || !sodi->writer.pendingBuffers) {
+		goto failPending;
+	}
+	for (i = 0; i < sodi->writer.maxPending; i++) {
+		PendingGrain *grain = &sodi->writer.pending[i];
+
+		grain->data = sodi->writer.pendingBuffers + i * (sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE + maxOutSize);
+		grain->out = grain->data + sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+	}
+	sodi->writer.maxOpen = opts && opts->openGrains ? opts->openGrains : DEFAULT_OPEN_GRAINS;
+	sodi->writer.open = calloc(sodi->writer.maxOpen, sizeof *sodi->writer.open);
+	sodi->writer.openBuffers = malloc(sodi->writer.maxOpen * sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE);
+	if (!sodi->writer.open || !sodi->writer.openBuffers) {
+		goto failPending;
+	}
+	for (i = 0; i < sodi->writer.maxOpen; i++) {
+		sodi->writer.open[i].grainNr = ~0ULL;
+		sodi->writer.open[i].data = sodi->writer.openBuffers + i * sodi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+	}
+	if (!startCompressThreads(sodi, numThreads)) {
+		goto failPending;
+	}
+	/*
+	 * Grains are collected in a large buffer and bypass the page cache if
+	 * the filesystem allows it.  The buffer starts at an aligned position,
+	 * what comes before the first grain is metadata written at close.
+	 */
+	sodi->writer.directFd = open(fileName, O_WRONLY | O_DIRECT);
+	if (sodi->writer.directFd == -1) {
+		sodi->writer.directFd = sodi->writer.fd;
+	}
+	sodi->writer.numOutChunks = opts && opts->queueDepth ? opts->queueDepth : DEFAULT_QUEUE_DEPTH;
+	if (sodi->writer.numOutChunks > 1) {
+		sodi->writer.ring = IoRing_Create(sodi->writer.numOutChunks);
+	}
+	if (!sodi->writer.ring) {
+		sodi->writer.numOutChunks = 1;
+	}
+	sodi->writer.outChunks = calloc(sodi->writer.numOutChunks, sizeof *sodi->writer.outChunks);
+	if (!sodi->writer.outChunks ||
+	    posix_memalign((void **)&sodi->writer.outBuffers, OUTPUT_ALIGNMENT,
+	                   (size_t)sodi->writer.numOutChunks * OUTPUT_BUFFER_SIZE) != 0) {
+		sodi->writer.outBuffers = NULL;
+		goto failAll;
+	}
+	for (i = 0; i < sodi->writer.numOutChunks; i++) {
+		sodi->writer.outChunks[i].data = sodi->writer.outBuffers + (size_t)i * OUTPUT_BUFFER_SIZE;
+	}
+	sodi->writer.outBuffer = sodi->writer.outBuffers;
+	if (!sodi->writer.gdAtEnd) {
+		off_t pos = (off_t)sodi->writer.curSP * VMDK_SECTOR_SIZE;
+
+		sodi->writer.outStart = pos & ~(off_t)(OUTPUT_ALIGNMENT - 1);
+		sodi->writer.outLen = pos - sodi->writer.outStart;
+		memset(sodi->writer.outBuffer, 0, sodi->writer.outLen);
+		if (opts && opts->checkpoints && !openCheckpoint(sodi, opts->resume)) {
+			goto failAll;
+		}
+	} else if (!writePrologue(sodi)) {
 		goto failAll;
 	}
 	return &sodi->hdr;
 
 failAll:
+	if (sodi->writer.checkpointFd != -1) {
+		close(sodi->writer.checkpointFd);
+	}
+	stopCompressThreads(&sodi->writer);
+	drainOutput(&sodi->writer);
+	IoRing_Destroy(sodi->writer.ring);
+	if (sodi->writer.directFd != sodi->writer.fd) {
+		close(sodi->writer.directFd);
+	}
+	free(sodi->writer.outChunks);
+	free(sodi->writer.outBuffers);
+failPending:
+	free(sodi->writer.pending);
+	free(sodi->writer.pendingBuffers);
+	free(sodi->writer.open);
+	free(sodi->writer.openBuffers);
 	free(sodi->writer.zlibBuffer.data);
 failDeflate:
 	deflateEnd(&sodi->writer.zstream);
-failGrainBuffer:
-	free(sodi->writer.grainBuffer);
 failFD:
 	close(sodi->writer.fd);
-failGDGT:
+failBase:
+	closeBase(&sodi->writer);
+failHashes:
+	EVP_MD_CTX_free(sodi->writer.hashCtx);
+	EVP_MD_CTX_free(sodi->writer.contentCtx);
+	for (i = 0; i < NUM_DIGEST_TYPES; i++) {
+		EVP_MD_CTX_free(sodi->writer.digestCtx[i]);
+	}
+	free(sodi->writer.grainHashes);
 	free(sodi->writer.gtInfo.gd);
 failFileName:
+	free(sodi->writer.toolsVersion);
 	free(sodi->writer.fileName);
 failSODI:
 	free(sodi);
@@ -682,16 +2540,384 @@ fail:
 	return NULL;
 }
 
+/*
+ * Hosted sparse extent (monolithicSparse), as used by Workstation and Fusion.
+ * Grains are stored uncompressed and all-zero grains are left out, so this
+ * writes at the speed of the output.  The layout is header, descriptor,
+ * optionally the redundant grain directory and tables, the grain directory
+ * and tables, then the grains, aligned to the grain size.  Grains are
+ * allocated in the order they are first written, any order works.
+ */
 typedef struct {
 	DiskInfo hdr;
 	SparseExtentHeader diskHdr;
 	SparseGTInfo gtInfo;
-	uint8_t *readBuffer;
+	SectorType gtOffset;
+	SectorType rgtOffset;
+	SectorType curSP;	/* where the next grain goes */
+	int fd;
+	char *fileName;
+	char *toolsVersion;
+	unsigned short randomState[3];
 	uint8_t *grainBuffer;
+	Durability durability;
+} HostedSparseDiskInfo;
+
+static HostedSparseDiskInfo *
+getHSDI(DiskInfo *self)
+{
+	return (HostedSparseDiskInfo *)self;
+}
+
+static bool
+isZeroedBytes(const uint8_t *data,
+              size_t len)
+{
+	size_t aligned = len & ~(size_t)7;
+
+	if (!isZeroed(data, aligned)) {
+		return false;
+	}
+	for (; aligned < len; aligned++) {
+		if (data[aligned] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static ssize_t
+HostedSparsePwrite(DiskInfo *self,
+                   const void *buf,
+                   size_t len,
+                   off_t pos)
+{
+	HostedSparseDiskInfo *hsdi = getHSDI(self);
+	uint64_t grainBytes = hsdi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+	const uint8_t *buf8 = buf;
+	size_t left = len;
+
+	if (pos < 0 || (uint64_t)pos + len > hsdi->diskHdr.capacity * VMDK_SECTOR_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (left > 0) {
+		uint64_t grainNr = pos / grainBytes;
+		uint32_t skip = pos % grainBytes;
+		size_t n = grainBytes - skip;
+		uint32_t sect;
+
+		if (n > left) {
+			n = left;
+		}
+		sect = __le32_to_cpu(hsdi->gtInfo.gt[grainNr]);
+		if (sect == 0) {
+			if (isZeroedBytes(buf8, n)) {
+				/* Unallocated grains read as zeroes anyway. */
+				goto next;
+			}
+			if (hsdi->curSP + hsdi->diskHdr.grainSize > UINT32_MAX) {
+				errno = EFBIG;
+				return -1;
+			}
+			sect = hsdi->curSP;
+			hsdi->curSP += hsdi->diskHdr.grainSize;
+			hsdi->gtInfo.gt[grainNr] = __cpu_to_le32(sect);
+			if (n != grainBytes) {
+				/* Always write whole grains, the rest of a new grain is zero. */
+				memset(hsdi->grainBuffer, 0, grainBytes);
+				memcpy(hsdi->grainBuffer + skip, buf8, n);
+				Throttle_Write(grainBytes);
+				if (!safePwrite(hsdi->fd, hsdi->grainBuffer, grainBytes, (off_t)sect * VMDK_SECTOR_SIZE)) {
+					return -1;
+				}
+				goto next;
+			}
+		}
+		Throttle_Write(n);
+		if (!safePwrite(hsdi->fd, buf8, n, (off_t)sect * VMDK_SECTOR_SIZE + skip)) {
+			return -1;
+		}
+next:
+		buf8 += n;
+		pos += n;
+		left -= n;
+	}
+	return len;
+}
+
+static ssize_t
+HostedSparsePread(DiskInfo *self,
+                  void *buf,
+                  size_t len,
+                  off_t pos)
+{
+	HostedSparseDiskInfo *hsdi = getHSDI(self);
+	uint64_t grainBytes = hsdi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+	uint8_t *buf8 = buf;
+	size_t left = len;
+
+	if (pos < 0 || (uint64_t)pos + len > hsdi->diskHdr.capacity * VMDK_SECTOR_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (left > 0) {
+		uint64_t grainNr = pos / grainBytes;
+		uint32_t skip = pos % grainBytes;
+		size_t n = grainBytes - skip;
+		uint32_t sect;
+
+		if (n > left) {
+			n = left;
+		}
+		sect = __le32_to_cpu(hsdi->gtInfo.gt[grainNr]);
+		if (sect == 0) {
+			memset(buf8, 0, n);
+		} else if (!safePread(hsdi->fd, buf8, n, (off_t)sect * VMDK_SECTOR_SIZE + skip)) {
+			return -1;
+		}
+		buf8 += n;
+		pos += n;
+		left -= n;
+	}
+	return len;
+}
+
+static off_t
+HostedSparseGetCapacity(DiskInfo *self)
+{
+	return getHSDI(self)->diskHdr.capacity * VMDK_SECTOR_SIZE;
+}
+
+static int
+HostedSparseAbort(DiskInfo *self)
+{
+	HostedSparseDiskInfo *hsdi = getHSDI(self);
+	int ret;
+
+	ret = close(hsdi->fd);
+	free(hsdi->grainBuffer);
+	free(hsdi->gtInfo.gd);
+	free(hsdi->toolsVersion);
+	free(hsdi->fileName);
+	free(hsdi);
+	return ret;
+}
+
+/* Write the grain directory and tables, and their redundant copies. */
+static bool
+writeHostedTables(HostedSparseDiskInfo *hsdi)
+{
+	SparseGTInfo *gtInfo = &hsdi->gtInfo;
+	size_t metaSize = (gtInfo->GDsectors + gtInfo->GTsectors * gtInfo->GTs) * VMDK_SECTOR_SIZE;
+	uint32_t i;
+
+	if (hsdi->diskHdr.flags & SPARSEFLAG_USE_REDUNDANT) {
+		/* Same tables, the directory points to the redundant copies. */
+		__le32 *rgd = malloc(metaSize);
+
+		if (!rgd) {
+			return false;
+		}
+		memcpy(rgd, gtInfo->gd, metaSize);
+		for (i = 0; i < gtInfo->GTs; i++) {
+			rgd[i] = __cpu_to_le32(hsdi->rgtOffset + i * gtInfo->GTsectors);
+		}
+		if (!safePwrite(hsdi->fd, rgd, metaSize, hsdi->diskHdr.rgdOffset * VMDK_SECTOR_SIZE)) {
+			free(rgd);
+			return false;
+		}
+		free(rgd);
+	}
+	return safePwrite(hsdi->fd, gtInfo->gd, metaSize, hsdi->diskHdr.gdOffset * VMDK_SECTOR_SIZE);
+}
+
+/*
+ * The grains written so far and the tables that map them go to the
+ * media.  The header still says the disk is incomplete until it is closed.
+ */
+static int
+HostedSparseFlush(DiskInfo *self)
+{
+	HostedSparseDiskInfo *hsdi = getHSDI(self);
+
+	if (!writeHostedTables(hsdi)) {
+		return -1;
+	}
+	return fdatasync(hsdi->fd);
+}
+
+static int
+HostedSparseClose(DiskInfo *self)
+{
+	HostedSparseDiskInfo *hsdi = getHSDI(self);
+	SparseExtentHeaderOnDisk onDisk;
+	uint32_t contentID[3];
+	uint32_t cid;
+	char *descFile;
+
+	if (!writeHostedTables(hsdi)) {
+		goto failAll;
+	}
+	do {
+		cid = jrand48(hsdi->randomState);
+	} while (cid == 0xFFFFFFFFU || cid == 0xFFFFFFFEU);
+	contentID[0] = jrand48(hsdi->randomState);
+	contentID[1] = jrand48(hsdi->randomState);
+	contentID[2] = jrand48(hsdi->randomState);
+	descFile = makeDiskDescriptorFile(basename(hsdi->fileName), "monolithicSparse", hsdi->diskHdr.capacity, cid, contentID, hsdi->toolsVersion);
+	if (!descFile) {
+		goto failAll;
+	}
+	if (strlen(descFile) > hsdi->diskHdr.descriptorSize * VMDK_SECTOR_SIZE ||
+	    !safePwrite(hsdi->fd, descFile, strlen(descFile), hsdi->diskHdr.descriptorOffset * VMDK_SECTOR_SIZE)) {
+		free(descFile);
+		goto failAll;
+	}
+	free(descFile);
+	/* Metadata first, then the header that makes the file valid. */
+	if (!syncOutput(hsdi->fd, hsdi->durability, false)) {
+		goto failAll;
+	}
+	setSparseExtentHeader(&onDisk, &hsdi->diskHdr, false);
+	if (!safePwrite(hsdi->fd, &onDisk, sizeof onDisk, 0) ||
+	    !syncOutput(hsdi->fd, hsdi->durability, true)) {
+		goto failAll;
+	}
+	return HostedSparseAbort(self);
+
+failAll:
+	HostedSparseAbort(self);
+	return -1;
+}
+
+static DiskInfoVMT hostedSparseVMT = {
+	.getCapacity = HostedSparseGetCapacity,
+	.pread = HostedSparsePread,
+	.pwrite = HostedSparsePwrite,
+	.flush = HostedSparseFlush,
+	.close = HostedSparseClose,
+	.abort = HostedSparseAbort
+};
+
+DiskInfo *
+HostedSparse_Create(const char *fileName,
+                    off_t capacity,
+                    const SparseWriterOptions *opts)
+{
+	HostedSparseDiskInfo *hsdi;
+	SparseExtentHeaderOnDisk onDisk;
+	SectorType next;
+
+	hsdi = calloc(1, sizeof *hsdi);
+	if (!hsdi) {
+		goto fail;
+	}
+	hsdi->hdr.vmt = &hostedSparseVMT;
+	hsdi->fileName = strdup(fileName);
+	hsdi->toolsVersion = strdup(opts && opts->toolsVersion ? opts->toolsVersion : DEFAULT_TOOLS_VERSION);
+	if (!hsdi->fileName || !hsdi->toolsVersion) {
+		goto failNames;
+	}
+	hsdi->diskHdr.version = 1;
+	hsdi->diskHdr.flags = SPARSEFLAG_VALID_NEWLINE_DETECTOR;
+	if (opts && opts->redundantGD) {
+		hsdi->diskHdr.flags |= SPARSEFLAG_USE_REDUNDANT;
+	}
+	hsdi->durability = opts ? opts->durability : DURABILITY_FULL;
+	hsdi->diskHdr.numGTEsPerGT = 512;
+	hsdi->diskHdr.compressAlgorithm = SPARSE_COMPRESSALGORITHM_NONE;
+	hsdi->diskHdr.grainSize = 128;
+	hsdi->diskHdr.capacity = CEILING(capacity, VMDK_SECTOR_SIZE);
+	if (!getGDGT(&hsdi->gtInfo, &hsdi->diskHdr)) {
+		goto failNames;
+	}
+	hsdi->grainBuffer = malloc(hsdi->diskHdr.grainSize * VMDK_SECTOR_SIZE);
+	if (!hsdi->grainBuffer) {
+		goto failGD;
+	}
+	if (!opts || !opts->reproducible) {
+		randomizeState(hsdi->randomState);
+	} else if (opts->seeded) {
+		/* The grains are not hashed, the identifiers come from the seed. */
+		seedState(hsdi->randomState, opts->seed);
+	} else {
+		errno = EINVAL;
+		goto failBuffer;
+	}
+
+	hsdi->diskHdr.descriptorOffset = 1;
+	hsdi->diskHdr.descriptorSize = 20;
+	next = hsdi->diskHdr.descriptorOffset + hsdi->diskHdr.descriptorSize;
+	if (hsdi->diskHdr.flags & SPARSEFLAG_USE_REDUNDANT) {
+		hsdi->diskHdr.rgdOffset = next;
+		hsdi->rgtOffset = next + hsdi->gtInfo.GDsectors;
+		next = hsdi->rgtOffset + hsdi->gtInfo.GTsectors * hsdi->gtInfo.GTs;
+	}
+	hsdi->diskHdr.gdOffset = next;
+	hsdi->gtOffset = next + hsdi->gtInfo.GDsectors;
+	next = prefillGD(&hsdi->gtInfo, hsdi->gtOffset);
+	hsdi->diskHdr.overHead = CEILING(next, hsdi->diskHdr.grainSize) * hsdi->diskHdr.grainSize;
+	hsdi->curSP = hsdi->diskHdr.overHead;
+
+	hsdi->fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (hsdi->fd == -1) {
+		goto failBuffer;
+	}
+	/* Not a valid disk until the final header is written on close. */
+	setSparseExtentHeader(&onDisk, &hsdi->diskHdr, true);
+	if (!safePwrite(hsdi->fd, &onDisk, sizeof onDisk, 0) ||
+	    ftruncate(hsdi->fd, hsdi->diskHdr.overHead * VMDK_SECTOR_SIZE) != 0) {
+		goto failFD;
+	}
+	return &hsdi->hdr;
+
+failFD:
+	close(hsdi->fd);
+failBuffer:
+	free(hsdi->grainBuffer);
+failGD:
+	free(hsdi->gtInfo.gd);
+failNames:
+	free(hsdi->toolsVersion);
+	free(hsdi->fileName);
+	free(hsdi);
+fail:
+	return NULL;
+}
+
+/*
+ * Snapshot chains.  A child disk refers to its parent through
+ * parentFileNameHint and parentCID in its descriptor; grains the child does
+ * not have are read from the nearest parent that has them.
+ */
+#define SPARSE_MAX_CHAIN	64
+#define GRAIN_LAYER_BACKING	0xfe	/* grain comes from a non-sparse base disk */
+#define GRAIN_LAYER_NONE	0xff	/* grain is not allocated anywhere */
+
+/*
+ * Inflated grains kept per compressed extent, direct mapped by grain
+ * number.  Small reads, as from an NBD client, then inflate a grain once.
+ */
+#define SPARSE_CACHED_GRAINS	16
+
+typedef struct SparseDiskInfo SparseDiskInfo;
+
+struct SparseDiskInfo {
+	DiskInfo hdr;
+	SparseExtentHeader diskHdr;
+	SparseGTInfo gtInfo;
+	uint8_t *readBuffer;
+	uint8_t *grainBuffer;		/* SPARSE_CACHED_GRAINS inflated grains */
+	uint32_t cachedGrain[SPARSE_CACHED_GRAINS];	/* ~0U for an empty slot */
 	size_t readBufferSize;
 	z_stream zstream;
 	int fd;
-} SparseDiskInfo;
+	SparseDiskInfo **parents;	/* nearest parent first */
+	unsigned int numParents;
+	DiskInfo *backing;		/* flat disk at the bottom of the chain, if any */
+	uint8_t *grainLayer;		/* per grain: 0 for this disk, i + 1 for parents[i] */
+};
 
 typedef struct {
 	off_t pos;
@@ -742,6 +2968,16 @@ getSDI(DiskInfo *self)
 	return (SparseDiskInfo *)self;
 }
 
+static uint8_t
+grainOwner(const SparseDiskInfo *sdi,
+           uint32_t grainNr)
+{
+	if (sdi->grainLayer) {
+		return sdi->grainLayer[grainNr];
+	}
+	return sdi->gtInfo.gt[grainNr] == __cpu_to_le32(0) ? GRAIN_LAYER_NONE : 0;
+}
+
 static off_t
 SparseGetCapacity(DiskInfo *self)
 {
@@ -761,8 +2997,13 @@ SparseNextData(DiskInfo *self,
 	uint32_t skip = p & (sdi->diskHdr.grainSize * VMDK_SECTOR_SIZE - 1);
 	bool want = false;
 
+	/* The last grain may be partial, *end can be the end of the disk. */
+	if ((uint64_t)p >= sdi->diskHdr.capacity * VMDK_SECTOR_SIZE) {
+		errno = ENXIO;
+		return -1;
+	}
 	while (grainNr < sdi->gtInfo.GTEs) {
-		bool empty = sdi->gtInfo.gt[grainNr] == __cpu_to_le32(0);
+		bool empty = grainOwner(sdi, grainNr) == GRAIN_LAYER_NONE;
 
 		if (empty == want) {
 			if (want) {
@@ -779,8 +3020,123 @@ SparseNextData(DiskInfo *self,
 		*end = sdi->gtInfo.lastGrainNr * (sdi->diskHdr.grainSize * VMDK_SECTOR_SIZE) + sdi->gtInfo.lastGrainSize;
 		return 0;
 	}
-	errno = ENXIO;
-	return -1;
+	errno = ENXIO;
+	return -1;
+}
+
+/*
+ * Read part of grain grainNr from one layer of the chain.  Parents may be
+ * smaller than the child, anything past the end of the layer reads as zeroes.
+ */
+static bool
+readGrain(SparseDiskInfo *sdi,
+          uint32_t grainNr,
+          uint8_t *buf8,
+          uint32_t readSkip,
+          uint32_t readLen)
+{
+	uint32_t sect;
+	uint32_t grainSize;
+
+	if (grainNr < sdi->gtInfo.lastGrainNr) {
+		grainSize = sdi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+	} else if (grainNr == sdi->gtInfo.lastGrainNr) {
+		grainSize = sdi->gtInfo.lastGrainSize;
+	} else {
+		grainSize = 0;
+	}
+	if (readSkip >= grainSize) {
+		memset(buf8, 0, readLen);
+		return true;
+	}
+	if (readLen > grainSize - readSkip) {
+		memset(buf8 + grainSize - readSkip, 0, readLen - (grainSize - readSkip));
+		readLen = grainSize - readSkip;
+	}
+
+	sect = __le32_to_cpu(sdi->gtInfo.gt[grainNr]);
+	if (sect <= 1) {
+		memset(buf8, 0, readLen);
+	} else if (sdi->diskHdr.flags & SPARSEFLAG_COMPRESSED) {
+		uint32_t slot = grainNr % SPARSE_CACHED_GRAINS;
+		uint8_t *grain = sdi->grainBuffer + slot * sdi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+		uint32_t hdrlen;
+		uint32_t cmpSize;
+
+		if (sdi->cachedGrain[slot] == grainNr) {
+			memcpy(buf8, grain + readSkip, readLen);
+			return true;
+		}
+		sdi->cachedGrain[slot] = ~0U;
+		if (!safePread(sdi->fd, sdi->readBuffer, VMDK_SECTOR_SIZE, sect * VMDK_SECTOR_SIZE)) {
+			return false;
+		}
+		if (sdi->diskHdr.flags & SPARSEFLAG_EMBEDDED_LBA) {
+			SparseGrainLBAHeaderOnDisk *hdr = (SparseGrainLBAHeaderOnDisk *)sdi->readBuffer;
+
+			if (__le64_to_cpu(hdr->lba) != grainNr * sdi->diskHdr.grainSize) {
+				return false;
+			}
+			cmpSize = __le32_to_cpu(hdr->cmpSize);
+			hdrlen = 12;
+		} else {
+			cmpSize = __le32_to_cpu(*(__le32*)sdi->readBuffer);
+			hdrlen = 4;
+		}
+		if (cmpSize > sdi->readBufferSize - hdrlen) {
+			return false;
+		}
+		if (cmpSize + hdrlen > VMDK_SECTOR_SIZE) {
+			size_t remainingLength = (cmpSize + hdrlen - VMDK_SECTOR_SIZE + VMDK_SECTOR_SIZE - 1) & ~(VMDK_SECTOR_SIZE - 1);
+
+			if (!safePread(sdi->fd, sdi->readBuffer + VMDK_SECTOR_SIZE, remainingLength, (sect + 1) * VMDK_SECTOR_SIZE)) {
+				return false;
+			}
+		}
+		if (inflateReset(&sdi->zstream) != Z_OK) {
+			return false;
+		}
+		sdi->zstream.next_in = sdi->readBuffer + hdrlen;
+		sdi->zstream.avail_in = cmpSize;
+		sdi->zstream.next_out = grain;
+		sdi->zstream.avail_out = sdi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+		if (inflate(&sdi->zstream, Z_FINISH) != Z_STREAM_END) {
+			return false;
+		}
+		if (sdi->diskHdr.grainSize * VMDK_SECTOR_SIZE - sdi->zstream.avail_out < grainSize) {
+			return false;
+		}
+		sdi->cachedGrain[slot] = grainNr;
+		memcpy(buf8, grain + readSkip, readLen);
+	} else {
+		if (!safePread(sdi->fd, buf8, readLen, sect * VMDK_SECTOR_SIZE + readSkip)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+readBacking(DiskInfo *backing,
+            uint8_t *buf8,
+            size_t len,
+            off_t pos)
+{
+	off_t capacity = backing->vmt->getCapacity(backing);
+	ssize_t rd = 0;
+
+	if (pos < capacity) {
+		if ((off_t)len > capacity - pos) {
+			rd = backing->vmt->pread(backing, buf8, capacity - pos, pos);
+		} else {
+			rd = backing->vmt->pread(backing, buf8, len, pos);
+		}
+		if (rd < 0) {
+			return false;
+		}
+	}
+	memset(buf8 + rd, 0, len - rd);
+	return true;
 }
 
 static ssize_t
@@ -796,8 +3152,9 @@ SparsePread(DiskInfo *self,
 
 	while (len > 0) {
 		uint32_t readLen;
-		uint32_t sect;
 		uint32_t grainSize;
+		uint8_t owner;
+		bool ok;
 
 		if (grainNr < sdi->gtInfo.lastGrainNr) {
 			grainSize = sdi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
@@ -810,62 +3167,23 @@ SparsePread(DiskInfo *self,
 			break;
 		}
 		readLen = grainSize - readSkip;
+		if (readLen > len) {
+			readLen = len;
+		}
 
-		sect = __le32_to_cpu(sdi->gtInfo.gt[grainNr]);
-		if (sect == 0) {
-			/* Read from parent... No parent for us... */
-			memset(buf8, 0, readLen);
-		} else if (sect == 1) {
+		owner = grainOwner(sdi, grainNr);
+		if (owner == GRAIN_LAYER_NONE) {
 			memset(buf8, 0, readLen);
+			ok = true;
+		} else if (owner == GRAIN_LAYER_BACKING) {
+			ok = readBacking(sdi->backing, buf8, readLen, (off_t)grainNr * sdi->diskHdr.grainSize * VMDK_SECTOR_SIZE + readSkip);
+		} else if (owner == 0) {
+			ok = readGrain(sdi, grainNr, buf8, readSkip, readLen);
 		} else {
-			if (sdi->diskHdr.flags & SPARSEFLAG_COMPRESSED) {
-				uint32_t hdrlen;
-				uint32_t cmpSize;
-
-				if (!safePread(sdi->fd, sdi->readBuffer, VMDK_SECTOR_SIZE, sect * VMDK_SECTOR_SIZE)) {
-					return -1;
-				}
-				if (sdi->diskHdr.flags & SPARSEFLAG_EMBEDDED_LBA) {
-					SparseGrainLBAHeaderOnDisk *hdr = (SparseGrainLBAHeaderOnDisk *)sdi->readBuffer;
-
-					if (__le64_to_cpu(hdr->lba) != grainNr * sdi->diskHdr.grainSize) {
-						return -1;
-					}
-					cmpSize = __le32_to_cpu(hdr->cmpSize);
-					hdrlen = 12;
-				} else {
-					cmpSize = __le32_to_cpu(*(__le32*)sdi->readBuffer);
-					hdrlen = 4;
-				}
-				if (cmpSize > sdi->readBufferSize - hdrlen) {
-					return -1;
-				}
-				if (cmpSize + hdrlen > VMDK_SECTOR_SIZE) {
-					size_t remainingLength = (cmpSize + hdrlen - VMDK_SECTOR_SIZE + VMDK_SECTOR_SIZE - 1) & ~(VMDK_SECTOR_SIZE - 1);
-
-					if (!safePread(sdi->fd, sdi->readBuffer + VMDK_SECTOR_SIZE, remainingLength, (sect + 1) * VMDK_SECTOR_SIZE)) {
-						return -1;
-					}
-				}
-				if (inflateReset(&sdi->zstream) != Z_OK) {
-					return -1;
-				}
-				sdi->zstream.next_in = sdi->readBuffer + hdrlen;
-				sdi->zstream.avail_in = cmpSize;
-				sdi->zstream.next_out = sdi->grainBuffer;
-				sdi->zstream.avail_out = sdi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
-				if (inflate(&sdi->zstream, Z_FINISH) != Z_STREAM_END) {
-					return -1;
-				}
-				if (sdi->diskHdr.grainSize * VMDK_SECTOR_SIZE - sdi->zstream.avail_out < grainSize) {
-					return -1;
-				}
-				memcpy(buf8, sdi->grainBuffer + readSkip, readLen);
-			} else {
-				if (!safePread(sdi->fd, buf8, readLen, sect * VMDK_SECTOR_SIZE + readSkip)) {
-					return -1;
-				}
-			}
+			ok = readGrain(sdi->parents[owner - 1], grainNr, buf8, readSkip, readLen);
+		}
+		if (!ok) {
+			return -1;
 		}
 		buf8 += readLen;
 		len -= readLen;
@@ -879,8 +3197,17 @@ static int
 SparseClose(DiskInfo *self)
 {
 	SparseDiskInfo *sdi = getSDI(self);
+	unsigned int i;
 	int fd;
 
+	for (i = 0; i < sdi->numParents; i++) {
+		SparseClose(&sdi->parents[i]->hdr);
+	}
+	free(sdi->parents);
+	if (sdi->backing) {
+		sdi->backing->vmt->close(sdi->backing);
+	}
+	free(sdi->grainLayer);
 	if (sdi->readBuffer) {
 		inflateEnd(&sdi->zstream);
 		free(sdi->readBuffer);
@@ -900,8 +3227,12 @@ static DiskInfoVMT sparseVMT = {
 	.abort = SparseClose,
 };
 
-DiskInfo *
-Sparse_Open(const char *fileName)
+/*
+ * Open a single sparse extent, without following its parents.  Fails with
+ * EMEDIUMTYPE if the file is not a sparse extent at all.
+ */
+static SparseDiskInfo *
+openExtent(const char *fileName)
 {
 	SparseDiskInfo *sdi;
 	int fd;
@@ -914,10 +3245,9 @@ Sparse_Open(const char *fileName)
 	if (fd == -1) {
 		goto fail;
 	}
-	if (read(fd, &onDisk, sizeof onDisk) != sizeof onDisk) {
-		goto failFd;
-	}
-	if (!checkSparseExtentHeader(&onDisk)) {
+	if (read(fd, &onDisk, sizeof onDisk) != sizeof onDisk ||
+	    !checkSparseExtentHeader(&onDisk)) {
+		errno = EMEDIUMTYPE;
 		goto failFd;
 	}
 	sdi = malloc(sizeof *sdi);
@@ -930,16 +3260,32 @@ Sparse_Open(const char *fileName)
 		goto failSdi;
 	}
 	sdi->hdr.vmt = &sparseVMT;
+	/* Stream optimized disks written in one pass have the real header at the end. */
+	if (sdi->diskHdr.gdOffset == SPARSE_GD_AT_END) {
+		struct stat stb;
+
+		if (fstat(fd, &stb) || stb.st_size < 3 * (off_t)VMDK_SECTOR_SIZE) {
+			goto failSdi;
+		}
+		if (!safePread(fd, &onDisk, sizeof onDisk, stb.st_size - 2 * VMDK_SECTOR_SIZE)) {
+			goto failSdi;
+		}
+		if (!getSparseExtentHeader(&sdi->diskHdr, &onDisk) ||
+		    sdi->diskHdr.gdOffset == SPARSE_GD_AT_END) {
+			goto failSdi;
+		}
+	}
 	if (!getGDGT(&sdi->gtInfo, &sdi->diskHdr)) {
 		goto failSdi;
 	}
 	if (sdi->diskHdr.flags & SPARSEFLAG_COMPRESSED) {
-		sdi->readBuffer = malloc((sdi->diskHdr.grainSize * 2 + 1) * VMDK_SECTOR_SIZE);
+		sdi->readBuffer = malloc((sdi->diskHdr.grainSize * (SPARSE_CACHED_GRAINS + 1) + 1) * VMDK_SECTOR_SIZE);
 		if (sdi->readBuffer == NULL) {
 			goto failGDGT;
 		}
 		sdi->readBufferSize = (sdi->diskHdr.grainSize + 1) * VMDK_SECTOR_SIZE;
 		sdi->grainBuffer = sdi->readBuffer + sdi->readBufferSize;
+		memset(sdi->cachedGrain, 0xff, sizeof sdi->cachedGrain);
 		sdi->zstream.zalloc = NULL;
 		sdi->zstream.zfree = NULL;
 		sdi->zstream.opaque = sdi;
@@ -965,7 +3311,7 @@ Sparse_Open(const char *fileName)
 	if (CoalescedPreaderExec(&cp)) {
 		goto failDF;
 	}
-	return &sdi->hdr;
+	return sdi;
 
 failDF:
 	if (sdi->readBuffer) {
@@ -983,3 +3329,574 @@ fail:
 	return NULL;
 }
 
+/*
+ * Return the embedded descriptor of an extent as a string, or NULL if it
+ * has none.
+ */
+static char *
+readDescriptor(int fd,
+               const SparseExtentHeader *hdr)
+{
+	size_t len = hdr->descriptorSize * VMDK_SECTOR_SIZE;
+	char *desc;
+
+	if (hdr->descriptorOffset == 0 || len == 0 || len > 1024 * 1024) {
+		errno = ENODATA;
+		return NULL;
+	}
+	desc = malloc(len + 1);
+	if (desc == NULL) {
+		return NULL;
+	}
+	if (!safePread(fd, desc, len, hdr->descriptorOffset * VMDK_SECTOR_SIZE)) {
+		free(desc);
+		return NULL;
+	}
+	desc[len] = '\0';
+	return desc;
+}
+
+/*
+ * Embedded descriptor of a sparse extent, without reading its grain tables.
+ * Fails with EMEDIUMTYPE if the file is not a sparse extent.
+ */
+char *
+Sparse_ReadDescriptor(const char *fileName)
+{
+	SparseExtentHeaderOnDisk onDisk;
+	SparseExtentHeader hdr;
+	char *desc = NULL;
+	int fd;
+
+	fd = open(fileName, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+	if (read(fd, &onDisk, sizeof onDisk) != sizeof onDisk ||
+	    !checkSparseExtentHeader(&onDisk)) {
+		errno = EMEDIUMTYPE;
+	} else if (!getSparseExtentHeader(&hdr, &onDisk)) {
+		errno = EINVAL;
+	} else {
+		desc = readDescriptor(fd, &hdr);
+	}
+	close(fd);
+	return desc;
+}
+
+/*
+ * Follow parentFileNameHint from the descriptor of sdi down to the base disk
+ * and check every link against parentCID, so that a parent modified after
+ * the child was created is not silently mixed in.
+ */
+static bool
+openChain(SparseDiskInfo *sdi,
+          const char *fileName)
+{
+	SparseDiskInfo *layer = sdi;
+	char *desc = readDescriptor(sdi->fd, &sdi->diskHdr);
+	char *path = strdup(fileName);
+	uint32_t parentCID;
+	bool ok = false;
+
+	if (path == NULL) {
+		goto out;
+	}
+	while (desc && (parentCID = Descriptor_GetCID(desc, "parentCID")) != 0xFFFFFFFFU) {
+		char *hint = Descriptor_GetValue(desc, "parentFileNameHint");
+		char *parentPath;
+		SparseDiskInfo *parent;
+		SparseDiskInfo **parents;
+
+		if (hint == NULL) {
+			fprintf(stderr, "%s: parentCID without parentFileNameHint\n", path);
+			errno = EINVAL;
+			goto out;
+		}
+		parentPath = Descriptor_ParentFileName(path, hint);
+		free(hint);
+		if (parentPath == NULL) {
+			goto out;
+		}
+		free(path);
+		path = parentPath;
+
+		parent = openExtent(path);
+		if (parent == NULL) {
+			if (errno != EMEDIUMTYPE) {
+				fprintf(stderr, "Cannot open parent disk %s: %s\n", path, strerror(errno));
+				goto out;
+			}
+			/* Not a sparse extent - let Disk_Open figure out what it is. */
+			sdi->backing = Disk_Open(path);
+			if (sdi->backing == NULL) {
+				fprintf(stderr, "Cannot open parent disk %s: %s\n", path, strerror(errno));
+				goto out;
+			}
+			/* Raw images have no CID to check, descriptor files do. */
+			free(desc);
+			desc = Descriptor_Load(path);
+			if (desc && Descriptor_GetCID(desc, "CID") != parentCID) {
+				fprintf(stderr, "%s: content ID does not match parentCID %08x of its child, the parent was modified\n", path, parentCID);
+				errno = ESTALE;
+				goto out;
+			}
+			break;
+		}
+		if (sdi->numParents == SPARSE_MAX_CHAIN) {
+			fprintf(stderr, "%s: snapshot chain is too long\n", fileName);
+			SparseClose(&parent->hdr);
+			errno = ELOOP;
+			goto out;
+		}
+		parents = realloc(sdi->parents, (sdi->numParents + 1) * sizeof *parents);
+		if (parents == NULL) {
+			SparseClose(&parent->hdr);
+			goto out;
+		}
+		sdi->parents = parents;
+		sdi->parents[sdi->numParents++] = parent;
+		layer = parent;
+
+		free(desc);
+		desc = readDescriptor(layer->fd, &layer->diskHdr);
+		if (desc == NULL || Descriptor_GetCID(desc, "CID") != parentCID) {
+			fprintf(stderr, "%s: content ID does not match parentCID %08x of its child, the parent was modified\n", path, parentCID);
+			errno = ESTALE;
+			goto out;
+		}
+		if (layer->diskHdr.grainSize != sdi->diskHdr.grainSize) {
+			fprintf(stderr, "%s: grain size differs from its child\n", path);
+			errno = EINVAL;
+			goto out;
+		}
+	}
+	ok = true;
+out:
+	free(path);
+	free(desc);
+	return ok;
+}
+
+/*
+ * Resolve every grain to the topmost layer that has it, so that reads and
+ * nextData() do not walk the chain again for each grain.
+ */
+static bool
+mergeChain(SparseDiskInfo *sdi)
+{
+	uint32_t GTEs = sdi->gtInfo.GTEs;
+	off_t grainBytes = sdi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+	unsigned int i;
+	uint32_t g;
+
+	sdi->grainLayer = malloc(GTEs);
+	if (sdi->grainLayer == NULL) {
+		return false;
+	}
+	memset(sdi->grainLayer, GRAIN_LAYER_NONE, GTEs);
+	for (i = 0; i <= sdi->numParents; i++) {
+		const SparseDiskInfo *layer = i ? sdi->parents[i - 1] : sdi;
+		uint32_t n = layer->gtInfo.GTEs < GTEs ? layer->gtInfo.GTEs : GTEs;
+
+		for (g = 0; g < n; g++) {
+			if (sdi->grainLayer[g] == GRAIN_LAYER_NONE &&
+			    layer->gtInfo.gt[g] != __cpu_to_le32(0)) {
+				sdi->grainLayer[g] = i;
+			}
+		}
+	}
+	if (sdi->backing) {
+		off_t pos = 0;
+		off_t end = 0;
+
+		while (sdi->backing->vmt->nextData(sdi->backing, &pos, &end) == 0) {
+			for (g = pos / grainBytes; g < GTEs && (off_t)g * grainBytes < end; g++) {
+				if (sdi->grainLayer[g] == GRAIN_LAYER_NONE) {
+					sdi->grainLayer[g] = GRAIN_LAYER_BACKING;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+DiskInfo *
+Sparse_Open(const char *fileName)
+{
+	SparseDiskInfo *sdi;
+
+	sdi = openExtent(fileName);
+	if (sdi == NULL) {
+		return NULL;
+	}
+	if (!openChain(sdi, fileName) ||
+	    ((sdi->numParents || sdi->backing) && !mergeChain(sdi))) {
+		int err = errno;
+
+		SparseClose(&sdi->hdr);
+		errno = err;
+		return NULL;
+	}
+	return &sdi->hdr;
+}
+
+/*
+ * Reading a streamOptimized disk from a pipe, e.g. straight out of an OVA.
+ * Every grain carries its LBA, so the grains can be decoded in the order
+ * they come without the grain directory.  nextData() reads and inflates the
+ * next grain, pread() can only read from that grain.
+ */
+typedef struct {
+	DiskInfo hdr;
+	SparseExtentHeader diskHdr;
+	int fd;
+	z_stream zstream;
+	uint8_t *readBuffer;
+	size_t readBufferSize;
+	uint8_t *grainBuffer;
+	off_t grainPos;		/* data in grainBuffer */
+	off_t grainEnd;
+	bool eos;
+} SparseStreamDiskInfo;
+
+static SparseStreamDiskInfo *
+getSSDI(DiskInfo *self)
+{
+	return (SparseStreamDiskInfo *)self;
+}
+
+/* Read exactly len bytes, a stream ending early is an error. */
+static bool
+streamRead(int fd,
+           void *buf,
+           size_t len)
+{
+	uint8_t *buf8 = buf;
+
+	while (len > 0) {
+		ssize_t r = read(fd, buf8, len);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		if (r == 0) {
+			errno = EIO;
+			return false;
+		}
+		buf8 += r;
+		len -= r;
+	}
+	return true;
+}
+
+static bool
+streamSkip(SparseStreamDiskInfo *ssdi,
+           uint64_t sectors)
+{
+	while (sectors > 0) {
+		uint64_t n = ssdi->readBufferSize / VMDK_SECTOR_SIZE;
+
+		if (n > sectors) {
+			n = sectors;
+		}
+		if (!streamRead(ssdi->fd, ssdi->readBuffer, n * VMDK_SECTOR_SIZE)) {
+			return false;
+		}
+		sectors -= n;
+	}
+	return true;
+}
+
+static off_t
+SparseStreamGetCapacity(DiskInfo *self)
+{
+	SparseStreamDiskInfo *ssdi = getSSDI(self);
+
+	return ssdi->diskHdr.capacity * VMDK_SECTOR_SIZE;
+}
+
+static int
+SparseStreamNextData(DiskInfo *self,
+                     off_t *pos,
+                     off_t *end)
+{
+	SparseStreamDiskInfo *ssdi = getSSDI(self);
+	uint64_t grainBytes = ssdi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+	uint64_t capacity = ssdi->diskHdr.capacity * VMDK_SECTOR_SIZE;
+
+	while (!ssdi->eos) {
+		SparseSpecialLBAHeaderOnDisk *marker = (SparseSpecialLBAHeaderOnDisk *)ssdi->readBuffer;
+		uint64_t lba;
+		uint32_t cmpSize;
+		size_t len;
+
+		if (!streamRead(ssdi->fd, ssdi->readBuffer, VMDK_SECTOR_SIZE)) {
+			return -1;
+		}
+		lba = __le64_to_cpu(marker->lba);
+		cmpSize = __le32_to_cpu(marker->cmpSize);
+		if (cmpSize == 0) {
+			/* Metadata follows, lba is its length in sectors. */
+			if (__le32_to_cpu(marker->type) == GRAIN_MARKER_EOS) {
+				ssdi->eos = true;
+			} else if (!streamSkip(ssdi, lba)) {
+				return -1;
+			}
+			continue;
+		}
+		len = CEILING(sizeof(SparseGrainLBAHeaderOnDisk) + cmpSize, VMDK_SECTOR_SIZE) * VMDK_SECTOR_SIZE;
+		if (len > ssdi->readBufferSize ||
+		    lba % ssdi->diskHdr.grainSize != 0 ||
+		    lba * VMDK_SECTOR_SIZE >= capacity) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (!streamRead(ssdi->fd, ssdi->readBuffer + VMDK_SECTOR_SIZE, len - VMDK_SECTOR_SIZE)) {
+			return -1;
+		}
+		ssdi->grainPos = lba * VMDK_SECTOR_SIZE;
+		ssdi->grainEnd = ssdi->grainPos + grainBytes;
+		if ((uint64_t)ssdi->grainEnd > capacity) {
+			ssdi->grainEnd = capacity;
+		}
+		if (inflateReset(&ssdi->zstream) != Z_OK) {
+			errno = EINVAL;
+			return -1;
+		}
+		ssdi->zstream.next_in = ssdi->readBuffer + sizeof(SparseGrainLBAHeaderOnDisk);
+		ssdi->zstream.avail_in = cmpSize;
+		ssdi->zstream.next_out = ssdi->grainBuffer;
+		ssdi->zstream.avail_out = grainBytes;
+		if (inflate(&ssdi->zstream, Z_FINISH) != Z_STREAM_END ||
+		    grainBytes - ssdi->zstream.avail_out < (uint64_t)(ssdi->grainEnd - ssdi->grainPos)) {
+			errno = EINVAL;
+			return -1;
+		}
+		*pos = ssdi->grainPos;
+		*end = ssdi->grainEnd;
+		return 0;
+	}
+	errno = ENXIO;
+	return -1;
+}
+
+static ssize_t
+SparseStreamPread(DiskInfo *self,
+                  void *buf,
+                  size_t len,
+                  off_t pos)
+{
+	SparseStreamDiskInfo *ssdi = getSSDI(self);
+
+	if (pos < ssdi->grainPos || pos + (off_t)len > ssdi->grainEnd) {
+		errno = ESPIPE;
+		return -1;
+	}
+	memcpy(buf, ssdi->grainBuffer + (pos - ssdi->grainPos), len);
+	return len;
+}
+
+static int
+SparseStreamClose(DiskInfo *self)
+{
+	SparseStreamDiskInfo *ssdi = getSSDI(self);
+
+	inflateEnd(&ssdi->zstream);
+	free(ssdi->readBuffer);
+	free(ssdi->grainBuffer);
+	free(ssdi);
+	return 0;
+}
+
+static DiskInfoVMT sparseStreamVMT = {
+	.getCapacity = SparseStreamGetCapacity,
+	.nextData = SparseStreamNextData,
+	.pread = SparseStreamPread,
+	.close = SparseStreamClose,
+	.abort = SparseStreamClose,
+};
+
+/*
+ * Open a streamOptimized disk that can only be read in order from fd, which
+ * stays open.  Grains are returned by nextData() in the order they appear.
+ */
+DiskInfo *
+Sparse_OpenStream(int fd)
+{
+	SparseStreamDiskInfo *ssdi;
+	SparseExtentHeaderOnDisk onDisk;
+	uint64_t grainBytes;
+
+	ssdi = calloc(1, sizeof *ssdi);
+	if (!ssdi) {
+		goto fail;
+	}
+	ssdi->hdr.vmt = &sparseStreamVMT;
+	ssdi->fd = fd;
+	if (!streamRead(fd, &onDisk, sizeof onDisk)) {
+		goto failSSDI;
+	}
+	if (!getSparseExtentHeader(&ssdi->diskHdr, &onDisk) ||
+	    !(ssdi->diskHdr.flags & SPARSEFLAG_EMBEDDED_LBA) ||
+	    ssdi->diskHdr.compressAlgorithm != SPARSE_COMPRESSALGORITHM_DEFLATE ||
+	    ssdi->diskHdr.grainSize < 1 || ssdi->diskHdr.grainSize > 128 ||
+	    !isPow2(ssdi->diskHdr.grainSize) ||
+	    ssdi->diskHdr.overHead < 1) {
+		errno = EMEDIUMTYPE;
+		goto failSSDI;
+	}
+	grainBytes = ssdi->diskHdr.grainSize * VMDK_SECTOR_SIZE;
+	if (inflateInit(&ssdi->zstream) != Z_OK) {
+		goto failSSDI;
+	}
+	/* A grain never compresses to more than twice its size. */
+	ssdi->readBufferSize = 2 * grainBytes + VMDK_SECTOR_SIZE;
+	ssdi->readBuffer = malloc(ssdi->readBufferSize);
+	ssdi->grainBuffer = malloc(grainBytes);
+	if (!ssdi->readBuffer || !ssdi->grainBuffer) {
+		goto failBuffers;
+	}
+	/* Skip the descriptor and any grain directory and tables before the grains. */
+	if (!streamSkip(ssdi, ssdi->diskHdr.overHead - 1)) {
+		goto failBuffers;
+	}
+	return &ssdi->hdr;
+
+failBuffers:
+	free(ssdi->readBuffer);
+	free(ssdi->grainBuffer);
+	inflateEnd(&ssdi->zstream);
+failSSDI:
+	free(ssdi);
+fail:
+	return NULL;
+}
+
+
+static bool
+openBase(SparseVmdkWriter *writer,
+         const char *baseFileName,
+         const char *fileName,
+         const SparseExtentHeader *hdr)
+{
+	SparseDiskInfo *sdi;
+	const GrainHashFileHeader *hashHdr;
+	struct stat stb;
+	struct stat dstStb;
+	char *hashFileName;
+	int fd;
+
+	if (stat(fileName, &dstStb) == 0 && stat(baseFileName, &stb) == 0 &&
+	    stb.st_dev == dstStb.st_dev && stb.st_ino == dstStb.st_ino) {
+		fprintf(stderr, "Base disk %s cannot be the destination\n", baseFileName);
+		return false;
+	}
+	writer->base = Sparse_Open(baseFileName);
+	if (!writer->base) {
+		fprintf(stderr, "Cannot open base disk %s\n", baseFileName);
+		return false;
+	}
+	sdi = getSDI(writer->base);
+	if (!(sdi->diskHdr.flags & SPARSEFLAG_COMPRESSED) ||
+	    !(sdi->diskHdr.flags & SPARSEFLAG_EMBEDDED_LBA) ||
+	    sdi->diskHdr.grainSize != hdr->grainSize) {
+		fprintf(stderr, "Base disk %s is not a compatible streamOptimized disk\n", baseFileName);
+		goto failBase;
+	}
+	if (fstat(sdi->fd, &stb)) {
+		goto failBase;
+	}
+	hashFileName = grainHashFileName(baseFileName);
+	if (!hashFileName) {
+		goto failBase;
+	}
+	fd = open(hashFileName, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Cannot open grain hashes %s: %s\n", hashFileName, strerror(errno));
+		free(hashFileName);
+		goto failBase;
+	}
+	free(hashFileName);
+	if (fstat(fd, &dstStb) || (size_t)dstStb.st_size < sizeof *hashHdr) {
+		goto failFd;
+	}
+	writer->baseHashMapLen = dstStb.st_size;
+	writer->baseHashMap = mmap(NULL, writer->baseHashMapLen, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (writer->baseHashMap == MAP_FAILED) {
+		writer->baseHashMap = NULL;
+		goto failFd;
+	}
+	close(fd);
+	hashHdr = writer->baseHashMap;
+	writer->baseGrains = __le64_to_cpu(hashHdr->numGrains);
+	if (memcmp(hashHdr->magic, GRAIN_HASH_MAGIC, sizeof hashHdr->magic) != 0 ||
+	    __le64_to_cpu(hashHdr->grainSize) != hdr->grainSize ||
+	    __le64_to_cpu(hashHdr->vmdkSize) != (uint64_t)stb.st_size ||
+	    writer->baseGrains > sdi->gtInfo.GTEs ||
+	    (writer->baseHashMapLen - sizeof *hashHdr) / GRAIN_HASH_SIZE < writer->baseGrains) {
+		fprintf(stderr, "Grain hashes do not match base disk %s\n", baseFileName);
+		goto failBase;
+	}
+	return true;
+
+failFd:
+	close(fd);
+failBase:
+	closeBase(writer);
+	return false;
+}
+
+static void
+closeBase(SparseVmdkWriter *writer)
+{
+	if (writer->baseHashMap) {
+		munmap(writer->baseHashMap, writer->baseHashMapLen);
+		writer->baseHashMap = NULL;
+	}
+	if (writer->base) {
+		writer->base->vmt->close(writer->base);
+		writer->base = NULL;
+	}
+	writer->baseGrains = 0;
+}
+
+/*
+ * Read the complete on-disk grain (LBA header, compressed data and padding)
+ * of grainNr from the base disk.  Returns its length, or 0 if the grain has
+ * to be compressed again.
+ */
+static size_t
+readBaseGrain(SparseVmdkWriter *writer,
+              uint64_t grainNr,
+              void *buf,
+              size_t bufSize)
+{
+	SparseDiskInfo *sdi = getSDI(writer->base);
+	SparseGrainLBAHeaderOnDisk *grainHdr = buf;
+	uint32_t sect;
+	size_t dataLen;
+
+	sect = __le32_to_cpu(sdi->gtInfo.gt[grainNr]);
+	if (sect <= 1) {
+		return 0;
+	}
+	if (!safePread(sdi->fd, buf, VMDK_SECTOR_SIZE, sect * VMDK_SECTOR_SIZE)) {
+		return 0;
+	}
+	if (__le64_to_cpu(grainHdr->lba) != grainNr * sdi->diskHdr.grainSize) {
+		return 0;
+	}
+	dataLen = CEILING(sizeof *grainHdr + __le32_to_cpu(grainHdr->cmpSize), VMDK_SECTOR_SIZE) * VMDK_SECTOR_SIZE;
+	if (dataLen > bufSize) {
+		return 0;
+	}
+	if (dataLen > VMDK_SECTOR_SIZE &&
+	    !safePread(sdi->fd, (uint8_t *)buf + VMDK_SECTOR_SIZE, dataLen - VMDK_SECTOR_SIZE, (sect + 1) * VMDK_SECTOR_SIZE)) {
+		return 0;
+	}
+	return dataLen;
+}
@@ -0,0 +1,122 @@
+/* *******************************************************************************
+ * Copyright (c) 2023 VMware, Inc.  All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”); you may not
+ * use this file except in compliance with the License.  You may obtain a copy of
+ * the License at:
+ *
+ *            http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed
+ * under the License is distributed on an “AS IS” BASIS, without warranties or
+ * conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ * *********************************************************************************/
+
+/*
+ * Resource limits for conversions that run next to other workloads: read
+ * and write bandwidth, each a token bucket, and the number of threads
+ * that compress at once.  They are process wide, so they can be changed
+ * while a conversion runs.  Nothing is limited by default.
+ */
+
+#define _GNU_SOURCE
+
+#include "diskinfo.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+/* A bucket holds at most this much time worth of its rate. */
+#define BURST_NSEC	100000000ULL
+
+typedef struct {
+	uint64_t rate;		/* bytes per second, 0 for no limit */
+	double tokens;		/* may go negative, a debt to sleep off */
+	struct timespec last;
+} TokenBucket;
+
+static pthread_mutex_t throttleLock = PTHREAD_MUTEX_INITIALIZER;
+static TokenBucket readBucket;
+static TokenBucket writeBucket;
+static unsigned int maxThreads;
+
+static void
+setRate(TokenBucket *bucket,
+        uint64_t rate)
+{
+	bucket->rate = rate;
+	bucket->tokens = 0;
+	clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+void
+Throttle_SetRates(uint64_t readRate,
+                  uint64_t writeRate)
+{
+	pthread_mutex_lock(&throttleLock);
+	setRate(&readBucket, readRate);
+	setRate(&writeBucket, writeRate);
+	pthread_mutex_unlock(&throttleLock);
+}
+
+void
+Throttle_SetThreads(unsigned int threads)
+{
+	__atomic_store_n(&maxThreads, threads, __ATOMIC_RELAXED);
+}
+
+/* Threads that may compress at once, 0 for no limit. */
+unsigned int
+Throttle_Threads(void)
+{
+	return __atomic_load_n(&maxThreads, __ATOMIC_RELAXED);
+}
+
+/* Take len bytes from the bucket, and sleep if that was more than it had. */
+static void
+consume(TokenBucket *bucket,
+        size_t len)
+{
+	struct timespec now;
+	uint64_t wait = 0;
+	double burst;
+
+	pthread_mutex_lock(&throttleLock);
+	if (bucket->rate == 0) {
+		pthread_mutex_unlock(&throttleLock);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bucket->tokens += ((now.tv_sec - bucket->last.tv_sec) * 1e9 + (now.tv_nsec - bucket->last.tv_nsec)) *
+	                  bucket->rate / 1e9;
+	bucket->last = now;
+	burst = (double)bucket->rate * BURST_NSEC / 1e9;
+	if (bucket->tokens > burst) {
+		bucket->tokens = burst;
+	}
+	bucket->tokens -= len;
+	if (bucket->tokens < 0) {
+		wait = -bucket->tokens * 1e9 / bucket->rate;
+	}
+	pthread_mutex_unlock(&throttleLock);
+	if (wait > 0) {
+		struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+		}
+	}
+}
+
+void
+Throttle_Read(size_t len)
+{
+	consume(&readBucket, len);
+}
+
+void
+Throttle_Write(size_t len)
+{
+	consume(&writeBucket, len);
+}
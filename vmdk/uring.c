@@ -0,0 +1,226 @@
+/* *******************************************************************************
+ * Copyright (c) 2023 VMware, Inc.  All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”); you may not
+ * use this file except in compliance with the License.  You may obtain a copy of
+ * the License at:
+ *
+ *            http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed
+ * under the License is distributed on an “AS IS” BASIS, without warranties or
+ * conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ * *********************************************************************************/
+
+/*
+ * A minimal io_uring, just enough to keep a few reads or writes in flight
+ * while the caller compresses.  It uses the system calls directly, so
+ * there is no dependency on liburing.  Where io_uring is not available
+ * (old kernels, seccomp, containers) IoRing_Create fails and the callers
+ * stay with pread and pwrite.
+ */
+
+#define _GNU_SOURCE
+
+#include "diskinfo.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+struct IoRing {
+	int fd;
+	unsigned int depth;
+	unsigned int inFlight;
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;
+	size_t cqRingSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+	unsigned int *sqTail;
+	unsigned int *sqMask;
+	unsigned int *sqArray;
+	unsigned int *cqHead;
+	unsigned int *cqTail;
+	unsigned int *cqMask;
+	struct io_uring_cqe *cqes;
+};
+
+/*
+ * Create a ring for depth requests in flight.  Returns NULL with errno set
+ * if the kernel does not offer io_uring.
+ */
+IoRing *
+IoRing_Create(unsigned int depth)
+{
+	struct io_uring_params params;
+	IoRing *ring;
+	int savedErrno;
+
+	ring = calloc(1, sizeof *ring);
+	if (!ring) {
+		return NULL;
+	}
+	memset(&params, 0, sizeof params);
+	ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (ring->fd == -1) {
+		goto fail;
+	}
+	ring->depth = depth;
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqRingSize > ring->sqRingSize) {
+			ring->sqRingSize = ring->cqRingSize;
+		}
+		ring->cqRingSize = 0;
+	}
+	ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                    ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sqRing == MAP_FAILED) {
+		goto failFd;
+	}
+	if (ring->cqRingSize == 0) {
+		ring->cqRing = ring->sqRing;
+	} else {
+		ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                    ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cqRing == MAP_FAILED) {
+			goto failSq;
+		}
+	}
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		goto failCq;
+	}
+	ring->sqTail = (unsigned int *)((uint8_t *)ring->sqRing + params.sq_off.tail);
+	ring->sqMask = (unsigned int *)((uint8_t *)ring->sqRing + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned int *)((uint8_t *)ring->sqRing + params.sq_off.array);
+	ring->cqHead = (unsigned int *)((uint8_t *)ring->cqRing + params.cq_off.head);
+	ring->cqTail = (unsigned int *)((uint8_t *)ring->cqRing + params.cq_off.tail);
+	ring->cqMask = (unsigned int *)((uint8_t *)ring->cqRing + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cqRing + params.cq_off.cqes);
+	return ring;
+
+failCq:
+	if (ring->cqRing != ring->sqRing) {
+		munmap(ring->cqRing, ring->cqRingSize);
+	}
+failSq:
+	munmap(ring->sqRing, ring->sqRingSize);
+failFd:
+	savedErrno = errno;
+	close(ring->fd);
+	errno = savedErrno;
+fail:
+	free(ring);
+	return NULL;
+}
+
+/* Submit a read or write of len bytes at pos, tag comes back with it. */
+int
+IoRing_Submit(IoRing *ring,
+              int fd,
+              bool write,
+              void *buf,
+              size_t len,
+              off_t pos,
+              uint64_t tag)
+{
+	unsigned int tail = *ring->sqTail;
+	unsigned int idx = tail & *ring->sqMask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	int ret;
+
+	if (ring->inFlight >= ring->depth) {
+		errno = EBUSY;
+		return -1;
+	}
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = pos;
+	sqe->user_data = tag;
+	ring->sqArray[idx] = idx;
+	__atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+	} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+	if (ret != 1) {
+		/*
+		 * The kernel only sees the entry through the tail, so it was
+		 * published first.  It did not take it, take it back, or the
+		 * next submission would send it along.
+		 */
+		__atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+		if (ret == 0) {
+			errno = EAGAIN;
+		}
+		return -1;
+	}
+	ring->inFlight++;
+	return 0;
+}
+
+/*
+ * Wait for any request to complete.  res is what the read or write
+ * returned, or -errno.
+ */
+int
+IoRing_Wait(IoRing *ring,
+            uint64_t *tag,
+            ssize_t *res)
+{
+	for (;;) {
+		unsigned int head = *ring->cqHead;
+
+		if (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+
+			*tag = cqe->user_data;
+			*res = cqe->res;
+			__atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+			ring->inFlight--;
+			return 0;
+		}
+		if (ring->inFlight == 0) {
+			errno = ENOENT;
+			return -1;
+		}
+		if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+		    errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+unsigned int
+IoRing_InFlight(const IoRing *ring)
+{
+	return ring->inFlight;
+}
+
+/* Destroy the ring, the caller has waited for everything it submitted. */
+void
+IoRing_Destroy(IoRing *ring)
+{
+	if (!ring) {
+		return;
+	}
+	munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqRing != ring->sqRing) {
+		munmap(ring->cqRing, ring->cqRingSize);
+	}
+	munmap(ring->sqRing, ring->sqRingSize);
+	close(ring->fd);
+	free(ring);
+}
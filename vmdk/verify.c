@@ -0,0 +1,314 @@
+/* *******************************************************************************
+ * Copyright (c) 2014-2023 VMware, Inc.  All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”); you may not
+ * use this file except in compliance with the License.  You may obtain a copy of
+ * the License at:
+ *
+ *            http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed
+ * under the License is distributed on an “AS IS” BASIS, without warranties or
+ * conditions of any kind, EITHER EXPRESS OR IMPLIED.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ * *********************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "diskinfo.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define VERIFY_CHUNK_SIZE	(4 * 1024 * 1024)	/* multiple of any grain size */
+#define VERIFY_SECTOR_SIZE	512
+
+typedef struct {
+	off_t pos;
+	off_t end;
+} VerifyExtent;
+
+typedef struct {
+	const char *srcName;
+	const char *dstName;
+	VerifyExtent *extents;
+	size_t numExtents;
+	pthread_mutex_t lock;
+	size_t nextExtent;	/* work queue position, protected by lock */
+	off_t nextPos;
+	off_t mismatch;		/* lowest mismatching offset found so far, -1 if none */
+	bool failed;
+} Verifier;
+
+static int
+compareExtents(const void *a,
+               const void *b)
+{
+	const VerifyExtent *ea = a;
+	const VerifyExtent *eb = b;
+
+	return ea->pos < eb->pos ? -1 : ea->pos > eb->pos;
+}
+
+static bool
+addExtents(DiskInfo *di,
+           VerifyExtent **extents,
+           size_t *numExtents,
+           size_t *maxExtents)
+{
+	off_t pos;
+	off_t end = 0;
+
+	while (di->vmt->nextData(di, &pos, &end) == 0) {
+		if (*numExtents == *maxExtents) {
+			size_t newMax = *maxExtents ? *maxExtents * 2 : 64;
+			VerifyExtent *newExtents = realloc(*extents, newMax * sizeof **extents);
+
+			if (!newExtents) {
+				return false;
+			}
+			*extents = newExtents;
+			*maxExtents = newMax;
+		}
+		(*extents)[*numExtents].pos = pos;
+		(*extents)[*numExtents].end = end;
+		(*numExtents)++;
+	}
+	return errno == ENXIO;
+}
+
+/*
+ * Everything that is not data in either disk reads as zeroes in both, so
+ * only the union of both allocation maps has to be compared.
+ */
+static bool
+buildExtents(Verifier *v,
+             DiskInfo *src,
+             DiskInfo *dst)
+{
+	size_t maxExtents = 0;
+	size_t i;
+	size_t j;
+
+	if (!addExtents(src, &v->extents, &v->numExtents, &maxExtents) ||
+	    !addExtents(dst, &v->extents, &v->numExtents, &maxExtents)) {
+		return false;
+	}
+	if (v->numExtents == 0) {
+		return true;
+	}
+	qsort(v->extents, v->numExtents, sizeof *v->extents, compareExtents);
+	for (i = 0, j = 1; j < v->numExtents; j++) {
+		if (v->extents[j].pos <= v->extents[i].end) {
+			if (v->extents[j].end > v->extents[i].end) {
+				v->extents[i].end = v->extents[j].end;
+			}
+		} else {
+			v->extents[++i] = v->extents[j];
+		}
+	}
+	v->numExtents = i + 1;
+	return true;
+}
+
+/* Hand out the next chunk that is below any mismatch found so far. */
+static bool
+getWork(Verifier *v,
+        off_t *pos,
+        size_t *len)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&v->lock);
+	while (!v->failed && v->nextExtent < v->numExtents) {
+		VerifyExtent *e = &v->extents[v->nextExtent];
+		off_t chunkEnd;
+
+		if (v->nextPos < e->pos) {
+			v->nextPos = e->pos;
+		}
+		if (v->nextPos >= e->end) {
+			v->nextExtent++;
+			continue;
+		}
+		if (v->mismatch != -1 && v->nextPos >= v->mismatch) {
+			break;
+		}
+		chunkEnd = (v->nextPos / VERIFY_CHUNK_SIZE + 1) * VERIFY_CHUNK_SIZE;
+		if (chunkEnd > e->end) {
+			chunkEnd = e->end;
+		}
+		*pos = v->nextPos;
+		*len = chunkEnd - v->nextPos;
+		v->nextPos = chunkEnd;
+		ret = true;
+		break;
+	}
+	pthread_mutex_unlock(&v->lock);
+	return ret;
+}
+
+static void
+reportMismatch(Verifier *v,
+               off_t pos)
+{
+	pthread_mutex_lock(&v->lock);
+	if (v->mismatch == -1 || pos < v->mismatch) {
+		v->mismatch = pos;
+	}
+	pthread_mutex_unlock(&v->lock);
+}
+
+static void
+reportFailure(Verifier *v)
+{
+	pthread_mutex_lock(&v->lock);
+	v->failed = true;
+	pthread_mutex_unlock(&v->lock);
+}
+
+/*
+ * Each worker opens its own handles, so reads and inflating of compressed
+ * grains run in parallel without sharing any state.
+ */
+static void *
+verifyWorker(void *arg)
+{
+	Verifier *v = arg;
+	DiskInfo *src;
+	DiskInfo *dst = NULL;
+	uint8_t *srcBuf = NULL;
+	uint8_t *dstBuf = NULL;
+	off_t pos;
+	size_t len;
+
+	src = Disk_Open(v->srcName);
+	if (src) {
+		dst = Disk_Open(v->dstName);
+	}
+	srcBuf = malloc(VERIFY_CHUNK_SIZE);
+	dstBuf = malloc(VERIFY_CHUNK_SIZE);
+	if (!src || !dst || !srcBuf || !dstBuf) {
+		fprintf(stderr, "Cannot open disks for verification: %s\n", strerror(errno));
+		reportFailure(v);
+		goto out;
+	}
+	while (getWork(v, &pos, &len)) {
+		if (src->vmt->pread(src, srcBuf, len, pos) != (ssize_t)len ||
+		    dst->vmt->pread(dst, dstBuf, len, pos) != (ssize_t)len) {
+			fprintf(stderr, "Read failed at offset %llu\n", (unsigned long long)pos);
+			reportFailure(v);
+			break;
+		}
+		if (memcmp(srcBuf, dstBuf, len) != 0) {
+			size_t i = 0;
+
+			while (srcBuf[i] == dstBuf[i]) {
+				i++;
+			}
+			reportMismatch(v, pos + i);
+		}
+	}
+out:
+	free(dstBuf);
+	free(srcBuf);
+	if (dst) {
+		dst->vmt->close(dst);
+	}
+	if (src) {
+		src->vmt->close(src);
+	}
+	return NULL;
+}
+
+/*
+ * Compare the contents of two disks.  Returns 0 if they are identical, 1 if
+ * they differ and -1 if verification failed.
+ */
+int
+verifyDisks(const char *srcName,
+            const char *dstName,
+            int numThreads)
+{
+	Verifier v;
+	DiskInfo *src;
+	DiskInfo *dst;
+	pthread_t *threads;
+	off_t srcCapacity;
+	off_t dstCapacity;
+	int started;
+	int i;
+	int ret = -1;
+
+	memset(&v, 0, sizeof v);
+	v.srcName = srcName;
+	v.dstName = dstName;
+	v.mismatch = -1;
+	pthread_mutex_init(&v.lock, NULL);
+
+	src = Disk_Open(srcName);
+	if (!src) {
+		fprintf(stderr, "Cannot open source disk %s: %s\n", srcName, strerror(errno));
+		goto out;
+	}
+	dst = Disk_Open(dstName);
+	if (!dst) {
+		fprintf(stderr, "Cannot open destination disk %s: %s\n", dstName, strerror(errno));
+		goto outSrc;
+	}
+	srcCapacity = src->vmt->getCapacity(src);
+	dstCapacity = dst->vmt->getCapacity(dst);
+	if (srcCapacity != dstCapacity) {
+		printf("Capacity mismatch: %llu != %llu\n",
+		       (unsigned long long)srcCapacity, (unsigned long long)dstCapacity);
+		ret = 1;
+		goto outDst;
+	}
+	if (!buildExtents(&v, src, dst)) {
+		fprintf(stderr, "Cannot get allocation map: %s\n", strerror(errno));
+		goto outDst;
+	}
+
+	if (numThreads < 1) {
+		numThreads = 1;
+	}
+	threads = calloc(numThreads, sizeof *threads);
+	if (!threads) {
+		goto outDst;
+	}
+	for (started = 0; started < numThreads; started++) {
+		if (pthread_create(&threads[started], NULL, verifyWorker, &v) != 0) {
+			break;
+		}
+	}
+	if (started == 0) {
+		verifyWorker(&v);
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	if (v.failed) {
+		ret = -1;
+	} else if (v.mismatch != -1) {
+		printf("Mismatch at LBA %llu (offset %llu)\n",
+		       (unsigned long long)(v.mismatch / VERIFY_SECTOR_SIZE),
+		       (unsigned long long)v.mismatch);
+		ret = 1;
+	} else {
+		printf("Disks are identical\n");
+		ret = 0;
+	}
+outDst:
+	dst->vmt->close(dst);
+outSrc:
+	src->vmt->close(src);
+out:
+	free(v.extents);
+	pthread_mutex_destroy(&v.lock);
+	return ret;
+}